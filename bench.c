@@ -0,0 +1,994 @@
+#include "simple_file_system.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define BENCH_TOTAL_NAMES 30000
+#define BENCH_NAMES_PER_ROUND 16
+#define BENCH_BATCHED_FILES 4096
+#define BENCH_ASYNC_REQUEST (4 * BLOCK_SIZE)
+#define BENCH_ASYNC_TOTAL (64 << 20)
+#define BENCH_INODE_FILES 100000
+#define BENCH_LIST_BATCH 256
+#define BENCH_PATH_DEPTH 8
+#define BENCH_PATH_FILES 2000
+#define BENCH_SMALL_FILES 4096
+#define BENCH_LOGS 8
+#define BENCH_LOG_SIZE (4 << 20)
+#define BENCH_PIECE (64 << 10)
+#define BENCH_CHECKSUM_BYTES (256 << 20)
+#define BENCH_COMPRESS_SIZE (32 << 20)
+
+long elapsed_us(struct timeval *start, struct timeval *end) {
+  return (end->tv_sec - start->tv_sec) * 1000000L +
+         (end->tv_usec - start->tv_usec);
+}
+
+void report(char *label, int ops, long us) {
+  printf("\t%-10s %8d ops %10ld us %12.0f ops/s\n", label, ops, us,
+         us > 0 ? ops * 1000000.0 / us : 0.0);
+}
+
+uint64_t free_block_count(struct Volume *volume) {
+  struct VolumeStats stats;
+  sfs_get_volume_stats(volume, &stats);
+  return stats.superblock.num_free_blocks;
+}
+
+uint32_t file_extents(struct Volume *volume) {
+  // Extents over every file on the volume
+  uint32_t extents = 0;
+  struct Inode inode;
+  for (int i = 0; sfs_get_inode(volume, i, &inode) == 0; i++) {
+    if (inode.used == USED_FLAG && inode.type == INODE_FILE) {
+      extents += inode.extent_count;
+    }
+  }
+  return extents;
+}
+
+void bench_name_index() {
+  struct timeval start, end;
+  long create_us = 0, open_us = 0, delete_us = 0;
+  char filename[MAX_FILENAME_SIZE + 1];
+
+  printf("* bench_name_index **\n");
+  if (create_format_vdisk("vfs_bench_names", 24) < 0) {
+    exit(-1);
+  }
+  struct Volume *volume = sfs_mount("vfs_bench_names");
+  if (volume == NULL) {
+    exit(-1);
+  }
+
+  // Names are cycled through the directory in rounds so the benchmark fits
+  // whatever file-count limit the format has
+  int done = 0;
+  while (done < BENCH_TOTAL_NAMES) {
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < BENCH_NAMES_PER_ROUND; i++) {
+      sprintf(filename, "bench_%d.dat", done + i);
+      if (sfs_create(volume, filename) < 0) {
+        exit(-1);
+      }
+    }
+    gettimeofday(&end, NULL);
+    create_us += elapsed_us(&start, &end);
+
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < BENCH_NAMES_PER_ROUND; i++) {
+      sprintf(filename, "bench_%d.dat", done + i);
+      int fd = sfs_open(volume, filename, READ_MODE);
+      if (fd < 0) {
+        exit(-1);
+      }
+      sfs_close(volume, fd);
+    }
+    gettimeofday(&end, NULL);
+    open_us += elapsed_us(&start, &end);
+
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < BENCH_NAMES_PER_ROUND; i++) {
+      sprintf(filename, "bench_%d.dat", done + i);
+      if (sfs_delete(volume, filename) < 0) {
+        exit(-1);
+      }
+    }
+    gettimeofday(&end, NULL);
+    delete_us += elapsed_us(&start, &end);
+
+    done += BENCH_NAMES_PER_ROUND;
+  }
+
+  report("create", done, create_us);
+  report("open", done, open_us);
+  report("delete", done, delete_us);
+  sfs_umount(volume);
+}
+
+void bench_bulk_io(int mount_flags, char *label) {
+  struct timeval start, end;
+  struct CacheStats stats;
+  int file_size = 64 << 20;
+  int chunk = 1 << 20;
+  char *buffer = malloc(chunk);
+  memset(buffer, 'x', chunk);
+
+  printf("* bench_bulk_io (%s) **\n", label);
+  if (create_format_vdisk("vfs_bench_bulk", 27) < 0) {
+    exit(-1);
+  }
+  struct Volume *volume = sfs_mount_with_flags("vfs_bench_bulk", mount_flags);
+  if (volume == NULL || sfs_create(volume, "bulk.bin") < 0) {
+    exit(-1);
+  }
+
+  sfs_reset_cache_stats(volume);
+  int fd = sfs_open(volume, "bulk.bin", WRITE_MODE);
+  gettimeofday(&start, NULL);
+  for (int written = 0; written < file_size; written += chunk) {
+    if (sfs_write(volume, fd, buffer, chunk) < 0) {
+      exit(-1);
+    }
+  }
+  sfs_sync(volume);
+  gettimeofday(&end, NULL);
+  sfs_close(volume, fd);
+  sfs_get_cache_stats(volume, &stats);
+  printf("\twrite %6.1f MiB/s, %llu disk writes\n",
+         64.0 * 1000000 / elapsed_us(&start, &end),
+         (unsigned long long)stats.disk_writes);
+
+  sfs_reset_cache_stats(volume);
+  fd = sfs_open(volume, "bulk.bin", READ_MODE);
+  gettimeofday(&start, NULL);
+  for (int read = 0; read < file_size; read += chunk) {
+    if (sfs_read(volume, fd, buffer, chunk) < 0) {
+      exit(-1);
+    }
+  }
+  gettimeofday(&end, NULL);
+  sfs_close(volume, fd);
+  sfs_get_cache_stats(volume, &stats);
+  printf("\tread  %6.1f MiB/s, %llu disk reads\n",
+         64.0 * 1000000 / elapsed_us(&start, &end),
+         (unsigned long long)stats.disk_reads);
+
+  free(buffer);
+  sfs_umount(volume);
+}
+
+#define SCALING_ITERATIONS 400
+#define SCALING_CHUNK (64 * 1024)
+
+struct ScalingTask {
+  struct Volume *volume;
+  long id;
+};
+
+void *scaling_worker(void *arg) {
+  struct ScalingTask *task = arg;
+  struct Volume *volume = task->volume;
+  long id = task->id;
+  char filename[100];
+  char *buffer = malloc(SCALING_CHUNK);
+  memset(buffer, (int)id, SCALING_CHUNK);
+  sprintf(filename, "scale_%ld.bin", id);
+
+  int fd = sfs_open(volume, filename, WRITE_MODE);
+  for (int i = 0; i < SCALING_ITERATIONS; i++) {
+    sfs_seek(volume, fd, 0, SFS_SEEK_SET);
+    sfs_write(volume, fd, buffer, SCALING_CHUNK);
+  }
+  sfs_close(volume, fd);
+
+  fd = sfs_open(volume, filename, READ_MODE);
+  for (int i = 0; i < SCALING_ITERATIONS; i++) {
+    sfs_seek(volume, fd, 0, SFS_SEEK_SET);
+    sfs_read(volume, fd, buffer, SCALING_CHUNK);
+  }
+  sfs_close(volume, fd);
+
+  free(buffer);
+  return NULL;
+}
+
+void bench_thread_scaling() {
+  struct timeval start, end;
+  char filename[100];
+
+  printf("* bench_thread_scaling **\n");
+  for (int threads = 1; threads <= 8; threads *= 2) {
+    if (create_format_vdisk("vfs_bench_threads", 26) < 0) {
+      exit(-1);
+    }
+    struct Volume *volume = sfs_mount("vfs_bench_threads");
+    if (volume == NULL) {
+      exit(-1);
+    }
+    for (int i = 0; i < threads; i++) {
+      sprintf(filename, "scale_%d.bin", i);
+      sfs_create(volume, filename);
+    }
+
+    pthread_t workers[8];
+    struct ScalingTask tasks[8];
+    gettimeofday(&start, NULL);
+    for (long i = 0; i < threads; i++) {
+      tasks[i].volume = volume;
+      tasks[i].id = i;
+      pthread_create(&workers[i], NULL, scaling_worker, &tasks[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+      pthread_join(workers[i], NULL);
+    }
+    gettimeofday(&end, NULL);
+
+    double mib = 2.0 * threads * SCALING_ITERATIONS * SCALING_CHUNK / (1 << 20);
+    printf("\t%d threads: %8.1f MiB/s\n", threads,
+           mib * 1000000 / elapsed_us(&start, &end));
+    sfs_umount(volume);
+  }
+}
+
+void bench_batched_creates() {
+  struct timeval start, end;
+  char filename[MAX_FILENAME_SIZE + 1], label[32], data[200];
+  memset(data, 'r', sizeof(data));
+
+  // Small files are created, written and deleted durably, committing once
+  // per batch; batch size 1 is a commit after every file
+  printf("* bench_batched_creates **\n");
+  for (int batch = 1; batch <= 16; batch *= 4) {
+    if (create_format_vdisk("vfs_bench_batch", 24) < 0) {
+      exit(-1);
+    }
+    struct Volume *volume = sfs_mount("vfs_bench_batch");
+    if (volume == NULL) {
+      exit(-1);
+    }
+
+    gettimeofday(&start, NULL);
+    for (int done = 0; done < BENCH_BATCHED_FILES; done += batch) {
+      sfs_begin_batch(volume);
+      for (int i = 0; i < batch; i++) {
+        sprintf(filename, "small_%d.dat", done + i);
+        if (sfs_create(volume, filename) < 0 ||
+            sfs_append(volume, filename, data, sizeof(data)) < 0) {
+          exit(-1);
+        }
+      }
+      sfs_commit_batch(volume);
+
+      sfs_begin_batch(volume);
+      for (int i = 0; i < batch; i++) {
+        sprintf(filename, "small_%d.dat", done + i);
+        sfs_delete(volume, filename);
+      }
+      sfs_commit_batch(volume);
+    }
+    gettimeofday(&end, NULL);
+
+    sprintf(label, "batch %d", batch);
+    report(label, BENCH_BATCHED_FILES, elapsed_us(&start, &end));
+    sfs_umount(volume);
+  }
+}
+
+void release_slot(struct AsyncRequest *request) { request->user_data = NULL; }
+
+void bench_async_depth_run(struct Volume *volume, char *vdisk_name, int fd,
+                           int depth, int flags) {
+  struct timeval start, end;
+  struct AsyncRequest *requests = calloc(depth, sizeof(struct AsyncRequest));
+  char *buffers = malloc((size_t)depth * BENCH_ASYNC_REQUEST);
+  struct AsyncQueue *queue = sfs_async_open(volume, depth, flags);
+  if (requests == NULL || buffers == NULL || queue == NULL) {
+    exit(-1);
+  }
+
+  // Start every run from a cold page cache so requests really wait on I/O
+  int raw = open(vdisk_name, O_RDONLY);
+  posix_fadvise(raw, 0, 0, POSIX_FADV_DONTNEED);
+  close(raw);
+
+  // Keep depth random reads in flight; the callback frees a request's slot
+  int chunks = BENCH_ASYNC_TOTAL / BENCH_ASYNC_REQUEST;
+  int submitted = 0, completed = 0;
+  unsigned seed = 7;
+  gettimeofday(&start, NULL);
+  while (completed < chunks) {
+    for (int i = 0; i < depth && submitted < chunks; i++) {
+      if (requests[i].user_data != NULL) {
+        continue;
+      }
+      requests[i].opcode = SFS_ASYNC_READ;
+      requests[i].fd = fd;
+      requests[i].size = BENCH_ASYNC_REQUEST;
+      requests[i].offset = (rand_r(&seed) % chunks) * BENCH_ASYNC_REQUEST;
+      requests[i].buffer = buffers + (size_t)i * BENCH_ASYNC_REQUEST;
+      requests[i].callback = release_slot;
+      requests[i].user_data = &requests[i];
+      sfs_async_submit(queue, &requests[i]);
+      submitted++;
+    }
+    completed += sfs_async_poll(queue, 1);
+  }
+  gettimeofday(&end, NULL);
+
+  printf("\t%-8s depth %2d: %8.1f MiB/s\n",
+         sfs_async_uses_ring(queue) ? "io_uring" : "threads", depth,
+         (BENCH_ASYNC_TOTAL >> 20) * 1000000.0 / elapsed_us(&start, &end));
+  sfs_async_close(queue);
+  free(buffers);
+  free(requests);
+}
+
+void bench_async_queue_depth() {
+  printf("* bench_async_queue_depth **\n");
+  if (create_format_vdisk("vfs_bench_async", 27) < 0) {
+    exit(-1);
+  }
+  struct Volume *volume = sfs_mount("vfs_bench_async");
+  char *buffer = calloc(1, BENCH_ASYNC_TOTAL);
+  if (volume == NULL || buffer == NULL ||
+      sfs_create(volume, "async.bin") < 0) {
+    exit(-1);
+  }
+  int fd = sfs_open(volume, "async.bin", WRITE_MODE);
+  sfs_write(volume, fd, buffer, BENCH_ASYNC_TOTAL);
+  sfs_close(volume, fd);
+  sfs_sync(volume);
+  free(buffer);
+
+  fd = sfs_open(volume, "async.bin", READ_MODE);
+  for (int flags = 0; flags <= SFS_ASYNC_THREADS; flags += SFS_ASYNC_THREADS) {
+    for (int depth = 1; depth <= 64; depth *= 4) {
+      bench_async_depth_run(volume, "vfs_bench_async", fd, depth, flags);
+    }
+  }
+  sfs_close(volume, fd);
+  sfs_umount(volume);
+}
+
+void bench_small_sequential() {
+  // Streams a file through 1000-byte calls, which write-behind coalesces
+  // and read-ahead turns into a few large reads from a cold cache
+  struct timeval start, end;
+  struct CacheStats stats;
+  int file_size = 64 << 20;
+  int chunk = 1000;
+  char buffer[1000];
+  memset(buffer, 's', chunk);
+
+  printf("* bench_small_sequential **\n");
+  if (create_format_vdisk("vfs_bench_small", 27) < 0) {
+    exit(-1);
+  }
+  struct Volume *volume = sfs_mount("vfs_bench_small");
+  if (volume == NULL || sfs_create(volume, "small.bin") < 0) {
+    exit(-1);
+  }
+
+  sfs_reset_cache_stats(volume);
+  int fd = sfs_open(volume, "small.bin", WRITE_MODE);
+  gettimeofday(&start, NULL);
+  for (int written = 0; written + chunk <= file_size; written += chunk) {
+    if (sfs_write(volume, fd, buffer, chunk) < 0) {
+      exit(-1);
+    }
+  }
+  sfs_close(volume, fd);
+  sfs_sync(volume);
+  gettimeofday(&end, NULL);
+  sfs_get_cache_stats(volume, &stats);
+  printf("\twrite %6.1f MiB/s, %llu cache accesses\n",
+         64.0 * 1000000 / elapsed_us(&start, &end),
+         (unsigned long long)(stats.hits + stats.misses));
+
+  sfs_umount(volume);
+  volume = sfs_mount("vfs_bench_small");
+  if (volume == NULL) {
+    exit(-1);
+  }
+  sfs_reset_cache_stats(volume);
+  fd = sfs_open(volume, "small.bin", READ_MODE);
+  gettimeofday(&start, NULL);
+  for (int read = 0; read + chunk <= file_size; read += chunk) {
+    if (sfs_read(volume, fd, buffer, chunk) < 0) {
+      exit(-1);
+    }
+  }
+  gettimeofday(&end, NULL);
+  sfs_close(volume, fd);
+  sfs_get_cache_stats(volume, &stats);
+  printf("\tread  %6.1f MiB/s, %llu disk reads, %llu blocks prefetched\n",
+         64.0 * 1000000 / elapsed_us(&start, &end),
+         (unsigned long long)stats.disk_reads,
+         (unsigned long long)stats.prefetched);
+
+  sfs_umount(volume);
+}
+
+void bench_append_throughput() {
+  // Appends 32 MiB to one log in records of each size, against plain
+  // sequential writes of the same records to a file of the host
+  struct timeval start, end;
+  int total = 32 << 20;
+  int record_sizes[] = {64, 512, BLOCK_SIZE, 64 << 10, 1 << 20};
+  char *buffer = malloc(1 << 20);
+  memset(buffer, 'l', 1 << 20);
+
+  printf("* bench_append_throughput **\n");
+  for (int i = 0; i < 5; i++) {
+    int record = record_sizes[i];
+    int fd = open("bench_raw.bin", O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) {
+      exit(-1);
+    }
+    gettimeofday(&start, NULL);
+    for (off_t written = 0; written < total; written += record) {
+      if (pwrite(fd, buffer, record, written) != record) {
+        exit(-1);
+      }
+    }
+    fdatasync(fd);
+    gettimeofday(&end, NULL);
+    close(fd);
+    long raw_us = elapsed_us(&start, &end);
+
+    if (create_format_vdisk("vfs_bench_append", 26) < 0) {
+      exit(-1);
+    }
+    struct Volume *volume = sfs_mount("vfs_bench_append");
+    if (volume == NULL || sfs_create(volume, "append.log") < 0) {
+      exit(-1);
+    }
+    gettimeofday(&start, NULL);
+    for (int written = 0; written < total; written += record) {
+      if (sfs_append(volume, "append.log", buffer, record) < 0) {
+        exit(-1);
+      }
+    }
+    sfs_sync(volume);
+    gettimeofday(&end, NULL);
+    sfs_umount(volume);
+    long append_us = elapsed_us(&start, &end);
+
+    printf("\trecord %7d: sfs_append %7.1f MiB/s, pwrite %7.1f MiB/s\n",
+           record, 32.0 * 1000000 / append_us, 32.0 * 1000000 / raw_us);
+  }
+  unlink("bench_raw.bin");
+  free(buffer);
+}
+
+void bench_mount_scaling() {
+  // Mounts sparse volumes of growing size, each holding the same 1000
+  // files. Mount itself reads only the superblock; the first open reads the
+  // root directory's path to the file, and loading everything reads the
+  // inode table below its high-water mark and the bitmap as well.
+  struct timeval start, end;
+  char filename[32];
+  int shifts[] = {30, 36, 40}; // 1 GiB, 64 GiB, 1 TiB
+
+  printf("* bench_mount_scaling **\n");
+  for (int i = 0; i < 3; i++) {
+    if (create_format_vdisk_size("vfs_bench_mount",
+                                 (uint64_t)1 << shifts[i]) < 0) {
+      exit(-1);
+    }
+    struct Volume *volume = sfs_mount("vfs_bench_mount");
+    if (volume == NULL) {
+      exit(-1);
+    }
+    for (int f = 0; f < 1000; f++) {
+      sprintf(filename, "file_%d", f);
+      if (sfs_create(volume, filename) < 0) {
+        exit(-1);
+      }
+    }
+    sfs_umount(volume);
+
+    gettimeofday(&start, NULL);
+    volume = sfs_mount("vfs_bench_mount");
+    gettimeofday(&end, NULL);
+    if (volume == NULL) {
+      exit(-1);
+    }
+    long mount_us = elapsed_us(&start, &end);
+
+    gettimeofday(&start, NULL);
+    int fd = sfs_open(volume, "file_0", READ_MODE);
+    gettimeofday(&end, NULL);
+    long open_us = elapsed_us(&start, &end);
+    sfs_close(volume, fd);
+
+    gettimeofday(&start, NULL);
+    sfs_load_metadata(volume);
+    gettimeofday(&end, NULL);
+    printf("	%5llu GiB: mount %6ld us, first open %6ld us, full load %8ld "
+           "us\n",
+           (unsigned long long)1 << (shifts[i] - 30), mount_us, open_us,
+           elapsed_us(&start, &end));
+    sfs_umount(volume);
+  }
+  unlink("vfs_bench_mount");
+}
+
+void bench_inode_table() {
+  // Remounts a volume with many files in one directory and times the first
+  // open, which reads one path down the directory's tree, then a lookup of
+  // every file through the tree and again from the dentry cache
+  struct timeval start, end;
+  char filename[32];
+
+  printf("* bench_inode_table **\n");
+  if (create_format_vdisk_size("vfs_bench_inodes", (uint64_t)32 << 30) < 0) {
+    exit(-1);
+  }
+  struct Volume *volume = sfs_mount("vfs_bench_inodes");
+  if (volume == NULL || sfs_begin_batch(volume) < 0) {
+    exit(-1);
+  }
+  for (int i = 0; i < BENCH_INODE_FILES; i++) {
+    sprintf(filename, "inode_%d", i);
+    if (sfs_create(volume, filename) < 0) {
+      exit(-1);
+    }
+  }
+  sfs_commit_batch(volume);
+  sfs_umount(volume);
+
+  volume = sfs_mount("vfs_bench_inodes");
+  if (volume == NULL) {
+    exit(-1);
+  }
+  gettimeofday(&start, NULL);
+  int fd = sfs_open(volume, "inode_0", READ_MODE);
+  gettimeofday(&end, NULL);
+  sfs_close(volume, fd);
+  long first_us = elapsed_us(&start, &end);
+
+  printf("\t%zu bytes per file, first open in %ld us\n",
+         sizeof(struct Inode), first_us);
+  char *labels[2] = {"open cold", "open warm"};
+  for (int pass = 0; pass < 2; pass++) {
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < BENCH_INODE_FILES; i++) {
+      sprintf(filename, "inode_%d", i);
+      fd = sfs_open(volume, filename, READ_MODE);
+      if (fd < 0) {
+        exit(-1);
+      }
+      sfs_close(volume, fd);
+    }
+    gettimeofday(&end, NULL);
+    report(labels[pass], BENCH_INODE_FILES, elapsed_us(&start, &end));
+  }
+
+  // Listing the directory with every file's attributes, in bulk
+  struct DirEntryPlus *entries =
+      malloc(BENCH_LIST_BATCH * sizeof(struct DirEntryPlus));
+  gettimeofday(&start, NULL);
+  struct DirectoryStream *stream = sfs_opendir(volume, "/");
+  int listed = 0, filled;
+  while ((filled = sfs_readdir_plus(stream, entries, BENCH_LIST_BATCH)) > 0) {
+    listed += filled;
+  }
+  sfs_closedir(stream);
+  gettimeofday(&end, NULL);
+  free(entries);
+  if (listed != BENCH_INODE_FILES) {
+    exit(-1);
+  }
+  report("readdir+", listed, elapsed_us(&start, &end));
+  sfs_umount(volume);
+  unlink("vfs_bench_inodes");
+}
+
+void bench_path_lookup() {
+  // Opens files BENCH_PATH_DEPTH directories deep, first after a remount,
+  // when every component is looked up in its directory's blocks, then with
+  // every component in the dentry cache
+  struct timeval start, end;
+  char path[BENCH_PATH_DEPTH * 8 + 32];
+
+  printf("* bench_path_lookup **\n");
+  if (create_format_vdisk("vfs_bench_paths", 30) < 0) {
+    exit(-1);
+  }
+  struct Volume *volume = sfs_mount("vfs_bench_paths");
+  if (volume == NULL || sfs_begin_batch(volume) < 0) {
+    exit(-1);
+  }
+  int length = 0;
+  for (int d = 0; d < BENCH_PATH_DEPTH; d++) {
+    length += sprintf(path + length, "/dir_%d", d);
+    if (sfs_mkdir(volume, path) < 0) {
+      exit(-1);
+    }
+  }
+  for (int i = 0; i < BENCH_PATH_FILES; i++) {
+    sprintf(path + length, "/file_%d", i);
+    if (sfs_create(volume, path) < 0) {
+      exit(-1);
+    }
+  }
+  sfs_commit_batch(volume);
+  sfs_umount(volume);
+
+  volume = sfs_mount("vfs_bench_paths");
+  if (volume == NULL) {
+    exit(-1);
+  }
+  char *labels[2] = {"path cold", "path warm"};
+  for (int pass = 0; pass < 2; pass++) {
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < BENCH_PATH_FILES; i++) {
+      sprintf(path + length, "/file_%d", i);
+      int fd = sfs_open(volume, path, READ_MODE);
+      if (fd < 0) {
+        exit(-1);
+      }
+      sfs_close(volume, fd);
+    }
+    gettimeofday(&end, NULL);
+    report(labels[pass], BENCH_PATH_FILES, elapsed_us(&start, &end));
+  }
+  sfs_umount(volume);
+  unlink("vfs_bench_paths");
+}
+
+void bench_small_files() {
+  // Writes BENCH_SMALL_FILES files of one size in a batch, then reads them
+  // all back after a remount, reporting the disk space each file takes.
+  // 20 bytes stay in the inode, 1000 share tail blocks, 3000 get a block.
+  struct timeval start, end;
+  char filename[32], label[32], data[3000];
+  int sizes[3] = {20, 1000, 3000};
+  memset(data, 's', sizeof(data));
+
+  printf("* bench_small_files **\n");
+  for (int s = 0; s < 3; s++) {
+    if (create_format_vdisk("vfs_bench_small", 31) < 0) {
+      exit(-1);
+    }
+    struct Volume *volume = sfs_mount("vfs_bench_small");
+    if (volume == NULL || sfs_begin_batch(volume) < 0) {
+      exit(-1);
+    }
+    for (int i = 0; i < BENCH_SMALL_FILES; i++) {
+      sprintf(filename, "small_%d", i);
+      if (sfs_create(volume, filename) < 0) {
+        exit(-1);
+      }
+    }
+    sfs_commit_batch(volume);
+    uint64_t free_blocks = free_block_count(volume);
+
+    gettimeofday(&start, NULL);
+    sfs_begin_batch(volume);
+    for (int i = 0; i < BENCH_SMALL_FILES; i++) {
+      sprintf(filename, "small_%d", i);
+      if (sfs_append(volume, filename, data, sizes[s]) < 0) {
+        exit(-1);
+      }
+    }
+    sfs_commit_batch(volume);
+    gettimeofday(&end, NULL);
+    sprintf(label, "write %d", sizes[s]);
+    report(label, BENCH_SMALL_FILES, elapsed_us(&start, &end));
+    printf("	%-10s %8.0f bytes of disk per file\n", "",
+           (double)(free_blocks - free_block_count(volume)) *
+               BLOCK_SIZE / BENCH_SMALL_FILES);
+    sfs_umount(volume);
+
+    volume = sfs_mount("vfs_bench_small");
+    if (volume == NULL) {
+      exit(-1);
+    }
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < BENCH_SMALL_FILES; i++) {
+      sprintf(filename, "small_%d", i);
+      int fd = sfs_open(volume, filename, READ_MODE);
+      if (fd < 0 || sfs_read(volume, fd, data, sizes[s]) < 0) {
+        exit(-1);
+      }
+      sfs_close(volume, fd);
+    }
+    gettimeofday(&end, NULL);
+    sprintf(label, "read %d", sizes[s]);
+    report(label, BENCH_SMALL_FILES, elapsed_us(&start, &end));
+    sfs_umount(volume);
+  }
+  unlink("vfs_bench_small");
+}
+
+void bench_interleaved_appends() {
+  // Appends 1000-byte records to BENCH_LOGS logs in turn, syncing every
+  // 4 MiB, then reads each log back whole after a remount. Delayed
+  // allocation keeps each log in few extents, which the reads show.
+  struct timeval start, end;
+  char filename[32], record[1000];
+  char *buffer = malloc(BENCH_LOG_SIZE);
+  int records = BENCH_LOG_SIZE / sizeof(record);
+  memset(record, 'i', sizeof(record));
+
+  printf("* bench_interleaved_appends **\n");
+  if (create_format_vdisk("vfs_bench_logs", 28) < 0) {
+    exit(-1);
+  }
+  struct Volume *volume = sfs_mount("vfs_bench_logs");
+  if (volume == NULL) {
+    exit(-1);
+  }
+  for (int f = 0; f < BENCH_LOGS; f++) {
+    sprintf(filename, "log_%d", f);
+    if (sfs_create(volume, filename) < 0) {
+      exit(-1);
+    }
+  }
+  gettimeofday(&start, NULL);
+  for (int r = 0; r < records; r++) {
+    for (int f = 0; f < BENCH_LOGS; f++) {
+      sprintf(filename, "log_%d", f);
+      if (sfs_append(volume, filename, record, sizeof(record)) < 0) {
+        exit(-1);
+      }
+    }
+    if ((r + 1) % ((4 << 20) / BENCH_LOGS / sizeof(record)) == 0) {
+      sfs_sync(volume);
+    }
+  }
+  sfs_sync(volume);
+  gettimeofday(&end, NULL);
+  report("append", records * BENCH_LOGS, elapsed_us(&start, &end));
+  sfs_umount(volume);
+
+  volume = sfs_mount("vfs_bench_logs");
+  if (volume == NULL || sfs_load_metadata(volume) < 0) {
+    exit(-1);
+  }
+  gettimeofday(&start, NULL);
+  for (int f = 0; f < BENCH_LOGS; f++) {
+    sprintf(filename, "log_%d", f);
+    int fd = sfs_open(volume, filename, READ_MODE);
+    if (fd < 0 ||
+        sfs_read(volume, fd, buffer, records * sizeof(record)) < 0) {
+      exit(-1);
+    }
+    sfs_close(volume, fd);
+  }
+  gettimeofday(&end, NULL);
+  uint32_t extents = file_extents(volume);
+  long us = elapsed_us(&start, &end);
+  printf("	%-10s %8.1f extents per log, %7.1f MiB/s\n", "read",
+         (double)extents / BENCH_LOGS,
+         BENCH_LOGS * (double)records * sizeof(record) / us);
+  sfs_umount(volume);
+  unlink("vfs_bench_logs");
+  free(buffer);
+}
+
+void bench_preallocation(int flags, char *label) {
+  // Fills BENCH_LOGS files of BENCH_LOG_SIZE in BENCH_PIECE pieces taken in
+  // a shuffled order across all of them, as a download of many parts at
+  // once would, then reads each back whole after a remount. With flags
+  // other than -1 every file is first preallocated with them, which keeps
+  // it in one extent whatever the order of the writes.
+  struct timeval start, end;
+  char filename[32];
+  int pieces = BENCH_LOG_SIZE / BENCH_PIECE, total = BENCH_LOGS * pieces;
+  int fds[BENCH_LOGS], *order = malloc(total * sizeof(int));
+  char *buffer = malloc(BENCH_LOG_SIZE);
+  memset(buffer, 'p', BENCH_LOG_SIZE);
+  srand(1);
+  for (int i = 0; i < total; i++) {
+    order[i] = i;
+  }
+  for (int i = total - 1; i > 0; i--) {
+    int j = rand() % (i + 1), swap = order[i];
+    order[i] = order[j];
+    order[j] = swap;
+  }
+
+  printf("* bench_preallocation (%s) **\n", label);
+  if (create_format_vdisk("vfs_bench_prealloc", 28) < 0) {
+    exit(-1);
+  }
+  struct Volume *volume = sfs_mount("vfs_bench_prealloc");
+  if (volume == NULL) {
+    exit(-1);
+  }
+  gettimeofday(&start, NULL);
+  for (int f = 0; f < BENCH_LOGS; f++) {
+    sprintf(filename, "part_%d", f);
+    if (sfs_create(volume, filename) < 0 ||
+        (fds[f] = sfs_open(volume, filename, WRITE_MODE)) < 0 ||
+        (flags != -1 &&
+         sfs_fallocate(volume, fds[f], 0, BENCH_LOG_SIZE, flags) < 0)) {
+      exit(-1);
+    }
+  }
+  for (int i = 0; i < total; i++) {
+    int f = order[i] / pieces;
+    int64_t offset = (int64_t)(order[i] % pieces) * BENCH_PIECE;
+    if (sfs_seek(volume, fds[f], offset, SFS_SEEK_SET) < 0 ||
+        sfs_write(volume, fds[f], buffer, BENCH_PIECE) < 0) {
+      exit(-1);
+    }
+  }
+  for (int f = 0; f < BENCH_LOGS; f++) {
+    sfs_close(volume, fds[f]);
+  }
+  sfs_sync(volume);
+  gettimeofday(&end, NULL);
+  report("write", total, elapsed_us(&start, &end));
+  sfs_umount(volume);
+
+  volume = sfs_mount("vfs_bench_prealloc");
+  if (volume == NULL || sfs_load_metadata(volume) < 0) {
+    exit(-1);
+  }
+  gettimeofday(&start, NULL);
+  for (int f = 0; f < BENCH_LOGS; f++) {
+    sprintf(filename, "part_%d", f);
+    int fd = sfs_open(volume, filename, READ_MODE);
+    if (fd < 0 || sfs_read(volume, fd, buffer, BENCH_LOG_SIZE) < 0) {
+      exit(-1);
+    }
+    sfs_close(volume, fd);
+  }
+  gettimeofday(&end, NULL);
+  uint32_t extents = file_extents(volume);
+  long us = elapsed_us(&start, &end);
+  printf("	%-10s %8.1f extents per file, %7.1f MiB/s\n", "read",
+         (double)extents / BENCH_LOGS,
+         BENCH_LOGS * (double)BENCH_LOG_SIZE / us);
+  sfs_umount(volume);
+  unlink("vfs_bench_prealloc");
+  free(buffer);
+  free(order);
+}
+
+void bench_checksum_kernels() {
+  // Block-sized checksums over a buffer that fits in the caches
+  struct timeval start, end;
+  char *names[SFS_CRC32C_KERNELS] = {"bytewise", "slicing-8", "sse4.2"};
+  int blocks = 64;
+  char *buffer = malloc(blocks * BLOCK_SIZE);
+  for (int i = 0; i < blocks * BLOCK_SIZE; i++) {
+    buffer[i] = (char)(i * 7 + i / 4096);
+  }
+
+  printf("* bench_checksum_kernels **\n");
+  for (int kernel = 0; kernel < SFS_CRC32C_KERNELS; kernel++) {
+    if (!sfs_crc32c_supported(kernel)) {
+      printf("\t%-10s not supported by this CPU\n", names[kernel]);
+      continue;
+    }
+    long rounds = BENCH_CHECKSUM_BYTES / BLOCK_SIZE;
+    if (kernel == SFS_CRC32C_BYTEWISE) {
+      rounds /= 8;
+    }
+    gettimeofday(&start, NULL);
+    for (long i = 0; i < rounds; i++) {
+      sfs_crc32c_kernel(kernel, 0, buffer + (i % blocks) * BLOCK_SIZE,
+                        BLOCK_SIZE);
+    }
+    gettimeofday(&end, NULL);
+    long us = elapsed_us(&start, &end);
+    printf("\t%-10s %6.2f GB/s\n", names[kernel],
+           us > 0 ? rounds * (double)BLOCK_SIZE / us / 1000 : 0.0);
+  }
+  free(buffer);
+}
+
+void bench_compression(int mount_flags, bool text, char *label) {
+  // Appends BENCH_COMPRESS_SIZE of JSON-style log lines or random bytes
+  // in 1 MiB writes, then reads it back on a fresh mount
+  struct timeval start, end;
+  struct CacheStats stats;
+  int chunk = 1 << 20;
+  char *data = malloc(BENCH_COMPRESS_SIZE);
+  int length = 0;
+  srand(25);
+  for (int line = 0; length < BENCH_COMPRESS_SIZE; line++) {
+    char text_line[200];
+    int n = snprintf(text_line, sizeof(text_line),
+                     "{\"ts\":\"2026-10-18T12:%02d:%02d.%03dZ\",\"level\":"
+                     "\"%s\",\"req\":%d,\"path\":\"/api/v1/items/%d\","
+                     "\"status\":%d,\"ms\":%d}\n",
+                     line / 3600 % 60, line / 60 % 60, line * 7 % 1000,
+                     line % 13 == 0 ? "warn" : "info", rand() % 1000000,
+                     rand() % 500, line % 17 == 0 ? 404 : 200, rand() % 250);
+    if (n > BENCH_COMPRESS_SIZE - length) {
+      n = BENCH_COMPRESS_SIZE - length;
+    }
+    for (int i = 0; i < n; i++) {
+      data[length + i] = text ? text_line[i] : (char)rand();
+    }
+    length += n;
+  }
+
+  printf("* bench_compression (%s) **\n", label);
+  if (create_format_vdisk("vfs_bench_compress", 27) < 0) {
+    exit(-1);
+  }
+  struct Volume *volume =
+      sfs_mount_with_flags("vfs_bench_compress", mount_flags);
+  if (volume == NULL || sfs_create(volume, "log.json") < 0) {
+    exit(-1);
+  }
+  sfs_sync(volume);
+  uint64_t free_blocks = free_block_count(volume);
+
+  int fd = sfs_open(volume, "log.json", WRITE_MODE);
+  gettimeofday(&start, NULL);
+  for (int written = 0; written < BENCH_COMPRESS_SIZE; written += chunk) {
+    if (sfs_write(volume, fd, data + written, chunk) < 0) {
+      exit(-1);
+    }
+  }
+  sfs_close(volume, fd);
+  sfs_sync(volume);
+  gettimeofday(&end, NULL);
+  uint64_t used = free_blocks - free_block_count(volume);
+  printf("\twrite %6.1f MiB/s, %llu blocks, ratio %.2f\n",
+         (BENCH_COMPRESS_SIZE >> 20) * 1000000.0 /
+             elapsed_us(&start, &end),
+         (unsigned long long)used,
+         (double)BENCH_COMPRESS_SIZE / BLOCK_SIZE / used);
+  sfs_umount(volume);
+
+  volume = sfs_mount_with_flags("vfs_bench_compress", mount_flags);
+  if (volume == NULL) {
+    exit(-1);
+  }
+  sfs_reset_cache_stats(volume);
+  fd = sfs_open(volume, "log.json", READ_MODE);
+  gettimeofday(&start, NULL);
+  for (int read = 0; read < BENCH_COMPRESS_SIZE; read += chunk) {
+    if (sfs_read(volume, fd, data + read, chunk) < 0) {
+      exit(-1);
+    }
+  }
+  gettimeofday(&end, NULL);
+  sfs_close(volume, fd);
+  sfs_get_cache_stats(volume, &stats);
+  printf("\tread  %6.1f MiB/s, %llu chunks decompressed\n",
+         (BENCH_COMPRESS_SIZE >> 20) * 1000000.0 /
+             elapsed_us(&start, &end),
+         (unsigned long long)stats.chunk_misses);
+  sfs_umount(volume);
+  free(data);
+}
+
+int main(int argc, char **argv) {
+  bench_name_index();
+  bench_bulk_io(0, "fd");
+  bench_bulk_io(SFS_MOUNT_MMAP, "mmap");
+  bench_bulk_io(SFS_MOUNT_NO_VERIFY, "fd, no verify");
+  bench_thread_scaling();
+  bench_batched_creates();
+  bench_async_queue_depth();
+  bench_small_sequential();
+  bench_append_throughput();
+  bench_mount_scaling();
+  bench_inode_table();
+  bench_path_lookup();
+  bench_small_files();
+  bench_interleaved_appends();
+  bench_preallocation(-1, "none");
+  bench_preallocation(SFS_FALLOC_KEEP_SIZE, "keep size");
+  bench_preallocation(SFS_FALLOC_NO_ZERO, "no zeroing");
+  bench_checksum_kernels();
+  bench_compression(0, true, "text, plain");
+  bench_compression(SFS_MOUNT_COMPRESS, true, "text, compressed");
+  bench_compression(SFS_MOUNT_COMPRESS, false, "random, compressed");
+  return 0;
+}
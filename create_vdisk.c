@@ -2,32 +2,76 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 
 #define MAX_VDISK_FILENAME 255
 
+// Parses a byte count with an optional K, M, G or T suffix (powers of 1024)
+int parse_size(char *text, uint64_t *size) {
+  char *end;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (end == text) {
+    return -1;
+  }
+
+  int shift = 0;
+  switch (*end) {
+  case 'T':
+  case 't':
+    shift += 10;
+    // fall through
+  case 'G':
+  case 'g':
+    shift += 10;
+    // fall through
+  case 'M':
+  case 'm':
+    shift += 10;
+    // fall through
+  case 'K':
+  case 'k':
+    shift += 10;
+    end++;
+    break;
+  }
+  if (*end != '\0') {
+    return -1;
+  }
+
+  *size = (uint64_t)value << shift;
+  return 0;
+}
+
 int main(int argc, char **argv) {
   // Argument 1: name of file for virtual disk
-  // Argument 2: Number of Blocks to be alloted to virtual disk (Each block is
-  // 4K Bytes)
+  // Argument 2: size of the virtual disk in bytes, optionally suffixed with
+  // K, M, G or T (rounded down to whole 4K blocks)
 
   char vdisk_name[MAX_VDISK_FILENAME + 1];
-  int num_blocks;
+  uint64_t size;
 
-  if (argc != 3) {
+  if (argc != 3 || parse_size(argv[2], &size) < 0) {
     printf("Incorrect Format!\nCorrect format is: ./create_vdisk <virtual disk "
-           "name> <number of blocks>");
+           "name> <size, e.g. 4096, 64M or 2G>\n");
     return -1;
   }
 
-  strcpy(vdisk_name, argv[1]);
-  num_blocks = atoi(argv[2]);
+  strncpy(vdisk_name, argv[1], MAX_VDISK_FILENAME);
+  vdisk_name[MAX_VDISK_FILENAME] = '\0';
 
   printf("LOG: Creating Virtual disk %s...\n", vdisk_name);
-  int status = create_format_vdisk(vdisk_name, num_blocks);
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  int status = create_format_vdisk_size(vdisk_name, size);
+  gettimeofday(&end, NULL);
   if (status < 0) {
-    printf("ERROR: Some problem occured while creating virutal disk");
+    printf("ERROR: Some problem occured while creating virutal disk\n");
     return -1;
-  } else {
-    printf("LOG: Successfully created virutal disk %s", vdisk_name);
   }
+
+  long elapsed = (end.tv_sec - start.tv_sec) * 1000000L +
+                 (end.tv_usec - start.tv_usec);
+  printf("LOG: Successfully created virutal disk %s\n", vdisk_name);
+  printf("LOG: Formatted in %.3f ms\n", elapsed / 1000.0);
+  return 0;
 }
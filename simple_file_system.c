@@ -1,4 +1,15 @@
+#ifdef __linux__
+#define _GNU_SOURCE // fallocate, to punch holes in the vdisk
+#endif
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define SFS_HAVE_IO_URING
+#undef BLOCK_SIZE // from <linux/fs.h>; the file system's own follows
+#endif
+
 #include "simple_file_system.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -6,838 +17,7289 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
-
-#define MAX_FILENAME_SIZE 255
-#define BLOCK_SIZE 4096
-#define UNUSED_FLAG 0
-#define USED_FLAG 1
-#define BITMAP_BLOCK 1
-#define FCB_BLOCKS_START 9
-#define FCB_BLOCKS_COUNT 4
-#define SUPERBLOCK_BLOCK 0
-#define ROOT_DIR_START 5
-#define ROOT_DIR_COUNT 4
-#define MAX_FILES 128
-#define POINTERS_PER_BLK (BLOCK_SIZE / sizeof(uint32_t))
-#define INVALID_BLOCK_POINTER 0xFF
-#define MAX_OPEN_FILES 16
-
-#define SFS_SEEK_SET 0
-#define SFS_SEEK_CUR 1
-#define SFS_SEEK_END 2
-
-#define READ_MODE 0
-#define WRITE_MODE 1
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#define SFS_HAVE_SSE42
+#endif
+
+struct OpenFile {
+  struct Inode *inode;
+  int open_mode;
+  int64_t read_write_pointer;
+  pthread_mutex_t lock; // serializes calls sharing this descriptor
+
+  // Read-ahead: a read starting where the previous one ended is sequential
+  // and keeps the next readahead_window blocks in the cache
+  uint64_t next_read;
+  uint32_t readahead_window; // blocks; doubles while reads stay sequential
+  uint32_t readahead_end;    // logical block prefetching has reached
+
+  // Write-behind: small writes collect here until a whole buffer, a seek,
+  // close or sfs_sync writes them to the file in one go
+  char *write_buffer; // WRITE_BEHIND_BLOCKS blocks, allocated on first use
+  uint64_t write_start;
+  uint32_t write_length;
+};
+
+// In-memory block cache slot (never written to disk as-is)
+struct CacheEntry {
+  char data[BLOCK_SIZE];
+  uint64_t block_number;
+  int hash_next;
+  bool valid;
+  bool dirty;
+  bool referenced;
+};
+
+// A file's full extent list while it is being read or written
+struct ExtentMap {
+  struct Extent *extents;
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t dirty_from; // extents before this index match what is on disk
+
+  // Appended blocks that have no disk blocks yet, see append_delayed
+  char *delayed;
+  uint32_t delayed_first; // logical block of delayed[0]
+  uint32_t delayed_count;
+};
+
+// A decompressed chunk, keyed by the first block it is stored in
+struct ChunkCacheEntry {
+  uint64_t start;
+  bool valid;
+  bool referenced;
+  char *data; // COMPRESS_CHUNK_BLOCKS blocks
+};
+
+// A position in a directory tree: the nodes from the root down to a leaf,
+// and the child or key taken in each
+struct DirectoryPath {
+  int depth;
+  uint64_t blocks[DIRECTORY_MAX_DEPTH];
+  int index[DIRECTORY_MAX_DEPTH];
+  struct DirectoryNode nodes[DIRECTORY_MAX_DEPTH];
+};
+
+// An open directory listing. It holds the rest of one leaf's keys at a
+// time and resumes after the last of them, so the directory can change
+// between calls: an entry added or removed meanwhile may or may not be
+// listed, but every other entry is listed exactly once.
+struct DirectoryStream {
+  struct Volume *volume;
+  int slot; // of the directory
+  struct DirectoryKey keys[DIRECTORY_LEAF_KEYS];
+  int key_count;
+  int next_key;
+  struct DirectoryKey resume; // first key past the ones held
+  bool at_end;
+};
+
+// One vectored transfer over physically contiguous blocks. A partial first
+// or last block is staged in a bounce buffer; the whole blocks in between
+// move straight to or from caller memory.
+struct BlockRun {
+  uint64_t start;
+  uint32_t count;
+  char *head;
+  char *body;
+  char *tail;
+};
+
+struct CacheShard {
+  struct CacheEntry *entries;
+  int *buckets;
+  int capacity;
+  int bucket_count;
+  int clock_hand;
+  pthread_mutex_t lock;
+};
+
+struct BlockRange {
+  uint64_t start;
+  uint32_t count;
+};
+
+// A tail block in use, in the tail table (see load_tail_blocks)
+struct TailBlock {
+  uint64_t block;
+  uint32_t used;    // one bit per fragment holding data
+  uint32_t pending; // freed, but not reusable before the next commit
+  int next;         // in its hash chain, or in the free list
+};
+
+// Fragments freed from one tail block since the last commit
+struct TailFree {
+  uint64_t block;
+  uint32_t fragments;
+};
+
+// Whole blocks of one request moving between the disk and caller memory
+struct AsyncRun {
+  struct AsyncRequest *request;
+  uint64_t start;
+  uint32_t count;
+  char *body;
+};
+
+// Submission and completion rings shared with the kernel
+struct AsyncRing {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map;
+  size_t sq_map_size;
+  void *cq_map;
+  size_t cq_map_size;
+  size_t sqes_size;
+};
+
+struct AsyncQueue {
+  struct Volume *volume;
+  struct AsyncQueue *next_queue; // on the volume's list
+  pthread_mutex_t lock;
+  int in_flight; // submitted, not yet returned by sfs_async_poll
+  struct AsyncRequest *completed_head;
+  struct AsyncRequest *completed_tail;
+  int completed_count;
+
+  bool use_ring;
+  struct AsyncRing ring;
+  unsigned ring_in_flight; // entries submitted and not yet reaped
+  unsigned ring_unsubmitted;
+
+  // Worker pool used when the ring is not
+  pthread_t *workers;
+  int worker_count;
+  bool stopping;
+  pthread_cond_t work_ready;
+  pthread_cond_t completed_ready;
+  struct AsyncRequest *pending_head;
+  struct AsyncRequest *pending_tail;
+};
+
+// A block written with its pending checksum, see checksum_written
+struct ChecksumWrite {
+  uint64_t block;
+  uint32_t checksum;
+};
+
+// Everything belonging to one mounted vdisk
+struct Volume {
+  int vdisk_fd;
+  char *vdisk_map;
+  size_t vdisk_map_size;
+
+  struct SuperBlock superblock;
+  struct Inode *inodes;
+  uint32_t *inode_keys; // name_hash | INODE_KEY_USED per slot, 0 if free
+  struct LongName *long_names;
+  int num_inodes;
+  int inodes_used; // high-water marks, see take_slot
+  int names_used;
+  uint64_t *bitmap;
+  uint32_t bitmap_words;
+  struct BlockChecksum *checksums; // the checksum region, mapped shared
+  size_t checksums_size;
+  bool verify_checksums;
+  pthread_mutex_t checksum_lock; // guards the list below
+  struct ChecksumWrite *checksum_writes; // written since the last commit
+  int checksum_write_count;
+  int checksum_write_capacity;
+  uint64_t data_blocks_start;
+  uint64_t alloc_hint;
+  uint64_t reserved_blocks; // free, but promised to delayed blocks
+  uint32_t delayed_blocks;  // held in memory over all files
+  bool compress;            // delayed data is flushed in compressed chunks
+
+  // Lazy mount: metadata blocks are read on first touch (see fault_blocks)
+  pthread_mutex_t fault_lock;
+  bool *resident;       // per metadata block, set once it has been read
+  bool free_inodes_loaded; // free_inode_slots has been built
+  bool metadata_loaded; // every metadata block in use is resident
+  pthread_t prefetch_thread;
+  bool prefetching;
+  bool prefetch_stop;
+
+  int open_file_count;
+  struct OpenFile open_file_table[MAX_OPEN_FILES];
+
+  // Locking order: journal -> commit -> directory -> open file table ->
+  // descriptor -> file -> async queue list -> async queue -> tail table ->
+  // allocator -> dentry cache -> metadata fault -> chunk cache -> cache
+  // shard -> checksum list
+  pthread_rwlock_t directory_lock;
+  pthread_mutex_t open_file_lock;
+  pthread_mutex_t alloc_lock;
+  pthread_rwlock_t *file_locks; // inode slots share them round-robin
+  int file_lock_count;
+  struct ExtentMap *file_maps;  // per inode slot, see file_map
+
+  // Dentry cache, see lookup_component
+  pthread_mutex_t dentry_lock;
+  int *name_buckets;
+  int *name_next;
+  int *name_parent; // parent slot + 1 per cached slot, 0 if not cached
+  int name_bucket_count;
+  int dentry_count;
+  int *free_inode_slots;
+  int free_inode_count;
+
+  // Tail table, see load_tail_blocks
+  pthread_mutex_t tail_lock;
+  bool tails_loaded;
+  struct TailBlock *tail_blocks;
+  int tail_capacity;
+  int *tail_buckets; // tail_capacity of them
+  int tail_free_entry;
+  int tail_hint; // entry new fragments are tried in first, or -1
+  struct TailFree *tail_frees; // freed since the last commit
+  int tail_free_count;
+  int tail_free_capacity;
+
+  struct CacheShard cache_shards[CACHE_SHARDS];
+  bool cache_ready;
+  pthread_mutex_t cache_init_lock;
+  int cache_capacity;
+  struct CacheStats cache_stats;
+
+  // Decompressed chunks, see read_chunk_range
+  pthread_mutex_t chunk_lock;
+  struct ChunkCacheEntry chunk_cache[CHUNK_CACHE_ENTRIES];
+  int chunk_hand; // CLOCK hand
+  int chunks_cached;
+
+  // Metadata journal: the committed image is what the journal and the
+  // checkpointed home blocks describe; the live copies above run ahead of it
+  pthread_mutex_t journal_lock; // serializes commits and checkpoints
+  pthread_rwlock_t commit_lock; // held shared by every mutating call
+  uint64_t journal_start;
+  uint32_t journal_blocks;
+  uint32_t journal_head;     // next free block in the journal
+  uint32_t journal_sequence; // sequence of the next transaction
+  uint32_t max_transaction_blocks;
+  char *journal_buffer;
+  struct Inode *committed_inodes;
+  struct LongName *committed_names;
+  uint64_t *committed_bitmap;
+  bool *dirty_inodes;
+  bool *dirty_names;
+  int *dirty_inode_list; // the slots set in dirty_inodes, in marking order
+  int *dirty_name_list;
+  uint32_t dirty_inode_count;
+  uint32_t dirty_name_count;
+  int committed_inodes_used;
+  int committed_names_used;
+  uint64_t committed_free_blocks; // counters of the committed image
+  uint32_t committed_files;
+  uint64_t *dirty_words;            // one bit per bitmap word
+  bool *checkpoint_dirty;           // metadata blocks changed since checkpoint
+  struct BlockRange *pending_frees; // freed, but not committed yet
+  int pending_free_count;
+  int pending_free_capacity;
+  uint64_t pending_free_blocks;
+  uint64_t operations;           // mutating calls finished so far
+  uint64_t committed_operations; // of those, covered by the last commit
+
+  pthread_mutex_t async_lock; // guards the queue list
+  struct AsyncQueue *async_queues;
+};
 
 // Utility functions
 int min(int a, int b) { return a > b ? b : a; }
-
-int dir_entry_size = sizeof(struct DirectoryEntry);
-int num_entries;
-uint32_t block_count;
-int num_fcbs;
-
-int vdisk_fd;
-
-struct SuperBlock superblock;
-struct DirectoryEntry *directory;
-struct FCB *file_control_blocks;
-bool bitmap[BLOCK_SIZE];
-
-int file_count = 0;
-int open_file_count = 0;
-struct OpenFile open_file_table[MAX_OPEN_FILES];
+int max(int a, int b) { return a > b ? a : b; }
+
+// Internal helpers used before their definition
+int plan_layout(uint64_t num_blocks, struct SuperBlock *layout);
+uint32_t journal_size(struct SuperBlock *layout);
+void set_geometry(struct Volume *volume);
+void init_bitmap(struct Volume *volume);
+void init_superblock(struct Volume *volume);
+void init_root_directory(struct Volume *volume);
+uint32_t hash_filename(const char *filename);
+void journal_mark_bitmap(struct Volume *volume, uint64_t start,
+                         uint64_t count);
+int journal_commit(struct Volume *volume);
+extern __thread struct Volume *open_batch;
+void defer_run(struct Volume *volume, struct AsyncRequest *request,
+               struct BlockRun *run, bool write);
+void async_drain(struct Volume *volume);
+int flush_write_behind(struct Volume *volume, struct OpenFile *open_file);
+void flush_open_files(struct Volume *volume);
+void store_file_maps(struct Volume *volume);
+int flush_delayed_blocks(struct Volume *volume, struct ExtentMap *map,
+                         uint64_t file_size);
+void release_tail_fragments(struct Volume *volume, struct TailFree *frees,
+                            int free_count);
+void get_file_name(struct Volume *volume, int slot, char *filename);
+pthread_rwlock_t *file_lock(struct Volume *volume,
+                            struct Inode *entry);
+void cache_destroy(struct Volume *volume);
+void fault_range(struct Volume *volume, uint64_t start_block,
+                 size_t first_byte, size_t bytes);
+struct Volume *create_volume();
+void close_vdisk(struct Volume *volume);
+void checksum_store(struct Volume *volume, uint64_t start, uint32_t count,
+                    const char *data);
+void checksum_written(struct Volume *volume, uint64_t start, uint32_t count);
+bool checksum_verify(struct Volume *volume, uint64_t start, uint32_t count,
+                     const char *data);
+extern __thread bool checksum_failed;
+void chunk_cache_drop(struct Volume *volume, uint64_t start, uint32_t count);
+void read_chunk_range(struct Volume *volume, struct Extent *extent,
+                      uint32_t offset, char *buffer, uint32_t size);
+int expand_chunks(struct Volume *volume, struct ExtentMap *map,
+                  uint32_t first, uint32_t end);
 
 int create_format_vdisk(char *vdiskname, unsigned int m) {
-  char command[1000];
-  int size;
-  int num = 1;
-  int count;
+  return create_format_vdisk_size(vdiskname, (uint64_t)1 << m);
+}
 
-  size = num << m;
-  count = size / BLOCK_SIZE;
+// Formats without touching the data area: the image is created sparse with
+// ftruncate, and only the superblock and the bitmap blocks with bits set are
+// written. The inode table, name table, journal and checksum region start
+// out as holes (all-zero records are unused), so formatting costs O(bitmap)
+// rather than O(disk size).
+int create_format_vdisk_size(char *vdiskname, uint64_t size) {
+  uint64_t count = size / BLOCK_SIZE;
 
-  printf("LOG(create_format_vdisk): (m: %d, size: %d bytes, blocks: %d)\n", m,
-         size, count);
+  printf("LOG(create_format_vdisk): (size: %llu bytes, blocks: %llu)\n",
+         (unsigned long long)size, (unsigned long long)count);
 
-  int header_count = 1 + 1 + FCB_BLOCKS_COUNT + ROOT_DIR_COUNT;
+  if (count > MAX_VOLUME_BLOCKS) {
+    printf("ERROR: Disk size exceeds the supported block count!\n");
+    return -1;
+  }
 
-  if (count < header_count) {
+  struct SuperBlock layout;
+  if (plan_layout(count, &layout) < 0) {
     printf("ERROR: Larger disk size required!\n");
     return -1;
   }
 
-  sprintf(command, "dd if=/dev/zero of=%s bs=%d count=%d", vdiskname,
-          BLOCK_SIZE, count);
-  system(command);
-
-  vdisk_fd = open(vdiskname, O_RDWR);
-  if (vdisk_fd < 0) {
+  struct Volume *volume = create_volume();
+  if (volume == NULL) {
+    return -1;
+  }
+  volume->vdisk_fd = open(vdiskname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (volume->vdisk_fd < 0) {
     perror("Failed to open virtual disk");
+    close_vdisk(volume);
+    return -1;
+  }
+  if (ftruncate(volume->vdisk_fd, (off_t)count * BLOCK_SIZE) < 0) {
+    perror("Failed to size virtual disk");
+    close_vdisk(volume);
     return -1;
   }
 
-  int total_blocks = count;
-  int available_blocks = total_blocks - header_count;
-
-  init_bitmap();
-  int total_fcbs = init_FCB();
-  init_superblock(total_blocks, available_blocks, total_fcbs);
-  init_root_directory();
+  volume->superblock = layout;
+  set_geometry(volume);
+  init_bitmap(volume);
+  init_root_directory(volume);
+  init_superblock(volume);
 
-  fsync(vdisk_fd);
-  close(vdisk_fd);
+  cache_destroy(volume);
+  fsync(volume->vdisk_fd);
+  close_vdisk(volume);
   return 0;
 }
 
-void write_block(void *block, uint32_t block_number) {
-  uint32_t offset = block_number * BLOCK_SIZE;
-  lseek(vdisk_fd, (off_t)offset, SEEK_SET);
+// Raw disk access (bypasses the block cache). Positional I/O only, so
+// concurrent callers never race on a shared file offset.
 
-  ssize_t bytes_written = write(vdisk_fd, block, BLOCK_SIZE);
+void stat_add(uint64_t *counter, uint64_t amount) {
+  __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
 }
 
-void read_block(void *block, uint32_t block_number) {
-  // Reads the given block number and copies the content into block
-
-  uint32_t offset = block_number * BLOCK_SIZE;
-  lseek(vdisk_fd, (off_t)offset, SEEK_SET);
-
-  read(vdisk_fd, block, BLOCK_SIZE);
+void disk_write_block(struct Volume *volume, void *block,
+                      uint64_t block_number) {
+  checksum_store(volume, block_number, 1, block);
+  ssize_t bytes_written = pwrite(volume->vdisk_fd, block, BLOCK_SIZE,
+                                 (off_t)block_number * BLOCK_SIZE);
+  if (bytes_written != BLOCK_SIZE) {
+    perror("Failed to write block");
+  } else {
+    checksum_written(volume, block_number, 1);
+  }
+  stat_add(&volume->cache_stats.disk_writes, 1);
 }
 
-// Bitmap related functions
-
-void init_bitmap() {
+void disk_read_block(struct Volume *volume, void *block,
+                     uint64_t block_number) {
+  // A short read fails like a bad checksum, see checksum_verify
+  ssize_t bytes_read = pread(volume->vdisk_fd, block, BLOCK_SIZE,
+                             (off_t)block_number * BLOCK_SIZE);
+  stat_add(&volume->cache_stats.disk_reads, 1);
+  if (bytes_read != BLOCK_SIZE) {
+    perror("Failed to read block");
+    memset(block, 0, BLOCK_SIZE);
+    checksum_failed = true;
+    return;
+  }
+  checksum_verify(volume, block_number, 1, block);
+}
 
-  for (int i = 0; i < BLOCK_SIZE; i++) {
-    bitmap[i] = UNUSED_FLAG;
+// CRC32C
+//
+// The Castagnoli CRC, in three kernels that all give the same result: a
+// table lookup per byte, slicing-by-8 (eight tables, one 64-bit word at a
+// time), and the SSE4.2 crc32 instruction. The instruction has a latency of
+// three cycles but issues one per cycle, so the last runs three independent
+// streams over CRC32C_LONG (or CRC32C_SHORT) bytes each and merges their
+// CRCs with tables that append that many zero bytes to a CRC. The tables
+// are built on first use; sfs_crc32c picks the fastest kernel the CPU has.
+
+uint32_t crc32c_table[8][256];
+uint32_t crc32c_long[4][256];
+uint32_t crc32c_short[4][256];
+uint32_t (*crc32c_best)(uint32_t crc, const void *data, size_t length);
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+uint32_t gf2_matrix_times(const uint32_t *matrix, uint32_t vector) {
+  uint32_t sum = 0;
+  for (; vector != 0; vector >>= 1, matrix++) {
+    if (vector & 1) {
+      sum ^= *matrix;
+    }
   }
+  return sum;
+}
 
-  write_block((void *)bitmap, BITMAP_BLOCK);
+void gf2_matrix_square(uint32_t *square, const uint32_t *matrix) {
+  for (int n = 0; n < 32; n++) {
+    square[n] = gf2_matrix_times(matrix, matrix[n]);
+  }
 }
 
-void load_bitmap() { read_block(bitmap, BITMAP_BLOCK); }
+void crc32c_zeros(uint32_t zeros[4][256], size_t length) {
+  // Tables that append length zero bytes to a CRC, a byte of it at a time.
+  // The operator is a 32x32 matrix over GF(2), one column per word: that of
+  // a single zero bit, squared into that of each power of two bytes and
+  // multiplied in for the bits set in length.
+  uint32_t power[32], square[32], shift[32], product[32];
+  power[0] = CRC32C_POLY;
+  for (int n = 1; n < 32; n++) {
+    power[n] = 1u << (n - 1);
+  }
+  for (int i = 0; i < 3; i++) {
+    gf2_matrix_square(square, power);
+    memcpy(power, square, sizeof(power));
+  }
+  for (int n = 0; n < 32; n++) {
+    shift[n] = 1u << n;
+  }
+  while (length > 0) {
+    if (length & 1) {
+      for (int n = 0; n < 32; n++) {
+        product[n] = gf2_matrix_times(power, shift[n]);
+      }
+      memcpy(shift, product, sizeof(shift));
+    }
+    length >>= 1;
+    gf2_matrix_square(square, power);
+    memcpy(power, square, sizeof(power));
+  }
 
-int find_empty_block() {
-  for (int i = 0; i < BLOCK_SIZE; i++) {
-    if (bitmap[i] == UNUSED_FLAG) {
-      bitmap[i] = USED_FLAG;
-      return i;
+  for (uint32_t n = 0; n < 256; n++) {
+    for (int byte = 0; byte < 4; byte++) {
+      zeros[byte][n] = gf2_matrix_times(shift, n << (8 * byte));
     }
   }
-  return -1;
 }
 
-// Superblock related functions
-
-void init_superblock(int total_blocks, int available_blocks, int total_fcbs) {
-  char block[BLOCK_SIZE] = {0};
-  struct SuperBlock *superblock = (struct SuperBlock *)block;
-  superblock->num_blocks = total_blocks;
-  superblock->num_free_blocks = available_blocks;
-  superblock->num_files = 0;
-  superblock->num_free_fcbs = total_fcbs;
+uint32_t crc32c_shift(uint32_t zeros[4][256], uint32_t crc) {
+  return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+         zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
 
-  write_block((void *)superblock, SUPERBLOCK_BLOCK);
+uint32_t crc32c_bytewise(uint32_t crc, const void *data, size_t length) {
+  const unsigned char *next = data;
+  crc = ~crc;
+  while (length-- > 0) {
+    crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
 }
 
-void get_superblock(struct SuperBlock *superblock_buffer) {
-  char block[BLOCK_SIZE] = {0};
-  read_block(block, SUPERBLOCK_BLOCK);
-  memcpy(superblock_buffer, block, sizeof(struct SuperBlock));
+uint32_t crc32c_slicing(uint32_t crc, const void *data, size_t length) {
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+  return crc32c_bytewise(crc, data, length);
+#else
+  const unsigned char *next = data;
+  crc = ~crc;
+  while (length > 0 && ((uintptr_t)next & 7) != 0) {
+    crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+    length--;
+  }
+  for (; length >= 8; next += 8, length -= 8) {
+    uint64_t word;
+    memcpy(&word, next, sizeof(word));
+    word ^= crc;
+    crc = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff] ^
+          crc32c_table[5][(word >> 16) & 0xff] ^
+          crc32c_table[4][(word >> 24) & 0xff] ^
+          crc32c_table[3][(word >> 32) & 0xff] ^
+          crc32c_table[2][(word >> 40) & 0xff] ^
+          crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+  }
+  while (length-- > 0) {
+    crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+#endif
 }
 
-int init_FCB() {
-  int fcb_size = sizeof(struct FCB);
-  int total_fcbs = 0;
-  num_fcbs = BLOCK_SIZE / fcb_size;
-  char block[BLOCK_SIZE] = {0};
+#ifdef SFS_HAVE_SSE42
+// Inlined even in unoptimised builds, where a call per word costs more
+// than the instruction
+static inline __attribute__((target("sse4.2"), always_inline)) uint64_t
+crc32c_word(uint64_t crc, const unsigned char *next) {
+  return _mm_crc32_u64(crc, *(const uint64_t *)next);
+}
 
-  for (int i = 0; i < FCB_BLOCKS_COUNT; i++) {
-    total_fcbs += num_fcbs;
+__attribute__((target("sse4.2"))) uint32_t
+crc32c_sse42(uint32_t crc, const void *data, size_t length) {
+  const unsigned char *next = data;
+  uint64_t crc0 = ~crc;
+  while (length > 0 && ((uintptr_t)next & 7) != 0) {
+    crc0 = _mm_crc32_u8(crc0, *next++);
+    length--;
+  }
 
-    for (int j = 0; j < num_fcbs; j++) {
-      struct FCB *fcb = (struct FCB *)(block + j * fcb_size);
-      fcb->used = UNUSED_FLAG;
+  // Three streams at a time, the longer stride first
+  size_t strides[2] = {CRC32C_LONG, CRC32C_SHORT};
+  for (int s = 0; s < 2; s++) {
+    size_t stride = strides[s];
+    uint32_t(*zeros)[256] = s == 0 ? crc32c_long : crc32c_short;
+    while (length >= 3 * stride) {
+      uint64_t crc1 = 0, crc2 = 0;
+      const unsigned char *end = next + stride;
+      for (; next < end; next += 8) {
+        crc0 = crc32c_word(crc0, next);
+        crc1 = crc32c_word(crc1, next + stride);
+        crc2 = crc32c_word(crc2, next + 2 * stride);
+      }
+      crc0 = crc32c_shift(zeros, crc0) ^ crc1;
+      crc0 = crc32c_shift(zeros, crc0) ^ crc2;
+      next += 2 * stride;
+      length -= 3 * stride;
     }
+  }
 
-    write_block((void *)block, FCB_BLOCKS_START + i);
+  for (; length >= 8; next += 8, length -= 8) {
+    crc0 = crc32c_word(crc0, next);
   }
-  return total_fcbs;
+  while (length-- > 0) {
+    crc0 = _mm_crc32_u8(crc0, *next++);
+  }
+  return ~(uint32_t)crc0;
 }
+#endif
 
-void load_FCBs() {
-  char block[BLOCK_SIZE] = {0};
-  int fcb_size = sizeof(struct FCB);
-  num_fcbs = BLOCK_SIZE / fcb_size;
-  file_control_blocks =
-      malloc(num_fcbs * FCB_BLOCKS_COUNT * sizeof(struct FCB));
-  for (int i = 0; i < FCB_BLOCKS_COUNT; i++) {
-    read_block(block, FCB_BLOCKS_START + i);
-    memcpy(&file_control_blocks[i * num_fcbs], block, num_fcbs * fcb_size);
+void crc32c_init(void) {
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t crc = n;
+    for (int k = 0; k < 8; k++) {
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    crc32c_table[0][n] = crc;
+  }
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t crc = crc32c_table[0][n];
+    for (int k = 1; k < 8; k++) {
+      crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+      crc32c_table[k][n] = crc;
+    }
+  }
+  crc32c_zeros(crc32c_long, CRC32C_LONG);
+  crc32c_zeros(crc32c_short, CRC32C_SHORT);
+  crc32c_best = crc32c_slicing;
+#ifdef SFS_HAVE_SSE42
+  if (sfs_crc32c_supported(SFS_CRC32C_SSE42)) {
+    crc32c_best = crc32c_sse42;
   }
+#endif
 }
 
-void init_open_file_table() {
-  for (int i = 0; i < MAX_OPEN_FILES; i++) {
-    open_file_table[i].dir_entry_pointer = NULL;
-    open_file_table[i].read_write_pointer = 0;
+bool sfs_crc32c_supported(int kernel) {
+  if (kernel == SFS_CRC32C_SSE42) {
+#ifdef SFS_HAVE_SSE42
+    return __builtin_cpu_supports("sse4.2");
+#else
+    return false;
+#endif
   }
+  return kernel == SFS_CRC32C_BYTEWISE || kernel == SFS_CRC32C_SLICING;
 }
 
-// Index Block operations
-
-void set_index_block(struct IndexBlock *index_block, int block_number) {
-  char block[BLOCK_SIZE];
-  memcpy(block, index_block, sizeof(struct IndexBlock));
-
-  // Zero out any remaining space in the block (for alignment/padding)
-  if (sizeof(struct IndexBlock) < BLOCK_SIZE) {
-    memset(block + sizeof(struct IndexBlock), 0,
-           BLOCK_SIZE - sizeof(struct IndexBlock));
+uint32_t sfs_crc32c_kernel(int kernel, uint32_t crc, const void *data,
+                           size_t length) {
+  // As sfs_crc32c with the given kernel, or the fastest one if the CPU
+  // lacks it
+  pthread_once(&crc32c_once, crc32c_init);
+  switch (kernel) {
+  case SFS_CRC32C_BYTEWISE:
+    return crc32c_bytewise(crc, data, length);
+  case SFS_CRC32C_SLICING:
+    return crc32c_slicing(crc, data, length);
+  default:
+    return crc32c_best(crc, data, length);
   }
+}
 
-  write_block(block, block_number);
+uint32_t sfs_crc32c(uint32_t crc, const void *data, size_t length) {
+  // Continues crc over length more bytes; start from 0
+  pthread_once(&crc32c_once, crc32c_init);
+  return crc32c_best(crc, data, length);
 }
 
-void get_index_block(struct IndexBlock *index_block, int block_number) {
-  char block[BLOCK_SIZE];
-  read_block(block, block_number);
-  memcpy(index_block, block, sizeof(struct IndexBlock));
+// Block checksums
+//
+// Each block of the data area has an entry in the checksum region, which
+// follows the journal. The region is mapped shared, so entries reach the
+// vdisk through the page cache, not the journal. An entry's current
+// checksum only ever describes contents already durable: a write records
+// its checksum as pending first, and the commit after it makes that
+// current once it has synced the data (see checksum_promote). After a crash
+// a block holds its current contents, or those of a write that reached the
+// disk without its commit, matching the pending checksum; anything else,
+// including a write lost or torn after it was synced, fails. Blocks are
+// checked as they are read from the vdisk, unless the volume was mounted
+// with SFS_MOUNT_NO_VERIFY, and blocks never written (entry 0) are not. A
+// mismatch is reported, counted and fails the read that met it; the
+// blocks in the cache are trusted.
+
+__thread bool checksum_failed = false;
+
+uint32_t block_checksum(const void *data) {
+  // 0 is kept to mean no checksum yet
+  uint32_t crc = sfs_crc32c(0, data, BLOCK_SIZE);
+  return crc != 0 ? crc : 1;
+}
+
+struct BlockChecksum *checksum_entry(struct Volume *volume, uint64_t block) {
+  if (volume->checksums == NULL || block < volume->data_blocks_start ||
+      block >= volume->superblock.num_blocks) {
+    return NULL;
+  }
+  return &volume->checksums[block];
 }
-// Directory operations
 
-void init_root_directory() {
-  int dir_entry_size = sizeof(struct DirectoryEntry);
-  num_entries = BLOCK_SIZE / dir_entry_size;
-  directory =
-      malloc(num_entries * ROOT_DIR_COUNT * sizeof(struct DirectoryEntry));
+void checksum_store(struct Volume *volume, uint64_t start, uint32_t count,
+                    const char *data) {
+  // Records the checksums of count blocks about to be written from data as
+  // pending; contents equal to the current ones need none
+  for (uint32_t i = 0; i < count; i++) {
+    struct BlockChecksum *entry = checksum_entry(volume, start + i);
+    if (entry == NULL) {
+      continue;
+    }
+    uint32_t checksum = block_checksum(data + (size_t)i * BLOCK_SIZE);
+    uint32_t current = __atomic_load_n(&entry->current, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->pending, checksum != current ? checksum : 0,
+                     __ATOMIC_RELAXED);
+  }
+}
 
-  char block[BLOCK_SIZE];
+void checksum_written(struct Volume *volume, uint64_t start, uint32_t count) {
+  // Called once count blocks have been handed to the vdisk: their pending
+  // checksums are promoted by the next commit, which syncs them first
+  if (volume->checksums == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&volume->checksum_lock);
+  for (uint32_t i = 0; i < count; i++) {
+    struct BlockChecksum *entry = checksum_entry(volume, start + i);
+    uint32_t pending =
+        entry != NULL ? __atomic_load_n(&entry->pending, __ATOMIC_RELAXED) : 0;
+    if (pending == 0) {
+      continue;
+    }
+    if (volume->checksum_write_count == volume->checksum_write_capacity) {
+      int capacity = volume->checksum_write_capacity * 2 + 64;
+      struct ChecksumWrite *grown = realloc(
+          volume->checksum_writes, capacity * sizeof(struct ChecksumWrite));
+      if (grown == NULL) {
+        // The block keeps passing on its pending checksum until rewritten
+        printf("ERROR: Could not record a written checksum\n");
+        break;
+      }
+      volume->checksum_writes = grown;
+      volume->checksum_write_capacity = capacity;
+    }
+    struct ChecksumWrite *write =
+        &volume->checksum_writes[volume->checksum_write_count++];
+    write->block = start + i;
+    write->checksum = pending;
+  }
+  pthread_mutex_unlock(&volume->checksum_lock);
+}
 
-  for (int i = 0; i < num_entries; i++) {
-    struct DirectoryEntry *dir_entry =
-        (struct DirectoryEntry *)(block + i * dir_entry_size);
-    dir_entry->used = UNUSED_FLAG;
+void checksum_promote(struct Volume *volume, struct ChecksumWrite *writes,
+                      int write_count) {
+  // Makes the checksums of synced writes current. A block cleared since is
+  // left alone, and one written again keeps its newer pending checksum.
+  // The current checksum changes first, so a concurrent read of the block
+  // always matches one of the two.
+  pthread_mutex_lock(&volume->checksum_lock);
+  for (int w = 0; w < write_count; w++) {
+    struct BlockChecksum *entry = checksum_entry(volume, writes[w].block);
+    uint32_t checksum = writes[w].checksum;
+    if (__atomic_load_n(&entry->pending, __ATOMIC_RELAXED) == 0) {
+      continue;
+    }
+    __atomic_store_n(&entry->current, checksum, __ATOMIC_RELAXED);
+    __atomic_compare_exchange_n(&entry->pending, &checksum, 0, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
   }
+  pthread_mutex_unlock(&volume->checksum_lock);
+}
 
-  for (int i = 0; i < ROOT_DIR_COUNT; i++) {
-    write_block((void *)block, ROOT_DIR_START + i);
+void checksum_clear(struct Volume *volume, uint64_t start, uint32_t count) {
+  // Forgets the checksums of blocks whose contents are about to go
+  pthread_mutex_lock(&volume->checksum_lock);
+  for (uint32_t i = 0; i < count; i++) {
+    struct BlockChecksum *entry = checksum_entry(volume, start + i);
+    if (entry != NULL) {
+      __atomic_store_n(&entry->current, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&entry->pending, 0, __ATOMIC_RELAXED);
+    }
   }
+  pthread_mutex_unlock(&volume->checksum_lock);
 }
 
-void load_directory() {
-  char block[BLOCK_SIZE]; // buffer for reading
-  int dir_entry_size = sizeof(struct DirectoryEntry);
-  directory =
-      malloc(num_entries * ROOT_DIR_COUNT * sizeof(struct DirectoryEntry));
+bool checksum_matches(struct Volume *volume, uint64_t block,
+                      const char *data) {
+  struct BlockChecksum *entry = checksum_entry(volume, block);
+  if (!volume->verify_checksums || entry == NULL) {
+    return true;
+  }
+  uint32_t current = __atomic_load_n(&entry->current, __ATOMIC_RELAXED);
+  if (current == 0) {
+    return true;
+  }
+  uint32_t checksum = block_checksum(data);
+  return checksum == current ||
+         checksum == __atomic_load_n(&entry->pending, __ATOMIC_RELAXED);
+}
 
-  for (int i = 0; i < ROOT_DIR_COUNT; i++) {
-    read_block(block, ROOT_DIR_START + i);
-    memcpy(&directory[i * num_entries], block, num_entries * dir_entry_size);
+bool checksum_verify(struct Volume *volume, uint64_t start, uint32_t count,
+                     const char *data) {
+  // Checks count blocks just read into data, reporting those that fail
+  bool intact = true;
+  for (uint32_t i = 0; i < count; i++) {
+    if (!checksum_matches(volume, start + i, data + (size_t)i * BLOCK_SIZE)) {
+      printf("ERROR: Block %llu failed its checksum\n",
+             (unsigned long long)(start + i));
+      stat_add(&volume->cache_stats.checksum_errors, 1);
+      intact = false;
+    }
+  }
+  if (!intact) {
+    checksum_failed = true;
   }
+  return intact;
 }
 
-// File system operations
+// LZ4
+//
+// The LZ4 block format: a sequence is a token byte (literal count in the
+// high nibble, match length minus LZ4_MIN_MATCH in the low one, 15 in
+// either meaning more length bytes follow), the literals, and a 2-byte
+// little-endian offset back to the match. The last sequence has literals
+// only. The compressor is the usual greedy one over a hash table of 4-byte
+// sequences, taking bigger steps through data that keeps not matching, so
+// incompressible data costs little.
+
+uint32_t lz4_read32(const unsigned char *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
 
-int sfs_mount(char *vdiskname) {
-  vdisk_fd = open(vdiskname, O_RDWR);
-  get_superblock(&superblock);
-  load_directory();
-  load_bitmap();
-  load_FCBs();
-  init_open_file_table();
+uint32_t lz4_hash(uint32_t sequence) {
+  return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
 
-  if (vdisk_fd < 0) {
-    perror("Failed to mount vdisk");
-    return -1;
+unsigned char *lz4_put_length(unsigned char *out, size_t length) {
+  // Writes the part of a length past its nibble
+  for (; length >= 255; length -= 255) {
+    *out++ = 255;
   }
-  printf("LOG(sfs_mount): Mounted %s successfully\n", vdiskname);
-
-  return 0;
+  *out++ = (unsigned char)length;
+  return out;
 }
 
-int sfs_umount() {
-  if (vdisk_fd >= 0) {
-    fsync(vdisk_fd); // Ensure all writes are flushed
-    close(vdisk_fd);
-    printf("LOG(sfs_umount): Unmounted successfully\n");
-    vdisk_fd = -1;
-  } else {
-    printf("LOG(sfs_umount): No disk mounted.\n");
+unsigned char *lz4_put_sequence(unsigned char *out, unsigned char *out_end,
+                                const unsigned char *literals,
+                                size_t literal_count, size_t offset,
+                                size_t match_length) {
+  // Appends one sequence, without a match if match_length is 0, or returns
+  // NULL if it would not fit
+  size_t needed = 1 + literal_count / 255 + 1 + literal_count + 2 +
+                  match_length / 255 + 1;
+  if ((size_t)(out_end - out) < needed) {
+    return NULL;
   }
-  return 0;
+  unsigned char *token = out++;
+  *token = (literal_count < 15 ? literal_count : 15) << 4;
+  if (literal_count >= 15) {
+    out = lz4_put_length(out, literal_count - 15);
+  }
+  memcpy(out, literals, literal_count);
+  out += literal_count;
+  if (match_length == 0) {
+    return out;
+  }
+
+  *out++ = offset & 0xff;
+  *out++ = offset >> 8;
+  size_t extra = match_length - LZ4_MIN_MATCH;
+  *token |= extra < 15 ? extra : 15;
+  if (extra >= 15) {
+    out = lz4_put_length(out, extra - 15);
+  }
+  return out;
 }
 
-int sfs_create(char *filename) {
-  if (file_count == MAX_FILES) {
-    printf("Max number of files created! Cannot create more files");
-    return -1;
+int sfs_lz4_compress(const void *source, int source_size, void *dest,
+                     int capacity) {
+  // Compresses source into at most capacity bytes of dest and returns
+  // their count, or 0 if they don't fit
+  const unsigned char *in = source, *end = in + source_size;
+  const unsigned char *anchor = in, *next = in;
+  unsigned char *out = dest, *out_end = out + capacity;
+  uint32_t table[1 << LZ4_HASH_BITS] = {0};
+  uint32_t misses = 0;
+
+  if (source_size > LZ4_MATCH_LIMIT) {
+    const unsigned char *match_limit = end - LZ4_MATCH_LIMIT;
+    const unsigned char *match_end_limit = end - LZ4_LAST_LITERALS;
+    next++;
+    while (next < match_limit) {
+      uint32_t sequence = lz4_read32(next);
+      uint32_t *slot = &table[lz4_hash(sequence)];
+      const unsigned char *match = in + *slot;
+      *slot = next - in;
+      if (next - match > LZ4_MAX_OFFSET || lz4_read32(match) != sequence) {
+        next += 1 + (misses++ >> 6);
+        continue;
+      }
+      misses = 0;
+
+      while (next > anchor && match > in && next[-1] == match[-1]) {
+        next--;
+        match--;
+      }
+      const unsigned char *match_end = next + LZ4_MIN_MATCH;
+      const unsigned char *source_end = match + LZ4_MIN_MATCH;
+      while (match_end < match_end_limit && *match_end == *source_end) {
+        match_end++;
+        source_end++;
+      }
+      out = lz4_put_sequence(out, out_end, anchor, next - anchor,
+                             next - match, match_end - next);
+      if (out == NULL) {
+        return 0;
+      }
+      next = anchor = match_end;
+      if (next - 2 < match_limit) {
+        table[lz4_hash(lz4_read32(next - 2))] = next - 2 - in;
+      }
+    }
   }
 
-  // Find first free directory entry + check if already a file of same name
-  // exists
-  int first_free_dir_entry = num_entries * ROOT_DIR_COUNT + 1;
-  for (int i = 0; i < num_entries * ROOT_DIR_COUNT; i++) {
-    if (directory[i].used == UNUSED_FLAG) {
-      first_free_dir_entry = min(first_free_dir_entry, i);
+  out = lz4_put_sequence(out, out_end, anchor, end - anchor, 0, 0);
+  return out == NULL ? 0 : out - (unsigned char *)dest;
+}
+
+int sfs_lz4_decompress(const void *source, int source_size, void *dest,
+                       int capacity) {
+  // Returns the number of bytes produced, or -1 if source is not valid LZ4
+  // data or would produce more than capacity bytes
+  const unsigned char *in = source, *in_end = in + source_size;
+  unsigned char *out = dest, *out_end = out + capacity;
+
+  while (in < in_end) {
+    unsigned token = *in++;
+    size_t literal_count = token >> 4;
+    if (literal_count == 15) {
+      unsigned char more;
+      do {
+        if (in == in_end) {
+          return -1;
+        }
+        more = *in++;
+        literal_count += more;
+      } while (more == 255);
+    }
+    if (literal_count > (size_t)(in_end - in) ||
+        literal_count > (size_t)(out_end - out)) {
+      return -1;
+    }
+    memcpy(out, in, literal_count);
+    in += literal_count;
+    out += literal_count;
+    if (in == in_end) {
+      break; // the last sequence has no match
     }
 
-    if (directory[i].used == USED_FLAG &&
-        strcmp(directory[i].filename, filename) == 0) {
-      printf("Directory already has file of same name!\n");
+    if (in_end - in < 2) {
+      return -1;
+    }
+    size_t offset = in[0] | (in[1] << 8);
+    in += 2;
+    size_t match_length = token & 15;
+    if (match_length == 15) {
+      unsigned char more;
+      do {
+        if (in == in_end) {
+          return -1;
+        }
+        more = *in++;
+        match_length += more;
+      } while (more == 255);
+    }
+    match_length += LZ4_MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(out - (unsigned char *)dest) ||
+        match_length > (size_t)(out_end - out)) {
       return -1;
     }
-  }
 
-  // Find first empty FCB
-  int first_free_fcb = num_fcbs * FCB_BLOCKS_COUNT + 1;
-  for (int i = 0; i < num_fcbs * FCB_BLOCKS_COUNT; i++) {
-    if (file_control_blocks[i].used == UNUSED_FLAG) {
-      first_free_fcb = min(first_free_fcb, i);
-      break;
+    // A match may overlap its own output, repeating the last offset bytes;
+    // each copy takes at most offset bytes so source and target never do
+    while (match_length > 0) {
+      size_t piece = match_length < offset ? match_length : offset;
+      memcpy(out, out - offset, piece);
+      out += piece;
+      match_length -= piece;
     }
   }
+  return out - (unsigned char *)dest;
+}
 
-  if (first_free_fcb == num_fcbs * FCB_BLOCKS_COUNT + 1) {
-    printf("No free FCBs remaining\n");
-    return -1;
-  }
+// Block cache
+//
+// All block I/O goes through a fixed-size write-back cache. The cache is
+// split into CACHE_SHARDS independent shards (by block number) so threads
+// working on different blocks rarely contend; each shard has its own lock,
+// chained hash on the block number and CLOCK eviction. Dirty slots are only
+// written to disk on eviction or on a flush (sfs_sync / sfs_umount).
 
-  // Find first empty block in bitmap (for index block)
-  int first_free_block = BLOCK_SIZE + 1;
-  for (int i = 0; i < BLOCK_SIZE; i++) {
-    if (bitmap[i] == false) {
-      first_free_block = min(first_free_block, i);
-      bitmap[first_free_block] = true;
-      break;
-    }
-  }
+struct CacheShard *cache_shard(struct Volume *volume, uint64_t block_number) {
+  return &volume->cache_shards[block_number % CACHE_SHARDS];
+}
 
-  if (first_free_block == BLOCK_SIZE + 1) {
-    printf("No free blocks remaining\n");
-    return -1;
+int cache_bucket(struct CacheShard *shard, uint64_t block_number) {
+  return (int)((block_number / CACHE_SHARDS * 2654435761u) &
+               (shard->bucket_count - 1));
+}
+
+void cache_free_shards(struct Volume *volume) {
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    free(volume->cache_shards[i].entries);
+    free(volume->cache_shards[i].buckets);
+    volume->cache_shards[i].entries = NULL;
+    volume->cache_shards[i].buckets = NULL;
   }
+}
 
-  first_free_block += FCB_BLOCKS_COUNT + FCB_BLOCKS_START;
+int cache_init(struct Volume *volume) {
+  if (__atomic_load_n(&volume->cache_ready, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
 
-  // Write index block to first free block
-  struct IndexBlock index_block;
-  memset(index_block.block_pointers, INVALID_BLOCK_POINTER,
-         sizeof(index_block.block_pointers));
-  set_index_block(&index_block, first_free_block);
+  pthread_mutex_lock(&volume->cache_init_lock);
+  if (volume->cache_ready) {
+    pthread_mutex_unlock(&volume->cache_init_lock);
+    return 0;
+  }
 
-  // Set directory entry
-  directory[first_free_dir_entry].index_block = first_free_block;
-  directory[first_free_dir_entry].used = USED_FLAG;
-  directory[first_free_dir_entry].fcb_index = first_free_fcb;
-  strcpy(directory[first_free_dir_entry].filename, filename);
-  directory[first_free_dir_entry].size = 0;
+  int shard_capacity =
+      (volume->cache_capacity + CACHE_SHARDS - 1) / CACHE_SHARDS;
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    struct CacheShard *shard = &volume->cache_shards[i];
+    shard->capacity = shard_capacity;
+    shard->bucket_count = 1;
+    while (shard->bucket_count < shard_capacity * 2) {
+      shard->bucket_count <<= 1;
+    }
 
-  // Set FCB
-  file_control_blocks[first_free_fcb].used = USED_FLAG;
-  strcpy(file_control_blocks[first_free_fcb].filename, filename);
-  file_control_blocks[first_free_fcb].size = 0;
-  file_control_blocks[first_free_fcb].created_at = time(NULL);
-  file_control_blocks[first_free_fcb].last_modified_at = time(NULL);
+    shard->entries = calloc(shard_capacity, sizeof(struct CacheEntry));
+    shard->buckets = malloc(shard->bucket_count * sizeof(int));
+    if (shard->entries == NULL || shard->buckets == NULL) {
+      printf("ERROR: Could not allocate block cache\n");
+      cache_free_shards(volume);
+      pthread_mutex_unlock(&volume->cache_init_lock);
+      return -1;
+    }
 
-  file_count++;
+    for (int j = 0; j < shard->bucket_count; j++) {
+      shard->buckets[j] = -1;
+    }
+    shard->clock_hand = 0;
+    pthread_mutex_init(&shard->lock, NULL);
+  }
 
+  __atomic_store_n(&volume->cache_ready, true, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&volume->cache_init_lock);
   return 0;
 }
 
-int sfs_delete(char *filename) {
+// The helpers below expect the shard lock to be held
 
-  int dir_entry_index = num_entries * ROOT_DIR_COUNT + 1;
-  for (int i = 0; i < num_entries * ROOT_DIR_COUNT; i++) {
-    if (directory[i].used == USED_FLAG &&
-        strcmp(directory[i].filename, filename) == 0) {
-      dir_entry_index = i;
-      break;
+int cache_lookup(struct CacheShard *shard, uint64_t block_number) {
+  for (int i = shard->buckets[cache_bucket(shard, block_number)]; i != -1;
+       i = shard->entries[i].hash_next) {
+    if (shard->entries[i].block_number == block_number) {
+      return i;
     }
   }
+  return -1;
+}
 
-  if (dir_entry_index == num_entries * ROOT_DIR_COUNT + 1) {
-    printf("Could not find given file\n");
-    return -1;
+void cache_unlink(struct CacheShard *shard, int slot) {
+  int *link =
+      &shard->buckets[cache_bucket(shard, shard->entries[slot].block_number)];
+  while (*link != slot) {
+    link = &shard->entries[*link].hash_next;
   }
+  *link = shard->entries[slot].hash_next;
+}
 
-  // Mark directory entry as unused
-  directory[dir_entry_index].used = UNUSED_FLAG;
-  printf("Set dir entry to unused\n");
-
-  // Mark file control block as ununsed
-  file_control_blocks[directory[dir_entry_index].fcb_index].used = UNUSED_FLAG;
-  printf("Set FCB to unused\n");
-
-  // Mark all blocks in index block as unused
-  char block[BLOCK_SIZE];
-  read_block(block, directory[dir_entry_index].index_block);
-  struct IndexBlock *index_block = (struct IndexBlock *)block;
-
-  for (int i = 0; i < POINTERS_PER_BLK &&
-                  index_block->block_pointers[i] != INVALID_BLOCK_POINTER;
-       i++) {
-    bitmap[index_block->block_pointers[i]] = UNUSED_FLAG;
+void cache_writeback(struct Volume *volume, struct CacheShard *shard,
+                     int slot) {
+  struct CacheEntry *entry = &shard->entries[slot];
+  if (entry->valid && entry->dirty) {
+    disk_write_block(volume, entry->data, entry->block_number);
+    entry->dirty = false;
+    stat_add(&volume->cache_stats.writebacks, 1);
   }
-  printf("Set bitmap blocks to unused\n");
+}
 
-  // Mark index block as unused
-  bitmap[directory[dir_entry_index].index_block] = UNUSED_FLAG;
-  printf("Set bitmap index block to unused\n");
+int cache_evict(struct Volume *volume, struct CacheShard *shard) {
+  // CLOCK: referenced slots get a second chance before being reused
+  for (;;) {
+    int slot = shard->clock_hand;
+    struct CacheEntry *entry = &shard->entries[slot];
+    shard->clock_hand = (shard->clock_hand + 1) % shard->capacity;
 
-  file_count--;
+    if (!entry->valid) {
+      return slot;
+    }
+    if (entry->referenced) {
+      entry->referenced = false;
+      continue;
+    }
 
-  return 0;
+    cache_writeback(volume, shard, slot);
+    cache_unlink(shard, slot);
+    entry->valid = false;
+    stat_add(&volume->cache_stats.evictions, 1);
+    return slot;
+  }
 }
 
-int sfs_open(char *filename, int mode) {
-  if (open_file_count >= MAX_OPEN_FILES) {
-    printf("Maximum number of files already opened (%d)\n", open_file_count);
-    return -1;
+struct CacheEntry *cache_get(struct Volume *volume, struct CacheShard *shard,
+                             uint64_t block_number, bool load) {
+  int slot = cache_lookup(shard, block_number);
+  if (slot >= 0) {
+    stat_add(&volume->cache_stats.hits, 1);
+    shard->entries[slot].referenced = true;
+    return &shard->entries[slot];
   }
 
-  for (int i = 0; i < MAX_OPEN_FILES; i++) {
-    if (open_file_table[i].dir_entry_pointer != NULL &&
-        strcmp(open_file_table[i].dir_entry_pointer->filename, filename) == 0) {
-      printf("This file is already opened somewhere!\n");
-      return -1;
-    }
+  stat_add(&volume->cache_stats.misses, 1);
+  slot = cache_evict(volume, shard);
+  struct CacheEntry *entry = &shard->entries[slot];
+  int bucket = cache_bucket(shard, block_number);
+  entry->block_number = block_number;
+  entry->valid = true;
+  entry->dirty = false;
+  entry->referenced = true;
+  entry->hash_next = shard->buckets[bucket];
+  shard->buckets[bucket] = slot;
+
+  if (load) {
+    memset(entry->data, 0, BLOCK_SIZE);
+    disk_read_block(volume, entry->data, block_number);
   }
+  return entry;
+}
 
-  // Find first free entry in open file table (this will also be our file
-  // descriptor)
-  int fd = -1;
-  for (int i = 0; i < MAX_OPEN_FILES; i++) {
-    if (open_file_table[i].dir_entry_pointer == NULL) {
-      fd = i;
-      break;
+void cache_flush(struct Volume *volume) {
+  if (!volume->cache_ready) {
+    return;
+  }
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    struct CacheShard *shard = &volume->cache_shards[i];
+    pthread_mutex_lock(&shard->lock);
+    for (int slot = 0; slot < shard->capacity; slot++) {
+      cache_writeback(volume, shard, slot);
     }
+    pthread_mutex_unlock(&shard->lock);
   }
+}
 
-  // Find the directory entry of the file
-  int dir_entry_index = num_entries * ROOT_DIR_COUNT + 1;
-  for (int i = 0; i < num_entries * ROOT_DIR_COUNT; i++) {
-    if (directory[i].used == USED_FLAG &&
-        strcmp(directory[i].filename, filename) == 0) {
-      dir_entry_index = i;
-      break;
+void cache_destroy(struct Volume *volume) {
+  pthread_mutex_lock(&volume->cache_init_lock);
+  if (volume->cache_ready) {
+    cache_flush(volume);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+      pthread_mutex_destroy(&volume->cache_shards[i].lock);
     }
+    cache_free_shards(volume);
+    volume->cache_ready = false;
   }
+  pthread_mutex_unlock(&volume->cache_init_lock);
+}
 
-  if (dir_entry_index == num_entries * ROOT_DIR_COUNT + 1) {
-    printf("Could not find given file\n");
-    return -1;
+void write_block(struct Volume *volume, void *block, uint64_t block_number) {
+  if (volume->vdisk_map != NULL) {
+    checksum_store(volume, block_number, 1, block);
+    memcpy(volume->vdisk_map + (size_t)block_number * BLOCK_SIZE, block,
+           BLOCK_SIZE);
+    checksum_written(volume, block_number, 1);
+    return;
+  }
+  if (cache_init(volume) < 0) {
+    disk_write_block(volume, block, block_number);
+    return;
   }
 
-  open_file_table[fd].open_mode = mode;
-  open_file_table[fd].read_write_pointer = 0;
-  open_file_table[fd].dir_entry_pointer = &directory[dir_entry_index];
-  open_file_count++;
-
-  return fd;
+  struct CacheShard *shard = cache_shard(volume, block_number);
+  pthread_mutex_lock(&shard->lock);
+  struct CacheEntry *entry = cache_get(volume, shard, block_number, false);
+  memcpy(entry->data, block, BLOCK_SIZE);
+  entry->dirty = true;
+  pthread_mutex_unlock(&shard->lock);
 }
 
-int sfs_close(int fd) {
-  if (fd >= MAX_OPEN_FILES) {
-    printf("File descriptor out of range");
-    return -1;
-  }
+void read_block(struct Volume *volume, void *block, uint64_t block_number) {
+  // Reads the given block number and copies the content into block
 
-  if (open_file_table[fd].dir_entry_pointer == NULL) {
-    printf("The file was not open\n");
-    return -1;
+  if (volume->vdisk_map != NULL) {
+    memcpy(block, volume->vdisk_map + (size_t)block_number * BLOCK_SIZE,
+           BLOCK_SIZE);
+    checksum_verify(volume, block_number, 1, block);
+    return;
+  }
+  if (cache_init(volume) < 0) {
+    disk_read_block(volume, block, block_number);
+    return;
   }
 
-  open_file_table[fd].dir_entry_pointer = NULL;
-  open_file_count--;
-
-  return 0;
+  // A block that failed its checksum is not kept
+  bool failed = checksum_failed;
+  checksum_failed = false;
+  struct CacheShard *shard = cache_shard(volume, block_number);
+  pthread_mutex_lock(&shard->lock);
+  struct CacheEntry *entry = cache_get(volume, shard, block_number, true);
+  memcpy(block, entry->data, BLOCK_SIZE);
+  if (checksum_failed) {
+    cache_unlink(shard, entry - shard->entries);
+    entry->valid = false;
+  }
+  pthread_mutex_unlock(&shard->lock);
+  checksum_failed |= failed;
 }
 
-int sfs_seek(int fd, int offset, int whence) {
-  int read_write_pointer_copy = open_file_table[fd].read_write_pointer;
-  switch (whence) {
-  case SEEK_SET:
-    open_file_table[fd].read_write_pointer = offset;
-    break;
-
-  case SEEK_CUR:
-    open_file_table[fd].read_write_pointer += offset;
-    break;
-
-  case SEEK_END:
-    open_file_table[fd].read_write_pointer =
-        file_control_blocks[open_file_table[fd].dir_entry_pointer->fcb_index]
-            .size +
-        offset;
-    break;
+// Vectored block I/O
+//
+// A BlockRun is issued as a single preadv/pwritev of up to three iovecs
+// (head bounce, caller memory, tail bounce). The cache is reconciled first:
+// dirty copies of the run's blocks are written back before a read, and
+// cached copies are dropped before a write, so a concurrent eviction can
+// never resurrect stale data around the transfer.
+
+void cache_writeback_range(struct Volume *volume, uint64_t start,
+                           uint32_t count) {
+  if (!volume->cache_ready) {
+    return;
+  }
+  for (uint64_t i = start; i < start + count; i++) {
+    struct CacheShard *shard = cache_shard(volume, i);
+    pthread_mutex_lock(&shard->lock);
+    int slot = cache_lookup(shard, i);
+    if (slot >= 0) {
+      cache_writeback(volume, shard, slot);
+    }
+    pthread_mutex_unlock(&shard->lock);
   }
+}
 
-  if (open_file_table[fd].read_write_pointer >
-      file_control_blocks[open_file_table[fd].dir_entry_pointer->fcb_index]
-          .size) {
-    printf("Read-Write pointer going out of bounds\n");
-    open_file_table[fd].read_write_pointer = read_write_pointer_copy;
-    return -1;
+void cache_discard(struct Volume *volume, uint64_t start, uint32_t count) {
+  if (!volume->cache_ready) {
+    return;
   }
+  for (uint64_t i = start; i < start + count; i++) {
+    struct CacheShard *shard = cache_shard(volume, i);
+    pthread_mutex_lock(&shard->lock);
+    int slot = cache_lookup(shard, i);
+    if (slot >= 0) {
+      cache_unlink(shard, slot);
+      shard->entries[slot].valid = false;
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
 
-  return 0;
+void zero_blocks(struct Volume *volume, uint64_t start, uint32_t count) {
+  // Zeroes a run of blocks on disk without passing it through the cache.
+  // The host zeroes the range in place, or else makes a hole of it, where
+  // it can; otherwise zeros are written out.
+  static const char zeros[ZERO_CHUNK_BLOCKS * BLOCK_SIZE];
+  off_t offset = (off_t)start * BLOCK_SIZE;
+  uint64_t length = (uint64_t)count * BLOCK_SIZE;
+  cache_discard(volume, start, count);
+  checksum_clear(volume, start, count);
+#ifdef FALLOC_FL_ZERO_RANGE
+  if (fallocate(volume->vdisk_fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+                offset, length) == 0) {
+    return;
+  }
+#endif
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if (fallocate(volume->vdisk_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                offset, length) == 0) {
+    return;
+  }
+#endif
+  if (volume->vdisk_map != NULL) {
+    memset(volume->vdisk_map + offset, 0, length);
+    return;
+  }
+  while (length > 0) {
+    size_t chunk = length < sizeof(zeros) ? length : sizeof(zeros);
+    if (pwrite(volume->vdisk_fd, zeros, chunk, offset) != (ssize_t)chunk) {
+      perror("Failed to zero blocks");
+      return;
+    }
+    stat_add(&volume->cache_stats.disk_writes, chunk / BLOCK_SIZE);
+    offset += chunk;
+    length -= chunk;
+  }
 }
 
-int sfs_read(int fd, void *buffer, int size) {
+void transfer_run(struct Volume *volume, struct BlockRun *run, bool write) {
+  struct iovec iov[3];
+  int iov_count = 0;
+  uint32_t body_blocks =
+      run->count - (run->head != NULL ? 1 : 0) - (run->tail != NULL ? 1 : 0);
 
-  if (fd >= MAX_OPEN_FILES || open_file_table[fd].dir_entry_pointer == NULL) {
-    printf(
-        "ERROR: The given file descriptor does not belong to an open file\n");
-    return -1;
+  if (run->head != NULL) {
+    iov[iov_count].iov_base = run->head;
+    iov[iov_count++].iov_len = BLOCK_SIZE;
   }
-
-  if (open_file_table[fd].open_mode != READ_MODE) {
-    printf("ERROR: The given file is not opened in read mode\n");
-    return -1;
+  if (body_blocks > 0) {
+    iov[iov_count].iov_base = run->body;
+    iov[iov_count++].iov_len = (size_t)body_blocks * BLOCK_SIZE;
+  }
+  if (run->tail != NULL) {
+    iov[iov_count].iov_base = run->tail;
+    iov[iov_count++].iov_len = BLOCK_SIZE;
   }
-  int file_size =
-      file_control_blocks[open_file_table[fd].dir_entry_pointer->fcb_index]
-          .size;
-  printf("File size: %d\n", file_size);
 
-  int read_write_pointer = open_file_table[fd].read_write_pointer;
-  if (read_write_pointer + size > file_size) {
-    printf("ERROR: Not enough bytes to read in file\n");
-    return -1;
+  uint64_t block = run->start;
+  if (write) {
+    for (int i = 0; i < iov_count; i++) {
+      uint32_t count = iov[i].iov_len / BLOCK_SIZE;
+      checksum_store(volume, block, count, iov[i].iov_base);
+      block += count;
+    }
   }
 
-  if (size == 0) {
-    return 0;
+  off_t offset = (off_t)run->start * BLOCK_SIZE;
+  ssize_t expected = (ssize_t)run->count * BLOCK_SIZE;
+  if (volume->vdisk_map != NULL) {
+    // Mapped disk: copy straight between the mapping and the iovecs
+    for (int i = 0; i < iov_count; i++) {
+      if (write) {
+        memcpy(volume->vdisk_map + offset, iov[i].iov_base, iov[i].iov_len);
+      } else {
+        memcpy(iov[i].iov_base, volume->vdisk_map + offset, iov[i].iov_len);
+      }
+      offset += iov[i].iov_len;
+    }
+  } else if (write) {
+    cache_discard(volume, run->start, run->count);
+    ssize_t bytes_written = pwritev(volume->vdisk_fd, iov, iov_count, offset);
+    stat_add(&volume->cache_stats.disk_writes, 1);
+    if (bytes_written != expected) {
+      perror("Failed to write blocks");
+      return;
+    }
+  } else {
+    cache_writeback_range(volume, run->start, run->count);
+    ssize_t bytes_read = preadv(volume->vdisk_fd, iov, iov_count, offset);
+    stat_add(&volume->cache_stats.disk_reads, 1);
+    if (bytes_read != expected) {
+      // A short read fails like a bad checksum
+      perror("Failed to read blocks");
+      checksum_failed = true;
+      return;
+    }
   }
 
-  int start_block = read_write_pointer / BLOCK_SIZE;
-  int start_block_offset = read_write_pointer % BLOCK_SIZE;
-  int end_block = (read_write_pointer + size) / BLOCK_SIZE;
-  int end_block_offset = (read_write_pointer + size) % BLOCK_SIZE;
+  if (write) {
+    checksum_written(volume, run->start, run->count);
+    return;
+  }
+  for (int i = 0; i < iov_count; i++) {
+    uint32_t count = iov[i].iov_len / BLOCK_SIZE;
+    checksum_verify(volume, block, count, iov[i].iov_base);
+    block += count;
+  }
+}
 
-  // Fetch the index block of the file
-  struct IndexBlock index_block;
-  get_index_block(&index_block,
-                  open_file_table[fd].dir_entry_pointer->index_block);
+void cache_fill(struct Volume *volume, void *block, uint64_t block_number) {
+  // Keeps a clean copy of a block that was just written to disk
+  if (volume->vdisk_map != NULL || cache_init(volume) < 0) {
+    return;
+  }
 
-  char block[BLOCK_SIZE];
-  size_t copy_size;
-  if (start_block == end_block) {
-    read_block(block, index_block.block_pointers[start_block]);
+  struct CacheShard *shard = cache_shard(volume, block_number);
+  pthread_mutex_lock(&shard->lock);
+  struct CacheEntry *entry = cache_get(volume, shard, block_number, false);
+  memcpy(entry->data, block, BLOCK_SIZE);
+  entry->dirty = false;
+  pthread_mutex_unlock(&shard->lock);
+}
 
-    copy_size = end_block_offset - start_block_offset;
-    memcpy(buffer, block + start_block_offset, copy_size);
-    return 0;
+void write_partial_block(struct Volume *volume, uint64_t block_number,
+                         uint32_t offset, void *data, uint32_t length,
+                         bool fresh) {
+  // Changes part of a block in place, in the cache or the mapping, instead
+  // of copying the whole block out and back. A fresh block has no contents
+  // worth reading and is zeroed around the new bytes.
+  char *block;
+  if (volume->vdisk_map != NULL) {
+    // Built aside first, as its checksum is stored before it changes
+    char bounce[BLOCK_SIZE];
+    block = volume->vdisk_map + (size_t)block_number * BLOCK_SIZE;
+    if (fresh) {
+      memset(bounce, 0, BLOCK_SIZE);
+    } else {
+      memcpy(bounce, block, BLOCK_SIZE);
+    }
+    memcpy(bounce + offset, data, length);
+    checksum_store(volume, block_number, 1, bounce);
+    memcpy(block, bounce, BLOCK_SIZE);
+    checksum_written(volume, block_number, 1);
+    return;
+  }
+  if (cache_init(volume) < 0) {
+    char bounce[BLOCK_SIZE];
+    if (fresh) {
+      memset(bounce, 0, BLOCK_SIZE);
+    } else {
+      disk_read_block(volume, bounce, block_number);
+    }
+    memcpy(bounce + offset, data, length);
+    disk_write_block(volume, bounce, block_number);
+    return;
   }
 
-  // Copy from (starting pointer offset to end of starting block)
-  read_block(block, index_block.block_pointers[start_block]);
-  copy_size = BLOCK_SIZE - start_block_offset;
-  memcpy(buffer, block + start_block_offset, copy_size);
-
-  // Copy from first block after the starting offset till last complete end
-  // block
-  for (int i = start_block + 1; i < end_block; i++) {
-    read_block(buffer + start_block_offset + (i - start_block) * BLOCK_SIZE,
-               index_block.block_pointers[i]);
+  struct CacheShard *shard = cache_shard(volume, block_number);
+  pthread_mutex_lock(&shard->lock);
+  struct CacheEntry *entry = cache_get(volume, shard, block_number, !fresh);
+  if (fresh) {
+    memset(entry->data, 0, BLOCK_SIZE);
   }
+  memcpy(entry->data + offset, data, length);
+  entry->dirty = true;
+  pthread_mutex_unlock(&shard->lock);
+}
 
-  // Copy from last complete block to end pointer offset
-  read_block(block, index_block.block_pointers[end_block]);
-  copy_size = end_block_offset;
-  memcpy(buffer + start_block_offset + (end_block - start_block) * BLOCK_SIZE,
-         block, copy_size);
+void cache_prefetch(struct Volume *volume, uint64_t start, uint32_t count) {
+  // Brings blocks into the cache with one transfer. A block the cache
+  // already holds keeps its copy, which may be newer than the disk.
+  if (volume->vdisk_map != NULL || cache_init(volume) < 0) {
+    return;
+  }
+  char *buffer = malloc((size_t)count * BLOCK_SIZE);
+  if (buffer == NULL) {
+    return;
+  }
+  ssize_t expected = (ssize_t)count * BLOCK_SIZE;
+  stat_add(&volume->cache_stats.disk_reads, 1);
+  if (pread(volume->vdisk_fd, buffer, expected,
+            (off_t)start * BLOCK_SIZE) != expected) {
+    free(buffer);
+    return;
+  }
 
-  open_file_table[fd].read_write_pointer =
-      end_block * BLOCK_SIZE + end_block_offset;
+  for (uint32_t i = 0; i < count; i++) {
+    struct CacheShard *shard = cache_shard(volume, start + i);
+    pthread_mutex_lock(&shard->lock);
+    if (cache_lookup(shard, start + i) < 0 &&
+        checksum_matches(volume, start + i, buffer + (size_t)i * BLOCK_SIZE)) {
+      struct CacheEntry *entry = cache_get(volume, shard, start + i, false);
+      memcpy(entry->data, buffer + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+      stat_add(&volume->cache_stats.prefetched, 1);
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+  free(buffer);
+}
 
-  return 0;
+void write_blocks(struct Volume *volume, void *buffer, uint64_t start,
+                  uint32_t count) {
+  if (count == 1) {
+    write_block(volume, buffer, start);
+    return;
+  }
+  struct BlockRun run = {start, count, NULL, buffer, NULL};
+  transfer_run(volume, &run, true);
 }
 
-int sfs_write(int fd, void *buffer, int size) {
+void read_blocks(struct Volume *volume, void *buffer, uint64_t start,
+                 uint32_t count) {
+  if (count == 1) {
+    read_block(volume, buffer, start);
+    return;
+  }
+  struct BlockRun run = {start, count, NULL, buffer, NULL};
+  transfer_run(volume, &run, false);
+}
 
-  if (fd >= MAX_OPEN_FILES || open_file_table[fd].dir_entry_pointer == NULL) {
-    printf(
-        "ERROR: The given file descriptor does not belong to an open file\n");
+int sfs_sync(struct Volume *volume) {
+  if (volume->vdisk_fd < 0) {
+    printf("LOG(sfs_sync): No disk mounted.\n");
     return -1;
   }
+  if (open_batch == volume) {
+    printf("ERROR: Cannot sync inside a batch; commit it instead\n");
+    return -1;
+  }
+  // Every call that returned before this one is durable afterwards;
+  // concurrent callers share one journal write
+  flush_open_files(volume);
+  return journal_commit(volume);
+}
 
-  if (open_file_table[fd].open_mode != WRITE_MODE) {
-    printf("ERROR: The given file is not opened in write mode\n");
+int sfs_set_cache_capacity(struct Volume *volume, int num_blocks) {
+  if (num_blocks <= 0) {
+    printf("ERROR: Cache capacity must be at least one block\n");
     return -1;
   }
 
-  int file_size =
-      file_control_blocks[open_file_table[fd].dir_entry_pointer->fcb_index]
-          .size;
-  int read_write_pointer = open_file_table[fd].read_write_pointer;
+  // Drop the old cache (writing back dirty blocks); the new one is allocated
+  // lazily on the next block access
+  cache_destroy(volume);
+  volume->cache_capacity = num_blocks;
+  return 0;
+}
+
+void sfs_get_cache_stats(struct Volume *volume, struct CacheStats *stats) {
+  *stats = volume->cache_stats;
+}
+
+void sfs_reset_cache_stats(struct Volume *volume) {
+  memset(&volume->cache_stats, 0, sizeof(volume->cache_stats));
+}
+
+// Bitmap related functions
+//
+// One bit per block (1 = used), stored in 64-bit words over as many blocks
+// as the volume needs starting at the superblock's bitmap_start. Bit numbers
+// are absolute block numbers; the header blocks and the tail past the end of
+// the disk are permanently marked used. Searches skip whole words with
+// count-trailing-zeros and start from a rotating next-fit hint.
+
+void set_geometry(struct Volume *volume) {
+  // Derives the in-memory geometry from the superblock's region table
+  struct SuperBlock *superblock = &volume->superblock;
+  volume->num_inodes =
+      (uint64_t)superblock->inode_blocks * BLOCK_SIZE / sizeof(struct Inode);
+  volume->bitmap_words =
+      superblock->bitmap_blocks * (BLOCK_SIZE / sizeof(uint64_t));
+  volume->journal_start = superblock->journal_start;
+  volume->journal_blocks = superblock->journal_blocks;
+  volume->data_blocks_start =
+      superblock->checksum_start + superblock->checksum_blocks;
+  volume->alloc_hint = volume->data_blocks_start;
+}
+
+uint64_t *bitmap_word(struct Volume *volume, uint64_t word_index) {
+  fault_range(volume, volume->superblock.bitmap_start,
+              word_index * sizeof(uint64_t), sizeof(uint64_t));
+  return &volume->bitmap[word_index];
+}
+
+bool bitmap_test(struct Volume *volume, uint64_t block_number) {
+  return (*bitmap_word(volume, block_number / 64) >> (block_number % 64)) & 1;
+}
+
+void bitmap_set_range(struct Volume *volume, uint64_t start, uint64_t count,
+                      bool used) {
+  uint64_t end = start + count;
+  while (start < end) {
+    uint32_t bit = start % 64;
+    uint32_t span = end - start < 64 - bit ? end - start : 64 - bit;
+    uint64_t mask = span == 64 ? ~0ULL : ((1ULL << span) - 1) << bit;
+    if (used) {
+      *bitmap_word(volume, start / 64) |= mask;
+    } else {
+      *bitmap_word(volume, start / 64) &= ~mask;
+    }
+    start += span;
+  }
+}
+
+void init_bitmap(struct Volume *volume) {
+  // Only the bitmap blocks covering the header or the tail past the end of
+  // the disk have bits set; the others are left as holes
+  struct SuperBlock *superblock = &volume->superblock;
+  uint64_t block[BLOCK_SIZE / sizeof(uint64_t)];
+  for (uint32_t i = 0; i < superblock->bitmap_blocks; i++) {
+    uint64_t first = (uint64_t)i * BITS_PER_BLOCK;
+    uint64_t end = first + BITS_PER_BLOCK;
+    if (first >= volume->data_blocks_start && end <= superblock->num_blocks) {
+      continue;
+    }
+
+    memset(block, 0, BLOCK_SIZE);
+    for (uint64_t b = first; b < end; b++) {
+      if (b < volume->data_blocks_start || b >= superblock->num_blocks) {
+        block[(b - first) / 64] |= 1ULL << (b % 64);
+      }
+    }
+    write_block(volume, block, superblock->bitmap_start + i);
+  }
+}
+
+int64_t bitmap_find(struct Volume *volume, uint64_t from, uint64_t end,
+                    bool want_used) {
+  // First block in [from, end) whose bit equals want_used, or -1. Only the
+  // words up to end are looked at (and so faulted in).
+  uint64_t total_blocks = (uint64_t)volume->bitmap_words * 64;
+  end = end < total_blocks ? end : total_blocks;
+  if (from >= end) {
+    return -1;
+  }
+
+  uint64_t word_index = from / 64;
+  uint64_t last_word = (end - 1) / 64;
+  uint64_t word = *bitmap_word(volume, word_index);
+  word = (want_used ? word : ~word) & (~0ULL << (from % 64));
+  while (word == 0) {
+    if (++word_index > last_word) {
+      return -1;
+    }
+    word = *bitmap_word(volume, word_index);
+    word = want_used ? word : ~word;
+  }
+  uint64_t found = word_index * 64 + __builtin_ctzll(word);
+  return found < end ? (int64_t)found : -1;
+}
+
+uint32_t allocate_blocks(struct Volume *volume, uint32_t count,
+                         uint64_t *start, bool reserved) {
+  // Allocates a run of up to count contiguous blocks and returns its length
+  // (0 if the disk is full). A full-length run is preferred; otherwise the
+  // longest run seen is handed out and the caller asks again for the rest.
+  // Blocks reserved for delayed appends are only handed out against their
+  // reservation.
+  pthread_mutex_lock(&volume->alloc_lock);
+  uint64_t available = volume->superblock.num_free_blocks -
+                       (reserved ? 0 : volume->reserved_blocks);
+  if (count > available) {
+    count = available;
+  }
+  if (count == 0) {
+    pthread_mutex_unlock(&volume->alloc_lock);
+    return 0;
+  }
+  uint64_t total_blocks = (uint64_t)volume->bitmap_words * 64;
+  uint64_t best_start = 0;
+  uint32_t best_length = 0;
+
+  for (int pass = 0; pass < 2; pass++) {
+    uint64_t position =
+        pass == 0 ? volume->alloc_hint : volume->data_blocks_start;
+    uint64_t limit = pass == 0 ? total_blocks : volume->alloc_hint;
+
+    while (position < limit) {
+      int64_t run_start = bitmap_find(volume, position, limit, false);
+      if (run_start < 0) {
+        break;
+      }
+      // A run is never needed longer than count, so the search for its end
+      // stops there instead of crossing all the free space behind it
+      uint64_t wanted_end = run_start + count;
+      int64_t run_end = bitmap_find(volume, run_start, wanted_end, true);
+      if (run_end < 0) {
+        run_end = wanted_end < total_blocks ? wanted_end : total_blocks;
+      }
+
+      uint64_t length = run_end - run_start;
+      if (length >= count) {
+        best_start = run_start;
+        best_length = count;
+        pass = 2;
+        break;
+      }
+      if (length > best_length) {
+        best_start = run_start;
+        best_length = length;
+      }
+      position = run_end;
+    }
+  }
+
+  if (best_length == 0) {
+    pthread_mutex_unlock(&volume->alloc_lock);
+    return 0;
+  }
+
+  bitmap_set_range(volume, best_start, best_length, true);
+  journal_mark_bitmap(volume, best_start, best_length);
+  volume->superblock.num_free_blocks -= best_length;
+  if (reserved) {
+    volume->reserved_blocks -= best_length;
+  }
+  volume->alloc_hint = best_start + best_length;
+  if (volume->alloc_hint >= total_blocks) {
+    volume->alloc_hint = volume->data_blocks_start;
+  }
+  *start = best_start;
+  pthread_mutex_unlock(&volume->alloc_lock);
+  return best_length;
+}
+
+int64_t find_empty_block(struct Volume *volume) {
+  uint64_t block_number;
+  if (allocate_blocks(volume, 1, &block_number, false) == 0) {
+    return -1;
+  }
+  return block_number;
+}
+
+void free_blocks(struct Volume *volume, uint64_t start, uint32_t count) {
+  // The blocks stay allocated until the commit recording the free is
+  // durable (see release_pending_frees), so the committed state never
+  // refers to a block that has already been reused. Their bitmap words are
+  // faulted in now, as the commit copies them without looking.
+  chunk_cache_drop(volume, start, count);
+  pthread_mutex_lock(&volume->alloc_lock);
+  fault_range(volume, volume->superblock.bitmap_start,
+              start / 64 * sizeof(uint64_t),
+              ((start + count - 1) / 64 - start / 64 + 1) * sizeof(uint64_t));
+  if (volume->pending_free_count == volume->pending_free_capacity) {
+    int capacity = volume->pending_free_capacity * 2 + 16;
+    struct BlockRange *grown = realloc(
+        volume->pending_frees, capacity * sizeof(struct BlockRange));
+    if (grown == NULL) {
+      printf("ERROR: Could not record freed blocks\n");
+      pthread_mutex_unlock(&volume->alloc_lock);
+      return;
+    }
+    volume->pending_frees = grown;
+    volume->pending_free_capacity = capacity;
+  }
+  struct BlockRange range = {start, count};
+  volume->pending_frees[volume->pending_free_count++] = range;
+  volume->pending_free_blocks += count;
+  pthread_mutex_unlock(&volume->alloc_lock);
+}
+
+void release_blocks(struct Volume *volume, struct BlockRange *ranges,
+                    int range_count) {
+  pthread_mutex_lock(&volume->alloc_lock);
+  for (int r = 0; r < range_count; r++) {
+    uint64_t end = ranges[r].start + ranges[r].count;
+    for (uint64_t i = ranges[r].start; i < end; i++) {
+      if (i < volume->data_blocks_start ||
+          i >= volume->superblock.num_blocks || !bitmap_test(volume, i)) {
+        continue;
+      }
+      bitmap_set_range(volume, i, 1, false);
+      volume->superblock.num_free_blocks++;
+    }
+    volume->pending_free_blocks -= ranges[r].count;
+  }
+  pthread_mutex_unlock(&volume->alloc_lock);
+}
+
+void free_block(struct Volume *volume, uint64_t block_number) {
+  free_blocks(volume, block_number, 1);
+}
+
+bool reserve_blocks(struct Volume *volume, uint32_t count) {
+  // Sets free blocks aside for data that is given its blocks later
+  pthread_mutex_lock(&volume->alloc_lock);
+  bool reserved =
+      volume->superblock.num_free_blocks - volume->reserved_blocks >= count;
+  if (reserved) {
+    volume->reserved_blocks += count;
+  }
+  pthread_mutex_unlock(&volume->alloc_lock);
+  return reserved;
+}
+
+void unreserve_blocks(struct Volume *volume, uint32_t count) {
+  pthread_mutex_lock(&volume->alloc_lock);
+  volume->reserved_blocks -= count;
+  pthread_mutex_unlock(&volume->alloc_lock);
+}
+
+void unallocate_blocks(struct Volume *volume, uint64_t start,
+                       uint32_t count) {
+  // Takes back blocks handed out against the reservation that were never
+  // written or mapped. Nothing refers to them, so unlike free_blocks they
+  // are free, and reserved again, at once.
+  pthread_mutex_lock(&volume->alloc_lock);
+  bitmap_set_range(volume, start, count, false);
+  journal_mark_bitmap(volume, start, count);
+  volume->superblock.num_free_blocks += count;
+  volume->reserved_blocks += count;
+  pthread_mutex_unlock(&volume->alloc_lock);
+}
+
+// Whole-volume tables
+//
+// Tables with an element per inode, name slot or bitmap word are sized
+// for the whole volume, but only the part below the high-water marks is
+// normally touched. They are mapped with MAP_NORESERVE, so the rest costs
+// neither memory nor commit charge, and reads as zeros.
+
+void *table_alloc(size_t count, size_t size) {
+  size_t bytes = count > 0 ? count * size : 1;
+  void *table = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return table == MAP_FAILED ? NULL : table;
+}
+
+void table_free(void *table, size_t count, size_t size) {
+  if (table != NULL) {
+    munmap(table, count > 0 ? count * size : 1);
+  }
+}
+
+// Metadata regions
+//
+// The inode table, the name table and the bitmap are each a flat array laid
+// over consecutive blocks (a block holds whole inodes and names), kept in a
+// private copy even on a mapped disk; only the journal checkpointer writes
+// them back. Mount reads none of it: each block is read the first time
+// something touches it, into both the live and the committed copy, and
+// stays resident until unmount. Inodes are handed out from the bottom up,
+// so nothing above the high-water marks is ever read.
+//
+// The live inode table keeps the disk layout, as the journal and faults
+// move whole blocks of it. Scans only need to know which slots are used and
+// under which name hash, so that is split out into the inode_keys column
+// and kept in step wherever an inode changes.
+
+int init_metadata(struct Volume *volume) {
+  struct SuperBlock *superblock = &volume->superblock;
+  volume->inodes_used = superblock->inodes_used;
+  volume->names_used = superblock->names_used;
+  volume->inodes = table_alloc(superblock->inode_blocks, BLOCK_SIZE);
+  volume->inode_keys = table_alloc(volume->num_inodes, sizeof(uint32_t));
+  volume->long_names = table_alloc(superblock->name_blocks, BLOCK_SIZE);
+  volume->bitmap = table_alloc(superblock->bitmap_blocks, BLOCK_SIZE);
+  volume->resident = table_alloc(
+      volume->journal_start - superblock->inode_start, sizeof(bool));
+  if (volume->inodes == NULL || volume->inode_keys == NULL ||
+      volume->long_names == NULL || volume->bitmap == NULL ||
+      volume->resident == NULL) {
+    printf("ERROR: Could not allocate metadata region\n");
+    return -1;
+  }
+  return 0;
+}
+
+char *metadata_block(struct Volume *volume, uint64_t block_number,
+                     bool committed) {
+  // Where an inode, name or bitmap block lives in the live or committed
+  // copy
+  struct SuperBlock *superblock = &volume->superblock;
+  if (block_number < superblock->name_start) {
+    char *base =
+        committed ? (char *)volume->committed_inodes : (char *)volume->inodes;
+    return base + (size_t)(block_number - superblock->inode_start) * BLOCK_SIZE;
+  }
+  if (block_number < superblock->bitmap_start) {
+    char *base = committed ? (char *)volume->committed_names
+                           : (char *)volume->long_names;
+    return base + (size_t)(block_number - superblock->name_start) * BLOCK_SIZE;
+  }
+  char *base =
+      committed ? (char *)volume->committed_bitmap : (char *)volume->bitmap;
+  return base + (size_t)(block_number - superblock->bitmap_start) * BLOCK_SIZE;
+}
+
+void update_inode_keys(struct Volume *volume, int first, int count) {
+  for (int i = first; i < first + count; i++) {
+    struct Inode *inode = &volume->inodes[i];
+    volume->inode_keys[i] =
+        inode->used == USED_FLAG ? inode->name_hash | INODE_KEY_USED : 0;
+  }
+}
+
+bool block_resident(struct Volume *volume, uint64_t block_number) {
+  return __atomic_load_n(
+      &volume->resident[block_number - volume->superblock.inode_start],
+      __ATOMIC_ACQUIRE);
+}
+
+void fault_blocks(struct Volume *volume, uint64_t first, uint64_t last) {
+  // Caller holds the fault lock. Reads every block of [first, last], all in
+  // one region, that is not resident yet; adjacent ones in a single call.
+  // A block that is not resident has never changed since the last
+  // checkpoint, so its home copy is both the live and the committed image.
+  uint64_t block = first;
+  while (block <= last) {
+    if (block_resident(volume, block)) {
+      block++;
+      continue;
+    }
+    uint64_t end = block + 1;
+    while (end <= last && !block_resident(volume, end)) {
+      end++;
+    }
+
+    // One transfer straight into the live copy, leaving the cache alone
+    char *live = metadata_block(volume, block, false);
+    struct BlockRun run = {block, end - block, NULL, live, NULL};
+    transfer_run(volume, &run, false);
+    memcpy(metadata_block(volume, block, true), live,
+           (size_t)(end - block) * BLOCK_SIZE);
+    uint64_t base = volume->superblock.inode_start;
+    if (block < volume->superblock.name_start) {
+      int per_block = BLOCK_SIZE / sizeof(struct Inode);
+      update_inode_keys(volume, (block - base) * per_block,
+                        (end - block) * per_block);
+    }
+    for (uint64_t b = block; b < end; b++) {
+      __atomic_store_n(&volume->resident[b - base], true, __ATOMIC_RELEASE);
+    }
+    block = end;
+  }
+}
+
+void fault_range(struct Volume *volume, uint64_t start_block,
+                 size_t first_byte, size_t bytes) {
+  // Makes the blocks holding bytes [first_byte, first_byte + bytes) of the
+  // region at start_block resident. Once they are, this is a flag check.
+  uint64_t first = start_block + first_byte / BLOCK_SIZE;
+  uint64_t last = start_block + (first_byte + bytes - 1) / BLOCK_SIZE;
+  uint64_t block = first;
+  while (block <= last && block_resident(volume, block)) {
+    block++;
+  }
+  if (block > last) {
+    return;
+  }
+  pthread_mutex_lock(&volume->fault_lock);
+  fault_blocks(volume, block, last);
+  pthread_mutex_unlock(&volume->fault_lock);
+}
+
+struct Inode *inode_at(struct Volume *volume, int slot) {
+  fault_range(volume, volume->superblock.inode_start,
+              (size_t)slot * sizeof(struct Inode), sizeof(struct Inode));
+  return &volume->inodes[slot];
+}
+
+struct LongName *long_name_at(struct Volume *volume, int slot) {
+  fault_range(volume, volume->superblock.name_start,
+              (size_t)slot * sizeof(struct LongName), sizeof(struct LongName));
+  return &volume->long_names[slot];
+}
+
+// Superblock related functions
+
+int plan_layout(uint64_t num_blocks, struct SuperBlock *layout) {
+  // Sizes every region for a disk of num_blocks blocks, or fails if the
+  // metadata would not leave room for any data
+  uint64_t slots = num_blocks / BLOCKS_PER_FILE_SLOT;
+  if (slots < MIN_FILE_SLOTS) {
+    slots = MIN_FILE_SLOTS;
+  } else if (slots > MAX_FILE_SLOTS) {
+    slots = MAX_FILE_SLOTS;
+  }
+
+  memset(layout, 0, sizeof(*layout));
+  layout->magic = SFS_MAGIC;
+  layout->version = SFS_FORMAT_VERSION;
+  layout->num_blocks = num_blocks;
+  layout->inode_start = SUPERBLOCK_BLOCK + 1;
+  layout->inode_blocks =
+      (slots * sizeof(struct Inode) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  layout->name_start = layout->inode_start + layout->inode_blocks;
+  layout->name_blocks =
+      (slots * sizeof(struct LongName) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  layout->bitmap_start = layout->name_start + layout->name_blocks;
+  layout->bitmap_blocks = (num_blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+  layout->journal_start = layout->bitmap_start + layout->bitmap_blocks;
+  layout->journal_blocks = journal_size(layout);
+  layout->journal_sequence = 1;
+  layout->checksum_start = layout->journal_start + layout->journal_blocks;
+  layout->checksum_blocks =
+      (num_blocks * sizeof(struct BlockChecksum) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  layout->num_files = 1; // the root directory
+  layout->inodes_used = ROOT_INODE + 1;
+
+  uint64_t header_count = layout->checksum_start + layout->checksum_blocks;
+  if (num_blocks <= header_count) {
+    return -1;
+  }
+  layout->num_free_blocks = num_blocks - header_count;
+  return 0;
+}
+
+void init_root_directory(struct Volume *volume) {
+  // Inode ROOT_INODE starts out as an empty directory
+  char block[BLOCK_SIZE] = {0};
+  struct Inode *root = (struct Inode *)block + ROOT_INODE;
+  root->used = USED_FLAG;
+  root->type = INODE_DIRECTORY;
+  root->name_hash = hash_filename("");
+  root->extent_root = INVALID_BLOCK_POINTER;
+  root->created_at = time(NULL);
+  root->last_modified_at = root->created_at;
+  write_block(volume, block, volume->superblock.inode_start);
+}
+
+void init_superblock(struct Volume *volume) {
+  char block[BLOCK_SIZE] = {0};
+  memcpy(block, &volume->superblock, sizeof(struct SuperBlock));
+  write_block(volume, block, SUPERBLOCK_BLOCK);
+}
+
+int load_superblock(struct Volume *volume) {
+  char block[BLOCK_SIZE] = {0};
+  read_block(volume, block, SUPERBLOCK_BLOCK);
+  memcpy(&volume->superblock, block, sizeof(struct SuperBlock));
+
+  struct SuperBlock *superblock = &volume->superblock;
+  if (superblock->magic != SFS_MAGIC ||
+      superblock->version != SFS_FORMAT_VERSION) {
+    printf("ERROR: Not a vdisk of this format version\n");
+    return -1;
+  }
+  set_geometry(volume);
+  if (superblock->inodes_used > (uint32_t)volume->num_inodes ||
+      superblock->names_used > superblock->inodes_used ||
+      volume->data_blocks_start > superblock->num_blocks) {
+    printf("ERROR: Superblock describes an impossible layout\n");
+    return -1;
+  }
+  return 0;
+}
+
+void init_open_file_table(struct Volume *volume) {
+  volume->open_file_count = 0;
+  for (int i = 0; i < MAX_OPEN_FILES; i++) {
+    volume->open_file_table[i].inode = NULL;
+    volume->open_file_table[i].read_write_pointer = 0;
+    volume->open_file_table[i].write_buffer = NULL;
+    volume->open_file_table[i].write_length = 0;
+    pthread_mutex_init(&volume->open_file_table[i].lock, NULL);
+  }
+}
+
+int init_file_locks(struct Volume *volume) {
+  // Up to MAX_FILE_LOCKS reader-writer locks shared round-robin by the
+  // directory slots, and one cached extent map per slot
+  volume->file_lock_count = min(volume->num_inodes, MAX_FILE_LOCKS);
+  volume->file_locks =
+      malloc(volume->file_lock_count * sizeof(pthread_rwlock_t));
+  volume->file_maps =
+      table_alloc(volume->num_inodes, sizeof(struct ExtentMap));
+  if (volume->file_locks == NULL || volume->file_maps == NULL) {
+    printf("ERROR: Could not allocate file locks\n");
+    free(volume->file_locks);
+    table_free(volume->file_maps, volume->num_inodes,
+               sizeof(struct ExtentMap));
+    volume->file_locks = NULL;
+    volume->file_maps = NULL;
+    return -1;
+  }
+  for (int i = 0; i < volume->file_lock_count; i++) {
+    pthread_rwlock_init(&volume->file_locks[i], NULL);
+  }
+  return 0;
+}
+
+// Metadata journal
+//
+// Mutating calls only change the live inode table, name table and bitmap,
+// and mark what they touched. A commit briefly waits for the calls in flight,
+// copies every dirty inode, name and bitmap word into the committed
+// image and into one transaction. Once the data it refers to is synced, it
+// appends that transaction to the journal region and syncs again; every call
+// finished before the commit started shares both. The checkpointer writes the
+// committed image to its home blocks only when the journal is nearly full
+// and at unmount, and mount replays the transactions written since.
+
+uint32_t transaction_blocks(uint32_t num_inodes, uint32_t bitmap_words) {
+  // Worst case: JOURNAL_RECORD_LIMIT inodes and names (or all of them, if
+  // there are fewer) and every other bitmap word dirty
+  uint64_t inodes = min(num_inodes, JOURNAL_RECORD_LIMIT);
+  uint64_t bytes =
+      sizeof(struct JournalHeader) +
+      inodes * (sizeof(struct JournalRecord) + sizeof(struct Inode)) +
+      inodes * (sizeof(struct JournalRecord) + sizeof(struct LongName)) +
+      ((uint64_t)bitmap_words / 2 + 1) * sizeof(struct JournalRecord) +
+      (uint64_t)bitmap_words * sizeof(uint64_t);
+  return (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+uint32_t journal_size(struct SuperBlock *layout) {
+  // Room for several worst-case transactions plus 0.1% of the disk, at most
+  // 4 MiB, so checkpoints stay rare
+  uint32_t inodes =
+      (uint64_t)layout->inode_blocks * BLOCK_SIZE / sizeof(struct Inode);
+  uint32_t bitmap_words =
+      layout->bitmap_blocks * (BLOCK_SIZE / sizeof(uint64_t));
+  uint32_t slack = layout->num_blocks / 1024 < 1024
+                      ? layout->num_blocks / 1024
+                      : 1024;
+  return 4 * transaction_blocks(inodes, bitmap_words) + slack;
+}
+
+uint32_t journal_checksum(const char *data, uint32_t length) {
+  return sfs_crc32c(0, data, length);
+}
+
+// A slot is marked by whoever holds its file or directory lock; the lists
+// of marked slots are shared, so their counters are bumped atomically
+void journal_mark_inode(struct Volume *volume, int slot) {
+  if (!volume->dirty_inodes[slot]) {
+    volume->dirty_inodes[slot] = true;
+    uint32_t index =
+        __atomic_fetch_add(&volume->dirty_inode_count, 1, __ATOMIC_RELAXED);
+    volume->dirty_inode_list[index] = slot;
+  }
+}
+
+void journal_mark_name(struct Volume *volume, int slot) {
+  if (!volume->dirty_names[slot]) {
+    volume->dirty_names[slot] = true;
+    uint32_t index =
+        __atomic_fetch_add(&volume->dirty_name_count, 1, __ATOMIC_RELAXED);
+    volume->dirty_name_list[index] = slot;
+  }
+}
+
+void journal_mark_bitmap(struct Volume *volume, uint64_t start,
+                         uint64_t count) {
+  // Caller holds the allocator lock
+  for (uint64_t word = start / 64; word <= (start + count - 1) / 64; word++) {
+    volume->dirty_words[word / 64] |= 1ULL << (word % 64);
+  }
+}
+
+bool journal_nearly_full(struct Volume *volume) {
+  // Past half the record limit the next commit is due, leaving the other
+  // half for calls still in flight
+  uint32_t inodes =
+      __atomic_load_n(&volume->dirty_inode_count, __ATOMIC_RELAXED);
+  uint32_t names =
+      __atomic_load_n(&volume->dirty_name_count, __ATOMIC_RELAXED);
+  return inodes >= JOURNAL_RECORD_LIMIT / 2 ||
+         names >= JOURNAL_RECORD_LIMIT / 2;
+}
+
+// The volume this thread has an open batch on, if any. The batch holds the
+// commit lock shared from sfs_begin_batch to sfs_commit_batch, so its calls
+// skip taking it again and no commit can land in the middle of it.
+__thread struct Volume *open_batch = NULL;
+
+void begin_operation(struct Volume *volume) {
+  if (open_batch != volume) {
+    pthread_rwlock_rdlock(&volume->commit_lock);
+  }
+}
+
+void end_operation(struct Volume *volume) {
+  // Callers hold no other lock by now. A long run of calls without a sync
+  // is committed before it outgrows one transaction; a batch is never
+  // split, see batch_full.
+  __atomic_fetch_add(&volume->operations, 1, __ATOMIC_RELAXED);
+  if (open_batch != volume) {
+    pthread_rwlock_unlock(&volume->commit_lock);
+    if (journal_nearly_full(volume)) {
+      journal_commit(volume);
+    }
+  }
+}
+
+bool batch_full(struct Volume *volume) {
+  // Checked before a call that changes metadata: in a batch that holds
+  // half a transaction's records already, the call is refused and the
+  // batch left as it is, so what it holds still commits as one. No single
+  // call dirties anything near the other half.
+  if (open_batch != volume || !journal_nearly_full(volume)) {
+    return false;
+  }
+  printf("ERROR: Batch is too large for one transaction; commit it first\n");
+  return true;
+}
+
+void checkpoint_mark(struct Volume *volume, uint64_t start_block,
+                     size_t first_byte, size_t bytes) {
+  uint64_t first = start_block + first_byte / BLOCK_SIZE;
+  uint64_t last = start_block + (first_byte + bytes - 1) / BLOCK_SIZE;
+  for (uint64_t i = first; i <= last; i++) {
+    volume->checkpoint_dirty[i - volume->superblock.inode_start] = true;
+  }
+}
+
+char *journal_append(char *cursor, uint8_t type, uint32_t target,
+                     uint32_t count, void *payload, size_t payload_size) {
+  struct JournalRecord record = {type, target, count};
+  memcpy(cursor, &record, sizeof(record));
+  memcpy(cursor + sizeof(record), payload, payload_size);
+  return cursor + sizeof(record) + payload_size;
+}
+
+uint32_t journal_capture(struct Volume *volume) {
+  // Moves every dirty record into the committed image and encodes it after
+  // the transaction header. Runs with all mutating calls excluded.
+  char *cursor = volume->journal_buffer + sizeof(struct JournalHeader);
+
+  for (uint32_t n = 0; n < volume->dirty_inode_count; n++) {
+    int i = volume->dirty_inode_list[n];
+    volume->dirty_inodes[i] = false;
+    volume->committed_files +=
+        (volume->inodes[i].used == USED_FLAG) -
+        (volume->committed_inodes[i].used == USED_FLAG);
+    volume->committed_inodes[i] = volume->inodes[i];
+    volume->committed_inodes_used = max(volume->committed_inodes_used, i + 1);
+    cursor = journal_append(cursor, JOURNAL_INODE, i, 1, &volume->inodes[i],
+                            sizeof(struct Inode));
+    checkpoint_mark(volume, volume->superblock.inode_start,
+                    (size_t)i * sizeof(struct Inode), sizeof(struct Inode));
+  }
+  volume->dirty_inode_count = 0;
+
+  for (uint32_t n = 0; n < volume->dirty_name_count; n++) {
+    int i = volume->dirty_name_list[n];
+    volume->dirty_names[i] = false;
+    volume->committed_names[i] = volume->long_names[i];
+    volume->committed_names_used = max(volume->committed_names_used, i + 1);
+    cursor = journal_append(cursor, JOURNAL_NAME, i, 1, &volume->long_names[i],
+                            sizeof(struct LongName));
+    checkpoint_mark(volume, volume->superblock.name_start,
+                    (size_t)i * sizeof(struct LongName),
+                    sizeof(struct LongName));
+  }
+  volume->dirty_name_count = 0;
+
+  // Freed blocks are still set in the live bitmap; the committed image
+  // already sees them free
+  for (int r = 0; r < volume->pending_free_count; r++) {
+    struct BlockRange *range = &volume->pending_frees[r];
+    journal_mark_bitmap(volume, range->start, range->count);
+  }
+  uint32_t dirty_word_count = (volume->bitmap_words + 63) / 64;
+  for (uint32_t i = 0; i < dirty_word_count; i++) {
+    uint64_t dirty = volume->dirty_words[i];
+    while (dirty != 0) {
+      uint32_t word = i * 64 + __builtin_ctzll(dirty);
+      volume->committed_free_blocks -=
+          __builtin_popcountll(volume->bitmap[word]) -
+          __builtin_popcountll(volume->committed_bitmap[word]);
+      volume->committed_bitmap[word] = volume->bitmap[word];
+      dirty &= dirty - 1;
+    }
+  }
+  for (int r = 0; r < volume->pending_free_count; r++) {
+    struct BlockRange *range = &volume->pending_frees[r];
+    for (uint64_t b = range->start; b < range->start + range->count; b++) {
+      uint64_t bit = 1ULL << (b % 64);
+      if (b >= volume->data_blocks_start &&
+          b < volume->superblock.num_blocks &&
+          (volume->committed_bitmap[b / 64] & bit)) {
+        volume->committed_bitmap[b / 64] &= ~bit;
+        volume->committed_free_blocks++;
+      }
+    }
+  }
+
+  // Runs of consecutive dirty words become one record each
+  uint32_t word = 0;
+  while (word < volume->bitmap_words) {
+    uint64_t dirty = volume->dirty_words[word / 64] >> (word % 64);
+    if (dirty == 0) {
+      word = (word / 64 + 1) * 64; // Skip a clean group of words at once
+      continue;
+    }
+    if (!(dirty & 1)) {
+      word += __builtin_ctzll(dirty);
+      continue;
+    }
+    uint32_t first = word;
+    while (word < volume->bitmap_words &&
+           ((volume->dirty_words[word / 64] >> (word % 64)) & 1)) {
+      word++;
+    }
+    cursor = journal_append(cursor, JOURNAL_BITMAP, first, word - first,
+                            &volume->committed_bitmap[first],
+                            (word - first) * sizeof(uint64_t));
+    checkpoint_mark(volume, volume->superblock.bitmap_start,
+                    (size_t)first * sizeof(uint64_t),
+                    (size_t)(word - first) * sizeof(uint64_t));
+  }
+  memset(volume->dirty_words, 0, dirty_word_count * sizeof(uint64_t));
+
+  return cursor - volume->journal_buffer - sizeof(struct JournalHeader);
+}
+
+void sync_vdisk(struct Volume *volume) {
+  if (volume->vdisk_map != NULL) {
+    msync(volume->vdisk_map, volume->vdisk_map_size, MS_SYNC);
+  } else {
+    if (volume->checksums != NULL) {
+      msync(volume->checksums, volume->checksums_size, MS_SYNC);
+    }
+    fdatasync(volume->vdisk_fd);
+  }
+}
+
+void count_superblock(struct Volume *volume, struct SuperBlock *superblock,
+                      struct Inode *inodes, int inodes_used, int names_used,
+                      uint64_t *bitmap) {
+  // Derives the counters from the metadata they summarise, which must all be
+  // resident. Slots past the high-water marks are known to be unused.
+  uint64_t used_blocks = 0;
+  for (uint32_t i = 0; i < volume->bitmap_words; i++) {
+    used_blocks += __builtin_popcountll(bitmap[i]);
+  }
+  superblock->num_free_blocks =
+      (uint64_t)volume->bitmap_words * 64 - used_blocks;
+
+  superblock->num_files = 0;
+  for (int i = 0; i < inodes_used; i++) {
+    superblock->num_files += inodes[i].used == USED_FLAG;
+  }
+  superblock->inodes_used = inodes_used;
+  superblock->names_used = names_used;
+}
+
+void journal_checkpoint(struct Volume *volume) {
+  // Caller holds the journal lock. Home blocks are written and synced before
+  // the superblock moves the journal start past the transactions they
+  // contain; a crash in between just replays those transactions again.
+  if (volume->journal_head == 0) {
+    return;
+  }
+
+  uint64_t first = volume->superblock.inode_start;
+  for (uint64_t block = first; block < volume->journal_start; block++) {
+    if (volume->checkpoint_dirty[block - first]) {
+      volume->checkpoint_dirty[block - first] = false;
+      write_block(volume, metadata_block(volume, block, true), block);
+    }
+  }
+  cache_flush(volume);
+  sync_vdisk(volume);
+
+  char block[BLOCK_SIZE] = {0};
+  struct SuperBlock *checkpointed = (struct SuperBlock *)block;
+  pthread_mutex_lock(&volume->alloc_lock);
+  *checkpointed = volume->superblock;
+  pthread_mutex_unlock(&volume->alloc_lock);
+  checkpointed->num_free_blocks = volume->committed_free_blocks;
+  checkpointed->num_files = volume->committed_files;
+  checkpointed->inodes_used = volume->committed_inodes_used;
+  checkpointed->names_used = volume->committed_names_used;
+  checkpointed->journal_sequence = volume->journal_sequence;
+  write_block(volume, block, SUPERBLOCK_BLOCK);
+  cache_flush(volume);
+  sync_vdisk(volume);
+  volume->journal_head = 0;
+}
+
+void journal_requeue(struct Volume *volume, uint32_t length,
+                     uint64_t committed_operations, struct BlockRange *frees,
+                     int free_count, struct TailFree *tail_frees,
+                     int tail_free_count) {
+  // Undoes the bookkeeping of a transaction that failed to reach the
+  // journal: its records are marked dirty again and its frees go back to
+  // waiting, so the next commit carries them instead. Caller holds the
+  // journal lock.
+  pthread_rwlock_wrlock(&volume->commit_lock);
+  char *cursor = volume->journal_buffer + sizeof(struct JournalHeader);
+  char *end = cursor + length;
+  pthread_mutex_lock(&volume->alloc_lock);
+  while (cursor < end) {
+    struct JournalRecord record;
+    memcpy(&record, cursor, sizeof(record));
+    cursor += sizeof(record);
+    for (uint32_t i = record.target; i < record.target + record.count; i++) {
+      if (record.type == JOURNAL_INODE) {
+        journal_mark_inode(volume, i);
+      } else if (record.type == JOURNAL_NAME) {
+        journal_mark_name(volume, i);
+      } else {
+        volume->dirty_words[i / 64] |= 1ULL << (i % 64);
+      }
+    }
+    cursor += (size_t)record.count *
+              (record.type == JOURNAL_INODE  ? sizeof(struct Inode)
+               : record.type == JOURNAL_NAME ? sizeof(struct LongName)
+                                             : sizeof(uint64_t));
+  }
+  // The freed blocks never left the live bitmap, and pending_free_blocks
+  // still counts them; only the list needs them back
+  int count = volume->pending_free_count + free_count;
+  struct BlockRange *ranges =
+      count > volume->pending_free_capacity
+          ? realloc(volume->pending_frees, count * sizeof(struct BlockRange))
+          : volume->pending_frees;
+  if (ranges == NULL && count > 0) {
+    printf("ERROR: Could not record freed blocks\n");
+  } else if (count > 0) {
+    memcpy(&ranges[volume->pending_free_count], frees,
+           free_count * sizeof(struct BlockRange));
+    volume->pending_frees = ranges;
+    volume->pending_free_count = count;
+    volume->pending_free_capacity = max(volume->pending_free_capacity, count);
+  }
+  pthread_mutex_unlock(&volume->alloc_lock);
+
+  pthread_mutex_lock(&volume->tail_lock);
+  for (int f = 0; f < tail_free_count; f++) {
+    if (volume->tail_free_count == volume->tail_free_capacity) {
+      int capacity = volume->tail_free_capacity * 2 + 16;
+      struct TailFree *grown =
+          realloc(volume->tail_frees, capacity * sizeof(struct TailFree));
+      if (grown == NULL) {
+        // As in tail_release: lost to this mount, found free on remount
+        printf("ERROR: Could not record freed fragments\n");
+        break;
+      }
+      volume->tail_frees = grown;
+      volume->tail_free_capacity = capacity;
+    }
+    volume->tail_frees[volume->tail_free_count++] = tail_frees[f];
+  }
+  pthread_mutex_unlock(&volume->tail_lock);
+  volume->committed_operations = committed_operations;
+  pthread_rwlock_unlock(&volume->commit_lock);
+}
+
+int journal_commit(struct Volume *volume) {
+  uint64_t target = __atomic_load_n(&volume->operations, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&volume->journal_lock);
+  if (volume->committed_operations >= target) {
+    // A commit that started after our calls finished already covered them
+    pthread_mutex_unlock(&volume->journal_lock);
+    return 0;
+  }
+
+  if (volume->journal_head + volume->max_transaction_blocks >
+      volume->journal_blocks) {
+    journal_checkpoint(volume);
+  }
+
+  pthread_rwlock_wrlock(&volume->commit_lock);
+  store_file_maps(volume);
+  uint32_t length = journal_capture(volume);
+  struct BlockRange *frees = volume->pending_frees;
+  int free_count = volume->pending_free_count;
+  volume->pending_frees = NULL;
+  volume->pending_free_count = 0;
+  volume->pending_free_capacity = 0;
+  pthread_mutex_lock(&volume->tail_lock);
+  struct TailFree *tail_frees = volume->tail_frees;
+  int tail_free_count = volume->tail_free_count;
+  volume->tail_frees = NULL;
+  volume->tail_free_count = 0;
+  volume->tail_free_capacity = 0;
+  pthread_mutex_unlock(&volume->tail_lock);
+  uint64_t committed_operations = volume->committed_operations;
+  volume->committed_operations = volume->operations;
+  pthread_rwlock_unlock(&volume->commit_lock);
+
+  // Data and extent tree blocks are durable before the transaction that
+  // refers to them is written, including data still in flight on an
+  // io_uring queue, and so are the blocks whose checksums become current
+  async_drain(volume);
+  cache_flush(volume);
+  pthread_mutex_lock(&volume->checksum_lock);
+  struct ChecksumWrite *writes = volume->checksum_writes;
+  int write_count = volume->checksum_write_count;
+  volume->checksum_writes = NULL;
+  volume->checksum_write_count = 0;
+  volume->checksum_write_capacity = 0;
+  pthread_mutex_unlock(&volume->checksum_lock);
+  sync_vdisk(volume);
+  checksum_promote(volume, writes, write_count);
+  free(writes);
+  if (length > 0) {
+    struct JournalHeader header = {JOURNAL_MAGIC, volume->journal_sequence,
+                                   length, 0};
+    header.checksum = journal_checksum(
+        volume->journal_buffer + sizeof(header), length);
+    memcpy(volume->journal_buffer, &header, sizeof(header));
+
+    uint32_t bytes = sizeof(header) + length;
+    uint32_t blocks = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    memset(volume->journal_buffer + bytes, 0, blocks * BLOCK_SIZE - bytes);
+    off_t offset =
+        (off_t)(volume->journal_start + volume->journal_head) * BLOCK_SIZE;
+    if (pwrite(volume->vdisk_fd, volume->journal_buffer,
+               (size_t)blocks * BLOCK_SIZE,
+               offset) != (ssize_t)blocks * BLOCK_SIZE) {
+      perror("Failed to write journal");
+      journal_requeue(volume, length, committed_operations, frees,
+                      free_count, tail_frees, tail_free_count);
+      free(frees);
+      free(tail_frees);
+      pthread_mutex_unlock(&volume->journal_lock);
+      return -1;
+    }
+    stat_add(&volume->cache_stats.disk_writes, 1);
+    volume->journal_head += blocks;
+    volume->journal_sequence++;
+    sync_vdisk(volume);
+  }
+
+  release_blocks(volume, frees, free_count);
+  free(frees);
+  release_tail_fragments(volume, tail_frees, tail_free_count);
+  free(tail_frees);
+  pthread_mutex_unlock(&volume->journal_lock);
+  return 0;
+}
+
+uint32_t blocks_needed(size_t size) {
+  // Upper bound on the blocks a write of size bytes allocates, counting a
+  // partial block at each end and a rewritten extent tree root and leaf
+  return size / BLOCK_SIZE + 4;
+}
+
+void reclaim_blocks(struct Volume *volume, uint32_t wanted) {
+  // Commits early when the space a call needs is only held by frees that
+  // are still waiting for their commit
+  if (open_batch == volume) {
+    return; // A commit would wait for our own batch
+  }
+  pthread_mutex_lock(&volume->alloc_lock);
+  bool commit = volume->pending_free_blocks > 0 &&
+                volume->superblock.num_free_blocks -
+                        volume->reserved_blocks <
+                    wanted;
+  pthread_mutex_unlock(&volume->alloc_lock);
+  if (commit) {
+    journal_commit(volume);
+  }
+}
+
+int sfs_begin_batch(struct Volume *volume) {
+  // Calls made by this thread until sfs_commit_batch reach the journal as
+  // one transaction: after a crash either all of them or none are visible
+  if (open_batch != NULL) {
+    printf("ERROR: This thread already has an open batch\n");
+    return -1;
+  }
+  pthread_rwlock_rdlock(&volume->commit_lock);
+  open_batch = volume;
+  return 0;
+}
+
+int sfs_commit_batch(struct Volume *volume) {
+  // Each metadata record the batch touched is written once, however many
+  // of its calls changed it, and the whole batch costs one journal write
+  if (open_batch != volume) {
+    printf("ERROR: No batch is open on this volume\n");
+    return -1;
+  }
+  open_batch = NULL;
+  pthread_rwlock_unlock(&volume->commit_lock);
+  return journal_commit(volume);
+}
+
+int journal_apply(struct Volume *volume, char *records, uint32_t length) {
+  // Replays one transaction onto the live metadata, which is committed too
+  char *cursor = records;
+  char *end = records + length;
+  while (cursor < end) {
+    struct JournalRecord record;
+    if (end - cursor < (long)sizeof(record)) {
+      return -1;
+    }
+    memcpy(&record, cursor, sizeof(record));
+    cursor += sizeof(record);
+
+    char *base, *committed;
+    size_t item_size;
+    uint32_t limit;
+    uint64_t start_block;
+    int *used = NULL;
+    if (record.type == JOURNAL_INODE) {
+      base = (char *)volume->inodes;
+      committed = (char *)volume->committed_inodes;
+      item_size = sizeof(struct Inode);
+      limit = volume->num_inodes;
+      start_block = volume->superblock.inode_start;
+      used = &volume->inodes_used;
+    } else if (record.type == JOURNAL_NAME) {
+      base = (char *)volume->long_names;
+      committed = (char *)volume->committed_names;
+      item_size = sizeof(struct LongName);
+      limit = volume->num_inodes;
+      start_block = volume->superblock.name_start;
+      used = &volume->names_used;
+    } else if (record.type == JOURNAL_BITMAP) {
+      base = (char *)volume->bitmap;
+      committed = (char *)volume->committed_bitmap;
+      item_size = sizeof(uint64_t);
+      limit = volume->bitmap_words;
+      start_block = volume->superblock.bitmap_start;
+    } else {
+      return -1;
+    }
+
+    size_t bytes = (size_t)record.count * item_size;
+    if (record.count == 0 || record.target >= limit ||
+        record.count > limit - record.target || end - cursor < (long)bytes) {
+      return -1;
+    }
+    if (used != NULL) {
+      *used = max(*used, record.target + record.count);
+    }
+    size_t offset = (size_t)record.target * item_size;
+    fault_range(volume, start_block, offset, bytes);
+    memcpy(base + offset, cursor, bytes);
+    memcpy(committed + offset, cursor, bytes);
+    if (record.type == JOURNAL_INODE) {
+      update_inode_keys(volume, record.target, record.count);
+    }
+    checkpoint_mark(volume, start_block, (size_t)record.target * item_size,
+                    bytes);
+    cursor += bytes;
+  }
+  return 0;
+}
+
+int journal_replay(struct Volume *volume) {
+  // Applies every intact transaction after the last checkpoint, stopping at
+  // the first block that does not continue the sequence
+  char *buffer = volume->journal_buffer;
+  uint32_t max_bytes = volume->max_transaction_blocks * BLOCK_SIZE;
+  int replayed = 0;
+
+  while (volume->journal_head < volume->journal_blocks) {
+    off_t offset =
+        (off_t)(volume->journal_start + volume->journal_head) * BLOCK_SIZE;
+    struct JournalHeader header;
+    if (pread(volume->vdisk_fd, &header, sizeof(header), offset) !=
+            sizeof(header) ||
+        header.magic != JOURNAL_MAGIC ||
+        header.sequence != volume->journal_sequence ||
+        header.length > max_bytes - sizeof(header)) {
+      break;
+    }
+
+    uint32_t bytes = sizeof(header) + header.length;
+    uint32_t blocks = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (volume->journal_head + blocks > volume->journal_blocks ||
+        pread(volume->vdisk_fd, buffer, bytes, offset) != bytes ||
+        journal_checksum(buffer + sizeof(header), header.length) !=
+            header.checksum ||
+        journal_apply(volume, buffer + sizeof(header), header.length) < 0) {
+      break;
+    }
+
+    volume->journal_head += blocks;
+    volume->journal_sequence++;
+    replayed++;
+  }
+  return replayed;
+}
+
+int init_journal(struct Volume *volume) {
+  uint64_t metadata_blocks =
+      volume->journal_start - volume->superblock.inode_start;
+
+  volume->max_transaction_blocks =
+      transaction_blocks(volume->num_inodes, volume->bitmap_words);
+  if (volume->max_transaction_blocks > volume->journal_blocks) {
+    printf("ERROR: Journal region is too small\n");
+    return -1;
+  }
+
+  volume->journal_buffer =
+      table_alloc(volume->max_transaction_blocks, BLOCK_SIZE);
+  volume->committed_inodes =
+      table_alloc(volume->num_inodes, sizeof(struct Inode));
+  volume->committed_names =
+      table_alloc(volume->num_inodes, sizeof(struct LongName));
+  volume->committed_bitmap =
+      table_alloc(volume->bitmap_words, sizeof(uint64_t));
+  volume->dirty_inodes = table_alloc(volume->num_inodes, sizeof(bool));
+  volume->dirty_names = table_alloc(volume->num_inodes, sizeof(bool));
+  volume->dirty_inode_list = table_alloc(volume->num_inodes, sizeof(int));
+  volume->dirty_name_list = table_alloc(volume->num_inodes, sizeof(int));
+  volume->dirty_words =
+      table_alloc((volume->bitmap_words + 63) / 64, sizeof(uint64_t));
+  volume->checkpoint_dirty = table_alloc(metadata_blocks, sizeof(bool));
+  if (volume->journal_buffer == NULL || volume->committed_inodes == NULL ||
+      volume->committed_names == NULL || volume->committed_bitmap == NULL ||
+      volume->dirty_inodes == NULL || volume->dirty_names == NULL ||
+      volume->dirty_inode_list == NULL || volume->dirty_name_list == NULL ||
+      volume->dirty_words == NULL || volume->checkpoint_dirty == NULL) {
+    printf("ERROR: Could not allocate journal\n");
+    return -1;
+  }
+
+  volume->journal_head = 0;
+  volume->journal_sequence = volume->superblock.journal_sequence;
+  int replayed = journal_replay(volume);
+  if (replayed > 0) {
+    // The superblock's counters date from the last checkpoint, and replay
+    // may have repeated changes its home blocks already had, so after a
+    // crash they are recounted from the whole of the metadata. A clean
+    // unmount checkpoints, and then they are trusted as they are.
+    printf("LOG(sfs_mount): Replayed %d journal transactions\n", replayed);
+    if (sfs_load_metadata(volume) < 0) {
+      return -1;
+    }
+    count_superblock(volume, &volume->superblock, volume->inodes,
+                     volume->inodes_used, volume->names_used, volume->bitmap);
+  }
+
+  // Replay may have raised the high-water marks
+  volume->committed_inodes_used = volume->inodes_used;
+  volume->committed_names_used = volume->names_used;
+  volume->committed_free_blocks = volume->superblock.num_free_blocks;
+  volume->committed_files = volume->superblock.num_files;
+  return 0;
+}
+
+void free_journal(struct Volume *volume) {
+  uint32_t inodes = volume->num_inodes;
+  table_free(volume->journal_buffer, volume->max_transaction_blocks,
+             BLOCK_SIZE);
+  table_free(volume->committed_inodes, inodes, sizeof(struct Inode));
+  table_free(volume->committed_names, inodes, sizeof(struct LongName));
+  table_free(volume->committed_bitmap, volume->bitmap_words,
+             sizeof(uint64_t));
+  table_free(volume->dirty_inodes, inodes, sizeof(bool));
+  table_free(volume->dirty_names, inodes, sizeof(bool));
+  table_free(volume->dirty_inode_list, inodes, sizeof(int));
+  table_free(volume->dirty_name_list, inodes, sizeof(int));
+  table_free(volume->dirty_words, (volume->bitmap_words + 63) / 64,
+             sizeof(uint64_t));
+  table_free(volume->checkpoint_dirty,
+             volume->journal_start - volume->superblock.inode_start,
+             sizeof(bool));
+  free(volume->pending_frees);
+  volume->journal_buffer = NULL;
+  volume->committed_inodes = NULL;
+  volume->committed_names = NULL;
+  volume->committed_bitmap = NULL;
+  volume->dirty_inodes = NULL;
+  volume->dirty_names = NULL;
+  volume->dirty_inode_list = NULL;
+  volume->dirty_name_list = NULL;
+  volume->dirty_inode_count = 0;
+  volume->dirty_name_count = 0;
+  volume->dirty_words = NULL;
+  volume->checkpoint_dirty = NULL;
+  volume->pending_frees = NULL;
+  volume->pending_free_count = 0;
+  volume->pending_free_capacity = 0;
+}
+
+// Extent map operations
+//
+// A file's data is described by a sorted list of extents. Up to
+// INLINE_EXTENTS are kept in the inode itself; longer lists spill into an
+// extent tree made of one root block listing leaf blocks, each leaf
+// holding the next EXTENTS_PER_LEAF extents in order. While a file is read or
+// written the whole list is held in a struct ExtentMap, and only the leaves
+// from dirty_from onwards are written back. A compressed chunk is an
+// extent too, one that covers more logical blocks than it stores.
+
+bool extent_compressed(struct Extent *extent) {
+  return (extent->length & EXTENT_COMPRESSED) != 0;
+}
+
+uint32_t extent_blocks(struct Extent *extent) {
+  // Logical blocks covered
+  return extent_compressed(extent) ? COMPRESS_CHUNK_BLOCKS : extent->length;
+}
+
+uint32_t extent_stored(struct Extent *extent) {
+  // Disk blocks taken
+  return extent->length & ~EXTENT_COMPRESSED;
+}
+
+void extent_map_init(struct ExtentMap *map) {
+  map->extents = NULL;
+  map->count = 0;
+  map->capacity = 0;
+  map->dirty_from = 0;
+  map->delayed = NULL;
+  map->delayed_first = 0;
+  map->delayed_count = 0;
+}
+
+void extent_map_free(struct ExtentMap *map) {
+  free(map->extents);
+  free(map->delayed);
+  extent_map_init(map);
+}
+
+int extent_map_reserve(struct ExtentMap *map, uint32_t count) {
+  if (count <= map->capacity) {
+    return 0;
+  }
+
+  uint32_t capacity = map->capacity > 0 ? map->capacity : INLINE_EXTENTS;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+  struct Extent *extents =
+      realloc(map->extents, capacity * sizeof(struct Extent));
+  if (extents == NULL) {
+    printf("ERROR: Could not allocate extent map\n");
+    return -1;
+  }
+  map->extents = extents;
+  map->capacity = capacity;
+  return 0;
+}
+
+void extent_map_touch(struct ExtentMap *map, uint32_t index) {
+  if (index < map->dirty_from) {
+    map->dirty_from = index;
+  }
+}
+
+uint32_t extent_map_upper(struct ExtentMap *map, uint32_t logical) {
+  // Number of extents starting at or before logical
+  uint32_t low = 0, high = map->count;
+  while (low < high) {
+    uint32_t mid = (low + high) / 2;
+    if (map->extents[mid].logical <= logical) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+int extent_map_find(struct ExtentMap *map, uint32_t logical) {
+  // Index of the extent containing logical block, or -1 if it is unmapped
+  uint32_t index = extent_map_upper(map, logical);
+  if (index == 0) {
+    return -1;
+  }
+  struct Extent *extent = &map->extents[index - 1];
+  if (logical >= extent->logical + extent_blocks(extent)) {
+    return -1;
+  }
+  return index - 1;
+}
+
+int extent_map_insert(struct ExtentMap *map, uint32_t logical, uint64_t start,
+                      uint32_t length) {
+  uint32_t index = extent_map_upper(map, logical);
+
+  // Grow the previous extent when the new run continues it on disk
+  if (index > 0 && !(length & EXTENT_COMPRESSED)) {
+    struct Extent *previous = &map->extents[index - 1];
+    if (!extent_compressed(previous) &&
+        previous->logical + previous->length == logical &&
+        previous->start + previous->length == start &&
+        previous->length + length <= EXTENT_MAX_BLOCKS) {
+      previous->length += length;
+      extent_map_touch(map, index - 1);
+      return 0;
+    }
+  }
+
+  if (extent_map_reserve(map, map->count + 1) < 0) {
+    return -1;
+  }
+  memmove(&map->extents[index + 1], &map->extents[index],
+          (map->count - index) * sizeof(struct Extent));
+  map->extents[index].logical = logical;
+  map->extents[index].start = start;
+  map->extents[index].length = length;
+  map->count++;
+  extent_map_touch(map, index);
+  return 0;
+}
+
+int extent_map_assign(struct Volume *volume, struct ExtentMap *map,
+                      uint32_t first, uint32_t last) {
+  // Maps every unmapped logical block in [first, last] to newly allocated
+  // blocks, in contiguous runs where possible. Nothing changes on failure.
+  struct ExtentMap runs;
+  extent_map_init(&runs);
+
+  uint32_t logical = first;
+  while (logical <= last) {
+    int index = extent_map_find(map, logical);
+    if (index >= 0) {
+      logical = map->extents[index].logical +
+                extent_blocks(&map->extents[index]);
+      continue;
+    }
+
+    uint32_t next = extent_map_upper(map, logical);
+    uint32_t hole_end = last;
+    if (next < map->count && map->extents[next].logical - 1 < hole_end) {
+      hole_end = map->extents[next].logical - 1;
+    }
+
+    uint32_t missing = hole_end - logical + 1;
+    while (missing > 0) {
+      uint64_t start;
+      uint32_t length = allocate_blocks(
+          volume, missing < EXTENT_MAX_BLOCKS ? missing : EXTENT_MAX_BLOCKS,
+          &start, false);
+      if (length == 0 || extent_map_reserve(&runs, runs.count + 1) < 0) {
+        if (length > 0) {
+          free_blocks(volume, start, length);
+        }
+        for (uint32_t i = 0; i < runs.count; i++) {
+          free_blocks(volume, runs.extents[i].start, runs.extents[i].length);
+        }
+        extent_map_free(&runs);
+        return -1;
+      }
+      runs.extents[runs.count].logical = logical;
+      runs.extents[runs.count].start = start;
+      runs.extents[runs.count].length = length;
+      runs.count++;
+      logical += length;
+      missing -= length;
+    }
+  }
+
+  int result = extent_map_reserve(map, map->count + runs.count);
+  for (uint32_t i = 0; i < runs.count; i++) {
+    if (result < 0) {
+      free_blocks(volume, runs.extents[i].start, runs.extents[i].length);
+    } else {
+      extent_map_insert(map, runs.extents[i].logical, runs.extents[i].start,
+                        runs.extents[i].length);
+    }
+  }
+  extent_map_free(&runs);
+  return result;
+}
+
+void extent_map_truncate(struct Volume *volume, struct ExtentMap *map,
+                         uint32_t num_blocks) {
+  // Releases every block at or past logical block num_blocks. A compressed
+  // chunk reaching across it must have been expanded (expand_chunks).
+  while (map->count > 0) {
+    struct Extent *extent = &map->extents[map->count - 1];
+    if (extent->logical >= num_blocks) {
+      free_blocks(volume, extent->start, extent_stored(extent));
+      map->count--;
+      extent_map_touch(map, map->count);
+      continue;
+    }
+
+    if (!extent_compressed(extent) &&
+        extent->logical + extent->length > num_blocks) {
+      uint32_t keep = num_blocks - extent->logical;
+      free_blocks(volume, extent->start + keep, extent->length - keep);
+      extent->length = keep;
+      extent_map_touch(map, map->count - 1);
+    }
+    break;
+  }
+}
+
+int extent_map_punch(struct Volume *volume, struct ExtentMap *map,
+                     uint32_t first, uint32_t end) {
+  // Releases every block in logical [first, end), splitting an extent that
+  // holds both ends of the range. Compressed chunks reaching across either
+  // end must have been expanded (expand_chunks). Nothing changes on
+  // failure.
+  if (extent_map_reserve(map, map->count + 1) < 0) {
+    return -1;
+  }
+  uint32_t index = extent_map_upper(map, first);
+  if (index > 0 && map->extents[index - 1].logical +
+                           extent_blocks(&map->extents[index - 1]) > first) {
+    index--;
+  }
+
+  while (index < map->count && map->extents[index].logical < end) {
+    struct Extent *extent = &map->extents[index];
+    uint32_t extent_end = extent->logical + extent_blocks(extent);
+    uint32_t cut_first = extent->logical > first ? extent->logical : first;
+    uint32_t cut_end = extent_end < end ? extent_end : end;
+    extent_map_touch(map, index);
+    if (extent_compressed(extent)) {
+      free_blocks(volume, extent->start, extent_stored(extent));
+      memmove(&map->extents[index], &map->extents[index + 1],
+              (map->count - index - 1) * sizeof(struct Extent));
+      map->count--;
+      continue;
+    }
+    free_blocks(volume, extent->start + (cut_first - extent->logical),
+                cut_end - cut_first);
+
+    if (cut_first > extent->logical && cut_end < extent_end) {
+      memmove(&map->extents[index + 2], &map->extents[index + 1],
+              (map->count - index - 1) * sizeof(struct Extent));
+      struct Extent *rest = &map->extents[index + 1];
+      rest->logical = cut_end;
+      rest->start = extent->start + (cut_end - extent->logical);
+      rest->length = extent_end - cut_end;
+      extent->length = cut_first - extent->logical;
+      map->count++;
+      break;
+    }
+    if (cut_first > extent->logical) {
+      extent->length = cut_first - extent->logical;
+      index++;
+    } else if (cut_end < extent_end) {
+      extent->start += cut_end - extent->logical;
+      extent->length = extent_end - cut_end;
+      extent->logical = cut_end;
+      break;
+    } else {
+      memmove(&map->extents[index], &map->extents[index + 1],
+              (map->count - index - 1) * sizeof(struct Extent));
+      map->count--;
+    }
+  }
+  return 0;
+}
+
+int load_extent_map(struct Volume *volume, struct Inode *entry,
+                    struct ExtentMap *map) {
+  extent_map_init(map);
+  if (extent_map_reserve(map, entry->extent_count) < 0) {
+    return -1;
+  }
+
+  if (entry->extent_root == INVALID_BLOCK_POINTER) {
+    memcpy(map->extents, entry->extents,
+           entry->extent_count * sizeof(struct Extent));
+  } else {
+    struct ExtentRoot root;
+    struct ExtentLeaf leaf;
+    uint32_t loaded = 0;
+    read_block(volume, &root, entry->extent_root);
+    for (uint32_t i = 0; i < root.leaf_count; i++) {
+      read_block(volume, &leaf, root.leaves[i]);
+      memcpy(&map->extents[loaded], leaf.extents,
+             leaf.count * sizeof(struct Extent));
+      loaded += leaf.count;
+    }
+  }
+
+  map->count = entry->extent_count;
+  map->dirty_from = map->count;
+  return 0;
+}
+
+void free_extent_tree(struct Volume *volume, uint64_t root_block) {
+  struct ExtentRoot root;
+  read_block(volume, &root, root_block);
+  for (uint32_t i = 0; i < root.leaf_count; i++) {
+    free_block(volume, root.leaves[i]);
+  }
+  free_block(volume, root_block);
+}
+
+int store_extent_map(struct Volume *volume, struct Inode *entry,
+                     struct ExtentMap *map) {
+  // The tree is copy-on-write: until the next journal commit the committed
+  // inode still points at the old root, so a changed root or leaf always
+  // goes to a new block and the old one is freed (freed blocks are not
+  // reused before that commit)
+  struct ExtentRoot old_root;
+  old_root.leaf_count = 0;
+  if (entry->extent_root != INVALID_BLOCK_POINTER) {
+    if (map->dirty_from >= map->count && map->count == entry->extent_count) {
+      return 0;
+    }
+    read_block(volume, &old_root, entry->extent_root);
+  }
+
+  if (map->count <= INLINE_EXTENTS) {
+    if (entry->extent_root != INVALID_BLOCK_POINTER) {
+      free_extent_tree(volume, entry->extent_root);
+      entry->extent_root = INVALID_BLOCK_POINTER;
+    }
+    memcpy(entry->extents, map->extents, map->count * sizeof(struct Extent));
+    entry->extent_count = map->count;
+    map->dirty_from = map->count;
+    return 0;
+  }
+
+  uint32_t leaf_count = (map->count + EXTENTS_PER_LEAF - 1) / EXTENTS_PER_LEAF;
+  if (leaf_count > LEAVES_PER_ROOT) {
+    printf("ERROR: File has too many extents\n");
+    return -1;
+  }
+
+  // Leaves before the first dirty one are shared with the old tree
+  uint32_t shared = min(map->dirty_from / EXTENTS_PER_LEAF,
+                        min(old_root.leaf_count, leaf_count));
+  struct ExtentRoot root;
+  memset(&root, 0, sizeof(root));
+  memcpy(root.leaves, old_root.leaves, shared * sizeof(root.leaves[0]));
+
+  int64_t root_block = find_empty_block(volume);
+  if (root_block == -1) {
+    printf("ERROR: Couldn't find a free block for the extent tree\n");
+    return -1;
+  }
+  for (root.leaf_count = shared; root.leaf_count < leaf_count;
+       root.leaf_count++) {
+    int64_t leaf_block = find_empty_block(volume);
+    if (leaf_block == -1) {
+      printf("ERROR: Couldn't find a free block for the extent tree\n");
+      while (root.leaf_count > shared) {
+        free_block(volume, root.leaves[--root.leaf_count]);
+      }
+      free_block(volume, root_block);
+      return -1;
+    }
+    root.leaves[root.leaf_count] = leaf_block;
+  }
+
+  struct ExtentLeaf leaf;
+  for (uint32_t i = shared; i < leaf_count; i++) {
+    uint32_t first = i * EXTENTS_PER_LEAF;
+    memset(&leaf, 0, sizeof(leaf));
+    leaf.count = min(EXTENTS_PER_LEAF, map->count - first);
+    memcpy(leaf.extents, &map->extents[first],
+           leaf.count * sizeof(struct Extent));
+    write_block(volume, &leaf, root.leaves[i]);
+  }
+  write_block(volume, &root, root_block);
+
+  if (entry->extent_root != INVALID_BLOCK_POINTER) {
+    for (uint32_t i = shared; i < old_root.leaf_count; i++) {
+      free_block(volume, old_root.leaves[i]);
+    }
+    free_block(volume, entry->extent_root);
+  }
+  entry->extent_root = root_block;
+  entry->extent_count = map->count;
+  map->dirty_from = map->count;
+  return 0;
+}
+
+// Each file's extent map is loaded once, when the file is opened or first
+// appended to, and then kept in volume->file_maps for every later call on
+// it. Calls change only the cached map; it is stored back into the inode
+// and extent tree when the file is closed and by every journal commit,
+// which is what makes repeated small writes cost just their data blocks. A
+// cached map is guarded by its file lock, and the file lock must be held
+// exclusively to load it.
+
+struct ExtentMap *file_map(struct Volume *volume,
+                           struct Inode *entry) {
+  struct ExtentMap *map = &volume->file_maps[entry - volume->inodes];
+  if (map->extents != NULL) {
+    return map;
+  }
+  // Even an empty map gets its array, which marks it as loaded
+  if (load_extent_map(volume, entry, map) < 0 ||
+      extent_map_reserve(map, INLINE_EXTENTS) < 0) {
+    extent_map_free(map);
+    return NULL;
+  }
+  return map;
+}
+
+int store_file_map(struct Volume *volume, struct Inode *entry) {
+  // Writes the cached map back if it differs from the entry
+  struct ExtentMap *map = &volume->file_maps[entry - volume->inodes];
+  if (map->extents == NULL ||
+      (map->dirty_from >= map->count && map->count == entry->extent_count)) {
+    return 0;
+  }
+  if (store_extent_map(volume, entry, map) < 0) {
+    return -1;
+  }
+  journal_mark_inode(volume, entry - volume->inodes);
+  return 0;
+}
+
+void store_file_maps(struct Volume *volume) {
+  // Runs with all mutating calls excluded, just before a commit captures
+  // the inode table, and gives delayed blocks their disk blocks first. A
+  // slot with a map loaded is resident; others are not looked at, as a
+  // prefetch may be reading them in.
+  for (int i = 0; i < volume->inodes_used; i++) {
+    struct Inode *entry = &volume->inodes[i];
+    pthread_rwlock_wrlock(file_lock(volume, entry));
+    if (volume->file_maps[i].extents != NULL && entry->used == USED_FLAG &&
+        (flush_delayed_blocks(volume, &volume->file_maps[i], entry->size) <
+             0 ||
+         store_file_map(volume, entry) < 0)) {
+      char filename[MAX_FILENAME_SIZE + 1];
+      get_file_name(volume, i, filename);
+      printf("ERROR: Could not store the extents of %s\n", filename);
+    }
+    pthread_rwlock_unlock(file_lock(volume, entry));
+  }
+}
+
+// File data transfer over an extent map. The requested range is walked as
+// runs of physically adjacent blocks (merging neighbouring extents that
+// continue each other on disk), and every run containing at least one whole
+// block becomes a single vectored transfer to or from the caller's buffer.
+// Pieces that only cover part of one block go through the block cache. With
+// a deferred request the whole blocks of each run are queued on it instead.
+
+uint32_t extent_map_run(struct ExtentMap *map, int index, uint32_t logical,
+                        uint64_t *physical) {
+  // Length of the physically contiguous run starting at logical, which lies
+  // in extent index
+  struct Extent *extent = &map->extents[index];
+  *physical = extent->start + (logical - extent->logical);
+  uint32_t count = extent->length - (logical - extent->logical);
+
+  for (uint32_t i = index + 1; i < map->count; i++) {
+    struct Extent *next = &map->extents[i];
+    if (next->logical != logical + count ||
+        next->start != *physical + count || extent_compressed(next)) {
+      break;
+    }
+    count += next->length;
+  }
+  return count;
+}
+
+void file_read_range(struct Volume *volume, struct ExtentMap *map,
+                     uint64_t position, char *buffer, uint32_t size,
+                     struct AsyncRequest *deferred) {
+  char head[BLOCK_SIZE], tail[BLOCK_SIZE];
+  uint64_t end = position + size;
+
+  while (position < end) {
+    uint32_t logical = position / BLOCK_SIZE;
+    uint32_t offset = position % BLOCK_SIZE;
+    uint32_t chunk = min(BLOCK_SIZE - offset, end - position);
+
+    int index = extent_map_find(map, logical);
+    if (index < 0 && logical >= map->delayed_first &&
+        logical < map->delayed_first + map->delayed_count) {
+      // Delayed blocks are read from memory
+      memcpy(buffer,
+             map->delayed +
+                 (position - (uint64_t)map->delayed_first * BLOCK_SIZE),
+             chunk);
+      buffer += chunk;
+      position += chunk;
+      continue;
+    }
+    if (index < 0) {
+      // Unmapped blocks read as zeros
+      memset(buffer, 0, chunk);
+      buffer += chunk;
+      position += chunk;
+      continue;
+    }
+
+    struct Extent *extent = &map->extents[index];
+    if (extent_compressed(extent)) {
+      // Compressed chunks are read whole, see read_chunk_range
+      uint64_t chunk_start = (uint64_t)extent->logical * BLOCK_SIZE;
+      uint64_t chunk_end = chunk_start + COMPRESS_CHUNK_BLOCKS * BLOCK_SIZE;
+      chunk = (chunk_end < end ? chunk_end : end) - position;
+      read_chunk_range(volume, extent, position - chunk_start, buffer, chunk);
+      buffer += chunk;
+      position += chunk;
+      continue;
+    }
+
+    uint64_t physical;
+    uint32_t count = extent_map_run(map, index, logical, &physical);
+    uint32_t last_logical = (end - 1) / BLOCK_SIZE;
+    if (logical + count - 1 > last_logical) {
+      count = last_logical - logical + 1;
+    }
+    uint64_t run_end = ((uint64_t)logical + count) * BLOCK_SIZE;
+    if (run_end > end) {
+      run_end = end;
+    }
+    uint32_t tail_size = run_end % BLOCK_SIZE;
+
+    // No whole block in this run: serve the first piece from the cache
+    if (count <= (uint32_t)(offset != 0) + (tail_size != 0)) {
+      read_block(volume, head, physical);
+      memcpy(buffer, head + offset, chunk);
+      buffer += chunk;
+      position += chunk;
+      continue;
+    }
+
+    chunk = run_end - position;
+    struct BlockRun run = {physical, count, NULL, buffer, NULL};
+    if (offset != 0) {
+      run.head = head;
+      run.body = buffer + (BLOCK_SIZE - offset);
+    }
+    if (tail_size != 0) {
+      run.tail = tail;
+    }
+    if (deferred != NULL) {
+      defer_run(volume, deferred, &run, false);
+    } else {
+      transfer_run(volume, &run, false);
+    }
+
+    if (run.head != NULL) {
+      memcpy(buffer, head + offset, BLOCK_SIZE - offset);
+    }
+    if (run.tail != NULL) {
+      memcpy(buffer + chunk - tail_size, tail, tail_size);
+    }
+
+    buffer += chunk;
+    position += chunk;
+  }
+}
+
+void read_ahead(struct Volume *volume, struct OpenFile *open_file,
+                struct ExtentMap *map, uint64_t position, uint32_t size,
+                uint64_t file_size) {
+  // Called after each read. Sequential small reads prefetch the blocks
+  // ahead of them in runs, refilling once the reader is half a window from
+  // the prefetched end; any other read starts the pattern over.
+  bool sequential = position == open_file->next_read;
+  open_file->next_read = position + size;
+  if (!sequential) {
+    open_file->readahead_window = READAHEAD_MIN_BLOCKS;
+    open_file->readahead_end = 0;
+    return;
+  }
+  // Mapped disks need no cache, and big reads already transfer whole runs
+  uint32_t window = open_file->readahead_window;
+  if (volume->vdisk_map != NULL || size >= window * BLOCK_SIZE) {
+    return;
+  }
+
+  uint32_t next_block = (position + size) / BLOCK_SIZE;
+  if (open_file->readahead_end > next_block + window / 2) {
+    return;
+  }
+  uint32_t logical = next_block > open_file->readahead_end
+                         ? next_block
+                         : open_file->readahead_end;
+  uint32_t end = next_block + window;
+  uint32_t file_blocks = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (end > file_blocks) {
+    end = file_blocks;
+  }
+  open_file->readahead_end = end;
+  open_file->readahead_window =
+      min(window * 2, min(READAHEAD_MAX_BLOCKS, volume->cache_capacity / 4));
+  if (open_file->readahead_window < READAHEAD_MIN_BLOCKS) {
+    open_file->readahead_window = READAHEAD_MIN_BLOCKS;
+  }
+
+  while (logical < end) {
+    int index = extent_map_find(map, logical);
+    if (index < 0) {
+      logical++; // Holes read as zeros without touching the disk
+      continue;
+    }
+    if (extent_compressed(&map->extents[index])) {
+      // Decompressed on demand instead
+      logical = map->extents[index].logical + COMPRESS_CHUNK_BLOCKS;
+      continue;
+    }
+    uint64_t physical;
+    uint32_t count = extent_map_run(map, index, logical, &physical);
+    if (count > end - logical) {
+      count = end - logical;
+    }
+    cache_prefetch(volume, physical, count);
+    logical += count;
+  }
+}
+
+void load_partial_block(struct Volume *volume, char *block, uint32_t logical,
+                        uint64_t physical, uint64_t file_size) {
+  // Blocks past the old end of file have no contents worth reading
+  if ((uint64_t)logical * BLOCK_SIZE >= file_size) {
+    memset(block, 0, BLOCK_SIZE);
+  } else {
+    read_block(volume, block, physical);
+  }
+}
+
+void file_write_range(struct Volume *volume, struct ExtentMap *map,
+                      uint64_t file_size, uint64_t position, char *buffer,
+                      uint32_t size, struct AsyncRequest *deferred) {
+  // Every block in the range must already be mapped (extent_map_assign)
+  char head[BLOCK_SIZE], tail[BLOCK_SIZE];
+  uint64_t end = position + size;
+
+  while (position < end) {
+    uint32_t logical = position / BLOCK_SIZE;
+    uint32_t offset = position % BLOCK_SIZE;
+    uint32_t chunk = min(BLOCK_SIZE - offset, end - position);
+
+    uint64_t physical;
+    uint32_t count = extent_map_run(map, extent_map_find(map, logical),
+                                    logical, &physical);
+    uint32_t last_logical = (end - 1) / BLOCK_SIZE;
+    if (logical + count - 1 > last_logical) {
+      count = last_logical - logical + 1;
+    }
+    uint64_t run_end = ((uint64_t)logical + count) * BLOCK_SIZE;
+    if (run_end > end) {
+      run_end = end;
+    }
+    uint32_t tail_size = run_end % BLOCK_SIZE;
+
+    // No whole block in this run: modify the first piece in the cache, so a
+    // run of small appends keeps updating the same cached tail block
+    if (count <= (uint32_t)(offset != 0) + (tail_size != 0)) {
+      write_partial_block(volume, physical, offset, buffer, chunk,
+                          (uint64_t)logical * BLOCK_SIZE >= file_size);
+      buffer += chunk;
+      position += chunk;
+      continue;
+    }
+
+    chunk = run_end - position;
+    struct BlockRun run = {physical, count, NULL, buffer, NULL};
+    if (offset != 0) {
+      load_partial_block(volume, head, logical, physical, file_size);
+      memcpy(head + offset, buffer, BLOCK_SIZE - offset);
+      run.head = head;
+      run.body = buffer + (BLOCK_SIZE - offset);
+    }
+    if (tail_size != 0) {
+      load_partial_block(volume, tail, logical + count - 1,
+                         physical + count - 1, file_size);
+      memcpy(tail, buffer + chunk - tail_size, tail_size);
+      run.tail = tail;
+    }
+    if (deferred != NULL) {
+      defer_run(volume, deferred, &run, true);
+    } else {
+      transfer_run(volume, &run, true);
+
+      // The partial tail is where the next sequential write lands
+      if (run.tail != NULL) {
+        cache_fill(volume, tail, physical + count - 1);
+      }
+    }
+
+    buffer += chunk;
+    position += chunk;
+  }
+}
+
+void zero_file_range(struct Volume *volume, struct ExtentMap *map,
+                     uint64_t position, uint64_t end) {
+  // Zeroes the mapped parts of a byte range within a block or two, such as
+  // the rest of the last block past the end of file, so that growing the
+  // file over it doesn't bring back bytes a truncate cut off
+  char zeros[BLOCK_SIZE] = {0};
+  while (position < end) {
+    uint32_t logical = position / BLOCK_SIZE;
+    uint32_t offset = position % BLOCK_SIZE;
+    uint32_t chunk = BLOCK_SIZE - offset;
+    if (chunk > end - position) {
+      chunk = end - position;
+    }
+    int index = extent_map_find(map, logical);
+    if (index >= 0 && extent_compressed(&map->extents[index])) {
+      // Left as it is if the chunk can't be expanded
+      index = expand_chunks(volume, map, logical, logical + 1) < 0
+                  ? -1
+                  : extent_map_find(map, logical);
+    }
+    if (index >= 0) {
+      struct Extent *extent = &map->extents[index];
+      write_partial_block(volume, extent->start + (logical - extent->logical),
+                          offset, zeros, chunk, false);
+    }
+    position += chunk;
+  }
+}
+
+void zero_file_tail(struct Volume *volume, struct ExtentMap *map,
+                    uint64_t file_size) {
+  uint64_t block_end = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+  zero_file_range(volume, map, file_size, block_end);
+}
+
+// Compressed chunks
+//
+// On a volume mounted with SFS_MOUNT_COMPRESS, delayed blocks that fill a
+// whole aligned chunk of COMPRESS_CHUNK_BLOCKS inside the file are
+// compressed with LZ4 when they are flushed, and kept that way if it saves
+// at least a block (see flush_chunks). A compressed chunk is read and
+// decompressed whole, into a CLOCK cache of CHUNK_CACHE_ENTRIES chunks
+// keyed by the chunk's first disk block, so a run of small reads over it
+// decompresses it once; freeing its blocks drops the entry. A write,
+// truncate or punch inside a chunk first expands it back into plain blocks.
+// Chunks are read on any mount; only new ones need the flag.
+
+int chunk_cache_find(struct Volume *volume, uint64_t start) {
+  // Called with chunk_lock held
+  for (int i = 0; i < CHUNK_CACHE_ENTRIES; i++) {
+    if (volume->chunk_cache[i].valid && volume->chunk_cache[i].start == start) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void chunk_cache_insert(struct Volume *volume, uint64_t start, char *data) {
+  // Takes over data, a decompressed chunk
+  pthread_mutex_lock(&volume->chunk_lock);
+  if (chunk_cache_find(volume, start) >= 0) {
+    // Another reader got there first
+    pthread_mutex_unlock(&volume->chunk_lock);
+    free(data);
+    return;
+  }
+  struct ChunkCacheEntry *entry;
+  while (true) {
+    entry = &volume->chunk_cache[volume->chunk_hand];
+    volume->chunk_hand = (volume->chunk_hand + 1) % CHUNK_CACHE_ENTRIES;
+    if (!entry->valid || !entry->referenced) {
+      break;
+    }
+    entry->referenced = false;
+  }
+  if (!entry->valid) {
+    __atomic_fetch_add(&volume->chunks_cached, 1, __ATOMIC_RELAXED);
+  }
+  free(entry->data);
+  entry->data = data;
+  entry->start = start;
+  entry->valid = true;
+  entry->referenced = true;
+  pthread_mutex_unlock(&volume->chunk_lock);
+}
+
+void chunk_cache_drop(struct Volume *volume, uint64_t start, uint32_t count) {
+  // Forgets the chunks stored from blocks in [start, start + count)
+  if (__atomic_load_n(&volume->chunks_cached, __ATOMIC_RELAXED) == 0) {
+    return;
+  }
+  pthread_mutex_lock(&volume->chunk_lock);
+  for (int i = 0; i < CHUNK_CACHE_ENTRIES; i++) {
+    struct ChunkCacheEntry *entry = &volume->chunk_cache[i];
+    if (entry->valid && entry->start >= start &&
+        entry->start < start + count) {
+      entry->valid = false;
+      __atomic_fetch_sub(&volume->chunks_cached, 1, __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&volume->chunk_lock);
+}
+
+void chunk_cache_destroy(struct Volume *volume) {
+  for (int i = 0; i < CHUNK_CACHE_ENTRIES; i++) {
+    free(volume->chunk_cache[i].data);
+    volume->chunk_cache[i].data = NULL;
+    volume->chunk_cache[i].valid = false;
+  }
+  volume->chunks_cached = 0;
+}
+
+bool unpack_chunk(struct Volume *volume, struct Extent *extent, char *chunk) {
+  // Reads and decompresses a whole chunk; false, with checksum_failed set,
+  // if its blocks or its contents are damaged
+  uint32_t stored = extent_stored(extent);
+  char *packed = malloc((size_t)stored * BLOCK_SIZE);
+  if (packed == NULL) {
+    printf("ERROR: Could not allocate memory for a compressed chunk\n");
+    checksum_failed = true;
+    return false;
+  }
+  bool failed = checksum_failed;
+  checksum_failed = false;
+  read_blocks(volume, packed, extent->start, stored);
+
+  struct ChunkHeader header;
+  memcpy(&header, packed, sizeof(header));
+  int chunk_size = COMPRESS_CHUNK_BLOCKS * BLOCK_SIZE;
+  bool intact = !checksum_failed;
+  if (intact &&
+      (header.magic != CHUNK_MAGIC ||
+       header.length > (size_t)stored * BLOCK_SIZE - sizeof(header) ||
+       sfs_lz4_decompress(packed + sizeof(header), header.length, chunk,
+                          chunk_size) != chunk_size)) {
+    printf("ERROR: Compressed chunk at block %llu is damaged\n",
+           (unsigned long long)extent->start);
+    intact = false;
+  }
+  free(packed);
+  checksum_failed = failed || !intact;
+  return intact;
+}
+
+void read_chunk_range(struct Volume *volume, struct Extent *extent,
+                      uint32_t offset, char *buffer, uint32_t size) {
+  // Copies size bytes from offset into a compressed chunk. A damaged chunk
+  // reads as zeros and fails the read, like a block failing its checksum.
+  pthread_mutex_lock(&volume->chunk_lock);
+  int index = chunk_cache_find(volume, extent->start);
+  if (index >= 0) {
+    struct ChunkCacheEntry *entry = &volume->chunk_cache[index];
+    entry->referenced = true;
+    memcpy(buffer, entry->data + offset, size);
+    pthread_mutex_unlock(&volume->chunk_lock);
+    stat_add(&volume->cache_stats.chunk_hits, 1);
+    return;
+  }
+  pthread_mutex_unlock(&volume->chunk_lock);
+  stat_add(&volume->cache_stats.chunk_misses, 1);
+
+  char *chunk = malloc((size_t)COMPRESS_CHUNK_BLOCKS * BLOCK_SIZE);
+  if (chunk == NULL || !unpack_chunk(volume, extent, chunk)) {
+    if (chunk == NULL) {
+      printf("ERROR: Could not allocate memory for a compressed chunk\n");
+      checksum_failed = true;
+    }
+    memset(buffer, 0, size);
+    free(chunk);
+    return;
+  }
+  memcpy(buffer, chunk + offset, size);
+  chunk_cache_insert(volume, extent->start, chunk);
+}
+
+int expand_chunks(struct Volume *volume, struct ExtentMap *map,
+                  uint32_t first, uint32_t end) {
+  // Turns the compressed chunks holding any of logical blocks [first, end)
+  // back into plain blocks, ahead of a change inside them. Nothing changes
+  // for a chunk that can't be read or given blocks.
+  uint32_t index = extent_map_upper(map, first);
+  if (index > 0) {
+    index--;
+  }
+  char *chunk = NULL;
+  int result = 0;
+  while (index < map->count && map->extents[index].logical < end) {
+    struct Extent extent = map->extents[index];
+    if (!extent_compressed(&extent) ||
+        extent.logical + COMPRESS_CHUNK_BLOCKS <= first) {
+      index++;
+      continue;
+    }
+    if (chunk == NULL) {
+      chunk = malloc((size_t)COMPRESS_CHUNK_BLOCKS * BLOCK_SIZE);
+    }
+    bool failed = checksum_failed;
+    if (chunk == NULL || !unpack_chunk(volume, &extent, chunk)) {
+      checksum_failed = failed;
+      printf("ERROR: Couldn't expand the compressed chunk at block %llu\n",
+             (unsigned long long)extent.start);
+      result = -1;
+      break;
+    }
+
+    extent_map_touch(map, index);
+    memmove(&map->extents[index], &map->extents[index + 1],
+            (map->count - index - 1) * sizeof(struct Extent));
+    map->count--;
+    uint32_t last = extent.logical + COMPRESS_CHUNK_BLOCKS - 1;
+    if (extent_map_assign(volume, map, extent.logical, last) < 0) {
+      extent_map_insert(map, extent.logical, extent.start, extent.length);
+      printf("ERROR: Couldn't find free blocks to expand a chunk into\n");
+      result = -1;
+      break;
+    }
+    uint64_t position = (uint64_t)extent.logical * BLOCK_SIZE;
+    file_write_range(volume, map, position, position, chunk,
+                     COMPRESS_CHUNK_BLOCKS * BLOCK_SIZE, NULL);
+    free_blocks(volume, extent.start, extent_stored(&extent));
+    index = extent_map_upper(map, last);
+  }
+  free(chunk);
+  return result;
+}
+
+int split_chunk_at(struct Volume *volume, struct ExtentMap *map,
+                   uint32_t logical) {
+  // Expands a compressed chunk holding both logical - 1 and logical, so the
+  // map can be cut between them
+  int index = extent_map_find(map, logical);
+  if (index < 0 || !extent_compressed(&map->extents[index]) ||
+      map->extents[index].logical == logical) {
+    return 0;
+  }
+  return expand_chunks(volume, map, logical, logical + 1);
+}
+
+// Delayed allocation
+//
+// Appended data past a file's last mapped block is held in memory, in its
+// extent map, with free blocks reserved for it but none chosen yet. Disk
+// blocks are picked when the data is flushed: by the next journal commit,
+// when the file's delayed blocks reach DELAYED_MAX_BLOCKS or the volume's
+// DELAYED_TOTAL_BLOCKS, and before any other kind of write to the file.
+// All of a file's delayed blocks then get one run where the free space
+// allows, so a file written in small pieces among others stays contiguous.
+// Reads copy delayed blocks from memory. Callers hold the file lock
+// exclusively, except for reads.
+
+uint32_t extent_map_end(struct ExtentMap *map) {
+  // Logical block after the last mapped one
+  if (map->count == 0) {
+    return 0;
+  }
+  struct Extent *last = &map->extents[map->count - 1];
+  return last->logical + extent_blocks(last);
+}
+
+void drop_delayed_blocks(struct Volume *volume, struct ExtentMap *map) {
+  // Forgets the delayed blocks and gives back their reservation
+  if (map->delayed_count == 0) {
+    return;
+  }
+  unreserve_blocks(volume, map->delayed_count);
+  __atomic_fetch_sub(&volume->delayed_blocks, map->delayed_count,
+                     __ATOMIC_RELAXED);
+  free(map->delayed);
+  map->delayed = NULL;
+  map->delayed_count = 0;
+}
+
+uint32_t pack_chunk(char *chunk, char *packed) {
+  // Compresses a chunk into packed behind its header, padding the last
+  // block with zeros. Returns the blocks it takes, 0 if it saves none.
+  int capacity = (COMPRESS_CHUNK_BLOCKS - 1) * BLOCK_SIZE -
+                 (int)sizeof(struct ChunkHeader);
+  int length = sfs_lz4_compress(chunk, COMPRESS_CHUNK_BLOCKS * BLOCK_SIZE,
+                                packed + sizeof(struct ChunkHeader), capacity);
+  if (length == 0) {
+    return 0;
+  }
+  struct ChunkHeader header = {CHUNK_MAGIC, length};
+  memcpy(packed, &header, sizeof(header));
+  size_t bytes = sizeof(header) + length;
+  uint32_t blocks = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  memset(packed + bytes, 0, (size_t)blocks * BLOCK_SIZE - bytes);
+  return blocks;
+}
+
+int flush_chunks(struct Volume *volume, struct ExtentMap *map,
+                 uint64_t file_size) {
+  // flush_delayed_blocks on a compressing mount. The delayed blocks are cut
+  // at chunk boundaries; whole chunks inside the file go to disk packed
+  // where that saves blocks, the rest as they are. Every piece gets its
+  // blocks in turn, so they follow each other on disk while the free space
+  // allows, and physically adjacent pieces are written together. A packed
+  // chunk that can't get one run is stored as it is instead.
+  uint32_t first = map->delayed_first;
+  uint32_t count = map->delayed_count;
+  uint32_t end = first + count;
+  char *packed = malloc((size_t)count * BLOCK_SIZE);
+  if (packed == NULL) {
+    printf("ERROR: Could not allocate memory for compression\n");
+    return -1;
+  }
+  struct ExtentMap runs;
+  extent_map_init(&runs);
+  uint32_t allocated = 0;
+  int result = 0;
+
+  for (uint32_t logical = first; result == 0 && logical < end;) {
+    uint32_t piece_end =
+        (logical / COMPRESS_CHUNK_BLOCKS + 1) * COMPRESS_CHUNK_BLOCKS;
+    if (piece_end > end) {
+      piece_end = end;
+    }
+    size_t offset = (size_t)(logical - first) * BLOCK_SIZE;
+    uint32_t stored = 0;
+    if (piece_end - logical == COMPRESS_CHUNK_BLOCKS &&
+        (uint64_t)piece_end * BLOCK_SIZE <= file_size) {
+      stored = pack_chunk(map->delayed + offset, packed + offset);
+    }
+
+    uint32_t done = 0;
+    if (stored > 0) {
+      uint64_t start;
+      uint32_t length = allocate_blocks(volume, stored, &start, true);
+      allocated += length;
+      if (length == stored) {
+        result = extent_map_insert(&runs, logical, start,
+                                   stored | EXTENT_COMPRESSED);
+        if (result < 0) {
+          unallocate_blocks(volume, start, length);
+        }
+        logical = piece_end;
+        continue;
+      }
+      // Too fragmented for the packed chunk: what was found starts the
+      // plain copy
+      if (length > 0) {
+        result = extent_map_insert(&runs, logical, start, length);
+        if (result < 0) {
+          unallocate_blocks(volume, start, length);
+        }
+      }
+      done = length;
+    }
+    while (result == 0 && logical + done < piece_end) {
+      uint64_t start;
+      uint32_t length = allocate_blocks(volume, piece_end - logical - done,
+                                        &start, true);
+      allocated += length;
+      if (length == 0) {
+        result = -1;
+        break;
+      }
+      result = extent_map_insert(&runs, logical + done, start, length);
+      if (result < 0) {
+        unallocate_blocks(volume, start, length);
+      }
+      done += length;
+    }
+    logical = piece_end;
+  }
+  if (result == 0) {
+    result = extent_map_reserve(map, map->count + runs.count);
+  }
+  if (result < 0) {
+    // The delayed blocks stay as they were, reservation included, for the
+    // next flush to try again
+    for (uint32_t i = 0; i < runs.count; i++) {
+      unallocate_blocks(volume, runs.extents[i].start,
+                        extent_stored(&runs.extents[i]));
+    }
+    extent_map_free(&runs);
+    free(packed);
+    printf("ERROR: Couldn't find blocks for delayed data\n");
+    return -1;
+  }
+  unreserve_blocks(volume, count - allocated);
+
+  // Write runs of physically adjacent pieces, copying them together first
+  // when there is more than one
+  for (uint32_t i = 0; i < runs.count;) {
+    uint32_t blocks = extent_stored(&runs.extents[i]);
+    uint32_t next = i + 1;
+    while (next < runs.count &&
+           runs.extents[next].start == runs.extents[i].start + blocks) {
+      blocks += extent_stored(&runs.extents[next]);
+      next++;
+    }
+    char *image = NULL;
+    if (next > i + 1) {
+      image = malloc((size_t)blocks * BLOCK_SIZE);
+    }
+    for (uint32_t j = i; j < next; j++) {
+      struct Extent *extent = &runs.extents[j];
+      char *data = (extent_compressed(extent) ? packed : map->delayed) +
+                   (size_t)(extent->logical - first) * BLOCK_SIZE;
+      uint32_t stored = extent_stored(extent);
+      if (image != NULL) {
+        memcpy(image + (extent->start - runs.extents[i].start) * BLOCK_SIZE,
+               data, (size_t)stored * BLOCK_SIZE);
+      } else {
+        write_blocks(volume, data, extent->start, stored);
+      }
+    }
+    if (image != NULL) {
+      write_blocks(volume, image, runs.extents[i].start, blocks);
+      free(image);
+    }
+    i = next;
+  }
+  for (uint32_t i = 0; i < runs.count; i++) {
+    extent_map_insert(map, runs.extents[i].logical, runs.extents[i].start,
+                      runs.extents[i].length);
+  }
+  extent_map_free(&runs);
+  free(packed);
+
+  __atomic_fetch_sub(&volume->delayed_blocks, count, __ATOMIC_RELAXED);
+  free(map->delayed);
+  map->delayed = NULL;
+  map->delayed_count = 0;
+  return 0;
+}
+
+int flush_delayed_blocks(struct Volume *volume, struct ExtentMap *map,
+                         uint64_t file_size) {
+  // Gives the delayed blocks disk blocks against their reservation, in as
+  // few runs as the free space allows, and writes them out in one go
+  if (map->delayed_count == 0) {
+    return 0;
+  }
+  if (volume->compress) {
+    return flush_chunks(volume, map, file_size);
+  }
+  uint32_t first = map->delayed_first;
+  uint32_t count = map->delayed_count;
+  struct ExtentMap runs;
+  extent_map_init(&runs);
+  int result = 0;
+  for (uint32_t done = 0; result == 0 && done < count;) {
+    uint64_t start;
+    uint32_t length = allocate_blocks(volume, count - done, &start, true);
+    if (length == 0) {
+      result = -1;
+      break;
+    }
+    result = extent_map_insert(&runs, first + done, start, length);
+    if (result < 0) {
+      unallocate_blocks(volume, start, length);
+    }
+    done += length;
+  }
+  if (result == 0) {
+    result = extent_map_reserve(map, map->count + runs.count);
+  }
+  if (result < 0) {
+    // The delayed blocks stay as they were, reservation included, for the
+    // next flush to try again
+    for (uint32_t i = 0; i < runs.count; i++) {
+      unallocate_blocks(volume, runs.extents[i].start,
+                        runs.extents[i].length);
+    }
+    extent_map_free(&runs);
+    printf("ERROR: Couldn't find blocks for delayed data\n");
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < runs.count; i++) {
+    extent_map_insert(map, runs.extents[i].logical, runs.extents[i].start,
+                      runs.extents[i].length);
+  }
+  extent_map_free(&runs);
+  uint64_t position = (uint64_t)first * BLOCK_SIZE;
+  file_write_range(volume, map, position, position, map->delayed,
+                   file_size - position, NULL);
+
+  __atomic_fetch_sub(&volume->delayed_blocks, count, __ATOMIC_RELAXED);
+  free(map->delayed);
+  map->delayed = NULL;
+  map->delayed_count = 0;
+  return 0;
+}
+
+int append_delayed(struct Volume *volume, struct ExtentMap *map,
+                   uint64_t position, char *data, uint32_t size) {
+  // Takes bytes appended at position, which lies past the mapped blocks or
+  // in the delayed ones, into memory and returns 1. Returns 0 if they are
+  // to be written now instead, with any delayed blocks flushed first, and
+  // -1 if those could not be.
+  uint32_t first = position / BLOCK_SIZE;
+  uint32_t last = (position + size - 1) / BLOCK_SIZE;
+  if (map->delayed_count == 0) {
+    map->delayed_first = first;
+  }
+  uint32_t count = last - map->delayed_first + 1;
+  uint32_t added = count - map->delayed_count;
+  bool fits = extent_map_end(map) <= map->delayed_first &&
+              first >= map->delayed_first && count <= DELAYED_MAX_BLOCKS &&
+              __atomic_load_n(&volume->delayed_blocks, __ATOMIC_RELAXED) +
+                      added <=
+                  DELAYED_TOTAL_BLOCKS;
+  char *grown = NULL;
+  if (fits && added > 0) {
+    grown = realloc(map->delayed, (size_t)count * BLOCK_SIZE);
+    if (grown != NULL && !reserve_blocks(volume, added)) {
+      map->delayed = grown;
+      grown = NULL;
+    }
+    if (grown == NULL) {
+      fits = false;
+    }
+  }
+  if (!fits) {
+    return flush_delayed_blocks(volume, map, position) < 0 ? -1 : 0;
+  }
+
+  if (added > 0) {
+    map->delayed = grown;
+    memset(map->delayed + (size_t)map->delayed_count * BLOCK_SIZE, 0,
+           (size_t)added * BLOCK_SIZE);
+    map->delayed_count = count;
+    __atomic_fetch_add(&volume->delayed_blocks, added, __ATOMIC_RELAXED);
+  }
+  memcpy(map->delayed + (position - (uint64_t)map->delayed_first * BLOCK_SIZE),
+         data, size);
+  return 1;
+}
+
+int write_file_end(struct Volume *volume, struct ExtentMap *map,
+                   uint64_t file_size, char *data, uint32_t size) {
+  // Appends to a file kept in blocks. The part that fits in a partly filled
+  // last block that is mapped goes straight into its cached copy, and the
+  // rest into delayed blocks. What is too large for those gets blocks now,
+  // one contiguous run for all of it, written from the caller's buffer.
+  // A compressing mount only compresses delayed blocks, so there large
+  // appends go through them in pieces.
+  uint32_t tail_offset = file_size % BLOCK_SIZE;
+  int index = extent_map_find(map, file_size / BLOCK_SIZE);
+  if (tail_offset != 0 && index >= 0 &&
+      extent_compressed(&map->extents[index])) {
+    // Left over from a truncate into the chunk
+    if (expand_chunks(volume, map, file_size / BLOCK_SIZE,
+                      file_size / BLOCK_SIZE + 1) < 0) {
+      return -1;
+    }
+    index = extent_map_find(map, file_size / BLOCK_SIZE);
+  }
+  if (tail_offset != 0 && index >= 0) {
+    struct Extent *extent = &map->extents[index];
+    uint32_t piece = min(BLOCK_SIZE - tail_offset, size);
+    write_partial_block(volume,
+                        extent->start + (file_size / BLOCK_SIZE -
+                                         extent->logical),
+                        tail_offset, data, piece, false);
+    file_size += piece;
+    data += piece;
+    size -= piece;
+  }
+  while (volume->compress && size > DELAYED_MAX_BLOCKS / 2 * BLOCK_SIZE) {
+    uint32_t piece = DELAYED_MAX_BLOCKS / 2 * BLOCK_SIZE;
+    // A piece that doesn't fit flushes the others, and then should
+    int taken = append_delayed(volume, map, file_size, data, piece);
+    if (taken == 0) {
+      taken = append_delayed(volume, map, file_size, data, piece);
+    }
+    if (taken < 0) {
+      return -1;
+    }
+    if (taken == 0) {
+      break;
+    }
+    file_size += piece;
+    data += piece;
+    size -= piece;
+  }
+  int taken = size > 0 ? append_delayed(volume, map, file_size, data, size)
+                       : 1;
+  if (taken != 0) {
+    return taken < 0 ? -1 : 0;
+  }
+
+  if (extent_map_assign(volume, map, file_size / BLOCK_SIZE,
+                        (file_size + size - 1) / BLOCK_SIZE) < 0) {
+    printf("No free blocks available\n");
+    return -1;
+  }
+  file_write_range(volume, map, file_size, file_size, data, size, NULL);
+  return 0;
+}
+
+// Small files
+//
+// A file of up to INLINE_DATA_SIZE bytes keeps its data in its inode, in
+// place of the inline extents, so it is journaled and read with the inode.
+// One of up to TAIL_MAX_SIZE bytes takes a run of TAIL_FRAGMENT_SIZE
+// fragments in a tail block that it shares with other small files. Writes
+// move a file between the two as its size changes; past TAIL_MAX_SIZE it
+// moves into blocks of its own for good. Only a file without blocks starts
+// out small.
+//
+// Which fragments are taken is known from the inodes alone. The tail table,
+// a hash from each tail block to its fragment masks, is built by the first
+// call that needs it from the inode table below its high-water mark. Freed
+// fragments, like freed blocks, are not reused before the commit recording
+// the free is durable, and a tail block is freed with its last fragment.
+
+int tail_bucket(struct Volume *volume, uint64_t block) {
+  return (block * 11400714819323198485ull) >> 32 &
+         (volume->tail_capacity - 1);
+}
+
+void free_tail_blocks(struct Volume *volume) {
+  free(volume->tail_blocks);
+  free(volume->tail_buckets);
+  free(volume->tail_frees);
+  volume->tail_blocks = NULL;
+  volume->tail_buckets = NULL;
+  volume->tail_frees = NULL;
+  volume->tail_capacity = 0;
+  volume->tail_free_count = 0;
+  volume->tail_free_capacity = 0;
+  volume->tails_loaded = false;
+}
+
+// The helpers below expect the tail lock to be held
+
+int tail_find(struct Volume *volume, uint64_t block) {
+  // Entry of a tail block, or -1
+  if (volume->tail_capacity == 0) {
+    return -1;
+  }
+  for (int i = volume->tail_buckets[tail_bucket(volume, block)]; i != -1;
+       i = volume->tail_blocks[i].next) {
+    if (volume->tail_blocks[i].block == block) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int tail_grow(struct Volume *volume) {
+  // Doubles the table, rehashing every entry in use
+  int capacity = volume->tail_capacity > 0 ? volume->tail_capacity * 2 : 64;
+  struct TailBlock *blocks =
+      realloc(volume->tail_blocks, capacity * sizeof(struct TailBlock));
+  int *buckets = malloc(capacity * sizeof(int));
+  if (blocks == NULL || buckets == NULL) {
+    if (blocks != NULL) {
+      volume->tail_blocks = blocks;
+    }
+    free(buckets);
+    printf("ERROR: Could not grow the tail table\n");
+    return -1;
+  }
+  int old_capacity = volume->tail_capacity;
+  volume->tail_blocks = blocks;
+  free(volume->tail_buckets);
+  volume->tail_buckets = buckets;
+  volume->tail_capacity = capacity;
+  for (int i = 0; i < capacity; i++) {
+    buckets[i] = -1;
+  }
+
+  // Entries in use keep their index; the free list takes the rest
+  volume->tail_free_entry = -1;
+  for (int i = capacity - 1; i >= 0; i--) {
+    struct TailBlock *entry = &blocks[i];
+    if (i >= old_capacity || entry->used == 0) {
+      entry->used = 0;
+      entry->next = volume->tail_free_entry;
+      volume->tail_free_entry = i;
+      continue;
+    }
+    int bucket = tail_bucket(volume, entry->block);
+    entry->next = buckets[bucket];
+    buckets[bucket] = i;
+  }
+  return 0;
+}
+
+int tail_add(struct Volume *volume, uint64_t block) {
+  // New entry for a tail block with no fragments taken yet
+  if (volume->tail_capacity == 0 || volume->tail_free_entry == -1) {
+    if (tail_grow(volume) < 0) {
+      return -1;
+    }
+  }
+  int index = volume->tail_free_entry;
+  struct TailBlock *entry = &volume->tail_blocks[index];
+  volume->tail_free_entry = entry->next;
+  int bucket = tail_bucket(volume, block);
+  entry->block = block;
+  entry->used = 0;
+  entry->pending = 0;
+  entry->next = volume->tail_buckets[bucket];
+  volume->tail_buckets[bucket] = index;
+  return index;
+}
+
+void tail_drop(struct Volume *volume, int index) {
+  struct TailBlock *entry = &volume->tail_blocks[index];
+  int *link = &volume->tail_buckets[tail_bucket(volume, entry->block)];
+  while (*link != index) {
+    link = &volume->tail_blocks[*link].next;
+  }
+  *link = entry->next;
+  entry->used = 0;
+  entry->next = volume->tail_free_entry;
+  volume->tail_free_entry = index;
+  if (volume->tail_hint == index) {
+    volume->tail_hint = -1;
+  }
+}
+
+uint32_t tail_mask(uint32_t first, uint32_t count) {
+  return (uint32_t)(((uint64_t)1 << (first + count)) - ((uint64_t)1 << first));
+}
+
+int tail_fit(struct TailBlock *entry, uint32_t count) {
+  // First fragment of a free run of count in the block, or -1
+  uint32_t taken = entry->used | entry->pending;
+  for (uint32_t first = 0; first + count <= TAIL_FRAGMENTS; first++) {
+    if ((taken & tail_mask(first, count)) == 0) {
+      return first;
+    }
+  }
+  return -1;
+}
+
+int tail_free_fragments(struct TailBlock *entry) {
+  return TAIL_FRAGMENTS - __builtin_popcount(entry->used | entry->pending);
+}
+
+int load_tail_blocks(struct Volume *volume) {
+  // Builds the tail table on first use. Callers hold the directory lock,
+  // which keeps creates and deletes out, and no file lock; no file changes
+  // its layout before the table exists.
+  if (__atomic_load_n(&volume->tails_loaded, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  pthread_mutex_lock(&volume->tail_lock);
+  if (volume->tails_loaded) {
+    pthread_mutex_unlock(&volume->tail_lock);
+    return 0;
+  }
+  pthread_mutex_lock(&volume->fault_lock);
+  fault_blocks(volume, volume->superblock.inode_start,
+               volume->superblock.inode_start +
+                   ((size_t)volume->inodes_used * sizeof(struct Inode) - 1) /
+                       BLOCK_SIZE);
+  pthread_mutex_unlock(&volume->fault_lock);
+
+  volume->tail_hint = -1;
+  for (int i = 0; i < volume->inodes_used; i++) {
+    struct Inode *inode = &volume->inodes[i];
+    if (inode->used != USED_FLAG || inode->type != INODE_FILE ||
+        inode->layout != FILE_DATA_TAIL) {
+      continue;
+    }
+    int index = tail_find(volume, inode->tail.block);
+    if (index == -1) {
+      index = tail_add(volume, inode->tail.block);
+    }
+    if (index == -1) {
+      free_tail_blocks(volume);
+      pthread_mutex_unlock(&volume->tail_lock);
+      return -1;
+    }
+    volume->tail_blocks[index].used |=
+        tail_mask(inode->tail.first, inode->tail.count);
+  }
+  __atomic_store_n(&volume->tails_loaded, true, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&volume->tail_lock);
+  return 0;
+}
+
+int tail_allocate(struct Volume *volume, char *data, uint32_t size,
+                  struct TailRef *ref) {
+  // Takes a run of fragments for size bytes of data and writes them, into
+  // the hint block if it has room and otherwise into a new tail block. A
+  // new block is zeroed around the data before another file can take
+  // fragments of it, as that file writes its own in place.
+  uint32_t count = (size + TAIL_FRAGMENT_SIZE - 1) / TAIL_FRAGMENT_SIZE;
+  pthread_mutex_lock(&volume->tail_lock);
+  int index = volume->tail_hint;
+  int first = index != -1 ? tail_fit(&volume->tail_blocks[index], count) : -1;
+  bool fresh = first == -1;
+  if (fresh) {
+    int64_t block = find_empty_block(volume);
+    index = block != -1 ? tail_add(volume, block) : -1;
+    if (index == -1) {
+      if (block != -1) {
+        free_block(volume, block);
+      }
+      pthread_mutex_unlock(&volume->tail_lock);
+      printf("ERROR: Couldn't find a free block for small files\n");
+      return -1;
+    }
+    write_partial_block(volume, block, 0, data, size, true);
+    volume->tail_hint = index;
+    first = 0;
+  }
+  struct TailBlock *entry = &volume->tail_blocks[index];
+  entry->used |= tail_mask(first, count);
+  ref->block = entry->block;
+  ref->first = first;
+  ref->count = count;
+  pthread_mutex_unlock(&volume->tail_lock);
+  if (!fresh) {
+    write_partial_block(volume, ref->block, ref->first * TAIL_FRAGMENT_SIZE,
+                        data, size, false);
+  }
+  return 0;
+}
+
+bool tail_extend(struct Volume *volume, struct TailRef *ref, uint32_t count) {
+  // Grows a run in place when the fragments after it are free
+  pthread_mutex_lock(&volume->tail_lock);
+  struct TailBlock *entry = &volume->tail_blocks[tail_find(volume, ref->block)];
+  uint32_t more = tail_mask(ref->first + ref->count, count - ref->count);
+  bool extended = ref->first + count <= TAIL_FRAGMENTS &&
+                  ((entry->used | entry->pending) & more) == 0;
+  if (extended) {
+    entry->used |= more;
+    ref->count = count;
+  }
+  pthread_mutex_unlock(&volume->tail_lock);
+  return extended;
+}
+
+void tail_release(struct Volume *volume, uint64_t block, uint32_t first,
+                  uint32_t count) {
+  // Frees fragments; the block goes with its last one
+  pthread_mutex_lock(&volume->tail_lock);
+  int index = tail_find(volume, block);
+  struct TailBlock *entry = &volume->tail_blocks[index];
+  uint32_t mask = tail_mask(first, count);
+  entry->used &= ~mask;
+  if (entry->used == 0) {
+    free_block(volume, block);
+    tail_drop(volume, index);
+    pthread_mutex_unlock(&volume->tail_lock);
+    return;
+  }
+
+  if (volume->tail_free_count == volume->tail_free_capacity) {
+    int capacity = volume->tail_free_capacity * 2 + 16;
+    struct TailFree *grown =
+        realloc(volume->tail_frees, capacity * sizeof(struct TailFree));
+    if (grown == NULL) {
+      // The fragments are lost to this mount; a remount finds them free
+      printf("ERROR: Could not record freed fragments\n");
+      entry->pending |= mask;
+      pthread_mutex_unlock(&volume->tail_lock);
+      return;
+    }
+    volume->tail_frees = grown;
+    volume->tail_free_capacity = capacity;
+  }
+  struct TailFree *freed = &volume->tail_frees[volume->tail_free_count++];
+  freed->block = block;
+  freed->fragments = mask;
+  entry->pending |= mask;
+  pthread_mutex_unlock(&volume->tail_lock);
+}
+
+void release_tail_fragments(struct Volume *volume, struct TailFree *frees,
+                            int free_count) {
+  // Makes fragments whose free has been committed reusable. The block with
+  // the most room afterwards is where new fragments go first.
+  pthread_mutex_lock(&volume->tail_lock);
+  for (int i = 0; i < free_count; i++) {
+    int index = tail_find(volume, frees[i].block);
+    if (index == -1) {
+      continue; // freed whole since
+    }
+    struct TailBlock *entry = &volume->tail_blocks[index];
+    entry->pending &= ~frees[i].fragments;
+    if (volume->tail_hint == -1 ||
+        tail_free_fragments(entry) >
+            tail_free_fragments(&volume->tail_blocks[volume->tail_hint])) {
+      volume->tail_hint = index;
+    }
+  }
+  pthread_mutex_unlock(&volume->tail_lock);
+}
+
+bool file_is_small(struct Inode *entry) {
+  return entry->layout != FILE_DATA_EXTENTS;
+}
+
+bool file_may_become_small(struct Inode *entry) {
+  // Whether a write could need the tail table
+  return entry->layout != FILE_DATA_EXTENTS || entry->size == 0;
+}
+
+int lock_file_for_write(struct Volume *volume, struct Inode *entry) {
+  // Takes the file lock exclusively, having loaded the tail table first if
+  // a write could need it. Caller holds the directory lock.
+  pthread_rwlock_wrlock(file_lock(volume, entry));
+  if (file_may_become_small(entry) &&
+      !__atomic_load_n(&volume->tails_loaded, __ATOMIC_ACQUIRE)) {
+    pthread_rwlock_unlock(file_lock(volume, entry));
+    if (load_tail_blocks(volume) < 0) {
+      return -1;
+    }
+    pthread_rwlock_wrlock(file_lock(volume, entry));
+  }
+  return 0;
+}
+
+void release_small_data(struct Volume *volume, struct Inode *entry) {
+  if (entry->layout == FILE_DATA_TAIL) {
+    tail_release(volume, entry->tail.block, entry->tail.first,
+                 entry->tail.count);
+  }
+  memset(entry->data, 0, INLINE_DATA_SIZE);
+  entry->layout = FILE_DATA_EXTENTS;
+}
+
+void small_read(struct Volume *volume, struct Inode *entry,
+                uint64_t position, char *buffer, uint32_t size) {
+  if (entry->layout == FILE_DATA_INLINE) {
+    memcpy(buffer, entry->data + position, size);
+    return;
+  }
+  char block[BLOCK_SIZE];
+  read_block(volume, block, entry->tail.block);
+  memcpy(buffer, block + entry->tail.first * TAIL_FRAGMENT_SIZE + position,
+         size);
+}
+
+int promote_small_file(struct Volume *volume, struct Inode *entry,
+                       struct ExtentMap *map) {
+  // Moves a small file's data into blocks of its own, as delayed data
+  // where it can
+  char data[TAIL_MAX_SIZE];
+  uint64_t size = entry->size;
+  if (!file_is_small(entry)) {
+    return 0;
+  }
+  if (size > 0) {
+    small_read(volume, entry, 0, data, size);
+    int taken = append_delayed(volume, map, 0, data, size);
+    if (taken < 0) {
+      return -1;
+    }
+    if (taken == 0) {
+      if (extent_map_assign(volume, map, 0, (size - 1) / BLOCK_SIZE) < 0) {
+        printf("ERROR: Couldn't find a free block to assign to file\n");
+        return -1;
+      }
+      file_write_range(volume, map, 0, 0, data, size, NULL);
+    }
+  }
+  release_small_data(volume, entry);
+  return 0;
+}
+
+int small_write(struct Volume *volume, struct Inode *entry,
+                struct ExtentMap *map, uint64_t position, char *buffer,
+                uint32_t size, uint64_t new_size) {
+  // Writes [position, position + size) of a file that is to end up
+  // new_size bytes long, if it is or can become small. Returns 1 once
+  // written, 0 if the caller is to write it through the extent map, which
+  // is all set up for that, and -1 on failure. Caller holds the file lock
+  // exclusively, and the tail table is loaded if file_may_become_small.
+  if (entry->layout == FILE_DATA_EXTENTS &&
+      (entry->size > 0 || map->count > 0)) {
+    return 0;
+  }
+  uint32_t fragments =
+      (new_size + TAIL_FRAGMENT_SIZE - 1) / TAIL_FRAGMENT_SIZE;
+
+  // Rewrites that keep the file where it is change just the new bytes
+  if (entry->layout == FILE_DATA_INLINE && new_size <= INLINE_DATA_SIZE) {
+    memcpy(entry->data + position, buffer, size);
+    memset(entry->data + new_size, 0, INLINE_DATA_SIZE - new_size);
+    return 1;
+  }
+  if (entry->layout == FILE_DATA_TAIL && new_size > INLINE_DATA_SIZE &&
+      new_size <= TAIL_MAX_SIZE && position <= entry->size &&
+      (fragments <= entry->tail.count ||
+       tail_extend(volume, &entry->tail, fragments))) {
+    write_partial_block(volume, entry->tail.block,
+                        entry->tail.first * TAIL_FRAGMENT_SIZE + position,
+                        buffer, size, false);
+    if (fragments < entry->tail.count) {
+      tail_release(volume, entry->tail.block, entry->tail.first + fragments,
+                   entry->tail.count - fragments);
+      entry->tail.count = fragments;
+    }
+    return 1;
+  }
+
+  // Into blocks of its own, with the caller writing the new bytes
+  if (new_size > TAIL_MAX_SIZE) {
+    return promote_small_file(volume, entry, map);
+  }
+
+  // Otherwise the data moves: gather what is kept and lay the write over
+  // it, with zeros in any gap between them
+  char data[TAIL_MAX_SIZE];
+  uint64_t kept = entry->size < new_size ? entry->size : new_size;
+  if (kept > 0) {
+    small_read(volume, entry, 0, data, kept);
+  }
+  if (position > kept) {
+    memset(data + kept, 0, position - kept);
+  }
+  memcpy(data + position, buffer, size);
+  if (new_size <= INLINE_DATA_SIZE) {
+    release_small_data(volume, entry);
+    memcpy(entry->data, data, new_size);
+    entry->layout = FILE_DATA_INLINE;
+    return 1;
+  }
+
+  if (!volume->tails_loaded) {
+    printf("ERROR: Tail table is not loaded\n");
+    return -1;
+  }
+  struct TailRef ref;
+  if (tail_allocate(volume, data, new_size, &ref) < 0) {
+    return -1;
+  }
+  release_small_data(volume, entry);
+  entry->tail = ref;
+  entry->layout = FILE_DATA_TAIL;
+  return 1;
+}
+
+// Directories
+//
+// A directory is an inode of type INODE_DIRECTORY; inode ROOT_INODE is the
+// root. Its entries live in a B+tree of DirectoryKeys whose root block is
+// the directory's extent_root; the names themselves stay in the inodes the
+// keys point at. Leaves that empty out are unlinked from their parents, but
+// nodes are never merged.
+//
+// The tree is copy-on-write like the extent trees: until the next commit
+// the committed inode still points at the old root, so a node the last
+// commit had allocated moves to a new block the first time it changes,
+// along with the path above it. Later changes in the same transaction
+// update the copies in place. Callers hold the directory lock, shared to
+// read a tree and exclusively to change one.
+
+uint32_t hash_filename(const char *filename) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (const unsigned char *c = (const unsigned char *)filename; *c; c++) {
+    hash ^= *c;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void set_file_name(struct Volume *volume, int slot, const char *filename) {
+  // Caller holds the directory lock exclusively and journals the inode
+  struct Inode *inode = &volume->inodes[slot];
+  size_t length = strlen(filename);
+  inode->name_hash = hash_filename(filename);
+  inode->name_length = length;
+  memset(inode->name, 0, INLINE_NAME_SIZE);
+  if (length <= INLINE_NAME_SIZE) {
+    memcpy(inode->name, filename, length);
+    return;
+  }
+  memcpy(inode->name, filename, INLINE_NAME_SIZE);
+  strcpy(long_name_at(volume, slot)->name, filename);
+  volume->names_used = max(volume->names_used, slot + 1);
+  journal_mark_name(volume, slot);
+}
+
+bool file_name_equals(struct Volume *volume, int slot, const char *filename,
+                      size_t length) {
+  struct Inode *inode = &volume->inodes[slot];
+  if (inode->name_length != length) {
+    return false;
+  }
+  if (length <= INLINE_NAME_SIZE) {
+    return memcmp(inode->name, filename, length) == 0;
+  }
+  return memcmp(inode->name, filename, INLINE_NAME_SIZE) == 0 &&
+         strcmp(long_name_at(volume, slot)->name, filename) == 0;
+}
+
+void get_file_name(struct Volume *volume, int slot, char *filename) {
+  // filename must hold MAX_FILENAME_SIZE + 1 bytes
+  struct Inode *inode = &volume->inodes[slot];
+  if (inode->name_length > INLINE_NAME_SIZE) {
+    strcpy(filename, long_name_at(volume, slot)->name);
+    return;
+  }
+  memcpy(filename, inode->name, inode->name_length);
+  filename[inode->name_length] = '\0';
+}
+
+int directory_key_compare(struct DirectoryKey a, struct DirectoryKey b) {
+  if (a.name_hash != b.name_hash) {
+    return a.name_hash < b.name_hash ? -1 : 1;
+  }
+  return a.slot < b.slot ? -1 : a.slot > b.slot;
+}
+
+// Leaves hold keys and branches children; both are handled as arrays of
+// items of the node's kind
+size_t directory_item_size(struct DirectoryNode *node) {
+  return node->level == 0 ? sizeof(struct DirectoryKey)
+                          : sizeof(struct DirectoryChild);
+}
+
+int directory_capacity(struct DirectoryNode *node) {
+  return node->level == 0 ? DIRECTORY_LEAF_KEYS : DIRECTORY_BRANCH_CHILDREN;
+}
+
+char *directory_item(struct DirectoryNode *node, int index) {
+  return (char *)node->keys + index * directory_item_size(node);
+}
+
+struct DirectoryKey directory_low(struct DirectoryNode *node) {
+  return node->level == 0 ? node->keys[0] : node->children[0].low;
+}
+
+void directory_node_insert(struct DirectoryNode *node, int index,
+                           void *item) {
+  size_t size = directory_item_size(node);
+  memmove(directory_item(node, index + 1), directory_item(node, index),
+          (node->count - index) * size);
+  memcpy(directory_item(node, index), item, size);
+  node->count++;
+}
+
+void directory_node_remove(struct DirectoryNode *node, int index) {
+  size_t size = directory_item_size(node);
+  node->count--;
+  memmove(directory_item(node, index), directory_item(node, index + 1),
+          (node->count - index) * size);
+}
+
+void directory_split(struct DirectoryNode *node, struct DirectoryNode *right,
+                     int index, void *item) {
+  // Inserts item into a full node and moves the upper half into right
+  size_t size = directory_item_size(node);
+  char items[BLOCK_SIZE + sizeof(struct DirectoryChild)];
+  int count = node->count + 1;
+  memcpy(items, directory_item(node, 0), index * size);
+  memcpy(items + index * size, item, size);
+  memcpy(items + (index + 1) * size, directory_item(node, index),
+         (node->count - index) * size);
+
+  int left = count / 2;
+  memset(right, 0, BLOCK_SIZE);
+  right->level = node->level;
+  right->count = count - left;
+  memcpy(directory_item(right, 0), items + left * size, right->count * size);
+  node->count = left;
+  memcpy(directory_item(node, 0), items, left * size);
+}
+
+int directory_seek(struct Volume *volume, struct Inode *directory,
+                   struct DirectoryKey key, struct DirectoryPath *path) {
+  // Walks from the root to the leaf where key is or would go, stopping at
+  // the first key not below it. Fails for an empty directory.
+  path->depth = 0;
+  uint64_t block = directory->extent_root;
+  if (block == INVALID_BLOCK_POINTER) {
+    return -1;
+  }
+  while (true) {
+    if (path->depth == DIRECTORY_MAX_DEPTH) {
+      printf("ERROR: Directory tree is too deep\n");
+      return -1;
+    }
+    int d = path->depth++;
+    struct DirectoryNode *node = &path->nodes[d];
+    path->blocks[d] = block;
+    read_block(volume, node, block);
+
+    // Binary search: first key not below key in a leaf, last child whose
+    // lower bound is not above it in a branch
+    int low = node->level == 0 ? 0 : 1, high = node->count;
+    while (low < high) {
+      int mid = (low + high) / 2;
+      int order = node->level == 0
+                      ? directory_key_compare(node->keys[mid], key)
+                      : directory_key_compare(node->children[mid].low, key);
+      if (order < 0 || (order == 0 && node->level != 0)) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    if (node->level == 0) {
+      path->index[d] = low;
+      return 0;
+    }
+    path->index[d] = low - 1;
+    block = node->children[low - 1].block;
+  }
+}
+
+bool directory_entry(struct Volume *volume, struct DirectoryPath *path,
+                     struct DirectoryKey *key) {
+  // The key at the path's position, moving on to the next leaf from the end
+  // of one. Returns false past the last key.
+  if (path->depth == 0) {
+    return false;
+  }
+  int leaf = path->depth - 1;
+  while (path->index[leaf] >= path->nodes[leaf].count) {
+    int d = leaf;
+    do {
+      if (d == 0) {
+        return false;
+      }
+      d--;
+      path->index[d]++;
+    } while (path->index[d] >= path->nodes[d].count);
+    for (; d < leaf; d++) {
+      uint64_t block = path->nodes[d].children[path->index[d]].block;
+      path->blocks[d + 1] = block;
+      read_block(volume, &path->nodes[d + 1], block);
+      path->index[d + 1] = 0;
+    }
+  }
+  *key = path->nodes[leaf].keys[path->index[leaf]];
+  return true;
+}
+
+void directory_next(struct DirectoryPath *path) {
+  path->index[path->depth - 1]++;
+}
+
+int directory_lookup(struct Volume *volume, int directory, const char *name,
+                     uint32_t hash) {
+  // Searches the directory's tree for name. Returns its inode slot, or -1.
+  struct DirectoryPath path;
+  struct DirectoryKey key = {hash, 0};
+  if (directory_seek(volume, inode_at(volume, directory), key, &path) < 0) {
+    return -1;
+  }
+  size_t length = strlen(name);
+  while (directory_entry(volume, &path, &key) && key.name_hash == hash) {
+    inode_at(volume, key.slot);
+    if (file_name_equals(volume, key.slot, name, length)) {
+      return key.slot;
+    }
+    directory_next(&path);
+  }
+  return -1;
+}
+
+bool block_committed(struct Volume *volume, uint64_t block_number) {
+  // Whether the last commit had the block allocated, in which case the
+  // committed metadata may still refer to it
+  bitmap_word(volume, block_number / 64); // faults in the committed copy too
+  return (volume->committed_bitmap[block_number / 64] >>
+          (block_number % 64)) &
+         1;
+}
+
+int directory_allocate(struct Volume *volume, uint64_t *blocks, int count) {
+  // Takes every block a change may need up front, so it either gets them
+  // all or fails before touching the tree
+  for (int i = 0; i < count; i++) {
+    int64_t block = find_empty_block(volume);
+    if (block == -1) {
+      printf("ERROR: Couldn't find a free block for the directory\n");
+      while (i > 0) {
+        free_block(volume, blocks[--i]);
+      }
+      return -1;
+    }
+    blocks[i] = block;
+  }
+  return 0;
+}
+
+int directory_shadow_count(struct Volume *volume, struct DirectoryPath *path) {
+  int count = 0;
+  for (int d = 0; d < path->depth; d++) {
+    count += block_committed(volume, path->blocks[d]);
+  }
+  return count;
+}
+
+void directory_shadow(struct Volume *volume, struct Inode *directory,
+                      struct DirectoryPath *path, uint64_t *spare,
+                      int *used) {
+  // Moves each node on the path that the last commit had onto a spare
+  // block. Parents are repointed in memory; the caller writes the path.
+  for (int d = 0; d < path->depth; d++) {
+    if (!block_committed(volume, path->blocks[d])) {
+      continue;
+    }
+    free_block(volume, path->blocks[d]);
+    path->blocks[d] = spare[(*used)++];
+    if (d == 0) {
+      directory->extent_root = path->blocks[0];
+    } else {
+      path->nodes[d - 1].children[path->index[d - 1]].block = path->blocks[d];
+    }
+  }
+}
+
+int directory_insert(struct Volume *volume, int directory_slot,
+                     struct DirectoryKey key) {
+  struct Inode *directory = inode_at(volume, directory_slot);
+  struct DirectoryPath path;
+  uint64_t spare[2 * DIRECTORY_MAX_DEPTH + 1];
+  int used = 0;
+
+  if (directory->extent_root == INVALID_BLOCK_POINTER) {
+    if (directory_allocate(volume, spare, 1) < 0) {
+      return -1;
+    }
+    struct DirectoryNode *leaf = &path.nodes[0];
+    memset(leaf, 0, BLOCK_SIZE);
+    leaf->count = 1;
+    leaf->keys[0] = key;
+    write_block(volume, leaf, spare[0]);
+    directory->extent_root = spare[0];
+  } else {
+    if (directory_seek(volume, directory, key, &path) < 0) {
+      return -1;
+    }
+
+    // Every full node from the leaf up splits, and a split root gets a new
+    // root above it
+    int splits = 0;
+    while (splits < path.depth &&
+           path.nodes[path.depth - 1 - splits].count ==
+               directory_capacity(&path.nodes[path.depth - 1 - splits])) {
+      splits++;
+    }
+    if (splits == DIRECTORY_MAX_DEPTH) {
+      printf("ERROR: Directory tree is too deep\n");
+      return -1;
+    }
+    if (directory_allocate(volume, spare,
+                           directory_shadow_count(volume, &path) + splits +
+                               (splits == path.depth)) < 0) {
+      return -1;
+    }
+    directory_shadow(volume, directory, &path, spare, &used);
+
+    // A split hands its new right half to the level above
+    struct DirectoryChild carry = {key, 0};
+    for (int d = path.depth - 1; d >= 0; d--) {
+      struct DirectoryNode *node = &path.nodes[d];
+      int index = node->level == 0 ? path.index[d] : path.index[d] + 1;
+      void *item = node->level == 0 ? (void *)&carry.low : (void *)&carry;
+      if (node->count < directory_capacity(node)) {
+        directory_node_insert(node, index, item);
+        break;
+      }
+
+      struct DirectoryNode right;
+      directory_split(node, &right, index, item);
+      carry.low = directory_low(&right);
+      carry.block = spare[used++];
+      write_block(volume, &right, carry.block);
+      if (d == 0) {
+        struct DirectoryNode root;
+        memset(&root, 0, BLOCK_SIZE);
+        root.level = node->level + 1;
+        root.count = 2;
+        root.children[0].low = directory_low(node);
+        root.children[0].block = path.blocks[0];
+        root.children[1] = carry;
+        directory->extent_root = spare[used++];
+        write_block(volume, &root, directory->extent_root);
+      }
+    }
+    for (int d = 0; d < path.depth; d++) {
+      write_block(volume, &path.nodes[d], path.blocks[d]);
+    }
+  }
+
+  directory->size++;
+  directory->last_modified_at = time(NULL);
+  journal_mark_inode(volume, directory_slot);
+  return 0;
+}
+
+int directory_remove(struct Volume *volume, int directory_slot,
+                     struct DirectoryKey key) {
+  struct Inode *directory = inode_at(volume, directory_slot);
+  struct DirectoryPath path;
+  struct DirectoryKey found;
+  uint64_t spare[DIRECTORY_MAX_DEPTH];
+  int used = 0;
+
+  if (directory_seek(volume, directory, key, &path) < 0 ||
+      !directory_entry(volume, &path, &found) ||
+      directory_key_compare(found, key) != 0) {
+    printf("ERROR: Directory does not list the entry\n");
+    return -1;
+  }
+  if (directory_allocate(volume, spare,
+                         directory_shadow_count(volume, &path)) < 0) {
+    return -1;
+  }
+  directory_shadow(volume, directory, &path, spare, &used);
+
+  // Emptied nodes are unlinked from their parents, and a root left with a
+  // single child hands over to it
+  int bottom = path.depth - 1;
+  directory_node_remove(&path.nodes[bottom], path.index[bottom]);
+  while (bottom > 0 && path.nodes[bottom].count == 0) {
+    free_block(volume, path.blocks[bottom]);
+    bottom--;
+    directory_node_remove(&path.nodes[bottom], path.index[bottom]);
+  }
+  int top = 0;
+  if (path.nodes[0].count == 0) {
+    free_block(volume, path.blocks[0]);
+    directory->extent_root = INVALID_BLOCK_POINTER;
+    top = bottom + 1;
+  }
+  while (top < bottom && path.nodes[top].count == 1) {
+    free_block(volume, path.blocks[top]);
+    top++;
+    directory->extent_root = path.blocks[top];
+  }
+  for (int d = top; d <= bottom; d++) {
+    write_block(volume, &path.nodes[d], path.blocks[d]);
+  }
+
+  directory->size--;
+  directory->last_modified_at = time(NULL);
+  journal_mark_inode(volume, directory_slot);
+  return 0;
+}
+
+// Path lookup
+//
+// Paths are '/'-separated from the root directory; a leading slash and
+// repeated slashes are ignored. Every component found is remembered in the
+// dentry cache, an in-memory hash from (parent directory, name) to inode
+// slot chained through name_next, so resolving a path again reads no
+// directory blocks. An entry leaves the cache only when its file or
+// directory is deleted: there is at most one per inode slot, so the cache
+// never needs evicting, and its hash table doubles as it fills. It has its
+// own lock, as lookups under the shared directory lock add to it.
+//
+// Creates take inode slots from a stack of the free ones below the
+// high-water mark, built from the inode keys by the first create.
+
+void free_dentries(struct Volume *volume) {
+  free(volume->name_buckets);
+  table_free(volume->name_next, volume->num_inodes, sizeof(int));
+  table_free(volume->name_parent, volume->num_inodes, sizeof(int));
+  table_free(volume->free_inode_slots, volume->num_inodes, sizeof(int));
+  volume->name_buckets = NULL;
+  volume->name_next = NULL;
+  volume->name_parent = NULL;
+  volume->free_inode_slots = NULL;
+  volume->dentry_count = 0;
+  volume->free_inode_count = 0;
+}
+
+int init_dentries(struct Volume *volume) {
+  volume->name_bucket_count = 64;
+  volume->name_buckets = malloc(volume->name_bucket_count * sizeof(int));
+  volume->name_next = table_alloc(volume->num_inodes, sizeof(int));
+  volume->name_parent = table_alloc(volume->num_inodes, sizeof(int));
+  if (volume->name_buckets == NULL || volume->name_next == NULL ||
+      volume->name_parent == NULL) {
+    printf("ERROR: Could not allocate the dentry cache\n");
+    return -1;
+  }
+  for (int i = 0; i < volume->name_bucket_count; i++) {
+    volume->name_buckets[i] = -1;
+  }
+  return 0;
+}
+
+int dentry_bucket(int bucket_count, int parent, uint32_t key) {
+  return (key ^ (uint32_t)parent * 2654435761u) & (bucket_count - 1);
+}
+
+// The helpers below expect the dentry lock to be held
+
+int dentry_lookup(struct Volume *volume, int parent, const char *name,
+                  size_t length, uint32_t key) {
+  int bucket = dentry_bucket(volume->name_bucket_count, parent, key);
+  for (int i = volume->name_buckets[bucket]; i != -1;
+       i = volume->name_next[i]) {
+    if (volume->name_parent[i] == parent + 1 &&
+        volume->inode_keys[i] == key &&
+        file_name_equals(volume, i, name, length)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void resize_dentries(struct Volume *volume, int bucket_count) {
+  // Rehashes every cached entry into bucket_count buckets. Without the
+  // memory the chains just stay longer.
+  int *buckets = malloc(bucket_count * sizeof(int));
+  if (buckets == NULL) {
+    return;
+  }
+  for (int i = 0; i < bucket_count; i++) {
+    buckets[i] = -1;
+  }
+  for (int b = 0; b < volume->name_bucket_count; b++) {
+    int slot = volume->name_buckets[b];
+    while (slot != -1) {
+      int next = volume->name_next[slot];
+      int bucket = dentry_bucket(bucket_count, volume->name_parent[slot] - 1,
+                                 volume->inode_keys[slot]);
+      volume->name_next[slot] = buckets[bucket];
+      buckets[bucket] = slot;
+      slot = next;
+    }
+  }
+  free(volume->name_buckets);
+  volume->name_buckets = buckets;
+  volume->name_bucket_count = bucket_count;
+}
+
+void dentry_insert(struct Volume *volume, int parent, int slot) {
+  if ((volume->dentry_count + 1) * 2 > volume->name_bucket_count) {
+    resize_dentries(volume, volume->name_bucket_count * 2);
+  }
+  int bucket = dentry_bucket(volume->name_bucket_count, parent,
+                             volume->inode_keys[slot]);
+  volume->name_next[slot] = volume->name_buckets[bucket];
+  volume->name_buckets[bucket] = slot;
+  volume->name_parent[slot] = parent + 1;
+  volume->dentry_count++;
+}
+
+void dentry_remove(struct Volume *volume, int slot) {
+  if (volume->name_parent[slot] == 0) {
+    return;
+  }
+  int bucket = dentry_bucket(volume->name_bucket_count,
+                             volume->name_parent[slot] - 1,
+                             volume->inode_keys[slot]);
+  int *link = &volume->name_buckets[bucket];
+  while (*link != -1 && *link != slot) {
+    link = &volume->name_next[*link];
+  }
+  if (*link == slot) {
+    *link = volume->name_next[slot];
+  }
+  volume->name_parent[slot] = 0;
+  volume->dentry_count--;
+}
+
+int lookup_component(struct Volume *volume, int parent, const char *name) {
+  // Inode slot of name in the parent directory, or -1. Tried in the dentry
+  // cache first, then in the directory's tree.
+  uint32_t hash = hash_filename(name);
+  uint32_t key = hash | INODE_KEY_USED;
+  size_t length = strlen(name);
+  pthread_mutex_lock(&volume->dentry_lock);
+  int slot = dentry_lookup(volume, parent, name, length, key);
+  pthread_mutex_unlock(&volume->dentry_lock);
+  if (slot != -1) {
+    return slot;
+  }
+
+  slot = directory_lookup(volume, parent, name, hash);
+  if (slot != -1) {
+    // Another lookup may have got there first
+    pthread_mutex_lock(&volume->dentry_lock);
+    if (dentry_lookup(volume, parent, name, length, key) == -1) {
+      dentry_insert(volume, parent, slot);
+    }
+    pthread_mutex_unlock(&volume->dentry_lock);
+  }
+  return slot;
+}
+
+int resolve_path(struct Volume *volume, const char *path, int *parent,
+                 char *name) {
+  // Finds the directory holding the path's last component and copies that
+  // component into name (MAX_FILENAME_SIZE + 1 bytes). Fails, having said
+  // why, if a directory on the way is missing or there is no component.
+  int directory = ROOT_INODE;
+  name[0] = '\0';
+  while (true) {
+    while (*path == '/') {
+      path++;
+    }
+    if (*path == '\0') {
+      break;
+    }
+    const char *end = strchr(path, '/');
+    size_t length = end != NULL ? (size_t)(end - path) : strlen(path);
+    if (length > MAX_FILENAME_SIZE) {
+      printf("Filename is longer than %d characters\n", MAX_FILENAME_SIZE);
+      return -1;
+    }
+    if (name[0] != '\0') {
+      // The previous component is a directory on the way
+      int slot = lookup_component(volume, directory, name);
+      if (slot == -1 || inode_at(volume, slot)->type != INODE_DIRECTORY) {
+        printf("Could not find directory %s\n", name);
+        return -1;
+      }
+      directory = slot;
+    }
+    memcpy(name, path, length);
+    name[length] = '\0';
+    path += length;
+  }
+  if (name[0] == '\0') {
+    printf("Path does not name a file or directory\n");
+    return -1;
+  }
+  *parent = directory;
+  return 0;
+}
+
+int lookup_path(struct Volume *volume, const char *path) {
+  // Inode slot the path names, or -1
+  char name[MAX_FILENAME_SIZE + 1];
+  int parent;
+  if (resolve_path(volume, path, &parent, name) < 0) {
+    return -1;
+  }
+  return lookup_component(volume, parent, name);
+}
+
+int load_free_inodes(struct Volume *volume) {
+  // Builds the free slot stack on first use, reading the inode table below
+  // its high-water mark. Callers hold the directory lock exclusively.
+  if (volume->free_inodes_loaded) {
+    return 0;
+  }
+  volume->free_inode_slots = table_alloc(volume->num_inodes, sizeof(int));
+  if (volume->free_inode_slots == NULL) {
+    printf("ERROR: Could not allocate the free inode list\n");
+    return -1;
+  }
+  pthread_mutex_lock(&volume->fault_lock);
+  fault_blocks(volume, volume->superblock.inode_start,
+               volume->superblock.inode_start +
+                   ((size_t)volume->inodes_used * sizeof(struct Inode) - 1) /
+                       BLOCK_SIZE);
+  pthread_mutex_unlock(&volume->fault_lock);
+
+  // Free slots are pushed in reverse so the lowest one is reused first
+  for (int i = volume->inodes_used - 1; i >= 0; i--) {
+    if (volume->inode_keys[i] == 0) {
+      volume->free_inode_slots[volume->free_inode_count++] = i;
+    }
+  }
+  volume->free_inodes_loaded = true;
+  return 0;
+}
+
+int take_slot(int *free_slots, int *free_count, int *used, int limit) {
+  // Reuses a freed slot below the high-water mark used, or else raises it.
+  // Returns -1 when every slot is taken.
+  if (*free_count > 0) {
+    return free_slots[--*free_count];
+  }
+  if (*used < limit) {
+    return (*used)++;
+  }
+  return -1;
+}
+
+// File system operations
+
+struct Volume *sfs_mount(char *vdiskname) {
+  return sfs_mount_with_flags(vdiskname, 0);
+}
+
+struct Volume *create_volume() {
+  struct Volume *volume = calloc(1, sizeof(struct Volume));
+  if (volume == NULL) {
+    printf("ERROR: Could not allocate volume\n");
+    return NULL;
+  }
+  volume->vdisk_fd = -1;
+  volume->cache_capacity = SFS_DEFAULT_CACHE_BLOCKS;
+  pthread_rwlock_init(&volume->directory_lock, NULL);
+  pthread_mutex_init(&volume->open_file_lock, NULL);
+  pthread_mutex_init(&volume->alloc_lock, NULL);
+  pthread_mutex_init(&volume->fault_lock, NULL);
+  pthread_mutex_init(&volume->dentry_lock, NULL);
+  pthread_mutex_init(&volume->tail_lock, NULL);
+  pthread_mutex_init(&volume->cache_init_lock, NULL);
+  pthread_mutex_init(&volume->chunk_lock, NULL);
+  pthread_mutex_init(&volume->checksum_lock, NULL);
+  pthread_mutex_init(&volume->journal_lock, NULL);
+  pthread_rwlock_init(&volume->commit_lock, NULL);
+  pthread_mutex_init(&volume->async_lock, NULL);
+  return volume;
+}
+
+int map_vdisk(struct Volume *volume) {
+  struct stat vdisk_stat;
+  if (fstat(volume->vdisk_fd, &vdisk_stat) < 0) {
+    perror("Failed to stat vdisk");
+    return -1;
+  }
+
+  volume->vdisk_map_size = vdisk_stat.st_size;
+  volume->vdisk_map = mmap(NULL, volume->vdisk_map_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, volume->vdisk_fd, 0);
+  if (volume->vdisk_map == MAP_FAILED) {
+    perror("Failed to map vdisk");
+    volume->vdisk_map = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+int map_checksums(struct Volume *volume) {
+  // The checksum region is used in place: inside the disk mapping on a
+  // mapped mount, through a mapping of its own otherwise
+  struct SuperBlock *superblock = &volume->superblock;
+  size_t offset = (size_t)superblock->checksum_start * BLOCK_SIZE;
+  volume->checksums_size = (size_t)superblock->checksum_blocks * BLOCK_SIZE;
+  if (volume->vdisk_map != NULL) {
+    volume->checksums = (struct BlockChecksum *)(volume->vdisk_map + offset);
+    return 0;
+  }
+  void *map = mmap(NULL, volume->checksums_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, volume->vdisk_fd, offset);
+  if (map == MAP_FAILED) {
+    perror("Failed to map block checksums");
+    return -1;
+  }
+  volume->checksums = map;
+  return 0;
+}
+
+void unmap_checksums(struct Volume *volume) {
+  if (volume->checksums != NULL && volume->vdisk_map == NULL) {
+    munmap(volume->checksums, volume->checksums_size);
+  }
+  volume->checksums = NULL;
+}
+
+void unload_metadata(struct Volume *volume) {
+  free_dentries(volume);
+  free_tail_blocks(volume);
+  if (volume->file_locks != NULL) {
+    for (int i = 0; i < volume->file_lock_count; i++) {
+      pthread_rwlock_destroy(&volume->file_locks[i]);
+    }
+    free(volume->file_locks);
+    volume->file_locks = NULL;
+  }
+  if (volume->file_maps != NULL) {
+    for (int i = 0; i < volume->inodes_used; i++) {
+      extent_map_free(&volume->file_maps[i]);
+    }
+    table_free(volume->file_maps, volume->num_inodes,
+               sizeof(struct ExtentMap));
+    volume->file_maps = NULL;
+  }
+  free_journal(volume);
+  table_free(volume->bitmap, volume->superblock.bitmap_blocks, BLOCK_SIZE);
+  table_free(volume->inodes, volume->superblock.inode_blocks, BLOCK_SIZE);
+  table_free(volume->inode_keys, volume->num_inodes, sizeof(uint32_t));
+  table_free(volume->long_names, volume->superblock.name_blocks, BLOCK_SIZE);
+  table_free(volume->resident,
+             volume->journal_start - volume->superblock.inode_start,
+             sizeof(bool));
+  volume->bitmap = NULL;
+  volume->inodes = NULL;
+  volume->long_names = NULL;
+  volume->resident = NULL;
+}
+
+void close_vdisk(struct Volume *volume) {
+  if (volume->prefetching) {
+    __atomic_store_n(&volume->prefetch_stop, true, __ATOMIC_RELAXED);
+    pthread_join(volume->prefetch_thread, NULL);
+    volume->prefetching = false;
+  }
+  unload_metadata(volume);
+  for (int i = 0; i < MAX_OPEN_FILES; i++) {
+    free(volume->open_file_table[i].write_buffer);
+  }
+  if (volume->vdisk_map != NULL) {
+    volume->checksums = NULL;
+    munmap(volume->vdisk_map, volume->vdisk_map_size);
+    volume->vdisk_map = NULL;
+  }
+  cache_destroy(volume);
+  chunk_cache_destroy(volume);
+  unmap_checksums(volume);
+  if (volume->vdisk_fd >= 0) {
+    close(volume->vdisk_fd);
+  }
+
+  pthread_rwlock_destroy(&volume->directory_lock);
+  pthread_mutex_destroy(&volume->open_file_lock);
+  pthread_mutex_destroy(&volume->alloc_lock);
+  pthread_mutex_destroy(&volume->fault_lock);
+  pthread_mutex_destroy(&volume->dentry_lock);
+  pthread_mutex_destroy(&volume->tail_lock);
+  pthread_mutex_destroy(&volume->cache_init_lock);
+  pthread_mutex_destroy(&volume->chunk_lock);
+  pthread_mutex_destroy(&volume->checksum_lock);
+  pthread_mutex_destroy(&volume->journal_lock);
+  pthread_rwlock_destroy(&volume->commit_lock);
+  pthread_mutex_destroy(&volume->async_lock);
+  free(volume->checksum_writes);
+  free(volume);
+}
+
+int sfs_load_metadata(struct Volume *volume) {
+  // Reads every metadata block still in use that is not resident yet, so no
+  // later call waits on a metadata read. Each region goes in chunks,
+  // letting calls that fault on their own get in between; an unmount cuts
+  // it short.
+  if (__atomic_load_n(&volume->metadata_loaded, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  pthread_rwlock_rdlock(&volume->directory_lock);
+  size_t inode_bytes = (size_t)volume->inodes_used * sizeof(struct Inode);
+  size_t name_bytes = (size_t)volume->names_used * sizeof(struct LongName);
+  pthread_rwlock_unlock(&volume->directory_lock);
+
+  struct SuperBlock *superblock = &volume->superblock;
+  uint64_t starts[3] = {superblock->inode_start, superblock->name_start,
+                        superblock->bitmap_start};
+  uint64_t ends[3] = {
+      superblock->inode_start + (inode_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE,
+      superblock->name_start + (name_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE,
+      superblock->bitmap_start + superblock->bitmap_blocks};
+  for (int region = 0; region < 3; region++) {
+    for (uint64_t block = starts[region]; block < ends[region];
+         block += PREFETCH_CHUNK_BLOCKS) {
+      if (__atomic_load_n(&volume->prefetch_stop, __ATOMIC_RELAXED)) {
+        return 0;
+      }
+      uint64_t last = block + PREFETCH_CHUNK_BLOCKS - 1;
+      if (last >= ends[region]) {
+        last = ends[region] - 1;
+      }
+      pthread_mutex_lock(&volume->fault_lock);
+      fault_blocks(volume, block, last);
+      pthread_mutex_unlock(&volume->fault_lock);
+    }
+  }
+  __atomic_store_n(&volume->metadata_loaded, true, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void *prefetch_metadata(void *arg) {
+  sfs_load_metadata(arg);
+  return NULL;
+}
+
+struct Volume *sfs_mount_with_flags(char *vdiskname, int flags) {
+  struct Volume *volume = create_volume();
+  if (volume == NULL) {
+    return NULL;
+  }
+
+  volume->vdisk_fd = open(vdiskname, O_RDWR);
+  if (volume->vdisk_fd < 0) {
+    perror("Failed to mount vdisk");
+    close_vdisk(volume);
+    return NULL;
+  }
+
+  if ((flags & SFS_MOUNT_MMAP) && map_vdisk(volume) < 0) {
+    close_vdisk(volume);
+    return NULL;
+  }
+
+  if (load_superblock(volume) < 0) {
+    close_vdisk(volume);
+    return NULL;
+  }
+  if (volume->vdisk_map != NULL &&
+      volume->superblock.num_blocks * BLOCK_SIZE > volume->vdisk_map_size) {
+    printf("ERROR: Virtual disk is smaller than its superblock says\n");
+    close_vdisk(volume);
+    return NULL;
+  }
+  if (map_checksums(volume) < 0) {
+    close_vdisk(volume);
+    return NULL;
+  }
+  volume->verify_checksums = !(flags & SFS_MOUNT_NO_VERIFY);
+  volume->compress = (flags & SFS_MOUNT_COMPRESS) != 0;
+
+  if (init_metadata(volume) < 0 || init_journal(volume) < 0) {
+    close_vdisk(volume);
+    return NULL;
+  }
+  init_open_file_table(volume);
+  if (init_file_locks(volume) < 0 || init_dentries(volume) < 0) {
+    close_vdisk(volume);
+    return NULL;
+  }
+  if ((flags & SFS_MOUNT_PREFETCH) &&
+      pthread_create(&volume->prefetch_thread, NULL, prefetch_metadata,
+                     volume) == 0) {
+    volume->prefetching = true;
+  }
+
+  printf("LOG(sfs_mount): Mounted %s successfully\n", vdiskname);
+
+  return volume;
+}
+
+int sfs_umount(struct Volume *volume) {
+  if (volume != NULL) {
+    // Queues still open would outlive the volume: their requests are
+    // completed and the queues closed, so their handles are dead after this
+    while (true) {
+      pthread_mutex_lock(&volume->async_lock);
+      struct AsyncQueue *queue = volume->async_queues;
+      pthread_mutex_unlock(&volume->async_lock);
+      if (queue == NULL) {
+        break;
+      }
+      sfs_async_close(queue);
+    }
+    if (open_batch == volume) {
+      sfs_commit_batch(volume); // An unfinished batch goes with the rest
+    }
+    // Commit outstanding calls and fold the journal into the home blocks, so
+    // the next mount has nothing to replay
+    flush_open_files(volume);
+    journal_commit(volume);
+    pthread_mutex_lock(&volume->journal_lock);
+    journal_checkpoint(volume);
+    pthread_mutex_unlock(&volume->journal_lock);
+    close_vdisk(volume);
+    printf("LOG(sfs_umount): Unmounted successfully\n");
+  } else {
+    printf("LOG(sfs_umount): No disk mounted.\n");
+  }
+  return 0;
+}
+
+int create_inode(struct Volume *volume, char *path, uint8_t type) {
+  char name[MAX_FILENAME_SIZE + 1];
+  int parent;
+  if (resolve_path(volume, path, &parent, name) < 0) {
+    return -1;
+  }
+  if (lookup_component(volume, parent, name) != -1) {
+    printf("Directory already has file of same name!\n");
+    return -1;
+  }
+
+  if (load_free_inodes(volume) < 0) {
+    return -1;
+  }
+  if (volume->free_inode_count == 0 &&
+      volume->inodes_used == volume->num_inodes) {
+    printf("No free inodes remaining\n");
+    return -1;
+  }
+
+  int slot = take_slot(volume->free_inode_slots, &volume->free_inode_count,
+                       &volume->inodes_used, volume->num_inodes);
+  // A slot just past the old high-water mark can share a block with ones
+  // above it that have never been read
+  struct Inode *inode = inode_at(volume, slot);
+
+  // Set the inode (data blocks are mapped on first write)
+  inode->used = USED_FLAG;
+  inode->type = type;
+  inode->size = 0;
+  inode->extent_count = 0;
+  inode->extent_root = INVALID_BLOCK_POINTER;
+  inode->layout = FILE_DATA_EXTENTS;
+  memset(inode->data, 0, INLINE_DATA_SIZE);
+  inode->created_at = time(NULL);
+  inode->last_modified_at = inode->created_at;
+  set_file_name(volume, slot, name);
+  update_inode_keys(volume, slot, 1);
+  journal_mark_inode(volume, slot);
+
+  struct DirectoryKey key = {inode->name_hash, slot};
+  if (directory_insert(volume, parent, key) < 0) {
+    inode->used = UNUSED_FLAG;
+    update_inode_keys(volume, slot, 1);
+    volume->free_inode_slots[volume->free_inode_count++] = slot;
+    return -1;
+  }
+  pthread_mutex_lock(&volume->dentry_lock);
+  dentry_insert(volume, parent, slot);
+  pthread_mutex_unlock(&volume->dentry_lock);
+  return 0;
+}
+
+int sfs_create(struct Volume *volume, char *filename) {
+  if (batch_full(volume)) {
+    return -1;
+  }
+  begin_operation(volume);
+  pthread_rwlock_wrlock(&volume->directory_lock);
+  int result = create_inode(volume, filename, INODE_FILE);
+  pthread_rwlock_unlock(&volume->directory_lock);
+  end_operation(volume);
+  return result;
+}
+
+int sfs_mkdir(struct Volume *volume, char *path) {
+  if (batch_full(volume)) {
+    return -1;
+  }
+  begin_operation(volume);
+  pthread_rwlock_wrlock(&volume->directory_lock);
+  int result = create_inode(volume, path, INODE_DIRECTORY);
+  pthread_rwlock_unlock(&volume->directory_lock);
+  end_operation(volume);
+  return result;
+}
+
+bool is_file_open(struct Volume *volume, struct Inode *entry) {
+  pthread_mutex_lock(&volume->open_file_lock);
+  bool open = false;
+  for (int i = 0; i < MAX_OPEN_FILES; i++) {
+    if (volume->open_file_table[i].inode == entry) {
+      open = true;
+    }
+  }
+  pthread_mutex_unlock(&volume->open_file_lock);
+  return open;
+}
+
+int remove_inode(struct Volume *volume, char *path, uint8_t type) {
+  char name[MAX_FILENAME_SIZE + 1];
+  int parent;
+  if (resolve_path(volume, path, &parent, name) < 0) {
+    return -1;
+  }
+  int slot = lookup_component(volume, parent, name);
+  if (slot == -1) {
+    printf("Could not find given file\n");
+    return -1;
+  }
+
+  struct Inode *inode = &volume->inodes[slot];
+  if (inode->type != type) {
+    printf(type == INODE_FILE ? "Cannot delete a directory as a file\n"
+                              : "Not a directory\n");
+    return -1;
+  }
+  if (type == INODE_DIRECTORY && inode->size > 0) {
+    printf("Directory is not empty\n");
+    return -1;
+  }
+  if (is_file_open(volume, inode)) {
+    printf("Cannot delete a file that is open\n");
+    return -1;
+  }
+
+  struct DirectoryKey key = {inode->name_hash, slot};
+  if (directory_remove(volume, parent, key) < 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&volume->dentry_lock);
+  dentry_remove(volume, slot);
+  pthread_mutex_unlock(&volume->dentry_lock);
+
+  // Mark the inode as unused. A long name is left in its slot of the name
+  // table, to be overwritten by the next long name given this inode. Before
+  // the first create there is no free stack yet; building it finds the slot.
+  inode->used = UNUSED_FLAG;
+  update_inode_keys(volume, slot, 1);
+  if (volume->free_inodes_loaded) {
+    volume->free_inode_slots[volume->free_inode_count++] = slot;
+  }
+  journal_mark_inode(volume, slot);
+
+  // Release the file's data, in its inode, a tail block or its own blocks
+  // and extent tree, and drop its cached map
+  if (type == INODE_FILE && file_is_small(inode)) {
+    if (inode->layout == FILE_DATA_TAIL && load_tail_blocks(volume) < 0) {
+      return 0; // the fragments stay taken until a remount
+    }
+    release_small_data(volume, inode);
+  } else if (type == INODE_FILE) {
+    struct ExtentMap *map = file_map(volume, inode);
+    if (map != NULL) {
+      drop_delayed_blocks(volume, map);
+      extent_map_truncate(volume, map, 0);
+      store_extent_map(volume, inode, map);
+      extent_map_free(map);
+    }
+  }
+  return 0;
+}
+
+int sfs_delete(struct Volume *volume, char *filename) {
+  if (batch_full(volume)) {
+    return -1;
+  }
+  begin_operation(volume);
+  pthread_rwlock_wrlock(&volume->directory_lock);
+  int result = remove_inode(volume, filename, INODE_FILE);
+  pthread_rwlock_unlock(&volume->directory_lock);
+  end_operation(volume);
+  return result;
+}
+
+int sfs_rmdir(struct Volume *volume, char *path) {
+  // Only an empty directory can be removed
+  if (batch_full(volume)) {
+    return -1;
+  }
+  begin_operation(volume);
+  pthread_rwlock_wrlock(&volume->directory_lock);
+  int result = remove_inode(volume, path, INODE_DIRECTORY);
+  pthread_rwlock_unlock(&volume->directory_lock);
+  end_operation(volume);
+  return result;
+}
+
+// Directory listing
+//
+// A stream reads its directory one leaf at a time: each refill seeks to
+// the first key past the ones it has listed and copies the rest of that
+// leaf, so no more than a leaf is held and nothing is read twice. The
+// entries are read from their inodes as they are returned, under the
+// shared directory lock; those deleted since the refill are skipped.
+
+struct DirectoryStream *sfs_opendir(struct Volume *volume, char *path) {
+  // The root is opened by an empty path or "/"
+  pthread_rwlock_rdlock(&volume->directory_lock);
+  int slot = ROOT_INODE;
+  if (path[strspn(path, "/")] != '\0') {
+    slot = lookup_path(volume, path);
+  }
+  if (slot == -1 || inode_at(volume, slot)->type != INODE_DIRECTORY) {
+    pthread_rwlock_unlock(&volume->directory_lock);
+    printf("Could not find directory %s\n", path);
+    return NULL;
+  }
+  pthread_rwlock_unlock(&volume->directory_lock);
+
+  struct DirectoryStream *stream = calloc(1, sizeof(struct DirectoryStream));
+  if (stream == NULL) {
+    printf("ERROR: Could not allocate a directory stream\n");
+    return NULL;
+  }
+  stream->volume = volume;
+  stream->slot = slot;
+  return stream;
+}
+
+void directory_stream_refill(struct DirectoryStream *stream) {
+  // Takes the keys from the resume point to the end of its leaf. The
+  // directory may have been removed since the stream was opened.
+  struct Volume *volume = stream->volume;
+  struct Inode *directory = inode_at(volume, stream->slot);
+  struct DirectoryPath path;
+  struct DirectoryKey key;
+  stream->key_count = 0;
+  stream->next_key = 0;
+  if (directory->used != USED_FLAG || directory->type != INODE_DIRECTORY ||
+      directory_seek(volume, directory, stream->resume, &path) < 0 ||
+      !directory_entry(volume, &path, &key)) {
+    stream->at_end = true;
+    return;
+  }
+
+  int leaf = path.depth - 1;
+  struct DirectoryNode *node = &path.nodes[leaf];
+  stream->key_count = node->count - path.index[leaf];
+  memcpy(stream->keys, &node->keys[path.index[leaf]],
+         stream->key_count * sizeof(struct DirectoryKey));
+  stream->resume = stream->keys[stream->key_count - 1];
+  stream->resume.slot++;
+}
+
+int directory_stream_next(struct DirectoryStream *stream) {
+  // Inode slot of the next entry still in the directory, or -1 at the end.
+  // Callers hold the directory lock shared.
+  struct Volume *volume = stream->volume;
+  while (!stream->at_end) {
+    if (stream->next_key == stream->key_count) {
+      directory_stream_refill(stream);
+      continue;
+    }
+    struct DirectoryKey key = stream->keys[stream->next_key++];
+    inode_at(volume, key.slot);
+    if (volume->inode_keys[key.slot] == (key.name_hash | INODE_KEY_USED)) {
+      return key.slot;
+    }
+  }
+  return -1;
+}
+
+int sfs_readdir(struct DirectoryStream *stream, struct DirEntry *entry) {
+  // Returns 1 with the next entry, or 0 once they have all been listed
+  struct Volume *volume = stream->volume;
+  pthread_rwlock_rdlock(&volume->directory_lock);
+  int slot = directory_stream_next(stream);
+  if (slot != -1) {
+    get_file_name(volume, slot, entry->name);
+    entry->type = volume->inodes[slot].type;
+  }
+  pthread_rwlock_unlock(&volume->directory_lock);
+  return slot != -1;
+}
+
+int sfs_readdir_plus(struct DirectoryStream *stream,
+                     struct DirEntryPlus *entries, int count) {
+  // Fills up to count entries with names and attributes in one pass, taking
+  // the directory lock once. Returns how many, 0 once all have been listed.
+  struct Volume *volume = stream->volume;
+  int filled = 0;
+  pthread_rwlock_rdlock(&volume->directory_lock);
+  while (filled < count) {
+    int slot = directory_stream_next(stream);
+    if (slot == -1) {
+      break;
+    }
+    struct Inode *inode = &volume->inodes[slot];
+    struct DirEntryPlus *entry = &entries[filled++];
+    get_file_name(volume, slot, entry->name);
+    entry->type = inode->type;
+    // A file's size and times change under its file lock
+    pthread_rwlock_t *lock =
+        inode->type == INODE_FILE ? file_lock(volume, inode) : NULL;
+    if (lock != NULL) {
+      pthread_rwlock_rdlock(lock);
+    }
+    entry->size = inode->size;
+    entry->created_at = inode->created_at;
+    entry->last_modified_at = inode->last_modified_at;
+    if (lock != NULL) {
+      pthread_rwlock_unlock(lock);
+    }
+  }
+  pthread_rwlock_unlock(&volume->directory_lock);
+  return filled;
+}
+
+int sfs_closedir(struct DirectoryStream *stream) {
+  free(stream);
+  return 0;
+}
+
+int open_file(struct Volume *volume, char *filename, int mode) {
+  if (volume->open_file_count >= MAX_OPEN_FILES) {
+    printf("Maximum number of files already opened (%d)\n",
+           volume->open_file_count);
+    return -1;
+  }
+
+  // Find the inode of the file
+  int dir_entry_index = lookup_path(volume, filename);
+  if (dir_entry_index == -1) {
+    printf("Could not find given file\n");
+    return -1;
+  }
+  struct Inode *entry = &volume->inodes[dir_entry_index];
+  if (entry->type != INODE_FILE) {
+    printf("Cannot open a directory\n");
+    return -1;
+  }
+
+  for (int i = 0; i < MAX_OPEN_FILES; i++) {
+    if (volume->open_file_table[i].inode == entry) {
+      printf("This file is already opened somewhere!\n");
+      return -1;
+    }
+  }
+
+  // Find first free entry in open file table (this will also be our file
+  // descriptor)
+  int fd = -1;
+  for (int i = 0; i < MAX_OPEN_FILES; i++) {
+    if (volume->open_file_table[i].inode == NULL) {
+      fd = i;
+      break;
+    }
+  }
+
+  // Reads only ever hold the file lock shared, so the map is loaded now
+  if (mode == WRITE_MODE) {
+    if (lock_file_for_write(volume, entry) < 0) {
+      return -1;
+    }
+  } else {
+    pthread_rwlock_wrlock(file_lock(volume, entry));
+  }
+  struct ExtentMap *map = file_map(volume, entry);
+  pthread_rwlock_unlock(file_lock(volume, entry));
+  if (map == NULL) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&volume->open_file_table[fd].lock);
+  volume->open_file_table[fd].open_mode = mode;
+  volume->open_file_table[fd].read_write_pointer = 0;
+  volume->open_file_table[fd].next_read = 0;
+  volume->open_file_table[fd].readahead_window = READAHEAD_MIN_BLOCKS;
+  volume->open_file_table[fd].readahead_end = 0;
+  volume->open_file_table[fd].write_length = 0;
+  volume->open_file_table[fd].inode = entry;
+  pthread_mutex_unlock(&volume->open_file_table[fd].lock);
+  volume->open_file_count++;
+
+  return fd;
+}
+
+int sfs_open(struct Volume *volume, char *filename, int mode) {
+  // The directory stays read-locked until the descriptor is registered, so
+  // the entry cannot be deleted underneath us
+  pthread_rwlock_rdlock(&volume->directory_lock);
+  pthread_mutex_lock(&volume->open_file_lock);
+  int fd = open_file(volume, filename, mode);
+  pthread_mutex_unlock(&volume->open_file_lock);
+  pthread_rwlock_unlock(&volume->directory_lock);
+  return fd;
+}
+
+struct OpenFile *lock_open_file(struct Volume *volume, int fd) {
+  // Returns the locked table entry for an open descriptor, or NULL
+  if (fd < 0 || fd >= MAX_OPEN_FILES) {
+    printf("File descriptor out of range\n");
+    return NULL;
+  }
+
+  struct OpenFile *open_file = &volume->open_file_table[fd];
+  pthread_mutex_lock(&open_file->lock);
+  if (open_file->inode == NULL) {
+    pthread_mutex_unlock(&open_file->lock);
+    printf(
+        "ERROR: The given file descriptor does not belong to an open file\n");
+    return NULL;
+  }
+  return open_file;
+}
+
+pthread_rwlock_t *file_lock(struct Volume *volume,
+                            struct Inode *entry) {
+  return &volume->file_locks[(entry - volume->inodes) %
+                             volume->file_lock_count];
+}
+
+int sfs_close(struct Volume *volume, int fd) {
+  // Buffered writes and the cached extent map reach the file first. If that
+  // fails the error is returned, but the descriptor is closed all the same.
+  begin_operation(volume);
+  struct OpenFile *open_file = lock_open_file(volume, fd);
+  if (open_file == NULL) {
+    end_operation(volume);
+    return -1;
+  }
+  int result = flush_write_behind(volume, open_file);
+  struct Inode *entry = open_file->inode;
+  pthread_rwlock_wrlock(file_lock(volume, entry));
+  if (store_file_map(volume, entry) < 0) {
+    result = -1;
+  }
+  pthread_rwlock_unlock(file_lock(volume, entry));
+  pthread_mutex_unlock(&open_file->lock);
+  end_operation(volume);
+
+  pthread_mutex_lock(&volume->open_file_lock);
+  open_file = lock_open_file(volume, fd);
+  if (open_file == NULL) {
+    pthread_mutex_unlock(&volume->open_file_lock);
+    return -1;
+  }
+
+  free(open_file->write_buffer);
+  open_file->write_buffer = NULL;
+  open_file->write_length = 0;
+  open_file->inode = NULL;
+  volume->open_file_count--;
+  pthread_mutex_unlock(&open_file->lock);
+  pthread_mutex_unlock(&volume->open_file_lock);
+
+  return result;
+}
+
+int sfs_seek(struct Volume *volume, int fd, int64_t offset, int whence) {
+  // Buffered writes are flushed so the file size is current. The pointer
+  // may go past the end, where a write leaves a hole behind it.
+  begin_operation(volume);
+  struct OpenFile *open_file = lock_open_file(volume, fd);
+  if (open_file == NULL) {
+    end_operation(volume);
+    return -1;
+  }
+  if (flush_write_behind(volume, open_file) < 0) {
+    pthread_mutex_unlock(&open_file->lock);
+    end_operation(volume);
+    return -1;
+  }
+
+  int64_t file_size = open_file->inode->size;
+  int64_t read_write_pointer_copy = open_file->read_write_pointer;
+  switch (whence) {
+  case SEEK_SET:
+    open_file->read_write_pointer = offset;
+    break;
+
+  case SEEK_CUR:
+    open_file->read_write_pointer += offset;
+    break;
+
+  case SEEK_END:
+    open_file->read_write_pointer = file_size + offset;
+    break;
+  }
+
+  int result = 0;
+  if (open_file->read_write_pointer < 0) {
+    printf("Read-Write pointer going out of bounds\n");
+    open_file->read_write_pointer = read_write_pointer_copy;
+    result = -1;
+  }
+
+  pthread_mutex_unlock(&open_file->lock);
+  end_operation(volume);
+  return result;
+}
+
+int read_open_file(struct Volume *volume, struct OpenFile *open_file,
+                   void *buffer, int size) {
+
+  if (open_file->open_mode != READ_MODE) {
+    printf("ERROR: The given file is not opened in read mode\n");
+    return -1;
+  }
+  struct Inode *entry = open_file->inode;
+  uint64_t file_size = entry->size;
+
+  uint64_t read_write_pointer = open_file->read_write_pointer;
+  if (size < 0 || read_write_pointer + size > file_size) {
+    printf("ERROR: Not enough bytes to read in file\n");
+    return -1;
+  }
+
+  if (size == 0) {
+    return 0;
+  }
+
+  checksum_failed = false;
+  if (file_is_small(entry)) {
+    small_read(volume, entry, read_write_pointer, buffer, size);
+  } else {
+    struct ExtentMap *map = file_map(volume, entry);
+    if (map == NULL) {
+      return -1;
+    }
+    file_read_range(volume, map, read_write_pointer, buffer, size, NULL);
+    read_ahead(volume, open_file, map, read_write_pointer, size, file_size);
+  }
+  if (checksum_failed) {
+    return -1;
+  }
+
+  open_file->read_write_pointer = read_write_pointer + size;
+
+  return 0;
+}
+
+int sfs_read(struct Volume *volume, int fd, void *buffer, int size) {
+  struct OpenFile *open_file = lock_open_file(volume, fd);
+  if (open_file == NULL) {
+    return -1;
+  }
+
+  // Readers of the same file share its lock; writers exclude them
+  pthread_rwlock_rdlock(file_lock(volume, open_file->inode));
+  int result = read_open_file(volume, open_file, buffer, size);
+  pthread_rwlock_unlock(file_lock(volume, open_file->inode));
+  pthread_mutex_unlock(&open_file->lock);
+  return result;
+}
+
+int write_open_file(struct Volume *volume, struct OpenFile *open_file,
+                    void *buffer, int size) {
+
+  if (open_file->open_mode != WRITE_MODE) {
+    printf("ERROR: The given file is not opened in write mode\n");
+    return -1;
+  }
+
+  struct Inode *entry = open_file->inode;
+  uint64_t read_write_pointer = open_file->read_write_pointer;
+  uint64_t end = read_write_pointer + size;
+  uint64_t new_size = end > entry->size ? end : entry->size;
+
+  if (size <= 0) {
+    return size == 0 ? 0 : -1;
+  }
+  if (end > MAX_FILE_SIZE) {
+    printf("ERROR: Write would exceed the maximum file size\n");
+    return -1;
+  }
+
+  struct ExtentMap *map = file_map(volume, entry);
+  if (map == NULL) {
+    return -1;
+  }
+  int small = small_write(volume, entry, map, read_write_pointer, buffer,
+                          size, new_size);
+  if (small < 0) {
+    return -1;
+  }
+
+  if (small == 0 && read_write_pointer == entry->size) {
+    // Writing on from the end is an append, blocks past the end never being
+    // mapped
+    if (write_file_end(volume, map, entry->size, buffer, size) < 0) {
+      return -1;
+    }
+  } else if (small == 0) {
+    // Map every block the write touches in one go, so multi-block writes
+    // get contiguous runs. One past the end leaves a hole behind it.
+    if (flush_delayed_blocks(volume, map, entry->size) < 0 ||
+        expand_chunks(volume, map, read_write_pointer / BLOCK_SIZE,
+                      (end - 1) / BLOCK_SIZE + 1) < 0) {
+      return -1;
+    }
+    if (read_write_pointer > entry->size) {
+      zero_file_tail(volume, map, entry->size);
+    }
+    if (extent_map_assign(volume, map, read_write_pointer / BLOCK_SIZE,
+                          (end - 1) / BLOCK_SIZE) < 0) {
+      printf("ERROR: Couldn't find a free block to assign to file\n");
+      return -1;
+    }
+
+    file_write_range(volume, map, entry->size, read_write_pointer, buffer,
+                     size, NULL);
+  }
+
+  // Update all size references
+  open_file->read_write_pointer = end;
+  entry->size = new_size;
+  entry->last_modified_at = time(NULL);
+  journal_mark_inode(volume, entry - volume->inodes);
+
+  return 0;
+}
+
+bool write_behind(struct OpenFile *open_file, void *buffer, int size) {
+  // Absorbs a small write into the descriptor's buffer if it fits. Buffered
+  // writes are always sequential: only a write moves the pointer, and
+  // everything else that does flushes first.
+  uint32_t capacity = WRITE_BEHIND_BLOCKS * BLOCK_SIZE;
+  if (open_file->open_mode != WRITE_MODE || size <= 0 ||
+      open_file->write_length + size > capacity) {
+    return false;
+  }
+  if (open_file->write_buffer == NULL) {
+    open_file->write_buffer = malloc(capacity);
+    if (open_file->write_buffer == NULL) {
+      return false;
+    }
+  }
+  if (open_file->write_length == 0) {
+    open_file->write_start = open_file->read_write_pointer;
+  }
+  memcpy(open_file->write_buffer + open_file->write_length, buffer, size);
+  open_file->write_length += size;
+  open_file->read_write_pointer += size;
+  return true;
+}
+
+int flush_write_behind(struct Volume *volume, struct OpenFile *open_file) {
+  // Writes out the buffered bytes as one write. Caller holds the
+  // descriptor's lock inside an operation.
+  if (open_file->write_length == 0) {
+    return 0;
+  }
+  uint32_t length = open_file->write_length;
+  int64_t read_write_pointer = open_file->read_write_pointer;
+  open_file->write_length = 0;
+  open_file->read_write_pointer = open_file->write_start;
+
+  pthread_rwlock_wrlock(file_lock(volume, open_file->inode));
+  int result =
+      write_open_file(volume, open_file, open_file->write_buffer, length);
+  pthread_rwlock_unlock(file_lock(volume, open_file->inode));
+  open_file->read_write_pointer = read_write_pointer;
+  return result;
+}
+
+void flush_open_files(struct Volume *volume) {
+  for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+    struct OpenFile *open_file = &volume->open_file_table[fd];
+    begin_operation(volume);
+    pthread_mutex_lock(&open_file->lock);
+    if (open_file->inode != NULL) {
+      flush_write_behind(volume, open_file);
+    }
+    pthread_mutex_unlock(&open_file->lock);
+    end_operation(volume);
+  }
+}
+
+int sfs_write(struct Volume *volume, int fd, void *buffer, int size) {
+  if (batch_full(volume)) {
+    return -1;
+  }
+  reclaim_blocks(volume, blocks_needed(size) + WRITE_BEHIND_BLOCKS);
+  begin_operation(volume);
+  struct OpenFile *open_file = lock_open_file(volume, fd);
+  if (open_file == NULL) {
+    end_operation(volume);
+    return -1;
+  }
+
+  // Small writes are buffered; a full buffer, or a write too big for it,
+  // flushes what is buffered first
+  int result = 0;
+  if (!write_behind(open_file, buffer, size)) {
+    result = flush_write_behind(volume, open_file);
+    if (result == 0 && !write_behind(open_file, buffer, size)) {
+      pthread_rwlock_wrlock(file_lock(volume, open_file->inode));
+      result = write_open_file(volume, open_file, buffer, size);
+      pthread_rwlock_unlock(file_lock(volume, open_file->inode));
+    }
+  }
+  if (result == 0 &&
+      open_file->write_length == WRITE_BEHIND_BLOCKS * BLOCK_SIZE) {
+    result = flush_write_behind(volume, open_file);
+  }
+  pthread_mutex_unlock(&open_file->lock);
+  end_operation(volume);
+  return result;
+}
+
+int append_file(struct Volume *volume, struct Inode *entry, void *data,
+                size_t size) {
+  uint64_t current_size = entry->size;
+
+  if (size == 0) {
+    return 0;
+  }
+  if (size > MAX_FILE_SIZE - current_size) {
+    printf("ERROR: Append would exceed the maximum file size\n");
+    return -1;
+  }
+
+  struct ExtentMap *map = file_map(volume, entry);
+  if (map == NULL) {
+    return -1;
+  }
+  int small = small_write(volume, entry, map, current_size, data, size,
+                          current_size + size);
+  if (small < 0 ||
+      (small == 0 &&
+       write_file_end(volume, map, current_size, data, size) < 0)) {
+    return -1;
+  }
+
+  entry->size += size;
+  entry->last_modified_at = time(NULL);
+  journal_mark_inode(volume, entry - volume->inodes);
+
+  return 0;
+}
+
+int sfs_append(struct Volume *volume, char *filename, void *data, size_t size) {
+  if (batch_full(volume)) {
+    return -1;
+  }
+  reclaim_blocks(volume, blocks_needed(size));
+  begin_operation(volume);
+  // The directory read lock keeps the file from being deleted meanwhile
+  pthread_rwlock_rdlock(&volume->directory_lock);
+  int dir_entry_index = lookup_path(volume, filename);
+  if (dir_entry_index == -1 ||
+      volume->inodes[dir_entry_index].type != INODE_FILE) {
+    pthread_rwlock_unlock(&volume->directory_lock);
+    end_operation(volume);
+    printf("File not found\n");
+    return -1;
+  }
+
+  // A descriptor open on the file has its buffered writes go first, and is
+  // kept locked so none are buffered over the appended bytes
+  struct Inode *entry = &volume->inodes[dir_entry_index];
+  struct OpenFile *open_file = NULL;
+  pthread_mutex_lock(&volume->open_file_lock);
+  for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+    if (volume->open_file_table[fd].inode == entry) {
+      open_file = &volume->open_file_table[fd];
+      pthread_mutex_lock(&open_file->lock);
+    }
+  }
+  pthread_mutex_unlock(&volume->open_file_lock);
+
+  int result = -1;
+  if ((open_file == NULL || flush_write_behind(volume, open_file) == 0) &&
+      lock_file_for_write(volume, entry) == 0) {
+    result = append_file(volume, entry, data, size);
+    pthread_rwlock_unlock(file_lock(volume, entry));
+  }
+  if (open_file != NULL) {
+    pthread_mutex_unlock(&open_file->lock);
+  }
+  pthread_rwlock_unlock(&volume->directory_lock);
+  end_operation(volume);
+  return result;
+}
+
+// Preallocation and holes
+//
+// Blocks a file has no extent for read as zeros, so a hole is simply an
+// unmapped range: a write past the end of file leaves one behind it, and
+// sfs_punch_hole frees the blocks of one in the middle. sfs_fallocate maps
+// a range to blocks ahead of the writes, in as few runs as the free space
+// allows, and zeroes those it added unless told not to; the host zeroes
+// them in the vdisk without the data passing through the cache. Blocks
+// past the end of file keep whatever they were last given, so growing a
+// file first zeroes the rest of its last block. All three work on a
+// descriptor open for writing, after its buffered writes.
+
+struct OpenFile *lock_file_for_change(struct Volume *volume, int fd) {
+  // Returns the locked table entry of a descriptor open for writing, with
+  // its buffered writes flushed and the file lock held exclusively, or NULL
+  struct OpenFile *open_file = lock_open_file(volume, fd);
+  if (open_file == NULL) {
+    return NULL;
+  }
+  if (open_file->open_mode != WRITE_MODE) {
+    printf("ERROR: The given file is not opened in write mode\n");
+    pthread_mutex_unlock(&open_file->lock);
+    return NULL;
+  }
+  if (flush_write_behind(volume, open_file) < 0) {
+    pthread_mutex_unlock(&open_file->lock);
+    return NULL;
+  }
+  pthread_rwlock_wrlock(file_lock(volume, open_file->inode));
+  return open_file;
+}
+
+void unlock_file_for_change(struct Volume *volume, struct OpenFile *open_file,
+                            bool changed) {
+  struct Inode *entry = open_file->inode;
+  if (changed) {
+    entry->last_modified_at = time(NULL);
+    journal_mark_inode(volume, entry - volume->inodes);
+  }
+  pthread_rwlock_unlock(file_lock(volume, entry));
+  pthread_mutex_unlock(&open_file->lock);
+}
+
+int truncate_file(struct Volume *volume, struct Inode *entry,
+                  struct ExtentMap *map, uint64_t size) {
+  // A small file, or one that becomes small, is rewritten with no new bytes
+  char none = 0;
+  int small = small_write(volume, entry, map, size, &none, 0, size);
+  if (small != 0) {
+    return small < 0 ? -1 : 0;
+  }
+
+  uint32_t num_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (flush_delayed_blocks(volume, map, entry->size) < 0 ||
+      (size < entry->size && split_chunk_at(volume, map, num_blocks) < 0)) {
+    return -1;
+  }
+  if (size < entry->size) {
+    extent_map_truncate(volume, map, num_blocks);
+  } else {
+    zero_file_tail(volume, map, entry->size);
+  }
+  return 0;
+}
 
-  int start_block = read_write_pointer / BLOCK_SIZE;
-  int start_block_offset = read_write_pointer % BLOCK_SIZE;
-  int end_block = (read_write_pointer + size) / BLOCK_SIZE;
-  int end_block_offset = (read_write_pointer + size) % BLOCK_SIZE;
+int sfs_truncate(struct Volume *volume, int fd, uint64_t size) {
+  if (size > MAX_FILE_SIZE) {
+    printf("ERROR: Truncate would exceed the maximum file size\n");
+    return -1;
+  }
+  if (batch_full(volume)) {
+    return -1;
+  }
+  begin_operation(volume);
 
+  // An emptied file takes small writes again, which need the tail table
   if (size == 0) {
-    return 0;
+    pthread_rwlock_rdlock(&volume->directory_lock);
+    int loaded = load_tail_blocks(volume);
+    pthread_rwlock_unlock(&volume->directory_lock);
+    if (loaded < 0) {
+      end_operation(volume);
+      return -1;
+    }
   }
 
-  // Fetch the index block of the file
-  struct IndexBlock index_block;
-  get_index_block(&index_block,
-                  open_file_table[fd].dir_entry_pointer->index_block);
-
-  char block[BLOCK_SIZE];
-  size_t copy_size;
+  struct OpenFile *open_file = lock_file_for_change(volume, fd);
+  if (open_file == NULL) {
+    end_operation(volume);
+    return -1;
+  }
+  struct Inode *entry = open_file->inode;
+  struct ExtentMap *map = file_map(volume, entry);
+  int result = map == NULL ? -1 : truncate_file(volume, entry, map, size);
+  if (result == 0) {
+    entry->size = size;
+  }
+  unlock_file_for_change(volume, open_file, result == 0);
+  end_operation(volume);
+  return result;
+}
 
-  // If file is empty, find an empty block and assign it to the file
-  if (index_block.block_pointers[start_block] == INVALID_BLOCK_POINTER) {
-    int empty_block_index = find_empty_block();
-    if (empty_block_index == -1) {
-      printf("ERROR: Couldn't find a free block to assign to file\n");
+int preallocate_file(struct Volume *volume, struct Inode *entry,
+                     struct ExtentMap *map, uint64_t offset, uint64_t end,
+                     int flags) {
+  if (promote_small_file(volume, entry, map) < 0 ||
+      flush_delayed_blocks(volume, map, entry->size) < 0) {
+    return -1;
+  }
+  uint32_t first = offset / BLOCK_SIZE;
+  uint32_t last = (end - 1) / BLOCK_SIZE;
+
+  // Note the holes in the range, which are to be zeroed once they have
+  // blocks; the blocks already mapped keep their contents
+  struct ExtentMap holes;
+  extent_map_init(&holes);
+  uint32_t logical = first;
+  while (logical <= last) {
+    int index = extent_map_find(map, logical);
+    if (index >= 0) {
+      logical = map->extents[index].logical +
+                extent_blocks(&map->extents[index]);
+      continue;
+    }
+    uint32_t next = extent_map_upper(map, logical);
+    uint32_t hole_end = last;
+    if (next < map->count && map->extents[next].logical - 1 < hole_end) {
+      hole_end = map->extents[next].logical - 1;
+    }
+    if (extent_map_insert(&holes, logical, 0, hole_end - logical + 1) < 0) {
+      extent_map_free(&holes);
       return -1;
     }
-    index_block.block_pointers[start_block] = empty_block_index;
+    logical = hole_end + 1;
   }
 
-  // If the start pointer and end pointer in same block
-  if (start_block == end_block) {
-    read_block(block, index_block.block_pointers[start_block]);
+  if (extent_map_assign(volume, map, first, last) < 0) {
+    printf("ERROR: Not enough free blocks to preallocate\n");
+    extent_map_free(&holes);
+    return -1;
+  }
+  for (uint32_t i = 0; i < holes.count && !(flags & SFS_FALLOC_NO_ZERO);
+       i++) {
+    logical = holes.extents[i].logical;
+    uint32_t hole_end = logical + holes.extents[i].length;
+    while (logical < hole_end) {
+      uint64_t physical;
+      uint32_t count = extent_map_run(map, extent_map_find(map, logical),
+                                      logical, &physical);
+      if (count > hole_end - logical) {
+        count = hole_end - logical;
+      }
+      zero_blocks(volume, physical, count);
+      logical += count;
+    }
+  }
+  extent_map_free(&holes);
 
-    copy_size = end_block_offset - start_block_offset;
-    memcpy(block + start_block_offset, buffer, copy_size);
-    write_block(block, index_block.block_pointers[start_block]);
+  if (!(flags & SFS_FALLOC_KEEP_SIZE) && end > entry->size) {
+    zero_file_tail(volume, map, entry->size);
+    entry->size = end;
+  }
+  return 0;
+}
 
-    uint32_t new_size = read_write_pointer + size;
+int sfs_fallocate(struct Volume *volume, int fd, uint64_t offset,
+                  uint64_t length, int flags) {
+  // Gives [offset, offset + length) blocks, growing the file over it
+  // unless SFS_FALLOC_KEEP_SIZE is given. Blocks the range already has are
+  // left as they are.
+  if (length == 0 || offset > MAX_FILE_SIZE - 1 ||
+      length > MAX_FILE_SIZE - offset) {
+    printf("ERROR: Invalid range to preallocate\n");
+    return -1;
+  }
+  if (batch_full(volume)) {
+    return -1;
+  }
+  reclaim_blocks(volume, blocks_needed(length));
+  begin_operation(volume);
+  struct OpenFile *open_file = lock_file_for_change(volume, fd);
+  if (open_file == NULL) {
+    end_operation(volume);
+    return -1;
+  }
+  struct Inode *entry = open_file->inode;
+  struct ExtentMap *map = file_map(volume, entry);
+  int result = map == NULL ? -1
+                           : preallocate_file(volume, entry, map, offset,
+                                              offset + length, flags);
+  unlock_file_for_change(volume, open_file, result == 0);
+  end_operation(volume);
+  return result;
+}
 
-    // Update all size references
-    open_file_table[fd].read_write_pointer = new_size;
+int punch_file_hole(struct Volume *volume, struct Inode *entry,
+                    struct ExtentMap *map, uint64_t offset, uint64_t end) {
+  if (end > entry->size) {
+    end = entry->size;
+  }
+  if (offset >= end) {
+    return 0;
+  }
+  if (file_is_small(entry)) {
+    char zeros[TAIL_MAX_SIZE] = {0};
+    return small_write(volume, entry, map, offset, zeros, end - offset,
+                       entry->size) < 0
+               ? -1
+               : 0;
+  }
 
-    // Get FCB reference
-    struct FCB *fcb =
-        &file_control_blocks[open_file_table[fd].dir_entry_pointer->fcb_index];
+  // Whole blocks are freed, counting a last block cut off at the end of
+  // file; the pieces of blocks at either end are zeroed
+  if (flush_delayed_blocks(volume, map, entry->size) < 0) {
+    return -1;
+  }
+  uint32_t first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  uint32_t last_end =
+      (end == entry->size ? end + BLOCK_SIZE - 1 : end) / BLOCK_SIZE;
+  uint64_t head_end = (uint64_t)first * BLOCK_SIZE;
+  if (head_end > end) {
+    head_end = end;
+  }
+  if (first < last_end && (split_chunk_at(volume, map, first) < 0 ||
+                           split_chunk_at(volume, map, last_end) < 0)) {
+    return -1;
+  }
+  zero_file_range(volume, map, offset, head_end);
+  if (first < last_end && extent_map_punch(volume, map, first, last_end) < 0) {
+    return -1;
+  }
+  uint64_t tail_start = (uint64_t)last_end * BLOCK_SIZE;
+  zero_file_range(volume, map, tail_start > head_end ? tail_start : head_end,
+                  end);
+  return 0;
+}
 
-    // Update metadata
-    fcb->size = new_size;
-    fcb->last_modified_at = time(NULL);
-    open_file_table[fd].dir_entry_pointer->size = new_size;
+int sfs_punch_hole(struct Volume *volume, int fd, uint64_t offset,
+                   uint64_t length) {
+  // Makes [offset, offset + length) read as zeros, freeing the blocks it
+  // covers whole. The file keeps its size.
+  if (length > UINT64_MAX - offset) {
+    printf("ERROR: Invalid range to punch\n");
+    return -1;
+  }
+  if (batch_full(volume)) {
+    return -1;
+  }
+  begin_operation(volume);
+  struct OpenFile *open_file = lock_file_for_change(volume, fd);
+  if (open_file == NULL) {
+    end_operation(volume);
+    return -1;
+  }
+  struct Inode *entry = open_file->inode;
+  struct ExtentMap *map = file_map(volume, entry);
+  int result = map == NULL ? -1
+                           : punch_file_hole(volume, entry, map, offset,
+                                             offset + length);
+  unlock_file_for_change(volume, open_file, result == 0);
+  end_operation(volume);
+  return result;
+}
 
-    // Persist the index block changes
-    set_index_block(&index_block,
-                    open_file_table[fd].dir_entry_pointer->index_block);
+// Asynchronous I/O
+//
+// An AsyncQueue runs positional reads and writes without blocking the
+// submitting thread on the data transfer. With io_uring the submitter walks
+// the extent map itself (file_read_range / file_write_range, as sfs_read and
+// sfs_write do), stages partial blocks through the cache, and queues each
+// run of whole blocks as one ring entry; a request completes when its last
+// entry does. Without io_uring, or with SFS_ASYNC_THREADS, depth worker
+// threads run the requests synchronously instead. Either way finished
+// requests are handed back, and their callbacks run, in sfs_async_poll.
+
+void defer_run(struct Volume *volume, struct AsyncRequest *request,
+               struct BlockRun *run, bool write) {
+  // Partial blocks go through the cache right away; whole blocks are
+  // recorded on the request for the ring
+  if (volume->vdisk_map != NULL) {
+    transfer_run(volume, run, write);
+    return;
+  }
 
-    return 0;
+  uint64_t start = run->start;
+  uint32_t count = run->count;
+  if (run->head != NULL) {
+    if (write) {
+      write_block(volume, run->head, start);
+    } else {
+      read_block(volume, run->head, start);
+    }
+    start++;
+    count--;
   }
+  if (run->tail != NULL) {
+    if (write) {
+      write_block(volume, run->tail, run->start + run->count - 1);
+    } else {
+      read_block(volume, run->tail, run->start + run->count - 1);
+    }
+    count--;
+  }
+
+  if (request->run_count == request->run_capacity) {
+    int capacity = request->run_capacity == 0 ? 4 : request->run_capacity * 2;
+    struct AsyncRun *runs =
+        realloc(request->runs, capacity * sizeof(struct AsyncRun));
+    if (runs == NULL) {
+      // Out of memory: move this run synchronously
+      struct BlockRun body = {start, count, NULL, run->body, NULL};
+      transfer_run(volume, &body, write);
+      return;
+    }
+    request->runs = runs;
+    request->run_capacity = capacity;
+  }
+
+  // Same cache reconciliation as transfer_run
+  if (write) {
+    checksum_store(volume, start, count, run->body);
+    cache_discard(volume, start, count);
+  } else {
+    cache_writeback_range(volume, start, count);
+  }
+  struct AsyncRun *deferred = &request->runs[request->run_count++];
+  deferred->request = request;
+  deferred->start = start;
+  deferred->count = count;
+  deferred->body = run->body;
+}
 
-  // Write from start pointer offset to end of start pointer block
-  read_block(block, index_block.block_pointers[start_block]);
+void complete_request(struct AsyncQueue *queue, struct AsyncRequest *request) {
+  // Caller holds the queue lock
+  request->next = NULL;
+  if (queue->completed_tail != NULL) {
+    queue->completed_tail->next = request;
+  } else {
+    queue->completed_head = request;
+  }
+  queue->completed_tail = request;
+  queue->completed_count++;
+  pthread_cond_broadcast(&queue->completed_ready);
+}
 
-  copy_size = BLOCK_SIZE - start_block_offset;
-  memcpy(block + start_block_offset, buffer, copy_size);
-  write_block(block, index_block.block_pointers[start_block]);
+#ifdef SFS_HAVE_IO_URING
 
-  // Write from first block after the starting offset till last complete end
-  // block
-  for (int i = start_block + 1; i < end_block; i++) {
-    if (index_block.block_pointers[i] == INVALID_BLOCK_POINTER) {
-      int empty_block_index = find_empty_block();
-      if (empty_block_index == -1) {
-        printf("ERROR: Couldn't find a free block to assign to file\n");
-        open_file_table[fd].read_write_pointer +=
-            start_block_offset + (i - 1 - start_block) * BLOCK_SIZE;
-        return -1;
-      }
-      index_block.block_pointers[i] = empty_block_index;
+int ring_setup(struct AsyncRing *ring, unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0) {
+    return -1;
+  }
+  // Plain IORING_OP_READ / IORING_OP_WRITE arrived with this feature
+  if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+    close(ring->fd);
+    return -1;
+  }
+
+  ring->entries = params.sq_entries;
+  ring->sq_map_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_map_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_map_size > ring->sq_map_size) {
+      ring->sq_map_size = ring->cq_map_size;
+    }
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_map = ring->sq_map;
+  if (ring->sq_map != MAP_FAILED &&
+      !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_CQ_RING);
+  }
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    perror("Failed to map io_uring");
+    if (ring->sqes != MAP_FAILED) {
+      munmap(ring->sqes, ring->sqes_size);
     }
-    write_block(buffer + start_block_offset + (i - start_block) * BLOCK_SIZE,
-                index_block.block_pointers[i]);
+    if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+      munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map != MAP_FAILED) {
+      munmap(ring->sq_map, ring->sq_map_size);
+    }
+    close(ring->fd);
+    return -1;
   }
 
-  // Write till end block offset
+  char *sq = ring->sq_map;
+  char *cq = ring->cq_map;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return 0;
+}
 
-  if (index_block.block_pointers[end_block] == INVALID_BLOCK_POINTER) {
-    int empty_block_index = find_empty_block();
-    if (empty_block_index == -1) {
-      printf("ERROR: Couldn't find a free block to assign to file\n");
-      open_file_table[fd].read_write_pointer +=
-          start_block_offset + (end_block - 1 - start_block) * BLOCK_SIZE;
-      return -1;
+void ring_teardown(struct AsyncRing *ring) {
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_map != ring->sq_map) {
+    munmap(ring->cq_map, ring->cq_map_size);
+  }
+  munmap(ring->sq_map, ring->sq_map_size);
+  close(ring->fd);
+}
+
+void ring_enter(struct AsyncQueue *queue, unsigned min_complete) {
+  // Submits everything queued so far, optionally waiting for completions
+  unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+  while (queue->ring_unsubmitted > 0 || min_complete > 0) {
+    int submitted = syscall(__NR_io_uring_enter, queue->ring.fd,
+                            queue->ring_unsubmitted, min_complete, flags,
+                            NULL, 0);
+    if (submitted < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+        continue;
+      }
+      perror("Failed to enter io_uring");
+      return;
+    }
+    queue->ring_unsubmitted -= submitted;
+    min_complete = 0;
+    flags = 0;
+  }
+}
+
+void ring_reap(struct AsyncQueue *queue) {
+  // Retires every available completion. Caller holds the queue lock.
+  struct AsyncRing *ring = &queue->ring;
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    struct AsyncRun *run = (struct AsyncRun *)(uintptr_t)cqe->user_data;
+    struct AsyncRequest *request = run->request;
+    if (cqe->res != (int)(run->count * BLOCK_SIZE)) {
+      request->result = -1;
+    } else if (request->opcode != SFS_ASYNC_WRITE &&
+               !checksum_verify(queue->volume, run->start, run->count,
+                                run->body)) {
+      request->result = -1;
+    }
+    if (request->opcode == SFS_ASYNC_WRITE) {
+      // Read-ahead may have cached the old contents meanwhile
+      cache_discard(queue->volume, run->start, run->count);
+      if (cqe->res == (int)(run->count * BLOCK_SIZE)) {
+        checksum_written(queue->volume, run->start, run->count);
+      }
+    }
+    if (--request->runs_pending == 0) {
+      complete_request(queue, request);
     }
-    index_block.block_pointers[end_block] = empty_block_index;
+    queue->ring_in_flight--;
+    head++;
   }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+void ring_submit_request(struct AsyncQueue *queue,
+                         struct AsyncRequest *request) {
+  // Queues every deferred run of the request on the ring, waiting for room
+  // when it is full
+  struct AsyncRing *ring = &queue->ring;
+  pthread_mutex_lock(&queue->lock);
+  for (int i = 0; i < request->run_count; i++) {
+    while (queue->ring_in_flight == ring->entries) {
+      ring_enter(queue, 1);
+      ring_reap(queue);
+    }
 
-  copy_size = end_block_offset;
-  memcpy(block,
-         buffer + start_block_offset + (end_block - start_block) * BLOCK_SIZE,
-         copy_size);
+    struct AsyncRun *run = &request->runs[i];
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->opcode == SFS_ASYNC_WRITE ? IORING_OP_WRITE
+                                                      : IORING_OP_READ;
+    sqe->fd = queue->volume->vdisk_fd;
+    sqe->off = (uint64_t)run->start * BLOCK_SIZE;
+    sqe->addr = (uintptr_t)run->body;
+    sqe->len = run->count * BLOCK_SIZE;
+    sqe->user_data = (uintptr_t)run;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    request->runs_pending++;
+    queue->ring_in_flight++;
+    queue->ring_unsubmitted++;
+    if (request->opcode == SFS_ASYNC_WRITE) {
+      stat_add(&queue->volume->cache_stats.disk_writes, 1);
+    } else {
+      stat_add(&queue->volume->cache_stats.disk_reads, 1);
+    }
+  }
+  ring_enter(queue, 0);
+  pthread_mutex_unlock(&queue->lock);
+}
 
-  // Free the remaining blocks
-  for (int i = end_block + 1; i < POINTERS_PER_BLK; i++) {
-    if (index_block.block_pointers[i] != INVALID_BLOCK_POINTER) {
-      bitmap[index_block.block_pointers[i]] = UNUSED_FLAG;
+#else
+
+int ring_setup(struct AsyncRing *ring, unsigned entries) { return -1; }
+void ring_teardown(struct AsyncRing *ring) {}
+void ring_enter(struct AsyncQueue *queue, unsigned min_complete) {}
+void ring_reap(struct AsyncQueue *queue) {}
+void ring_submit_request(struct AsyncQueue *queue,
+                         struct AsyncRequest *request) {}
+
+#endif
+
+void async_drain(struct Volume *volume) {
+  // Waits until no ring has transfers in flight; finished requests stay
+  // queued for their owners to poll
+  pthread_mutex_lock(&volume->async_lock);
+  for (struct AsyncQueue *queue = volume->async_queues; queue != NULL;
+       queue = queue->next_queue) {
+    if (!queue->use_ring) {
+      continue;
+    }
+    pthread_mutex_lock(&queue->lock);
+    ring_reap(queue);
+    while (queue->ring_in_flight > 0) {
+      ring_enter(queue, 1);
+      ring_reap(queue);
     }
-    index_block.block_pointers[i] = INVALID_BLOCK_POINTER;
+    pthread_mutex_unlock(&queue->lock);
   }
+  pthread_mutex_unlock(&volume->async_lock);
+}
 
-  // At the end of sfs_write():
-  uint32_t new_size = read_write_pointer + size;
+struct OpenFile *lock_request_file(struct Volume *volume,
+                                   struct AsyncRequest *request, int mode,
+                                   bool write_lock) {
+  // Takes the file lock of the request's descriptor. The descriptor's own
+  // lock is dropped again, so requests on one descriptor can overlap; it
+  // must stay open until they have completed.
+  struct OpenFile *open_file = lock_open_file(volume, request->fd);
+  if (open_file == NULL) {
+    return NULL;
+  }
+  if (open_file->open_mode != mode) {
+    printf("ERROR: The given file is not opened in %s mode\n",
+           mode == READ_MODE ? "read" : "write");
+    pthread_mutex_unlock(&open_file->lock);
+    return NULL;
+  }
+  if (write_lock && flush_write_behind(volume, open_file) < 0) {
+    pthread_mutex_unlock(&open_file->lock);
+    return NULL;
+  }
+  if (write_lock) {
+    pthread_rwlock_wrlock(file_lock(volume, open_file->inode));
+  } else {
+    pthread_rwlock_rdlock(file_lock(volume, open_file->inode));
+  }
+  pthread_mutex_unlock(&open_file->lock);
+  return open_file;
+}
 
-  // Update all size references
-  open_file_table[fd].read_write_pointer = new_size;
+int read_at(struct Volume *volume, struct AsyncQueue *queue,
+            struct AsyncRequest *request) {
+  // A ring queue gets the whole-block runs; otherwise they move here
+  struct OpenFile *open_file =
+      lock_request_file(volume, request, READ_MODE, false);
+  if (open_file == NULL) {
+    return -1;
+  }
+  struct Inode *entry = open_file->inode;
+  uint64_t file_size = entry->size;
+
+  int result = -1;
+  checksum_failed = false;
+  struct ExtentMap *map = file_map(volume, entry);
+  if (request->size < 0 || request->offset > file_size ||
+      (uint64_t)request->size > file_size - request->offset) {
+    printf("ERROR: Not enough bytes to read in file\n");
+  } else if (request->size == 0) {
+    result = 0;
+  } else if (file_is_small(entry)) {
+    small_read(volume, entry, request->offset, request->buffer,
+               request->size);
+    result = 0;
+  } else if (map != NULL) {
+    file_read_range(volume, map, request->offset, request->buffer,
+                    request->size, queue != NULL ? request : NULL);
+    if (queue != NULL) {
+      ring_submit_request(queue, request);
+    }
+    result = 0;
+  }
+  if (checksum_failed) {
+    result = -1;
+  }
 
-  // Get FCB reference
-  struct FCB *fcb =
-      &file_control_blocks[open_file_table[fd].dir_entry_pointer->fcb_index];
+  pthread_rwlock_unlock(file_lock(volume, entry));
+  return result;
+}
 
-  // Update metadata
-  fcb->size = new_size;
-  fcb->last_modified_at = time(NULL);
-  open_file_table[fd].dir_entry_pointer->size = new_size;
+int write_at(struct Volume *volume, struct AsyncQueue *queue,
+             struct AsyncRequest *request) {
+  // As read_at. The ring entries are queued before the call ends, so a
+  // journal commit that covers the new size also waits for the data.
+  if (batch_full(volume)) {
+    return -1;
+  }
+  reclaim_blocks(volume, blocks_needed(request->size));
+  begin_operation(volume);
+  struct OpenFile *open_file =
+      lock_request_file(volume, request, WRITE_MODE, true);
+  if (open_file == NULL) {
+    end_operation(volume);
+    return -1;
+  }
+  struct Inode *entry = open_file->inode;
+  uint64_t end = request->offset + request->size;
+
+  int result = -1;
+  struct ExtentMap *map = file_map(volume, entry);
+  if (request->size < 0 || end > MAX_FILE_SIZE) {
+    printf("ERROR: Write would exceed the maximum file size\n");
+  } else if (request->size == 0) {
+    result = 0;
+  } else if (map != NULL) {
+    // Positional writes are not delayed, and go to blocks of their own
+    int small = small_write(volume, entry, map, request->offset,
+                            request->buffer, request->size,
+                            end > entry->size ? end : entry->size);
+    if (small == 0 &&
+        (flush_delayed_blocks(volume, map, entry->size) < 0 ||
+         expand_chunks(volume, map, request->offset / BLOCK_SIZE,
+                       (end - 1) / BLOCK_SIZE + 1) < 0)) {
+      small = -1;
+    }
+    if (small == 0 && request->offset > entry->size) {
+      zero_file_tail(volume, map, entry->size);
+    }
+    if (small < 0) {
+      // Already reported
+    } else if (small == 0 &&
+               extent_map_assign(volume, map, request->offset / BLOCK_SIZE,
+                                 (end - 1) / BLOCK_SIZE) < 0) {
+      printf("ERROR: Couldn't find a free block to assign to file\n");
+    } else {
+      if (small == 0) {
+        file_write_range(volume, map, entry->size, request->offset,
+                         request->buffer, request->size,
+                         queue != NULL ? request : NULL);
+      }
+      if (queue != NULL) {
+        ring_submit_request(queue, request);
+      }
+      if (end > entry->size) {
+        entry->size = end;
+      }
+      entry->last_modified_at = time(NULL);
+      journal_mark_inode(volume, entry - volume->inodes);
+      result = 0;
+    }
+  }
 
-  // Persist the index block changes
-  set_index_block(&index_block,
-                  open_file_table[fd].dir_entry_pointer->index_block);
+  pthread_rwlock_unlock(file_lock(volume, entry));
+  end_operation(volume);
+  return result;
+}
 
-  return 0;
+int run_request(struct Volume *volume, struct AsyncQueue *queue,
+                struct AsyncRequest *request) {
+  if (request->opcode == SFS_ASYNC_WRITE) {
+    return write_at(volume, queue, request);
+  }
+  return read_at(volume, queue, request);
 }
 
-int sfs_append(char *filename, void *data, size_t size) {
-  // Find the directory entry for the file
-  int dir_entry_index = -1;
-  for (int i = 0; i < num_entries * ROOT_DIR_COUNT; i++) {
-    if (directory[i].used == USED_FLAG &&
-        strcmp(directory[i].filename, filename) == 0) {
-      dir_entry_index = i;
+void *async_worker(void *arg) {
+  struct AsyncQueue *queue = arg;
+  pthread_mutex_lock(&queue->lock);
+  while (true) {
+    while (queue->pending_head == NULL && !queue->stopping) {
+      pthread_cond_wait(&queue->work_ready, &queue->lock);
+    }
+    if (queue->pending_head == NULL) {
       break;
     }
+    struct AsyncRequest *request = queue->pending_head;
+    queue->pending_head = request->next;
+    if (queue->pending_head == NULL) {
+      queue->pending_tail = NULL;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    int result = run_request(queue->volume, NULL, request);
+
+    pthread_mutex_lock(&queue->lock);
+    request->result = result;
+    complete_request(queue, request);
   }
+  pthread_mutex_unlock(&queue->lock);
+  return NULL;
+}
 
-  if (dir_entry_index == -1) {
-    printf("File not found\n");
-    return -1;
+struct AsyncQueue *sfs_async_open(struct Volume *volume, int depth,
+                                  int flags) {
+  // depth is the ring size, or the number of worker threads
+  if (depth <= 0) {
+    printf("ERROR: Queue depth must be at least one\n");
+    return NULL;
+  }
+  struct AsyncQueue *queue = calloc(1, sizeof(struct AsyncQueue));
+  if (queue == NULL) {
+    printf("ERROR: Could not allocate async queue\n");
+    return NULL;
+  }
+  queue->volume = volume;
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->work_ready, NULL);
+  pthread_cond_init(&queue->completed_ready, NULL);
+
+  queue->use_ring =
+      !(flags & SFS_ASYNC_THREADS) && ring_setup(&queue->ring, depth) == 0;
+  if (!queue->use_ring) {
+    queue->worker_count = min(depth, 64);
+    queue->workers = malloc(queue->worker_count * sizeof(pthread_t));
+    if (queue->workers == NULL) {
+      printf("ERROR: Could not allocate async workers\n");
+      sfs_async_close(queue);
+      return NULL;
+    }
+    for (int i = 0; i < queue->worker_count; i++) {
+      pthread_create(&queue->workers[i], NULL, async_worker, queue);
+    }
   }
 
-  // Get the corresponding FCB for the file
-  struct FCB *fcb = &file_control_blocks[directory[dir_entry_index].fcb_index];
-  uint32_t current_size = fcb->size;
+  pthread_mutex_lock(&volume->async_lock);
+  queue->next_queue = volume->async_queues;
+  volume->async_queues = queue;
+  pthread_mutex_unlock(&volume->async_lock);
+  return queue;
+}
 
-  // If the file is empty, initialize index block
-  if (current_size == 0) {
-    struct IndexBlock new_index_block;
-    memset(new_index_block.block_pointers, INVALID_BLOCK_POINTER,
-           sizeof(new_index_block.block_pointers));
-    set_index_block(&new_index_block, directory[dir_entry_index].index_block);
+int sfs_async_submit(struct AsyncQueue *queue, struct AsyncRequest *request) {
+  // Errors in the request itself are reported through its result
+  if (request->opcode != SFS_ASYNC_READ && request->opcode != SFS_ASYNC_WRITE) {
+    printf("ERROR: Unknown async opcode %d\n", request->opcode);
+    return -1;
+  }
+  request->result = 0;
+  request->runs = NULL;
+  request->run_count = 0;
+  request->run_capacity = 0;
+  request->runs_pending = 1; // held by the submitter until it is done
+  request->next = NULL;
+
+  pthread_mutex_lock(&queue->lock);
+  queue->in_flight++;
+  if (!queue->use_ring) {
+    if (queue->pending_tail != NULL) {
+      queue->pending_tail->next = request;
+    } else {
+      queue->pending_head = request;
+    }
+    queue->pending_tail = request;
+    pthread_cond_signal(&queue->work_ready);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
   }
+  pthread_mutex_unlock(&queue->lock);
+
+  int result = run_request(queue->volume, queue, request);
 
-  // Find the last block in the file's index block (or first available index
-  // block)
-  struct IndexBlock index_block;
-  read_block(&index_block, directory[dir_entry_index].index_block);
+  pthread_mutex_lock(&queue->lock);
+  if (result < 0) {
+    request->result = -1;
+  }
+  if (--request->runs_pending == 0) {
+    complete_request(queue, request);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return 0;
+}
 
-  uint32_t last_block = INVALID_BLOCK_POINTER;
-  for (int i = 0; i < POINTERS_PER_BLK; i++) {
-    if (index_block.block_pointers[i] != INVALID_BLOCK_POINTER) {
-      last_block = index_block.block_pointers[i];
+int sfs_async_poll(struct AsyncQueue *queue, int min_complete) {
+  // Returns how many requests finished, after running their callbacks.
+  // Waits for at least min_complete of them, or for all in flight if fewer.
+  pthread_mutex_lock(&queue->lock);
+  if (min_complete > queue->in_flight) {
+    min_complete = queue->in_flight;
+  }
+  if (queue->use_ring) {
+    ring_reap(queue);
+  }
+  while (queue->completed_count < min_complete) {
+    if (queue->use_ring && queue->ring_in_flight > 0) {
+      ring_enter(queue, 1);
+      ring_reap(queue);
     } else {
-      break;
+      // A submitter or worker is still finishing its part
+      pthread_cond_wait(&queue->completed_ready, &queue->lock);
     }
   }
 
-  // If the file is too short, allocate a new block
-  if (last_block == INVALID_BLOCK_POINTER) {
-    // Find a free block from the bitmap
-    int new_block = -1;
-    for (int i = 0; i < BLOCK_SIZE; i++) {
-      if (bitmap[i] == UNUSED_FLAG) {
-        new_block = i;
-        bitmap[new_block] = true;
-        break;
-      }
+  struct AsyncRequest *request = queue->completed_head;
+  int completed = queue->completed_count;
+  queue->completed_head = NULL;
+  queue->completed_tail = NULL;
+  queue->completed_count = 0;
+  queue->in_flight -= completed;
+  pthread_mutex_unlock(&queue->lock);
+
+  while (request != NULL) {
+    struct AsyncRequest *next = request->next;
+    free(request->runs);
+    request->runs = NULL;
+    if (request->callback != NULL) {
+      request->callback(request);
     }
+    request = next;
+  }
+  return completed;
+}
 
-    if (new_block == -1) {
-      printf("No free blocks available\n");
-      return -1;
-    }
+int sfs_async_close(struct AsyncQueue *queue) {
+  // Completes every outstanding request first
+  while (sfs_async_poll(queue, 1) > 0) {
+  }
 
-    // Update the index block with the new block pointer
-    for (int i = 0; i < POINTERS_PER_BLK; i++) {
-      if (index_block.block_pointers[i] == INVALID_BLOCK_POINTER) {
-        index_block.block_pointers[i] = new_block;
-        set_index_block(&index_block, directory[dir_entry_index].index_block);
-        last_block = new_block;
-        break;
+  pthread_mutex_lock(&queue->lock);
+  queue->stopping = true;
+  pthread_cond_broadcast(&queue->work_ready);
+  pthread_mutex_unlock(&queue->lock);
+  for (int i = 0; i < queue->worker_count; i++) {
+    pthread_join(queue->workers[i], NULL);
+  }
+
+  struct Volume *volume = queue->volume;
+  pthread_mutex_lock(&volume->async_lock);
+  struct AsyncQueue **link = &volume->async_queues;
+  while (*link != NULL && *link != queue) {
+    link = &(*link)->next_queue;
+  }
+  if (*link != NULL) {
+    *link = queue->next_queue;
+  }
+  pthread_mutex_unlock(&volume->async_lock);
+
+  if (queue->use_ring) {
+    ring_teardown(&queue->ring);
+  }
+  free(queue->workers);
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->work_ready);
+  pthread_cond_destroy(&queue->completed_ready);
+  free(queue);
+  return 0;
+}
+
+bool sfs_async_uses_ring(struct AsyncQueue *queue) {
+  // Whether requests go through io_uring rather than the worker pool
+  return queue->use_ring;
+}
+
+// Volume inspection
+//
+// Read-only views of a mounted volume for tools and tests, which cannot see
+// inside struct Volume.
+
+uint32_t resident_count(struct Volume *volume, uint64_t start,
+                        uint32_t count) {
+  uint32_t resident = 0;
+  for (uint64_t block = start; block < start + count; block++) {
+    resident += block_resident(volume, block);
+  }
+  return resident;
+}
+
+void sfs_get_volume_stats(struct Volume *volume, struct VolumeStats *stats) {
+  struct SuperBlock *superblock = &volume->superblock;
+  pthread_mutex_lock(&volume->alloc_lock);
+  stats->superblock = *superblock;
+  stats->reserved_blocks = volume->reserved_blocks;
+  pthread_mutex_unlock(&volume->alloc_lock);
+  stats->num_inodes = volume->num_inodes;
+  pthread_rwlock_rdlock(&volume->directory_lock);
+  stats->inodes_used = volume->inodes_used;
+  stats->names_used = volume->names_used;
+  pthread_rwlock_unlock(&volume->directory_lock);
+  stats->delayed_blocks =
+      __atomic_load_n(&volume->delayed_blocks, __ATOMIC_RELAXED);
+  stats->journal_sequence =
+      __atomic_load_n(&volume->journal_sequence, __ATOMIC_RELAXED);
+  stats->resident_inode_blocks = resident_count(
+      volume, superblock->inode_start, superblock->inode_blocks);
+  stats->resident_name_blocks = resident_count(
+      volume, superblock->name_start, superblock->name_blocks);
+  stats->resident_bitmap_blocks = resident_count(
+      volume, superblock->bitmap_start, superblock->bitmap_blocks);
+}
+
+int sfs_get_inode(struct Volume *volume, int slot, struct Inode *inode) {
+  // Copies the inode in a slot, read in if it was not yet; -1 past the
+  // high-water mark
+  int result = -1;
+  pthread_rwlock_rdlock(&volume->directory_lock);
+  if (slot >= 0 && slot < volume->inodes_used) {
+    *inode = *inode_at(volume, slot);
+    result = 0;
+  }
+  pthread_rwlock_unlock(&volume->directory_lock);
+  return result;
+}
+
+void sfs_get_file_name(struct Volume *volume, int slot, char *filename) {
+  get_file_name(volume, slot, filename);
+}
+
+// What sfs_check_volume has seen so far, over the whole disk
+struct VolumeCheck {
+  uint64_t num_blocks;
+  char *owners;        // references per block
+  uint64_t *blocks;    // of the inode being checked
+  int *listed;         // directory entries per inode slot
+  uint32_t *fragments; // tail fragments taken per block
+};
+
+int check_directory_tree(struct Volume *volume, struct VolumeCheck *check,
+                         uint64_t block, int *count,
+                         struct DirectoryKey *last) {
+  // Collects a directory tree's blocks and counts how often each inode is
+  // listed. Returns the number of entries, or -1 on a bad key.
+  struct DirectoryNode node;
+  read_block(volume, &node, block);
+  check->blocks[(*count)++] = block;
+  int entries = 0;
+  for (int i = 0; i < node.count; i++) {
+    if (node.level > 0) {
+      int below = check_directory_tree(volume, check, node.children[i].block,
+                                       count, last);
+      if (below < 0) {
+        return -1;
       }
+      entries += below;
+      continue;
+    }
+    struct DirectoryKey key = node.keys[i];
+    if (key.slot >= (uint32_t)volume->num_inodes ||
+        volume->inodes[key.slot].used != USED_FLAG ||
+        volume->inodes[key.slot].name_hash != key.name_hash ||
+        key.name_hash < last->name_hash ||
+        (key.name_hash == last->name_hash && key.slot <= last->slot)) {
+      printf("ERROR: Directory block %llu lists a bad key\n",
+             (unsigned long long)block);
+      return -1;
     }
+    *last = key;
+    check->listed[key.slot]++;
+    entries++;
   }
+  return entries;
+}
 
-  // Write the new data to the last block of the file
-  char block[BLOCK_SIZE];
-  read_block(block, last_block);
-  uint32_t offset_in_block = current_size % BLOCK_SIZE;
+int check_inode(struct Volume *volume, struct VolumeCheck *check, int slot) {
+  // Claims the blocks and fragments one inode refers to
+  struct Inode *entry = &volume->inodes[slot];
+  uint64_t num_blocks = check->num_blocks;
+  uint64_t *blocks = check->blocks;
+  char filename[MAX_FILENAME_SIZE + 1];
+  get_file_name(volume, slot, filename);
+  if (strlen(filename) != entry->name_length ||
+      volume->inode_keys[slot] != (entry->name_hash | INODE_KEY_USED)) {
+    printf("ERROR: Inode %d has a bad name or key\n", slot);
+    return -1;
+  }
 
-  // Check if we have enough space in the current block
-  if (offset_in_block + size <= BLOCK_SIZE) {
-    memcpy(block + offset_in_block, data, size);
-    write_block(block, last_block);
-  } else {
-    // If not enough space, we need to split the data across multiple blocks
-    size_t remaining_size = size;
-    char *data_ptr = (char *)data;
-
-    // Write part of the data into the current block
-    memcpy(block + offset_in_block, data_ptr, BLOCK_SIZE - offset_in_block);
-    write_block(block, last_block);
-
-    remaining_size -= (BLOCK_SIZE - offset_in_block);
-    data_ptr += (BLOCK_SIZE - offset_in_block);
-
-    // Allocate new blocks and continue writing
-    while (remaining_size > 0) {
-      int new_block = -1;
-      for (int i = 0; i < BLOCK_SIZE; i++) {
-        if (bitmap[i] == UNUSED_FLAG) {
-          new_block = i;
-          bitmap[new_block] = true;
-          break;
-        }
+  int count = 0;
+  struct Extent extents[INLINE_EXTENTS + EXTENTS_PER_LEAF * 4];
+  uint32_t extent_count = 0;
+  if (entry->type == INODE_DIRECTORY) {
+    // The root is never listed, so every key sorts after this one
+    struct DirectoryKey last = {0, ROOT_INODE};
+    int entries = entry->extent_root == INVALID_BLOCK_POINTER
+                      ? 0
+                      : check_directory_tree(volume, check,
+                                             entry->extent_root, &count,
+                                             &last);
+    if (entries < 0) {
+      return -1;
+    }
+    if ((uint64_t)entries != entry->size || entry->extent_count != 0) {
+      printf("ERROR: Directory %s has %d entries, not %llu\n", filename,
+             entries, (unsigned long long)entry->size);
+      return -1;
+    }
+  } else if (entry->layout != FILE_DATA_EXTENTS) {
+    // A small file's fragments are its own, though its tail block is not
+    bool fits = entry->layout == FILE_DATA_INLINE
+                    ? entry->size <= INLINE_DATA_SIZE
+                    : entry->size > INLINE_DATA_SIZE &&
+                          entry->size <=
+                              entry->tail.count * TAIL_FRAGMENT_SIZE &&
+                          entry->tail.first + entry->tail.count <=
+                              TAIL_FRAGMENTS;
+    if (!fits || entry->extent_count != 0) {
+      printf("ERROR: Small file %s does not fit its layout\n", filename);
+      return -1;
+    }
+    if (entry->layout == FILE_DATA_TAIL) {
+      uint32_t mask = ((1u << entry->tail.count) - 1) << entry->tail.first;
+      if (entry->tail.block < num_blocks &&
+          check->fragments[entry->tail.block] == 0) {
+        blocks[count++] = entry->tail.block;
       }
-
-      if (new_block == -1) {
-        printf("No free blocks available\n");
+      if (entry->tail.block >= num_blocks ||
+          (check->fragments[entry->tail.block] & mask) != 0) {
+        printf("ERROR: Fragments of %s are out of range or shared\n",
+               filename);
         return -1;
       }
+      check->fragments[entry->tail.block] |= mask;
+    }
+  } else if (entry->extent_root == INVALID_BLOCK_POINTER) {
+    memcpy(extents, entry->extents,
+           entry->extent_count * sizeof(struct Extent));
+    extent_count = entry->extent_count;
+  } else {
+    struct ExtentRoot root;
+    struct ExtentLeaf leaf;
+    blocks[count++] = entry->extent_root;
+    read_block(volume, &root, entry->extent_root);
+    for (uint32_t l = 0; l < root.leaf_count && l < 4; l++) {
+      blocks[count++] = root.leaves[l];
+      read_block(volume, &leaf, root.leaves[l]);
+      memcpy(&extents[extent_count], leaf.extents,
+             leaf.count * sizeof(struct Extent));
+      extent_count += leaf.count;
+    }
+  }
+  if (extent_count != entry->extent_count) {
+    printf("ERROR: %s lists %u extents but its map holds %u\n", filename,
+           entry->extent_count, extent_count);
+    return -1;
+  }
 
-      read_block(block, new_block);
-      size_t chunk_size =
-          remaining_size > BLOCK_SIZE ? BLOCK_SIZE : remaining_size;
-      memcpy(block, data_ptr, chunk_size);
-      write_block(block, new_block);
+  // Files may have holes, and blocks past their end, but extents are in
+  // order and never overlap. A compressed chunk covers more logical blocks
+  // than it stores.
+  uint32_t covered_end = 0;
+  for (uint32_t e = 0; e < extent_count; e++) {
+    bool compressed = extents[e].length & EXTENT_COMPRESSED;
+    uint32_t stored = extents[e].length & ~EXTENT_COMPRESSED;
+    if ((e > 0 && extents[e].logical < covered_end) ||
+        (compressed && (stored == 0 || stored >= COMPRESS_CHUNK_BLOCKS))) {
+      printf("ERROR: Extents of %s overlap or are out of order\n", filename);
+      return -1;
+    }
+    covered_end =
+        extents[e].logical + (compressed ? COMPRESS_CHUNK_BLOCKS : stored);
+    for (uint32_t b = 0; b < stored; b++) {
+      if (count == (int)num_blocks) {
+        printf("ERROR: %s maps more blocks than the disk has\n", filename);
+        return -1;
+      }
+      blocks[count++] = extents[e].start + b;
+    }
+  }
 
-      remaining_size -= chunk_size;
-      data_ptr += chunk_size;
+  for (int b = 0; b < count; b++) {
+    if (blocks[b] < volume->data_blocks_start || blocks[b] >= num_blocks ||
+        check->owners[blocks[b]]++ != 0) {
+      printf("ERROR: Block %llu of %s is out of range or shared\n",
+             (unsigned long long)blocks[b], filename);
+      return -1;
+    }
+  }
+  return 0;
+}
 
-      // Update index block with the new block pointer
-      for (int i = 0; i < POINTERS_PER_BLK; i++) {
-        if (index_block.block_pointers[i] == INVALID_BLOCK_POINTER) {
-          index_block.block_pointers[i] = new_block;
-          set_index_block(&index_block, directory[dir_entry_index].index_block);
-          break;
-        }
+int check_free_space(struct Volume *volume, struct VolumeCheck *check) {
+  // Blocks freed since the last commit stay set in the bitmap until it is
+  // durable, but nothing may refer to them any more
+  for (int r = 0; r < volume->pending_free_count; r++) {
+    struct BlockRange *range = &volume->pending_frees[r];
+    for (uint64_t b = range->start; b < range->start + range->count; b++) {
+      if (check->owners[b]++ != 0) {
+        printf("ERROR: Freed block %llu is still in use\n",
+               (unsigned long long)b);
+        return -1;
       }
     }
   }
 
-  // Update the file size in the FCB
-  fcb->size += size;
-  fcb->last_modified_at = time(NULL);
-
-  // Update the directory entry
-  directory[dir_entry_index].size = fcb->size;
+  // Likewise freed fragments of a tail block
+  for (int f = 0; f < volume->tail_free_count; f++) {
+    struct TailFree *freed = &volume->tail_frees[f];
+    if ((check->fragments[freed->block] & freed->fragments) != 0) {
+      printf("ERROR: Freed fragments of block %llu are still in use\n",
+             (unsigned long long)freed->block);
+      return -1;
+    }
+  }
 
+  uint64_t free_count = 0;
+  for (uint64_t b = volume->data_blocks_start; b < check->num_blocks; b++) {
+    bool used = (volume->bitmap[b / 64] >> (b % 64)) & 1;
+    if (used != (check->owners[b] != 0)) {
+      printf("ERROR: Bitmap marks block %llu as %s\n", (unsigned long long)b,
+             used ? "used but nothing refers to it" : "free while in use");
+      return -1;
+    }
+    free_count += !used;
+  }
+  if (free_count != volume->superblock.num_free_blocks) {
+    printf("ERROR: Superblock counts disagree with the metadata\n");
+    return -1;
+  }
+  for (int i = 0; i < volume->num_inodes; i++) {
+    bool used = volume->inodes[i].used == USED_FLAG;
+    if (check->listed[i] != (used && i != ROOT_INODE)) {
+      printf("ERROR: Inode %d is listed %d times\n", i, check->listed[i]);
+      return -1;
+    }
+  }
   return 0;
 }
+
+int sfs_check_volume(struct Volume *volume) {
+  // Every block a file or directory refers to lies in the data area and
+  // belongs to it alone, the bitmap marks exactly those blocks as used, and
+  // every inode but the root is listed by exactly one directory. No other
+  // call may run on the volume meanwhile.
+  if (sfs_load_metadata(volume) < 0) {
+    return -1;
+  }
+  struct VolumeCheck check;
+  check.num_blocks = volume->superblock.num_blocks;
+  check.owners = calloc(check.num_blocks, 1);
+  check.blocks = malloc(check.num_blocks * sizeof(uint64_t));
+  check.listed = calloc(volume->num_inodes, sizeof(int));
+  check.fragments = calloc(check.num_blocks, sizeof(uint32_t));
+  int result = 0;
+  if (check.owners == NULL || check.blocks == NULL || check.listed == NULL ||
+      check.fragments == NULL) {
+    printf("ERROR: Could not allocate the volume check\n");
+    result = -1;
+  }
+  for (int i = 0; i < volume->num_inodes && result == 0; i++) {
+    if (volume->inodes[i].used == USED_FLAG) {
+      result = check_inode(volume, &check, i);
+    }
+  }
+  if (result == 0) {
+    result = check_free_space(volume, &check);
+  }
+  free(check.fragments);
+  free(check.listed);
+  free(check.blocks);
+  free(check.owners);
+  return result;
+}
@@ -2,6 +2,7 @@
 #define SIMPLE_FILE_SYSTEM_H
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -15,16 +16,50 @@
 #define BLOCK_SIZE 4096
 #define UNUSED_FLAG 0
 #define USED_FLAG 1
-#define BITMAP_BLOCK 1
-#define FCB_BLOCKS_START 9
-#define FCB_BLOCKS_COUNT 4
 #define SUPERBLOCK_BLOCK 0
-#define ROOT_DIR_START 5
-#define ROOT_DIR_COUNT 4
-#define MAX_FILES 128
-#define POINTERS_PER_BLK (BLOCK_SIZE / sizeof(uint32_t))
-#define INVALID_BLOCK_POINTER 0xFF
+#define SFS_MAGIC 0x31534653 // "SFS1"
+#define SFS_FORMAT_VERSION 7
+#define BLOCKS_PER_FILE_SLOT 64 // one inode per 256 KiB
+#define MIN_FILE_SLOTS 32
+#define MAX_FILE_SLOTS (1 << 24)
+#define MAX_VOLUME_BLOCKS ((uint64_t)UINT32_MAX * 64) // 1 PiB
+#define MAX_FILE_SIZE ((uint64_t)UINT32_MAX * BLOCK_SIZE)
+#define INLINE_EXTENTS 4
+#define INLINE_NAME_SIZE 20 // longer names go to the name table
+#define INLINE_DATA_SIZE 64  // the inline extents' bytes, see small_write
+#define TAIL_FRAGMENT_SIZE 256
+#define TAIL_FRAGMENTS (BLOCK_SIZE / TAIL_FRAGMENT_SIZE)
+#define TAIL_MAX_SIZE 2048 // larger files get blocks of their own
+#define FILE_DATA_EXTENTS 0
+#define FILE_DATA_INLINE 1
+#define FILE_DATA_TAIL 2
+#define INODE_KEY_USED 0x80000000u
+#define INODE_FILE 0
+#define INODE_DIRECTORY 1
+#define ROOT_INODE 0 // the root directory, created by formatting
+#define DIRECTORY_MAX_DEPTH 6
+#define INVALID_BLOCK_POINTER UINT64_MAX
 #define MAX_OPEN_FILES 16
+#define MAX_FILE_LOCKS 1024
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+#define SFS_DEFAULT_CACHE_BLOCKS 256
+#define CACHE_SHARDS 8
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_MAX_BLOCKS 64
+#define WRITE_BEHIND_BLOCKS 16
+#define ZERO_CHUNK_BLOCKS 16 // zeros written at a time, see zero_blocks
+#define DELAYED_MAX_BLOCKS 256    // per file, see append_delayed
+#define DELAYED_TOTAL_BLOCKS 2048 // per volume
+#define COMPRESS_CHUNK_BLOCKS 16      // logical blocks per compressed chunk
+#define CHUNK_CACHE_ENTRIES 32        // decompressed chunks kept per volume
+#define CHUNK_MAGIC 0x345A4C43        // "CLZ4"
+#define EXTENT_COMPRESSED 0x80000000u // in an extent's length, see Extent
+#define EXTENT_MAX_BLOCKS (EXTENT_COMPRESSED - 1)
+#define JOURNAL_MAGIC 0x4C4E524A // "JRNL"
+#define JOURNAL_INODE 1
+#define JOURNAL_NAME 2
+#define JOURNAL_BITMAP 3
+#define JOURNAL_RECORD_LIMIT 4096 // inode or name records per transaction
 
 #define SFS_SEEK_SET 0
 #define SFS_SEEK_CUR 1
@@ -33,60 +68,342 @@
 #define READ_MODE 0
 #define WRITE_MODE 1
 
-#pragma pack(push, 1)
+// Mount flags
+#define SFS_MOUNT_MMAP 0x1     // serve the vdisk from a shared memory mapping
+#define SFS_MOUNT_PREFETCH 0x2 // fault in all metadata on a background thread
+#define SFS_MOUNT_NO_VERIFY 0x4 // don't check block checksums on reads
+#define SFS_MOUNT_COMPRESS 0x8  // store appended data in compressed chunks
+#define PREFETCH_CHUNK_BLOCKS 256
 
-struct FCB {
-  char filename[MAX_FILENAME_SIZE + 1];
-  char owner[MAX_FILENAME_SIZE + 1];
-  uint32_t size;
-  time_t created_at;
-  time_t last_modified_at;
-  bool used;
-};
+#define SFS_ASYNC_READ 0
+#define SFS_ASYNC_WRITE 1
+#define SFS_ASYNC_THREADS 0x1 // use the worker pool even if io_uring works
+
+// CRC32C kernels, see sfs_crc32c_kernel
+#define SFS_CRC32C_BYTEWISE 0 // one table lookup per byte
+#define SFS_CRC32C_SLICING 1  // slicing-by-8 tables
+#define SFS_CRC32C_SSE42 2    // the crc32 instruction on three streams
+#define SFS_CRC32C_KERNELS 3
+#define CRC32C_POLY 0x82F63B78 // reflected Castagnoli polynomial
+#define CRC32C_LONG 1360 // three-stream stride: 4080 bytes of each block
+#define CRC32C_SHORT 128
 
+// LZ4 block format limits, see sfs_lz4_compress
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // the last bytes are always literals
+#define LZ4_MATCH_LIMIT 12  // no match starts closer to the end
+#define LZ4_MAX_OFFSET 65535
+
+// sfs_fallocate flags
+#define SFS_FALLOC_KEEP_SIZE 0x1 // allocate past the end without growing it
+#define SFS_FALLOC_NO_ZERO 0x2   // skip zeroing: old block contents show
+
+#pragma pack(push, 1)
+
+// Every region's place and size is decided at format time and recorded
+// here. The layout is superblock | inode table | name table | bitmap |
+// journal | checksums | data.
 struct SuperBlock {
-  uint32_t num_blocks;
-  uint32_t num_free_blocks;
-  uint32_t num_free_fcbs;
+  uint32_t magic;
+  uint32_t version;
+  uint64_t num_blocks;
+  uint64_t num_free_blocks;
   uint32_t num_files;
+  uint64_t inode_start;
+  uint32_t inode_blocks;
+  uint64_t name_start;
+  uint32_t name_blocks;
+  uint64_t bitmap_start;
+  uint32_t bitmap_blocks;
+  uint64_t journal_start;
+  uint32_t journal_blocks;
+  uint32_t journal_sequence; // sequence of the first transaction in it
+  uint64_t checksum_start;
+  uint32_t checksum_blocks;
+  uint32_t inodes_used; // slots at and past these were never used
+  uint32_t names_used;
+};
+
+// A journal transaction starts on a block boundary with this header; its
+// records follow directly
+struct JournalHeader {
+  uint32_t magic;
+  uint32_t sequence;
+  uint32_t length; // bytes of records
+  uint32_t checksum;
+};
+
+// Inode and name records carry count consecutive slot images starting at
+// target; bitmap records carry count 64-bit bitmap words
+struct JournalRecord {
+  uint8_t type;
+  uint32_t target;
+  uint32_t count;
+};
+
+// A run of physically contiguous blocks backing logical blocks
+// [logical, logical + length) of a file. With EXTENT_COMPRESSED set in
+// length it is a compressed chunk instead: the COMPRESS_CHUNK_BLOCKS
+// logical blocks from logical, packed into the other bits of length worth
+// of blocks from start.
+struct Extent {
+  uint32_t logical;
+  uint64_t start;
+  uint32_t length;
+};
+
+// Leads a compressed chunk's blocks: length bytes of LZ4 data follow
+struct ChunkHeader {
+  uint32_t magic;
+  uint32_t length;
 };
 
-struct IndexBlock {
-  uint32_t block_pointers[POINTERS_PER_BLK];
+#define EXTENTS_PER_LEAF                                                       \
+  ((BLOCK_SIZE - sizeof(uint32_t)) / sizeof(struct Extent))
+#define LEAVES_PER_ROOT ((BLOCK_SIZE - sizeof(uint32_t)) / sizeof(uint64_t))
+
+// Extent tree blocks, used once a file needs more than INLINE_EXTENTS
+struct ExtentLeaf {
+  uint32_t count;
+  struct Extent extents[EXTENTS_PER_LEAF];
 };
 
-struct DirectoryEntry {
-  char filename[MAX_FILENAME_SIZE + 1];
-  uint32_t size;
-  uint32_t fcb_index;
-  uint32_t index_block;
+struct ExtentRoot {
+  uint32_t leaf_count;
+  uint64_t leaves[LEAVES_PER_ROOT];
+};
+
+// Fragments [first, first + count) of a shared tail block
+struct TailRef {
+  uint64_t block;
+  uint8_t first;
+  uint8_t count;
+};
+
+// All of a file's metadata in 128 bytes, so 32 inodes fill a block exactly.
+// The first cache line holds everything a lookup or a transfer reads; the
+// inline extents fill the second, or a small file's data or tail fragments
+// do, as layout says. A name of up to INLINE_NAME_SIZE bytes is kept here
+// without a terminator, a longer one in the file's slot of the name table.
+// A directory's size is its entry count and its extent_root the root of its
+// directory tree.
+struct Inode {
+  uint32_t name_hash;
   bool used;
+  uint8_t name_length;
+  uint8_t type;   // INODE_FILE or INODE_DIRECTORY
+  uint8_t layout; // FILE_DATA_EXTENTS, FILE_DATA_INLINE or FILE_DATA_TAIL
+  uint64_t size;
+  uint64_t extent_root;
+  uint32_t extent_count;
+  char name[INLINE_NAME_SIZE];
+  int64_t created_at;
+  int64_t last_modified_at;
+  union {
+    struct Extent extents[INLINE_EXTENTS];
+    char data[INLINE_DATA_SIZE];
+    struct TailRef tail;
+  };
+};
+
+// Name table slot, indexed like the inode table
+struct LongName {
+  char name[MAX_FILENAME_SIZE + 1];
 };
 
-struct OpenFile {
-  struct DirectoryEntry *dir_entry_pointer;
-  int open_mode;
-  int read_write_pointer;
+// Directory tree blocks. Entries are keyed by name hash and then inode slot,
+// which makes every key unique. A branch lists its children with a lower
+// bound on the keys under each; the first child takes everything below the
+// second.
+struct DirectoryKey {
+  uint32_t name_hash;
+  uint32_t slot;
+};
+
+struct DirectoryChild {
+  struct DirectoryKey low;
+  uint64_t block;
+};
+
+#define DIRECTORY_LEAF_KEYS                                                    \
+  ((BLOCK_SIZE - 2 * sizeof(uint32_t)) / sizeof(struct DirectoryKey))
+#define DIRECTORY_BRANCH_CHILDREN                                              \
+  ((BLOCK_SIZE - 2 * sizeof(uint32_t)) / sizeof(struct DirectoryChild))
+
+struct DirectoryNode {
+  uint16_t level; // 0 for a leaf
+  uint16_t count;
+  uint32_t reserved;
+  union {
+    struct DirectoryKey keys[DIRECTORY_LEAF_KEYS];
+    struct DirectoryChild children[DIRECTORY_BRANCH_CHILDREN];
+  };
 };
 
 #pragma pack(pop)
 
+// The checksum region holds one entry per block of the volume (those of the
+// header unused): the CRC32C of the block's contents as of the last commit
+// and of a write since, 0 for none. See checksum_store.
+struct BlockChecksum {
+  uint32_t current;
+  uint32_t pending;
+};
+
+// An open directory listing, opaque to callers, see sfs_opendir
+struct DirectoryStream;
+
+// What sfs_readdir returns for each entry
+struct DirEntry {
+  char name[MAX_FILENAME_SIZE + 1];
+  uint8_t type; // INODE_FILE or INODE_DIRECTORY
+};
+
+// What sfs_readdir_plus returns for each entry: the attributes too
+struct DirEntryPlus {
+  char name[MAX_FILENAME_SIZE + 1];
+  uint8_t type;
+  uint64_t size; // bytes, or entries for a directory
+  int64_t created_at;
+  int64_t last_modified_at;
+};
+
+struct CacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t writebacks;
+  uint64_t evictions;
+  uint64_t disk_reads;
+  uint64_t disk_writes;
+  uint64_t prefetched; // blocks read ahead (also counted as misses)
+  uint64_t checksum_errors; // blocks read from the vdisk that failed theirs
+  uint64_t chunk_hits;      // compressed chunks read from the chunk cache
+  uint64_t chunk_misses;    // and those decompressed from the vdisk
+};
+
+// A mounted vdisk, opaque to callers. Each sfs_mount returns its own
+// volume, so several vdisks can be mounted side by side.
+struct Volume;
+
+// Counters of a mounted volume, see sfs_get_volume_stats
+struct VolumeStats {
+  struct SuperBlock superblock; // live copy, free block count included
+  int num_inodes;
+  int inodes_used; // slots at and past these were never used
+  int names_used;
+  uint64_t reserved_blocks;        // free, but promised to delayed blocks
+  uint32_t delayed_blocks;         // held in memory over all files
+  uint32_t journal_sequence;       // sequence of the next transaction
+  uint32_t resident_inode_blocks;  // metadata blocks read in so far
+  uint32_t resident_name_blocks;
+  uint32_t resident_bitmap_blocks;
+};
+
+struct AsyncRequest;
+struct AsyncRun;
+typedef void (*sfs_async_callback)(struct AsyncRequest *request);
+
+// One asynchronous read or write, owned by the caller until it has been
+// returned by sfs_async_poll. Transfers are positional: they never move the
+// descriptor's read-write pointer, and a write may start anywhere, leaving
+// a hole that reads as zeros if it starts past the end of the file.
+struct AsyncRequest {
+  int opcode; // SFS_ASYNC_READ or SFS_ASYNC_WRITE
+  int fd;
+  void *buffer;
+  int size;
+  uint64_t offset;
+  sfs_async_callback callback; // run by sfs_async_poll, may be NULL
+  void *user_data;
+  int result; // 0 or -1 once completed
+
+  // Owned by the queue while the request is in flight
+  struct AsyncRun *runs;
+  int run_count;
+  int run_capacity;
+  int runs_pending;
+  struct AsyncRequest *next;
+};
+
+// A queue of asynchronous requests on a volume, opaque to callers
+struct AsyncQueue;
+
 // Disk creation and management
 int create_format_vdisk(char *vdiskname, unsigned int m);
-int sfs_mount(char *vdiskname);
-int sfs_umount();
+int create_format_vdisk_size(char *vdiskname, uint64_t size);
+struct Volume *sfs_mount(char *vdiskname);
+struct Volume *sfs_mount_with_flags(char *vdiskname, int flags);
+int sfs_umount(struct Volume *volume);
+int sfs_load_metadata(struct Volume *volume);
 
 // File operations
-int sfs_create(char *filename);
-int sfs_delete(char *filename);
-int sfs_open(char *filename, int mode);
-int sfs_close(int fd);
-int sfs_seek(int fd, int offset, int whence);
-int sfs_read(int fd, void *buffer, int size);
-int sfs_write(int fd, void *buffer, int size);
+int sfs_create(struct Volume *volume, char *filename);
+int sfs_delete(struct Volume *volume, char *filename);
+int sfs_open(struct Volume *volume, char *filename, int mode);
+int sfs_close(struct Volume *volume, int fd);
+int sfs_seek(struct Volume *volume, int fd, int64_t offset, int whence);
+int sfs_read(struct Volume *volume, int fd, void *buffer, int size);
+int sfs_write(struct Volume *volume, int fd, void *buffer, int size);
+int sfs_append(struct Volume *volume, char *filename, void *data, size_t size);
+int sfs_truncate(struct Volume *volume, int fd, uint64_t size);
+int sfs_fallocate(struct Volume *volume, int fd, uint64_t offset,
+                  uint64_t length, int flags);
+int sfs_punch_hole(struct Volume *volume, int fd, uint64_t offset,
+                   uint64_t length);
+// Directories (paths are '/'-separated from the root)
+int sfs_mkdir(struct Volume *volume, char *path);
+int sfs_rmdir(struct Volume *volume, char *path);
+struct DirectoryStream *sfs_opendir(struct Volume *volume, char *path);
+int sfs_readdir(struct DirectoryStream *stream, struct DirEntry *entry);
+int sfs_readdir_plus(struct DirectoryStream *stream,
+                     struct DirEntryPlus *entries, int count);
+int sfs_closedir(struct DirectoryStream *stream);
+
+// Batches (metadata changes committed atomically, in one journal write).
+// Once a batch holds JOURNAL_RECORD_LIMIT / 2 inode or name records, calls
+// that change metadata fail until it is committed.
+int sfs_begin_batch(struct Volume *volume);
+int sfs_commit_batch(struct Volume *volume);
+
+// Asynchronous I/O. Unmounting closes the queues still open on the volume.
+struct AsyncQueue *sfs_async_open(struct Volume *volume, int depth,
+                                  int flags);
+int sfs_async_submit(struct AsyncQueue *queue, struct AsyncRequest *request);
+int sfs_async_poll(struct AsyncQueue *queue, int min_complete);
+int sfs_async_close(struct AsyncQueue *queue);
+bool sfs_async_uses_ring(struct AsyncQueue *queue);
+
+// Block cache
+int sfs_sync(struct Volume *volume);
+int sfs_set_cache_capacity(struct Volume *volume, int num_blocks);
+void sfs_get_cache_stats(struct Volume *volume, struct CacheStats *stats);
+void sfs_reset_cache_stats(struct Volume *volume);
+
+// Volume inspection
+void sfs_get_volume_stats(struct Volume *volume, struct VolumeStats *stats);
+int sfs_get_inode(struct Volume *volume, int slot, struct Inode *inode);
+void sfs_get_file_name(struct Volume *volume, int slot, char *filename);
+int sfs_check_volume(struct Volume *volume);
+
+// Checksums
+uint32_t sfs_crc32c(uint32_t crc, const void *data, size_t length);
+uint32_t sfs_crc32c_kernel(int kernel, uint32_t crc, const void *data,
+                           size_t length);
+bool sfs_crc32c_supported(int kernel);
+
+// Compression
+int sfs_lz4_compress(const void *source, int source_size, void *dest,
+                     int capacity);
+int sfs_lz4_decompress(const void *source, int source_size, void *dest,
+                       int capacity);
 
 // Utility functions
-void write_block(void *block, uint32_t block_number);
-void read_block(void *block, uint32_t block_number);
+void write_block(struct Volume *volume, void *block, uint64_t block_number);
+void read_block(struct Volume *volume, void *block, uint64_t block_number);
+void write_blocks(struct Volume *volume, void *buffer, uint64_t start,
+                  uint32_t count);
+void read_blocks(struct Volume *volume, void *buffer, uint64_t start,
+                 uint32_t count);
 
 #endif // SIMPLE_FILE_SYSTEM_H
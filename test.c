@@ -1,9 +1,14 @@
 #include "simple_file_system.h"
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 void is_res_pass(int res) {
@@ -12,6 +17,12 @@ void is_res_pass(int res) {
   }
 }
 
+void is_mounted(struct Volume *volume) {
+  if (volume == NULL) {
+    exit(-1);
+  }
+}
+
 void test_create_and_delete() {
   struct timeval start, end;
   int res_create;
@@ -30,17 +41,17 @@ void test_create_and_delete() {
                                       (start.tv_sec * 1000000 + start.tv_usec));
 
   printf("* sfs_mount **\n");
-  int res_mount = sfs_mount(vfs_name);
-  is_res_pass(res_mount);
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
 
   // Create a single file and then delete it
   printf("* sfs_create **\n");
-  int res_create_file = sfs_create("vfs_test.txt");
+  int res_create_file = sfs_create(volume, "vfs_test.txt");
   is_res_pass(res_create_file);
 
   // Re-create and open the file
-  sfs_create("vfs_test.txt");
-  int fd = sfs_open("vfs_test.txt", READ_MODE);
+  sfs_create(volume, "vfs_test.txt");
+  int fd = sfs_open(volume, "vfs_test.txt", READ_MODE);
   if (fd < 0) {
     printf("Error opening file\n");
     return;
@@ -48,15 +59,15 @@ void test_create_and_delete() {
 
   // Test reading data back
   int read_data = 0;
-  sfs_read(fd, &read_data, sizeof(int));
+  sfs_read(volume, fd, &read_data, sizeof(int));
   printf("Data read: %d\n", read_data);
 
   // Close the file
-  sfs_close(fd);
+  sfs_close(volume, fd);
 
   // Unmount the file system
   printf("* sfs_umount **\n");
-  int res_umount = sfs_umount();
+  int res_umount = sfs_umount(volume);
   if (res_umount < 0) {
     printf("ERROR: Can't umount the file system!\n");
   }
@@ -80,48 +91,2354 @@ void test_multiple_file_operations() {
                                       (start.tv_sec * 1000000 + start.tv_usec));
 
   printf("* sfs_mount **\n");
-  int res_mount = sfs_mount(vfs_name);
-  is_res_pass(res_mount);
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
 
   // Create multiple files
   char filename_test[100];
   for (int i = 0; i < 10; i++) {
     sprintf(filename_test, "file_%d.txt", i);
-    res_create = sfs_create(filename_test);
-    int fd = sfs_open(filename_test, WRITE_MODE);
+    res_create = sfs_create(volume, filename_test);
+    int fd = sfs_open(volume, filename_test, WRITE_MODE);
     int buffer[2] = {i, i + 1};
-    sfs_write(fd, buffer, sizeof(int));
-    sfs_seek(fd, 0, SFS_SEEK_SET);
-    sfs_close(fd);
+    sfs_write(volume, fd, buffer, sizeof(int));
+    sfs_seek(volume, fd, 0, SFS_SEEK_SET);
+    sfs_close(volume, fd);
     is_res_pass(res_create);
   }
 
   // Read data from files
   for (int i = 0; i < 10; i++) {
     sprintf(filename_test, "file_%d.txt", i);
-    int fd = sfs_open(filename_test, READ_MODE);
+    int fd = sfs_open(volume, filename_test, READ_MODE);
     if (fd < 0) {
       printf("Error opening file %d\n", i);
       return;
     }
-    sfs_seek(fd, 0, SFS_SEEK_SET);
+    sfs_seek(volume, fd, 0, SFS_SEEK_SET);
     int read_data = 0;
-    sfs_read(fd, &read_data, sizeof(int));
+    sfs_read(volume, fd, &read_data, sizeof(int));
     printf("Data in file_%d.txt: %d\n", i, read_data);
-    sfs_close(fd);
+    sfs_close(volume, fd);
   }
 
   // Unmount the file system
   printf("* sfs_umount **\n");
-  int res_umount = sfs_umount();
+  int res_umount = sfs_umount(volume);
   if (res_umount < 0) {
     printf("ERROR: Can't umount the file system!\n");
   }
   printf("[test] success!\n");
 }
 
+void test_block_cache() {
+  char *vfs_name = "vfs_cache";
+  printf("* create_format_vdisk (Block Cache) **\n");
+  is_res_pass(create_format_vdisk(vfs_name, 20));
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  is_res_pass(sfs_create(volume, "records.log"));
+
+  // Small record writes should be coalesced by write-behind and absorbed by
+  // the cache
+  int fd = sfs_open(volume, "records.log", WRITE_MODE);
+  is_res_pass(fd);
+  sfs_reset_cache_stats(volume);
+  for (int i = 0; i < 64; i++) {
+    is_res_pass(sfs_write(volume, fd, &i, sizeof(int)));
+  }
+  sfs_close(volume, fd);
+
+  struct CacheStats stats;
+  sfs_get_cache_stats(volume, &stats);
+  printf("\tHits: %llu, Misses: %llu, Disk reads: %llu, Disk writes: %llu\n",
+         (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+         (unsigned long long)stats.disk_reads,
+         (unsigned long long)stats.disk_writes);
+  if (stats.hits + stats.misses > 1 || stats.disk_writes != 0) {
+    printf("ERROR: Writes were not absorbed by the block cache\n");
+    exit(-1);
+  }
+
+  is_res_pass(sfs_sync(volume));
+  sfs_get_cache_stats(volume, &stats);
+  if (stats.writebacks == 0) {
+    printf("ERROR: sfs_sync did not write back dirty blocks\n");
+    exit(-1);
+  }
+
+  fd = sfs_open(volume, "records.log", READ_MODE);
+  is_res_pass(fd);
+  for (int i = 0; i < 64; i++) {
+    int record = -1;
+    sfs_seek(volume, fd, i * sizeof(int), SFS_SEEK_SET);
+    is_res_pass(sfs_read(volume, fd, &record, sizeof(int)));
+    if (record != i) {
+      printf("ERROR: Record %d read back as %d\n", i, record);
+      exit(-1);
+    }
+  }
+  sfs_close(volume, fd);
+
+  is_res_pass(sfs_umount(volume));
+  printf("[test] success!\n");
+}
+
+void test_name_index() {
+  char *vfs_name = "vfs_names";
+  printf("* create_format_vdisk (Filename Index) **\n");
+  is_res_pass(create_format_vdisk(vfs_name, 20));
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+
+  is_res_pass(sfs_create(volume, "alpha.txt"));
+  is_res_pass(sfs_create(volume, "beta.txt"));
+  if (sfs_create(volume, "alpha.txt") != -1) {
+    printf("ERROR: Duplicate filename was accepted\n");
+    exit(-1);
+  }
+
+  is_res_pass(sfs_delete(volume, "alpha.txt"));
+  if (sfs_open(volume, "alpha.txt", READ_MODE) != -1) {
+    printf("ERROR: Deleted file could still be opened\n");
+    exit(-1);
+  }
+
+  // The freed slot is reused and the other name is still reachable
+  is_res_pass(sfs_create(volume, "alpha.txt"));
+  int fd = sfs_open(volume, "beta.txt", READ_MODE);
+  is_res_pass(fd);
+  sfs_close(volume, fd);
+  fd = sfs_open(volume, "alpha.txt", READ_MODE);
+  is_res_pass(fd);
+  sfs_close(volume, fd);
+
+  is_res_pass(sfs_umount(volume));
+  printf("[test] success!\n");
+}
+
+void test_large_volume_allocation() {
+  char *vfs_name = "vfs_large";
+  printf("* create_format_vdisk (Large Volume) **\n");
+  is_res_pass(create_format_vdisk(vfs_name, 26)); // 16384 blocks
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+
+  // 20 files of 1 MiB need more blocks than a one-block bitmap could track
+  int chunk = 1 << 20;
+  int *buffer = malloc(chunk);
+  char filename[100];
+  for (int i = 0; i < 20; i++) {
+    sprintf(filename, "big_%d.bin", i);
+    is_res_pass(sfs_create(volume, filename));
+    int fd = sfs_open(volume, filename, WRITE_MODE);
+    is_res_pass(fd);
+    buffer[0] = i;
+    is_res_pass(sfs_write(volume, fd, buffer, chunk));
+    sfs_close(volume, fd);
+  }
+
+  for (int i = 0; i < 20; i++) {
+    sprintf(filename, "big_%d.bin", i);
+    int fd = sfs_open(volume, filename, READ_MODE);
+    is_res_pass(fd);
+    int first = -1;
+    is_res_pass(sfs_read(volume, fd, &first, sizeof(int)));
+    if (first != i) {
+      printf("ERROR: %s starts with %d\n", filename, first);
+      exit(-1);
+    }
+    sfs_close(volume, fd);
+  }
+
+  free(buffer);
+  is_res_pass(sfs_umount(volume));
+  printf("[test] success!\n");
+}
+
+void check_file_contents(struct Volume *volume, char *filename, char *expected,
+                         int size) {
+  char *actual = malloc(size);
+  int fd = sfs_open(volume, filename, READ_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_read(volume, fd, actual, size));
+  sfs_close(volume, fd);
+  if (memcmp(actual, expected, size) != 0) {
+    printf("ERROR: Contents of %s do not match what was written\n", filename);
+    exit(-1);
+  }
+  free(actual);
+}
+
+void test_extent_mapping() {
+  char *vfs_name = "vfs_extents";
+  printf("* create_format_vdisk (Extent Mapping) **\n");
+  is_res_pass(create_format_vdisk(vfs_name, 24));
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+
+  // One large unaligned write maps to a single contiguous extent
+  int size = 3 * (1 << 20) + 123;
+  char *data = malloc(size);
+  for (int i = 0; i < size; i++) {
+    data[i] = (char)(i * 7 + i / 4096);
+  }
+  is_res_pass(sfs_create(volume, "sequential.bin"));
+  int fd = sfs_open(volume, "sequential.bin", WRITE_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_write(volume, fd, data, size));
+  sfs_close(volume, fd);
+  check_file_contents(volume, "sequential.bin", data, size);
+
+  // Interleaved appends fragment two files into hundreds of extents each,
+  // which spills their maps into extent trees with several leaves
+  int blocks = 400;
+  is_res_pass(sfs_create(volume, "even.bin"));
+  is_res_pass(sfs_create(volume, "odd.bin"));
+  for (int i = 0; i < blocks; i++) {
+    is_res_pass(
+        sfs_append(volume, "even.bin", data + i * BLOCK_SIZE, BLOCK_SIZE));
+    is_res_pass(sfs_append(volume, "odd.bin", data + (i + 1) * BLOCK_SIZE,
+                           BLOCK_SIZE));
+  }
+  check_file_contents(volume, "even.bin", data, blocks * BLOCK_SIZE);
+  check_file_contents(volume, "odd.bin", data + BLOCK_SIZE,
+                      blocks * BLOCK_SIZE);
+
+  // Deleting returns the blocks, so the large file fits again afterwards
+  is_res_pass(sfs_delete(volume, "even.bin"));
+  is_res_pass(sfs_delete(volume, "odd.bin"));
+  is_res_pass(sfs_delete(volume, "sequential.bin"));
+  for (int i = 0; i < 4; i++) {
+    char filename[100];
+    sprintf(filename, "refill_%d.bin", i);
+    is_res_pass(sfs_create(volume, filename));
+    fd = sfs_open(volume, filename, WRITE_MODE);
+    is_res_pass(fd);
+    is_res_pass(sfs_write(volume, fd, data, size));
+    sfs_close(volume, fd);
+  }
+
+  free(data);
+  is_res_pass(sfs_umount(volume));
+  printf("[test] success!\n");
+}
+
+void test_vectored_io() {
+  char *vfs_name = "vfs_vectored";
+  printf("* create_format_vdisk (Vectored I/O) **\n");
+  is_res_pass(create_format_vdisk(vfs_name, 22));
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+
+  int size = 8 * BLOCK_SIZE;
+  char *expected = malloc(size);
+  char *patch = malloc(size);
+  for (int i = 0; i < size; i++) {
+    expected[i] = (char)i;
+    patch[i] = (char)(255 - i);
+  }
+
+  is_res_pass(sfs_create(volume, "patched.bin"));
+  int fd = sfs_open(volume, "patched.bin", WRITE_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_write(volume, fd, expected, size));
+
+  // Rewrite from an unaligned offset with partial head and tail blocks; the
+  // write ends the file there
+  int offset = 1000, patch_size = 3 * BLOCK_SIZE + 500;
+  is_res_pass(sfs_seek(volume, fd, offset, SFS_SEEK_SET));
+  is_res_pass(sfs_write(volume, fd, patch, patch_size));
+  sfs_close(volume, fd);
+  memcpy(expected + offset, patch, patch_size);
+  check_file_contents(volume, "patched.bin", expected, offset + patch_size);
+
+  // Unaligned read spanning several blocks
+  char *actual = malloc(size);
+  fd = sfs_open(volume, "patched.bin", READ_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_seek(volume, fd, 3000, SFS_SEEK_SET));
+  is_res_pass(sfs_read(volume, fd, actual, 2 * BLOCK_SIZE + 7));
+  sfs_close(volume, fd);
+  if (memcmp(actual, expected + 3000, 2 * BLOCK_SIZE + 7) != 0) {
+    printf("ERROR: Unaligned multi-block read returned wrong data\n");
+    exit(-1);
+  }
+
+  free(actual);
+  free(patch);
+  free(expected);
+  is_res_pass(sfs_umount(volume));
+  printf("[test] success!\n");
+}
+
+void test_mmap_mount() {
+  char *vfs_name = "vfs_mmap";
+  printf("* create_format_vdisk (Mapped Mount) **\n");
+  is_res_pass(create_format_vdisk(vfs_name, 22));
+  struct Volume *volume = sfs_mount_with_flags(vfs_name, SFS_MOUNT_MMAP);
+  is_mounted(volume);
+
+  int size = 5 * BLOCK_SIZE + 321;
+  char *data = malloc(size);
+  for (int i = 0; i < size; i++) {
+    data[i] = (char)(i % 251);
+  }
+  is_res_pass(sfs_create(volume, "mapped.bin"));
+  int fd = sfs_open(volume, "mapped.bin", WRITE_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_write(volume, fd, data, size));
+  sfs_close(volume, fd);
+  check_file_contents(volume, "mapped.bin", data, size);
+  is_res_pass(sfs_umount(volume));
+
+  // Metadata reaches the disk through the journal in either mode, so the
+  // file survives a remount either way
+  volume = sfs_mount_with_flags(vfs_name, SFS_MOUNT_MMAP);
+  is_mounted(volume);
+  check_file_contents(volume, "mapped.bin", data, size);
+  is_res_pass(sfs_umount(volume));
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  check_file_contents(volume, "mapped.bin", data, size);
+  is_res_pass(sfs_umount(volume));
+
+  free(data);
+  printf("[test] success!\n");
+}
+
+#define STRESS_THREADS 4
+#define STRESS_ROUNDS 50
+
+struct StressTask {
+  struct Volume *volume;
+  long id;
+};
+
+void *stress_worker(void *arg) {
+  struct StressTask *task = arg;
+  struct Volume *volume = task->volume;
+  long id = task->id;
+  char filename[100];
+  int size = 2 * BLOCK_SIZE + 100 * (int)id + 1;
+  char *data = malloc(size);
+  char *check = malloc(size);
+
+  sprintf(filename, "thread_%ld.bin", id);
+  if (sfs_create(volume, filename) < 0) {
+    return (void *)-1;
+  }
+
+  for (int round = 0; round < STRESS_ROUNDS; round++) {
+    memset(data, (int)(id * 31 + round), size);
+    int fd = sfs_open(volume, filename, WRITE_MODE);
+    if (fd < 0 || sfs_write(volume, fd, data, size) < 0) {
+      return (void *)-1;
+    }
+    sfs_close(volume, fd);
+    if (sfs_append(volume, filename, data, 10) < 0) {
+      return (void *)-1;
+    }
+
+    fd = sfs_open(volume, filename, READ_MODE);
+    if (fd < 0 || sfs_read(volume, fd, check, size) < 0 ||
+        memcmp(data, check, size) != 0) {
+      return (void *)-1;
+    }
+    sfs_close(volume, fd);
+  }
+
+  free(check);
+  free(data);
+  return NULL;
+}
+
+void test_concurrent_access() {
+  char *vfs_name = "vfs_threads";
+  printf("* create_format_vdisk (Concurrent Access) **\n");
+  is_res_pass(create_format_vdisk(vfs_name, 22));
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+
+  pthread_t threads[STRESS_THREADS];
+  struct StressTask tasks[STRESS_THREADS];
+  for (long i = 0; i < STRESS_THREADS; i++) {
+    tasks[i].volume = volume;
+    tasks[i].id = i;
+    pthread_create(&threads[i], NULL, stress_worker, &tasks[i]);
+  }
+  for (int i = 0; i < STRESS_THREADS; i++) {
+    void *status;
+    pthread_join(threads[i], &status);
+    if (status != NULL) {
+      printf("ERROR: Worker thread %d saw corrupted data\n", i);
+      exit(-1);
+    }
+  }
+
+  is_res_pass(sfs_umount(volume));
+  printf("[test] success!\n");
+}
+
+void test_multiple_volumes() {
+  printf("* create_format_vdisk (Multiple Volumes) **\n");
+  is_res_pass(create_format_vdisk("vfs_volume_a", 20));
+  is_res_pass(create_format_vdisk("vfs_volume_b", 22));
+  struct Volume *volume_a = sfs_mount("vfs_volume_a");
+  is_mounted(volume_a);
+  struct Volume *volume_b =
+      sfs_mount_with_flags("vfs_volume_b", SFS_MOUNT_MMAP);
+  is_mounted(volume_b);
+
+  // The same name lives independently on each volume
+  char data_a[3 * BLOCK_SIZE], data_b[2 * BLOCK_SIZE + 17];
+  memset(data_a, 'a', sizeof(data_a));
+  memset(data_b, 'b', sizeof(data_b));
+  is_res_pass(sfs_create(volume_a, "shared.txt"));
+  is_res_pass(sfs_create(volume_b, "shared.txt"));
+  int fd_a = sfs_open(volume_a, "shared.txt", WRITE_MODE);
+  int fd_b = sfs_open(volume_b, "shared.txt", WRITE_MODE);
+  is_res_pass(fd_a);
+  is_res_pass(fd_b);
+  is_res_pass(sfs_write(volume_a, fd_a, data_a, sizeof(data_a)));
+  is_res_pass(sfs_write(volume_b, fd_b, data_b, sizeof(data_b)));
+  sfs_close(volume_a, fd_a);
+  sfs_close(volume_b, fd_b);
+  check_file_contents(volume_a, "shared.txt", data_a, sizeof(data_a));
+  check_file_contents(volume_b, "shared.txt", data_b, sizeof(data_b));
+
+  // Unmounting one volume leaves the other usable
+  is_res_pass(sfs_delete(volume_a, "shared.txt"));
+  is_res_pass(sfs_umount(volume_a));
+  check_file_contents(volume_b, "shared.txt", data_b, sizeof(data_b));
+  is_res_pass(sfs_umount(volume_b));
+  printf("[test] success!\n");
+}
+
+void test_sparse_format() {
+  char *vfs_name = "vfs_sparse";
+  struct stat vdisk_stat;
+  printf("* create_format_vdisk_size (Sparse Format) **\n");
+
+  // A 1 GiB volume is created sparse: only the metadata blocks hit the disk
+  uint64_t size = (uint64_t)1 << 30;
+  is_res_pass(create_format_vdisk_size(vfs_name, size + 1000));
+  is_res_pass(stat(vfs_name, &vdisk_stat));
+  if ((uint64_t)vdisk_stat.st_size != size ||
+      (uint64_t)vdisk_stat.st_blocks * 512 > 1 << 20) {
+    printf("ERROR: Formatted image is %lld bytes with %lld allocated\n",
+           (long long)vdisk_stat.st_size,
+           (long long)vdisk_stat.st_blocks * 512);
+    exit(-1);
+  }
+
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  char data[BLOCK_SIZE + 10];
+  memset(data, 's', sizeof(data));
+  is_res_pass(sfs_create(volume, "sparse.txt"));
+  is_res_pass(sfs_append(volume, "sparse.txt", data, sizeof(data)));
+  is_res_pass(sfs_umount(volume));
+
+  // Reformatting replaces the old image instead of inheriting its contents
+  is_res_pass(create_format_vdisk_size(vfs_name, 64 * BLOCK_SIZE));
+  is_res_pass(stat(vfs_name, &vdisk_stat));
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  if (vdisk_stat.st_size != 64 * BLOCK_SIZE ||
+      sfs_open(volume, "sparse.txt", READ_MODE) != -1) {
+    printf("ERROR: Reformatted image kept its old size or files\n");
+    exit(-1);
+  }
+  is_res_pass(sfs_umount(volume));
+  printf("[test] success!\n");
+}
+
+#define CRASH_FILES 24
+#define CRASH_APPENDS 3
+#define CRASH_ITERATIONS 6
+
+struct VolumeStats volume_stats(struct Volume *volume) {
+  struct VolumeStats stats;
+  sfs_get_volume_stats(volume, &stats);
+  return stats;
+}
+
+struct CacheStats cache_stats(struct Volume *volume) {
+  struct CacheStats stats;
+  sfs_get_cache_stats(volume, &stats);
+  return stats;
+}
+
+uint64_t free_block_count(struct Volume *volume) {
+  return volume_stats(volume).superblock.num_free_blocks;
+}
+
+struct Inode find_inode(struct Volume *volume, char *filename) {
+  // Copy of the named file's inode, or an unused one if there is none
+  char name[MAX_FILENAME_SIZE + 1];
+  struct Inode inode;
+  for (int i = 0; sfs_get_inode(volume, i, &inode) == 0; i++) {
+    if (inode.used != USED_FLAG) {
+      continue;
+    }
+    sfs_get_file_name(volume, i, name);
+    if (strcmp(name, filename) == 0) {
+      return inode;
+    }
+  }
+  memset(&inode, 0, sizeof(inode));
+  return inode;
+}
+
+int file_size(struct Volume *volume, char *filename) {
+  // Size recorded in the file's inode, or -1 if there is none
+  struct Inode inode = find_inode(volume, filename);
+  return inode.used == USED_FLAG ? (int)inode.size : -1;
+}
+
+int crash_pattern(char *data, int round) {
+  // Appended CRASH_APPENDS times per round; starts with the round number
+  int size = BLOCK_SIZE / 2 + 37 * (round % 50);
+  for (int i = 0; i < size; i++) {
+    data[i] = (char)(round * 7 + i);
+  }
+  memcpy(data, &round, sizeof(round));
+  return size;
+}
+
+void crash_workload(char *vfs_name, int round, int report_fd) {
+  // Runs in a forked child until the parent kills it. Every round recycles
+  // one file and logs its number; every fifth round is synced and reported.
+  if (freopen("/dev/null", "w", stdout) == NULL) {
+    _exit(1);
+  }
+  struct Volume *volume = sfs_mount(vfs_name);
+  if (volume == NULL) {
+    _exit(1);
+  }
+
+  char data[BLOCK_SIZE], filename[32];
+  for (;; round++) {
+    sprintf(filename, "crash_%d", round % CRASH_FILES);
+    sfs_delete(volume, filename); // Fails harmlessly on the first pass
+    if (sfs_create(volume, filename) < 0) {
+      _exit(1);
+    }
+    int size = crash_pattern(data, round);
+    for (int i = 0; i < CRASH_APPENDS; i++) {
+      if (sfs_append(volume, filename, data, size) < 0 ||
+          (i == 1 &&
+           sfs_append(volume, "crash.log", &round, sizeof(round)) < 0)) {
+        _exit(1);
+      }
+    }
+    if (round % 5 == 4) {
+      if (sfs_sync(volume) < 0 ||
+          write(report_fd, &round, sizeof(round)) != sizeof(round)) {
+        _exit(1);
+      }
+    }
+  }
+}
+
+void check_volume_consistency(struct Volume *volume) {
+  if (sfs_check_volume(volume) < 0) {
+    exit(-1);
+  }
+}
+
+void check_crash_files(struct Volume *volume) {
+  // A recycled file holds whole appends of its round's pattern
+  char filename[32], pattern[BLOCK_SIZE];
+  char *contents = malloc(CRASH_APPENDS * BLOCK_SIZE);
+  for (int i = 0; i < CRASH_FILES; i++) {
+    sprintf(filename, "crash_%d", i);
+    int size = file_size(volume, filename);
+    if (size <= 0) {
+      continue;
+    }
+
+    int fd = sfs_open(volume, filename, READ_MODE);
+    is_res_pass(fd);
+    is_res_pass(sfs_read(volume, fd, contents, size));
+    sfs_close(volume, fd);
+    int round;
+    memcpy(&round, contents, sizeof(round));
+    int length = crash_pattern(pattern, round);
+    if (round % CRASH_FILES != i || size % length != 0 ||
+        size / length > CRASH_APPENDS) {
+      printf("ERROR: %s recovered with a torn size of %d bytes\n", filename,
+             size);
+      exit(-1);
+    }
+    for (int offset = 0; offset < size; offset += length) {
+      if (memcmp(contents + offset, pattern, length) != 0) {
+        printf("ERROR: %s recovered with corrupted contents\n", filename);
+        exit(-1);
+      }
+    }
+  }
+  free(contents);
+}
+
+int check_crash_log(struct Volume *volume, int synced) {
+  // The log holds consecutive round numbers and keeps every synced round;
+  // returns the round the next workload continues from
+  int size = file_size(volume, "crash.log");
+  int count = size / (int)sizeof(int);
+  if (size % sizeof(int) != 0 || count <= synced) {
+    printf("ERROR: Log recovered with %d rounds after round %d was synced\n",
+           count, synced);
+    exit(-1);
+  }
+
+  int *rounds = malloc(size + 1);
+  int fd = sfs_open(volume, "crash.log", READ_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_read(volume, fd, rounds, size));
+  sfs_close(volume, fd);
+  for (int i = 0; i < count; i++) {
+    if (rounds[i] != i) {
+      printf("ERROR: Log entry %d reads %d\n", i, rounds[i]);
+      exit(-1);
+    }
+  }
+  free(rounds);
+  return count;
+}
+
+void test_crash_recovery() {
+  char *vfs_name = "vfs_crash";
+  printf("* create_format_vdisk (Crash Recovery) **\n");
+  is_res_pass(create_format_vdisk(vfs_name, 22));
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  is_res_pass(sfs_create(volume, "crash.log"));
+  is_res_pass(sfs_umount(volume));
+
+  // Kill a busy child at a different point each time, then check that the
+  // recovered volume is consistent and kept everything that was synced
+  int round = 0;
+  for (int iteration = 0; iteration < CRASH_ITERATIONS; iteration++) {
+    int report[2];
+    is_res_pass(pipe(report));
+    fflush(stdout);
+    pid_t child = fork();
+    is_res_pass(child);
+    if (child == 0) {
+      close(report[0]);
+      crash_workload(vfs_name, round, report[1]);
+    }
+    close(report[1]);
+    usleep(20000 + 25000 * iteration);
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+
+    int synced = -1, reported;
+    while (read(report[0], &reported, sizeof(reported)) == sizeof(reported)) {
+      synced = reported;
+    }
+    close(report[0]);
+
+    volume = sfs_mount(vfs_name);
+    is_mounted(volume);
+    check_volume_consistency(volume);
+    check_crash_files(volume);
+    round = check_crash_log(volume, synced);
+    is_res_pass(sfs_umount(volume));
+    printf("\tKilled after round %d (last synced %d)\n", round - 1, synced);
+  }
+
+  if (round == 0) {
+    printf("ERROR: Crash workload never completed a round\n");
+    exit(-1);
+  }
+  printf("[test] success!\n");
+}
+
+void *batch_sync_worker(void *arg) {
+  sfs_sync(arg);
+  return NULL;
+}
+
+void test_batch_commit() {
+  char *vfs_name = "vfs_batch";
+  char filename[32], data[300];
+  printf("* create_format_vdisk (Batched Commit) **\n");
+  is_res_pass(create_format_vdisk(vfs_name, 22));
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  memset(data, 'b', sizeof(data));
+
+  // Creates, appends and deletes in a batch commit as one transaction
+  uint32_t sequence = volume_stats(volume).journal_sequence;
+  is_res_pass(sfs_begin_batch(volume));
+  if (sfs_begin_batch(volume) != -1 || sfs_sync(volume) != -1) {
+    printf("ERROR: Nested batch or sync inside a batch was accepted\n");
+    exit(-1);
+  }
+  for (int i = 0; i < 20; i++) {
+    sprintf(filename, "batch_%d", i);
+    is_res_pass(sfs_create(volume, filename));
+    is_res_pass(sfs_append(volume, filename, data, sizeof(data)));
+  }
+  for (int i = 0; i < 20; i += 4) {
+    sprintf(filename, "batch_%d", i);
+    is_res_pass(sfs_delete(volume, filename));
+  }
+  is_res_pass(sfs_commit_batch(volume));
+  if (volume_stats(volume).journal_sequence != sequence + 1) {
+    printf("ERROR: Batch took %u journal transactions\n",
+           volume_stats(volume).journal_sequence - sequence);
+    exit(-1);
+  }
+  is_res_pass(sfs_umount(volume));
+
+  // A batch too large for one transaction refuses the call that would
+  // overflow it, and still commits whole
+  is_res_pass(create_format_vdisk("vfs_batch_big", 30));
+  volume = sfs_mount("vfs_batch_big");
+  is_mounted(volume);
+  sequence = volume_stats(volume).journal_sequence;
+  is_res_pass(sfs_begin_batch(volume));
+  int created = 0;
+  while (created < JOURNAL_RECORD_LIMIT) {
+    sprintf(filename, "many_%d", created);
+    if (sfs_create(volume, filename) < 0) {
+      break;
+    }
+    created++;
+  }
+  is_res_pass(sfs_commit_batch(volume));
+  if (created < JOURNAL_RECORD_LIMIT / 4 || created == JOURNAL_RECORD_LIMIT ||
+      volume_stats(volume).journal_sequence != sequence + 1) {
+    printf("ERROR: Oversized batch made %d files in %u transactions\n",
+           created, volume_stats(volume).journal_sequence - sequence);
+    exit(-1);
+  }
+  sprintf(filename, "many_%d", created);
+  is_res_pass(sfs_create(volume, filename));
+  is_res_pass(sfs_umount(volume));
+  volume = sfs_mount("vfs_batch_big");
+  is_mounted(volume);
+  for (int i = 0; i <= created; i += created / 8) {
+    sprintf(filename, "many_%d", i);
+    is_res_pass(file_size(volume, filename));
+  }
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+
+  // A batch that never commits leaves no trace after a crash, even though
+  // another thread asks for a sync while it is open
+  fflush(stdout);
+  pid_t child = fork();
+  is_res_pass(child);
+  if (child == 0) {
+    pthread_t syncer;
+    volume = sfs_mount(vfs_name);
+    if (volume == NULL || sfs_begin_batch(volume) < 0) {
+      _exit(1);
+    }
+    for (int i = 0; i < 10; i++) {
+      sprintf(filename, "lost_%d", i);
+      sfs_create(volume, filename);
+      sfs_append(volume, filename, data, sizeof(data));
+    }
+    pthread_create(&syncer, NULL, batch_sync_worker, volume);
+    usleep(20000);
+    _exit(0);
+  }
+  waitpid(child, NULL, 0);
+
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  check_volume_consistency(volume);
+  for (int i = 0; i < 20; i++) {
+    sprintf(filename, "batch_%d", i);
+    if (file_size(volume, filename) != (i % 4 == 0 ? -1 : (int)sizeof(data))) {
+      printf("ERROR: %s does not match the committed batch\n", filename);
+      exit(-1);
+    }
+  }
+  for (int i = 0; i < 10; i++) {
+    sprintf(filename, "lost_%d", i);
+    if (file_size(volume, filename) != -1) {
+      printf("ERROR: %s from an uncommitted batch survived\n", filename);
+      exit(-1);
+    }
+  }
+  is_res_pass(sfs_umount(volume));
+  printf("[test] success!\n");
+}
+
+void count_completion(struct AsyncRequest *request) {
+  int *counters = request->user_data;
+  counters[request->result < 0 ? 1 : 0]++;
+}
+
+void test_async_io() {
+  char *vfs_name = "vfs_async";
+  int size = 64 * BLOCK_SIZE + 100, grown = size + 3000;
+  char *expected = calloc(grown, 1), *actual = malloc(grown);
+  struct AsyncRequest requests[34];
+  printf("* create_format_vdisk (Async I/O) **\n");
+  is_res_pass(create_format_vdisk(vfs_name, 22));
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+
+  // Once on io_uring (where the kernel has it) and once on worker threads
+  for (int backend = 0; backend < 2; backend++) {
+    int counters[2] = {0, 0};
+    memset(expected, 0, grown);
+    is_res_pass(sfs_create(volume, "async.bin"));
+    int fd = sfs_open(volume, "async.bin", WRITE_MODE);
+    is_res_pass(fd);
+    is_res_pass(sfs_write(volume, fd, expected, size));
+
+    struct AsyncQueue *queue =
+        sfs_async_open(volume, 8, backend == 0 ? 0 : SFS_ASYNC_THREADS);
+    if (queue == NULL) {
+      exit(-1);
+    }
+
+    // Overwrite the file in 32 uneven pieces and grow it by one more; a
+    // read on the write-only descriptor must fail through its callback
+    for (int i = 0; i < 34; i++) {
+      struct AsyncRequest *request = &requests[i];
+      memset(request, 0, sizeof(*request));
+      request->opcode = i == 33 ? SFS_ASYNC_READ : SFS_ASYNC_WRITE;
+      request->fd = fd;
+      request->offset = i < 32 ? (uint32_t)size / 32 * i : size;
+      request->size = i < 31 ? size / 32 : size - request->offset;
+      if (i >= 32) {
+        request->size = 3000;
+      }
+      request->buffer = i == 33 ? actual : expected + request->offset;
+      request->callback = count_completion;
+      request->user_data = counters;
+      for (int b = 0; b < request->size && i < 33; b++) {
+        expected[request->offset + b] = (char)(backend * 31 + i + b);
+      }
+      is_res_pass(sfs_async_submit(queue, request));
+    }
+    while (counters[0] + counters[1] < 34) {
+      sfs_async_poll(queue, 1);
+    }
+    sfs_close(volume, fd);
+    if (counters[1] != 1 || requests[33].result != -1) {
+      printf("ERROR: %d async requests failed\n", counters[1]);
+      exit(-1);
+    }
+
+    // Read it back in pieces, then compare with the synchronous path
+    memset(actual, 0, grown);
+    fd = sfs_open(volume, "async.bin", READ_MODE);
+    is_res_pass(fd);
+    for (int i = 0; i < 16; i++) {
+      struct AsyncRequest *request = &requests[i];
+      memset(request, 0, sizeof(*request));
+      request->opcode = SFS_ASYNC_READ;
+      request->fd = fd;
+      uint32_t next = i < 15 ? grown / 16 * (i + 1) + (i % 3) * 7 : grown;
+      request->offset =
+          i > 0 ? requests[i - 1].offset + requests[i - 1].size : 0;
+      request->size = next - request->offset;
+      request->buffer = actual + request->offset;
+      is_res_pass(sfs_async_submit(queue, request));
+    }
+    for (int done = 0; done < 16;) {
+      done += sfs_async_poll(queue, 16 - done);
+    }
+    is_res_pass(sfs_async_close(queue));
+    sfs_close(volume, fd);
+    for (int i = 0; i < 16; i++) {
+      is_res_pass(requests[i].result);
+    }
+    if (memcmp(actual, expected, grown) != 0) {
+      printf("ERROR: Async reads do not match the async writes\n");
+      exit(-1);
+    }
+    check_file_contents(volume, "async.bin", expected, grown);
+
+    // The async writes are as durable as synchronous ones
+    is_res_pass(sfs_umount(volume));
+    volume = sfs_mount(vfs_name);
+    is_mounted(volume);
+    check_file_contents(volume, "async.bin", expected, grown);
+    is_res_pass(sfs_delete(volume, "async.bin"));
+  }
+
+  // Unmounting with queues still open completes their requests first
+  int counters[2] = {0, 0};
+  is_res_pass(sfs_create(volume, "pending.bin"));
+  int fd = sfs_open(volume, "pending.bin", WRITE_MODE);
+  is_res_pass(fd);
+  for (int backend = 0; backend < 2; backend++) {
+    struct AsyncQueue *queue =
+        sfs_async_open(volume, 4, backend == 0 ? 0 : SFS_ASYNC_THREADS);
+    if (queue == NULL) {
+      exit(-1);
+    }
+    for (int i = backend * 4; i < backend * 4 + 4; i++) {
+      struct AsyncRequest *request = &requests[i];
+      memset(request, 0, sizeof(*request));
+      request->opcode = SFS_ASYNC_WRITE;
+      request->fd = fd;
+      request->offset = i * BLOCK_SIZE;
+      request->size = BLOCK_SIZE;
+      request->buffer = expected + request->offset;
+      request->callback = count_completion;
+      request->user_data = counters;
+      memset(request->buffer, 'a' + i, BLOCK_SIZE);
+      is_res_pass(sfs_async_submit(queue, request));
+    }
+  }
+  is_res_pass(sfs_umount(volume));
+  if (counters[0] != 8 || counters[1] != 0) {
+    printf("ERROR: Unmounting completed %d of 8 async writes\n",
+           counters[0]);
+    exit(-1);
+  }
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  check_file_contents(volume, "pending.bin", expected, 8 * BLOCK_SIZE);
+
+  is_res_pass(sfs_umount(volume));
+  free(actual);
+  free(expected);
+  printf("[test] success!\n");
+}
+
+void test_read_ahead_write_behind() {
+  char *vfs_name = "vfs_readahead";
+  int chunk = 1000, chunks = 300, size = chunk * chunks;
+  int file_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  char *expected = malloc(size), *actual = malloc(size);
+  printf("* create_format_vdisk (Read-ahead and Write-behind) **\n");
+  is_res_pass(create_format_vdisk(vfs_name, 22));
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  for (int i = 0; i < size; i++) {
+    expected[i] = (char)(i * 13 + i / 4096);
+  }
+
+  // Small sequential writes are coalesced into a few large ones, so the
+  // cache sees about one access per block rather than several
+  is_res_pass(sfs_create(volume, "stream.bin"));
+  int fd = sfs_open(volume, "stream.bin", WRITE_MODE);
+  is_res_pass(fd);
+  struct CacheStats stats;
+  sfs_reset_cache_stats(volume);
+  for (int i = 0; i < chunks; i++) {
+    is_res_pass(sfs_write(volume, fd, expected + i * chunk, chunk));
+  }
+  // Seeking flushes the buffer, so SEEK_END sees every byte written
+  if (sfs_seek(volume, fd, 0, SFS_SEEK_END) != 0 ||
+      find_inode(volume, "stream.bin").size != (uint64_t)size) {
+    printf("ERROR: SEEK_END missed buffered writes\n");
+    exit(-1);
+  }
+  is_res_pass(sfs_close(volume, fd));
+  sfs_get_cache_stats(volume, &stats);
+  if (stats.hits + stats.misses > (uint64_t)file_blocks * 2) {
+    printf("ERROR: %llu cache accesses for %d blocks of small writes\n",
+           (unsigned long long)(stats.hits + stats.misses), file_blocks);
+    exit(-1);
+  }
+  check_file_contents(volume, "stream.bin", expected, size);
+
+  // Appending by name to a file with buffered writes lands after them
+  is_res_pass(sfs_create(volume, "mixed.bin"));
+  fd = sfs_open(volume, "mixed.bin", WRITE_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_write(volume, fd, "AAAA", 4));
+  is_res_pass(sfs_append(volume, "mixed.bin", "BBBB", 4));
+  is_res_pass(sfs_close(volume, fd));
+  check_file_contents(volume, "mixed.bin", "AAAABBBB", 8);
+
+  // Reading it back from a cold cache in small sequential pieces costs a
+  // handful of large reads instead of one per block
+  is_res_pass(sfs_umount(volume));
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  fd = sfs_open(volume, "stream.bin", READ_MODE);
+  is_res_pass(fd);
+  sfs_reset_cache_stats(volume);
+  for (int i = 0; i < chunks; i++) {
+    is_res_pass(sfs_read(volume, fd, actual + i * chunk, chunk));
+  }
+  sfs_close(volume, fd);
+  sfs_get_cache_stats(volume, &stats);
+  printf("\tDisk reads: %llu, Prefetched: %llu, Blocks: %d\n",
+         (unsigned long long)stats.disk_reads,
+         (unsigned long long)stats.prefetched, file_blocks);
+  if (stats.prefetched == 0 || stats.disk_reads * 4 > (uint64_t)file_blocks) {
+    printf("ERROR: Sequential reads were not read ahead\n");
+    exit(-1);
+  }
+  if (memcmp(actual, expected, size) != 0) {
+    printf("ERROR: Read-ahead returned the wrong data\n");
+    exit(-1);
+  }
+
+  is_res_pass(sfs_umount(volume));
+  free(actual);
+  free(expected);
+  printf("[test] success!\n");
+}
+
+void test_cached_extent_map() {
+  char *vfs_name = "vfs_file_maps";
+  int records = 200, fragments = 12;
+  int size = fragments * BLOCK_SIZE + records * 16;
+  char *expected = malloc(size), filename[32];
+  printf("* create_format_vdisk (Cached Extent Map) **\n");
+  is_res_pass(create_format_vdisk(vfs_name, 22));
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  for (int i = 0; i < size; i++) {
+    expected[i] = (char)(i * 31 + i / 977);
+  }
+
+  // Interleaved appends, each pair committed before the next so delayed
+  // allocation cannot keep them apart, fragment both files past the inline
+  // extents, so their maps live in extent trees
+  is_res_pass(sfs_create(volume, "log_a"));
+  is_res_pass(sfs_create(volume, "log_b"));
+  for (int i = 0; i < fragments; i++) {
+    for (int file = 0; file < 2; file++) {
+      sprintf(filename, "log_%c", 'a' + file);
+      is_res_pass(sfs_append(volume, filename, expected + i * BLOCK_SIZE,
+                             BLOCK_SIZE));
+    }
+    is_res_pass(sfs_sync(volume));
+  }
+  struct Inode entry = find_inode(volume, "log_a");
+  if (entry.used != USED_FLAG || entry.extent_root == INVALID_BLOCK_POINTER) {
+    printf("ERROR: Fragmented file has no extent tree\n");
+    exit(-1);
+  }
+
+  // Small record appends touch only their data block: the tree is neither
+  // re-read nor rewritten until the next commit
+  uint64_t root = entry.extent_root;
+  struct CacheStats stats;
+  sfs_reset_cache_stats(volume);
+  for (int i = 0; i < records; i++) {
+    is_res_pass(sfs_append(volume, "log_a",
+                           expected + fragments * BLOCK_SIZE + i * 16, 16));
+  }
+  sfs_get_cache_stats(volume, &stats);
+  if (find_inode(volume, "log_a").extent_root != root ||
+      stats.hits + stats.misses > (uint64_t)records * 2 + 8) {
+    printf("ERROR: %llu cache accesses for %d record appends\n",
+           (unsigned long long)(stats.hits + stats.misses), records);
+    exit(-1);
+  }
+
+  // The cached map reaches the disk with the commit
+  is_res_pass(sfs_umount(volume));
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  check_volume_consistency(volume);
+  check_file_contents(volume, "log_a", expected, size);
+  check_file_contents(volume, "log_b", expected, fragments * BLOCK_SIZE);
+
+  is_res_pass(sfs_umount(volume));
+  free(expected);
+  printf("[test] success!\n");
+}
+
+void test_append_tail() {
+  char *vfs_name = "vfs_append";
+  int size = 300 * 1000;
+  char *expected = malloc(size);
+  printf("* create_format_vdisk (Append Tail) **\n");
+  is_res_pass(create_format_vdisk(vfs_name, 22));
+  for (int i = 0; i < size; i++) {
+    expected[i] = (char)(i * 7 + i / 333);
+  }
+
+  // Records of mixed sizes, some inside the tail block and some crossing
+  // one or more block boundaries, through the cache and the mapping
+  for (int flags = 0; flags <= SFS_MOUNT_MMAP; flags += SFS_MOUNT_MMAP) {
+    struct Volume *volume = sfs_mount_with_flags(vfs_name, flags);
+    is_mounted(volume);
+    is_res_pass(sfs_create(volume, "tail.log"));
+    struct CacheStats stats;
+    sfs_reset_cache_stats(volume);
+    int written = 0, long_records = 0;
+    for (int i = 0; written < size; i++) {
+      int record = i % 5 == 4 ? 3 * BLOCK_SIZE + i % 97 : 17 + (i * 37) % 600;
+      if (record > size - written) {
+        record = size - written;
+      }
+      is_res_pass(sfs_append(volume, "tail.log", expected + written, record));
+      written += record;
+      long_records += record > BLOCK_SIZE;
+    }
+    sfs_get_cache_stats(volume, &stats);
+
+    // Only multi-block records go to the disk before a sync, and a single
+    // appender's blocks stay in one extent
+    if (flags == 0 && stats.disk_writes > (uint64_t)long_records) {
+      printf("ERROR: %llu disk writes for %d multi-block appends\n",
+             (unsigned long long)stats.disk_writes, long_records);
+      exit(-1);
+    }
+    is_res_pass(sfs_sync(volume));
+    struct Inode entry;
+    for (int i = 0; sfs_get_inode(volume, i, &entry) == 0; i++) {
+      if (entry.used == USED_FLAG && entry.type == INODE_FILE &&
+          entry.extent_count != 1) {
+        printf("ERROR: Appended file has %u extents\n", entry.extent_count);
+        exit(-1);
+      }
+    }
+    check_file_contents(volume, "tail.log", expected, size);
+
+    is_res_pass(sfs_umount(volume));
+    volume = sfs_mount_with_flags(vfs_name, flags);
+    is_mounted(volume);
+    check_file_contents(volume, "tail.log", expected, size);
+    is_res_pass(sfs_delete(volume, "tail.log"));
+    is_res_pass(sfs_umount(volume));
+  }
+
+  free(expected);
+  printf("[test] success!\n");
+}
+
+void test_metadata_regions() {
+  char *vfs_name = "vfs_regions";
+  char filename[32];
+  struct stat vdisk_stat;
+  printf("* create_format_vdisk_size (Metadata Regions) **\n");
+
+  // An 8 GiB volume gets an inode table sized for it, and
+  // formatting still writes only a few blocks
+  is_res_pass(create_format_vdisk_size(vfs_name, (uint64_t)8 << 30));
+  is_res_pass(stat(vfs_name, &vdisk_stat));
+  if ((uint64_t)vdisk_stat.st_blocks * 512 > 1 << 20) {
+    printf("ERROR: Formatted image has %lld bytes allocated\n",
+           (long long)vdisk_stat.st_blocks * 512);
+    exit(-1);
+  }
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  int slots = ((uint64_t)8 << 30) / BLOCK_SIZE / BLOCKS_PER_FILE_SLOT;
+  struct VolumeStats stats = volume_stats(volume);
+  if (stats.num_inodes < slots || stats.inodes_used != 1) {
+    printf("ERROR: %d inodes on an 8 GiB volume\n", stats.num_inodes);
+    exit(-1);
+  }
+
+  // More files than one transaction holds: commits are forced on the way,
+  // and batches kept below the limit commit in between
+  int files = JOURNAL_RECORD_LIMIT * 2;
+  uint32_t sequence = volume_stats(volume).journal_sequence;
+  for (int i = 0; i < files / 2; i++) {
+    sprintf(filename, "file_%d", i);
+    is_res_pass(sfs_create(volume, filename));
+  }
+  for (int i = files / 2; i < files; i++) {
+    if (i % (JOURNAL_RECORD_LIMIT / 4) == 0) {
+      is_res_pass(sfs_begin_batch(volume));
+    }
+    sprintf(filename, "file_%d", i);
+    is_res_pass(sfs_create(volume, filename));
+    if ((i + 1) % (JOURNAL_RECORD_LIMIT / 4) == 0) {
+      is_res_pass(sfs_commit_batch(volume));
+    }
+  }
+  if (volume_stats(volume).journal_sequence - sequence < 4) {
+    printf("ERROR: %d creates took %u journal transactions\n", files,
+           volume_stats(volume).journal_sequence - sequence);
+    exit(-1);
+  }
+  for (int i = 0; i < files; i += 3) {
+    sprintf(filename, "file_%d", i);
+    is_res_pass(sfs_delete(volume, filename));
+  }
+  is_res_pass(sfs_append(volume, "file_1", filename, sizeof(filename)));
+  is_res_pass(sfs_umount(volume));
+
+  // Mount reads the inode table only up to its high-water mark, which counts
+  // the root directory too; freed slots below it are reused before it rises.
+  // Short names never reach the name table.
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  stats = volume_stats(volume);
+  if (stats.inodes_used != files + 1 || stats.names_used != 0) {
+    printf("ERROR: High-water marks are %d and %d after %d creates\n",
+           stats.inodes_used, stats.names_used, files);
+    exit(-1);
+  }
+  for (int i = 0; i < files; i++) {
+    sprintf(filename, "file_%d", i);
+    if ((file_size(volume, filename) >= 0) != (i % 3 != 0)) {
+      printf("ERROR: %s was not kept as it was before remount\n", filename);
+      exit(-1);
+    }
+  }
+  check_file_contents(volume, "file_1", "file_8190", 10);
+  is_res_pass(sfs_create(volume, "reused"));
+  if (volume_stats(volume).inodes_used != files + 1) {
+    printf("ERROR: Create raised the high-water mark past a free slot\n");
+    exit(-1);
+  }
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+
+  // A vdisk that is not in this format is refused
+  int fd = open(vfs_name, O_RDWR);
+  uint32_t magic = 0;
+  if (fd < 0 || pwrite(fd, &magic, sizeof(magic), 0) != sizeof(magic)) {
+    printf("ERROR: Could not overwrite the superblock\n");
+    exit(-1);
+  }
+  close(fd);
+  if (sfs_mount(vfs_name) != NULL) {
+    printf("ERROR: Mounted a vdisk without a valid superblock\n");
+    exit(-1);
+  }
+  unlink(vfs_name);
+  printf("[test] success!\n");
+}
+
+void test_lazy_mount() {
+  char *vfs_name = "vfs_lazy";
+  char filename[32], data[4 * BLOCK_SIZE];
+  printf("* create_format_vdisk_size (Lazy Mount) **\n");
+  is_res_pass(create_format_vdisk_size(vfs_name, (uint64_t)16 << 30));
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  int files = 1000;
+  for (int i = 0; i < files; i++) {
+    sprintf(filename, "lazy_%d", i);
+    is_res_pass(sfs_create(volume, filename));
+    is_res_pass(sfs_append(volume, filename, filename, strlen(filename) + 1));
+  }
+  is_res_pass(sfs_umount(volume));
+
+  // Mount reads the superblock and none of the metadata regions
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  struct VolumeStats stats = volume_stats(volume);
+  if (stats.resident_inode_blocks != 0 || stats.resident_name_blocks != 0 ||
+      stats.resident_bitmap_blocks != 0) {
+    printf("ERROR: Mount read metadata blocks\n");
+    exit(-1);
+  }
+
+  // A lookup faults in only the inode blocks on its path (here the root's and
+  // the file's); reading a file with a short name touches no name or bitmap
+  // block
+  sprintf(filename, "lazy_%d", 7);
+  check_file_contents(volume, filename, filename, strlen(filename) + 1);
+  stats = volume_stats(volume);
+  if (stats.resident_inode_blocks < 1 || stats.resident_inode_blocks > 2 ||
+      stats.resident_name_blocks != 0 || stats.resident_bitmap_blocks != 0) {
+    printf("ERROR: A lookup and a read faulted in the wrong blocks\n");
+    exit(-1);
+  }
+
+  // Allocating and freeing fault in just the bitmap blocks involved
+  memset(data, 'l', sizeof(data));
+  is_res_pass(sfs_append(volume, filename, data, sizeof(data)));
+  is_res_pass(sfs_delete(volume, "lazy_3"));
+  uint32_t bitmap = volume_stats(volume).resident_bitmap_blocks;
+  if (bitmap == 0 || bitmap > 2) {
+    printf("ERROR: %u bitmap blocks resident after an append\n", bitmap);
+    exit(-1);
+  }
+  is_res_pass(sfs_umount(volume));
+
+  // The counters a clean unmount left are trusted, and agree with the
+  // metadata once it is all read
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+
+  // A background prefetch races calls that fault blocks in themselves
+  volume = sfs_mount_with_flags(vfs_name, SFS_MOUNT_PREFETCH);
+  is_mounted(volume);
+  for (int i = 0; i < 200; i++) {
+    sprintf(filename, "extra_%d", i);
+    is_res_pass(sfs_create(volume, filename));
+    is_res_pass(sfs_append(volume, filename, data, sizeof(data)));
+    if (i % 4 == 0) {
+      sprintf(filename, "lazy_%d", i);
+      is_res_pass(sfs_delete(volume, filename));
+    }
+  }
+  is_res_pass(sfs_sync(volume));
+  is_res_pass(sfs_load_metadata(volume));
+  stats = volume_stats(volume);
+  if (stats.resident_bitmap_blocks != stats.superblock.bitmap_blocks) {
+    printf("ERROR: Loading the metadata left bitmap blocks unread\n");
+    exit(-1);
+  }
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+
+  // Unmounting stops a prefetch that is still running
+  volume = sfs_mount_with_flags(vfs_name, SFS_MOUNT_PREFETCH);
+  is_mounted(volume);
+  is_res_pass(sfs_umount(volume));
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+  unlink(vfs_name);
+  printf("[test] success!\n");
+}
+
+void test_inode_table() {
+  char *vfs_name = "vfs_inodes";
+  char names[6][MAX_FILENAME_SIZE + 2];
+  printf("* create_format_vdisk (Inode Table) **\n");
+
+  // A file's metadata is two cache lines, the second holding its extents
+  if (sizeof(struct Inode) != 128 || offsetof(struct Inode, extents) != 64) {
+    printf("ERROR: Inodes are %zu bytes with extents at %zu\n",
+           sizeof(struct Inode), offsetof(struct Inode, extents));
+    exit(-1);
+  }
+
+  // Names up to INLINE_NAME_SIZE bytes stay in the inode; longer ones,
+  // including two that only differ past the inline bytes, use the name table.
+  // That is indexed by inode slot, and the root directory holds slot 0.
+  int lengths[6] = {1, INLINE_NAME_SIZE, INLINE_NAME_SIZE + 1, 40, 40,
+                    MAX_FILENAME_SIZE};
+  for (int i = 0; i < 6; i++) {
+    memset(names[i], 'a' + i, lengths[i]);
+    names[i][lengths[i]] = '\0';
+  }
+  memset(names[4], 'd', INLINE_NAME_SIZE);
+  is_res_pass(create_format_vdisk(vfs_name, 22));
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  for (int i = 0; i < 6; i++) {
+    is_res_pass(sfs_create(volume, names[i]));
+    is_res_pass(sfs_append(volume, names[i], names[i], lengths[i] + 1));
+  }
+  memset(names[0], 'z', MAX_FILENAME_SIZE + 1);
+  names[0][MAX_FILENAME_SIZE + 1] = '\0';
+  if (sfs_create(volume, names[0]) != -1 ||
+      volume_stats(volume).names_used != 7) {
+    printf("ERROR: Name table holds %d slots after the creates\n",
+           volume_stats(volume).names_used);
+    exit(-1);
+  }
+  strcpy(names[0], "a");
+
+  // A long name freed with its inode is replaced by the next one given it
+  is_res_pass(sfs_delete(volume, names[3]));
+  memset(names[3], 'q', 30);
+  names[3][30] = '\0';
+  is_res_pass(sfs_create(volume, names[3]));
+  is_res_pass(sfs_append(volume, names[3], names[3], 31));
+  is_res_pass(sfs_umount(volume));
+
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  for (int i = 0; i < 6; i++) {
+    check_file_contents(volume, names[i], names[i], strlen(names[i]) + 1);
+  }
+  names[4][0] = 'e';
+  if (sfs_open(volume, names[4], READ_MODE) != -1 ||
+      volume_stats(volume).names_used != 7) {
+    printf("ERROR: Long names did not survive a remount\n");
+    exit(-1);
+  }
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+  unlink(vfs_name);
+  printf("[test] success!\n");
+}
+
+void test_directories() {
+  char *vfs_name = "vfs_directories";
+  char *paths[4] = {"same", "a/same", "/a/b/same", "a//b/c/same"};
+  char path[64];
+  printf("* create_format_vdisk (Directories) **\n");
+  is_res_pass(create_format_vdisk(vfs_name, 29));
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+
+  // Nested directories, each with a file of the same name
+  is_res_pass(sfs_mkdir(volume, "a"));
+  is_res_pass(sfs_mkdir(volume, "/a/b"));
+  is_res_pass(sfs_mkdir(volume, "a/b/c/"));
+  for (int i = 0; i < 4; i++) {
+    is_res_pass(sfs_create(volume, paths[i]));
+    is_res_pass(sfs_append(volume, paths[i], paths[i], strlen(paths[i]) + 1));
+  }
+  if (sfs_create(volume, "missing/file") != -1 ||
+      sfs_create(volume, "same/file") != -1 || sfs_mkdir(volume, "a/b") != -1 ||
+      sfs_create(volume, "/") != -1 || sfs_open(volume, "a", READ_MODE) != -1 ||
+      sfs_delete(volume, "a") != -1 || sfs_rmdir(volume, "same") != -1 ||
+      sfs_rmdir(volume, "a/b") != -1) {
+    printf("ERROR: A bad path or a file of the wrong type was accepted\n");
+    exit(-1);
+  }
+
+  // Enough entries in one directory to split its leaf under a branch
+  is_res_pass(sfs_sync(volume));
+  uint64_t free_blocks = free_block_count(volume);
+  is_res_pass(sfs_mkdir(volume, "wide"));
+  int entries = DIRECTORY_LEAF_KEYS * 3;
+  is_res_pass(sfs_begin_batch(volume));
+  for (int i = 0; i < entries; i++) {
+    sprintf(path, "wide/entry_%d", i);
+    is_res_pass(sfs_create(volume, path));
+  }
+  is_res_pass(sfs_commit_batch(volume));
+  struct Inode wide = find_inode(volume, "wide");
+  struct DirectoryNode node;
+  read_block(volume, &node, wide.extent_root);
+  if (wide.size != (uint64_t)entries || node.level != 1) {
+    printf("ERROR: Directory of %llu entries has a root at level %d\n",
+           (unsigned long long)wide.size, node.level);
+    exit(-1);
+  }
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+
+  // With the dentry cache empty again, paths resolve through the blocks
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  for (int i = 0; i < 4; i++) {
+    check_file_contents(volume, paths[i], paths[i], strlen(paths[i]) + 1);
+  }
+  for (int i = 0; i < entries; i += 97) {
+    sprintf(path, "/wide/entry_%d", i);
+    int fd = sfs_open(volume, path, READ_MODE);
+    is_res_pass(fd);
+    sfs_close(volume, fd);
+  }
+
+  // Emptying a directory, odd entries first, frees all its blocks
+  is_res_pass(sfs_begin_batch(volume));
+  for (int i = 1; i >= 0; i--) {
+    for (int j = i; j < entries; j += 2) {
+      sprintf(path, "wide/entry_%d", j);
+      is_res_pass(sfs_delete(volume, path));
+    }
+  }
+  is_res_pass(sfs_commit_batch(volume));
+  is_res_pass(sfs_rmdir(volume, "wide"));
+  is_res_pass(sfs_sync(volume));
+  if (free_block_count(volume) != free_blocks) {
+    printf("ERROR: %llu free blocks after emptying a directory, not %llu\n",
+           (unsigned long long)free_block_count(volume),
+           (unsigned long long)free_blocks);
+    exit(-1);
+  }
+  is_res_pass(sfs_delete(volume, "a/b/c/same"));
+  is_res_pass(sfs_rmdir(volume, "a/b/c"));
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  if (sfs_mkdir(volume, "a/b/c/d") != -1 || file_size(volume, "wide") != -1) {
+    printf("ERROR: Removed directories came back after a remount\n");
+    exit(-1);
+  }
+  check_file_contents(volume, paths[2], paths[2], strlen(paths[2]) + 1);
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+  unlink(vfs_name);
+  printf("[test] success!\n");
+}
+
+void test_directory_listing() {
+  char *vfs_name = "vfs_listing";
+  char path[MAX_FILENAME_SIZE + sizeof("docs/")];
+  struct DirEntry entry;
+  struct DirEntryPlus entries[100];
+  int files = DIRECTORY_LEAF_KEYS * 2 + 100;
+  char *seen = malloc(files);
+  printf("* create_format_vdisk (Directory Listing) **\n");
+  is_res_pass(create_format_vdisk(vfs_name, 29));
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+
+  // A directory over several leaves, holding files of different sizes and
+  // a subdirectory
+  is_res_pass(sfs_mkdir(volume, "docs"));
+  is_res_pass(sfs_mkdir(volume, "docs/sub"));
+  is_res_pass(sfs_mkdir(volume, "empty"));
+  is_res_pass(sfs_begin_batch(volume));
+  for (int i = 0; i < files; i++) {
+    sprintf(path, "docs/file_%d", i);
+    is_res_pass(sfs_create(volume, path));
+    is_res_pass(sfs_append(volume, path, path, i % 40));
+  }
+  is_res_pass(sfs_commit_batch(volume));
+  if (sfs_opendir(volume, "docs/file_0") != NULL ||
+      sfs_opendir(volume, "missing") != NULL) {
+    printf("ERROR: Opened a file or a missing path as a directory\n");
+    exit(-1);
+  }
+  is_res_pass(sfs_umount(volume));
+
+  // Entry by entry, each name once and only the directory's own
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  struct DirectoryStream *stream = sfs_opendir(volume, "/docs/");
+  memset(seen, 0, files);
+  int listed = 0, directories = 0, index;
+  while (sfs_readdir(stream, &entry) == 1) {
+    listed++;
+    if (entry.type == INODE_DIRECTORY && strcmp(entry.name, "sub") == 0) {
+      directories++;
+    } else if (entry.type != INODE_FILE ||
+               sscanf(entry.name, "file_%d", &index) != 1 || index < 0 ||
+               index >= files || seen[index]++ != 0) {
+      printf("ERROR: Listing returned %s\n", entry.name);
+      exit(-1);
+    }
+  }
+  if (listed != files + 1 || directories != 1 ||
+      sfs_readdir(stream, &entry) != 0) {
+    printf("ERROR: Listed %d entries of %d\n", listed, files + 1);
+    exit(-1);
+  }
+  sfs_closedir(stream);
+
+  // In bulk, with sizes and times
+  stream = sfs_opendir(volume, "docs");
+  listed = 0;
+  int filled;
+  while ((filled = sfs_readdir_plus(stream, entries, 100)) > 0) {
+    for (int i = 0; i < filled; i++) {
+      struct DirEntryPlus *plus = &entries[i];
+      bool file = sscanf(plus->name, "file_%d", &index) == 1;
+      uint64_t size = file ? index % 40 : 0;
+      if (plus->size != size || plus->last_modified_at < plus->created_at ||
+          plus->created_at == 0) {
+        printf("ERROR: %s listed with size %llu\n", plus->name,
+               (unsigned long long)plus->size);
+        exit(-1);
+      }
+    }
+    listed += filled;
+  }
+  sfs_closedir(stream);
+  if (listed != files + 1) {
+    printf("ERROR: Bulk listing returned %d entries\n", listed);
+    exit(-1);
+  }
+
+  // Deleting what has been listed and adding more while listing still
+  // lists every original entry once
+  stream = sfs_opendir(volume, "docs");
+  memset(seen, 0, files);
+  int added = 0;
+  while (sfs_readdir(stream, &entry) == 1) {
+    if (sscanf(entry.name, "file_%d", &index) != 1) {
+      continue;
+    }
+    if (seen[index]++ != 0) {
+      printf("ERROR: %s was listed twice\n", entry.name);
+      exit(-1);
+    }
+    sprintf(path, "docs/%s", entry.name);
+    is_res_pass(sfs_delete(volume, path));
+    if (added < files / 4) {
+      sprintf(path, "docs/added_%d", added++);
+      is_res_pass(sfs_create(volume, path));
+    }
+  }
+  sfs_closedir(stream);
+  if (memchr(seen, 0, files) != NULL) {
+    printf("ERROR: A listing changed underneath skipped an entry\n");
+    exit(-1);
+  }
+
+  // An empty directory and the root
+  stream = sfs_opendir(volume, "empty");
+  if (sfs_readdir(stream, &entry) != 0) {
+    printf("ERROR: Empty directory listed %s\n", entry.name);
+    exit(-1);
+  }
+  sfs_closedir(stream);
+  stream = sfs_opendir(volume, "/");
+  listed = 0;
+  while (sfs_readdir(stream, &entry) == 1) {
+    listed++;
+  }
+  sfs_closedir(stream);
+  if (listed != 2) {
+    printf("ERROR: Root lists %d entries\n", listed);
+    exit(-1);
+  }
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+  unlink(vfs_name);
+  free(seen);
+  printf("[test] success!\n");
+}
+
+int tail_blocks_used(struct Volume *volume, char *prefix, int files) {
+  // Distinct tail blocks holding the files prefix_0 to prefix_<files - 1>
+  char filename[32];
+  uint64_t seen[64];
+  int count = 0;
+  for (int i = 0; i < files; i++) {
+    sprintf(filename, "%s_%d", prefix, i);
+    struct Inode inode = find_inode(volume, filename);
+    if (inode.layout != FILE_DATA_TAIL) {
+      printf("ERROR: %s is not stored in a tail block\n", filename);
+      exit(-1);
+    }
+    int s = 0;
+    while (s < count && seen[s] != inode.tail.block) {
+      s++;
+    }
+    if (s == count && count < 64) {
+      seen[count++] = inode.tail.block;
+    }
+  }
+  return count;
+}
+
+void test_small_files() {
+  char *vfs_name = "vfs_small";
+  char filename[32], expected[3 * BLOCK_SIZE], actual[BLOCK_SIZE];
+  int files = 64;
+  printf("* create_format_vdisk (Small Files) **\n");
+  is_res_pass(create_format_vdisk(vfs_name, 26));
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  for (int i = 0; i < (int)sizeof(expected); i++) {
+    expected[i] = (char)(i * 13 + i / 7);
+  }
+  uint64_t empty_blocks = free_block_count(volume);
+  for (int i = 0; i < files; i++) {
+    sprintf(filename, "tiny_%d", i);
+    is_res_pass(sfs_create(volume, filename));
+    sprintf(filename, "small_%d", i);
+    is_res_pass(sfs_create(volume, filename));
+  }
+  is_res_pass(sfs_sync(volume));
+  uint64_t free_blocks = free_block_count(volume);
+
+  // Tiny files live in their inodes and take no blocks at all
+  for (int i = 0; i < files; i++) {
+    sprintf(filename, "tiny_%d", i);
+    is_res_pass(sfs_append(volume, filename, expected + i, 20));
+    if (find_inode(volume, filename).layout != FILE_DATA_INLINE) {
+      printf("ERROR: %s is not stored in its inode\n", filename);
+      exit(-1);
+    }
+  }
+  is_res_pass(sfs_sync(volume));
+  if (free_block_count(volume) != free_blocks) {
+    printf("ERROR: Inline files took %llu blocks\n",
+           (unsigned long long)(free_blocks -
+                                free_block_count(volume)));
+    exit(-1);
+  }
+
+  // Files of a few fragments share tail blocks, four to a block
+  for (int i = 0; i < files; i++) {
+    sprintf(filename, "small_%d", i);
+    is_res_pass(sfs_append(volume, filename, expected + i, 1000));
+  }
+  is_res_pass(sfs_sync(volume));
+  int tails = tail_blocks_used(volume, "small", files);
+  if (tails > files / 4 ||
+      free_blocks - free_block_count(volume) != (uint64_t)tails) {
+    printf("ERROR: %d small files took %d tail blocks\n", files, tails);
+    exit(-1);
+  }
+
+  // Truncates move a file between its inode and the tail blocks as it
+  // shrinks, and give up fragments it no longer needs
+  int fd = sfs_open(volume, "small_1", WRITE_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_write(volume, fd, expected + 5, 40));
+  is_res_pass(sfs_truncate(volume, fd, 40));
+  sfs_close(volume, fd);
+  fd = sfs_open(volume, "small_2", WRITE_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_write(volume, fd, expected + 7, 600));
+  is_res_pass(sfs_truncate(volume, fd, 600));
+  sfs_close(volume, fd);
+  if (find_inode(volume, "small_1").layout != FILE_DATA_INLINE ||
+      find_inode(volume, "small_2").tail.count != 3) {
+    printf("ERROR: Shrunk small files kept their old layout\n");
+    exit(-1);
+  }
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  for (int i = 3; i < files; i += 7) {
+    sprintf(filename, "tiny_%d", i);
+    check_file_contents(volume, filename, expected + i, 20);
+    sprintf(filename, "small_%d", i);
+    check_file_contents(volume, filename, expected + i, 1000);
+  }
+  check_file_contents(volume, "small_1", expected + 5, 40);
+  check_file_contents(volume, "small_2", expected + 7, 600);
+  check_volume_consistency(volume);
+
+  // Deleting them all gives every block back once committed, the tail
+  // blocks and the directory's
+  for (int i = 0; i < files; i++) {
+    sprintf(filename, "tiny_%d", i);
+    is_res_pass(sfs_delete(volume, filename));
+    sprintf(filename, "small_%d", i);
+    is_res_pass(sfs_delete(volume, filename));
+  }
+  is_res_pass(sfs_sync(volume));
+  if (free_block_count(volume) != empty_blocks) {
+    printf("ERROR: Deleting small files left %llu blocks in use\n",
+           (unsigned long long)(empty_blocks -
+                                free_block_count(volume)));
+    exit(-1);
+  }
+
+  // A growing file goes from its inode to a tail block to blocks of its own
+  is_res_pass(sfs_create(volume, "grow.log"));
+  int layouts[3] = {0, 0, 0};
+  for (int size = 0; size < (int)sizeof(expected); size += 20) {
+    is_res_pass(sfs_append(volume, "grow.log", expected + size, 20));
+    layouts[find_inode(volume, "grow.log").layout]++;
+  }
+  is_res_pass(sfs_sync(volume));
+  if (layouts[FILE_DATA_INLINE] != INLINE_DATA_SIZE / 20 ||
+      layouts[FILE_DATA_TAIL] != TAIL_MAX_SIZE / 20 - INLINE_DATA_SIZE / 20 ||
+      find_inode(volume, "grow.log").extent_count != 1) {
+    printf("ERROR: Growing file took layouts %d, %d, %d\n", layouts[0],
+           layouts[1], layouts[2]);
+    exit(-1);
+  }
+  check_file_contents(volume, "grow.log", expected, sizeof(expected));
+
+  // Positional I/O on a small file goes through the same paths
+  struct AsyncRequest request;
+  is_res_pass(sfs_create(volume, "async.txt"));
+  struct AsyncQueue *queue = sfs_async_open(volume, 4, SFS_ASYNC_THREADS);
+  if (queue == NULL) {
+    exit(-1);
+  }
+  fd = sfs_open(volume, "async.txt", WRITE_MODE);
+  is_res_pass(fd);
+  memset(&request, 0, sizeof(request));
+  request.opcode = SFS_ASYNC_WRITE;
+  request.fd = fd;
+  request.buffer = expected;
+  request.size = 700;
+  is_res_pass(sfs_async_submit(queue, &request));
+  sfs_async_poll(queue, 1);
+  is_res_pass(request.result);
+  sfs_close(volume, fd);
+  fd = sfs_open(volume, "async.txt", READ_MODE);
+  is_res_pass(fd);
+  request.opcode = SFS_ASYNC_READ;
+  request.fd = fd;
+  request.buffer = actual;
+  is_res_pass(sfs_async_submit(queue, &request));
+  sfs_async_poll(queue, 1);
+  is_res_pass(request.result);
+  sfs_close(volume, fd);
+  is_res_pass(sfs_async_close(queue));
+  if (memcmp(actual, expected, 700) != 0) {
+    printf("ERROR: Asynchronous I/O on a small file lost data\n");
+    exit(-1);
+  }
+
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+  printf("[test] success!\n");
+}
+
+void test_delayed_allocation() {
+  char *vfs_name = "vfs_delayed";
+  int files = 4, record = 3000, records = 60, size = record * records;
+  int blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  char *expected = malloc(size), filename[32];
+  printf("* create_format_vdisk (Delayed Allocation) **\n");
+  is_res_pass(create_format_vdisk(vfs_name, 24));
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  for (int i = 0; i < size; i++) {
+    expected[i] = (char)(i * 11 + i / 313);
+  }
+  for (int f = 0; f < files; f++) {
+    sprintf(filename, "log_%d", f);
+    is_res_pass(sfs_create(volume, filename));
+  }
+  is_res_pass(sfs_sync(volume));
+  uint64_t free_blocks = free_block_count(volume);
+
+  // Interleaved appends, too large for small files, reserve their blocks
+  // but take none before the commit, and read back from memory meanwhile
+  for (int r = 0; r < records; r++) {
+    for (int f = 0; f < files; f++) {
+      sprintf(filename, "log_%d", f);
+      is_res_pass(sfs_append(volume, filename, expected + r * record, record));
+    }
+  }
+  if (free_block_count(volume) != free_blocks ||
+      volume_stats(volume).reserved_blocks != (uint64_t)files * blocks) {
+    printf("ERROR: Appends took %llu blocks and reserved %llu\n",
+           (unsigned long long)(free_blocks -
+                                free_block_count(volume)),
+           (unsigned long long)volume_stats(volume).reserved_blocks);
+    exit(-1);
+  }
+  check_file_contents(volume, "log_1", expected, size);
+
+  // The commit gives each file a single run
+  is_res_pass(sfs_sync(volume));
+  for (int f = 0; f < files; f++) {
+    sprintf(filename, "log_%d", f);
+    if (find_inode(volume, filename).extent_count != 1) {
+      printf("ERROR: Interleaved appends left %s in %u extents\n", filename,
+             find_inode(volume, filename).extent_count);
+      exit(-1);
+    }
+    check_file_contents(volume, filename, expected, size);
+  }
+  struct VolumeStats stats = volume_stats(volume);
+  if (stats.reserved_blocks != 0 || stats.delayed_blocks != 0) {
+    printf("ERROR: Delayed blocks are left after the commit\n");
+    exit(-1);
+  }
+
+  // Sequential writes are delayed like appends; a rewrite inside the
+  // delayed blocks has them written out first
+  is_res_pass(sfs_create(volume, "data.bin"));
+  is_res_pass(sfs_create(volume, "side.log"));
+  int fd = sfs_open(volume, "data.bin", WRITE_MODE);
+  is_res_pass(fd);
+  for (int r = 0; r < records / 2; r++) {
+    is_res_pass(sfs_write(volume, fd, expected + r * record, record));
+    is_res_pass(sfs_append(volume, "side.log", expected + r * record, record));
+  }
+  sfs_close(volume, fd);
+  is_res_pass(sfs_sync(volume));
+  if (find_inode(volume, "data.bin").extent_count != 1 ||
+      find_inode(volume, "side.log").extent_count != 1) {
+    printf("ERROR: Interleaved writes and appends were fragmented\n");
+    exit(-1);
+  }
+  is_res_pass(sfs_append(volume, "side.log", expected, 3 * BLOCK_SIZE));
+  fd = sfs_open(volume, "side.log", WRITE_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_seek(volume, fd, 500, SFS_SEEK_SET));
+  is_res_pass(sfs_write(volume, fd, expected + 500, 100));
+  is_res_pass(sfs_truncate(volume, fd, 600));
+  sfs_close(volume, fd);
+  check_file_contents(volume, "side.log", expected, 600);
+
+  // A deleted file's delayed blocks give back their reservation
+  is_res_pass(sfs_append(volume, "log_2", expected, 3 * BLOCK_SIZE));
+  is_res_pass(sfs_delete(volume, "log_2"));
+  if (volume_stats(volume).reserved_blocks != 0) {
+    printf("ERROR: Deleting a file kept its reservation\n");
+    exit(-1);
+  }
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  check_file_contents(volume, "log_3", expected, size);
+  check_file_contents(volume, "data.bin", expected, size / 2);
+  check_file_contents(volume, "side.log", expected, 600);
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+  free(expected);
+  printf("[test] success!\n");
+}
+
+void test_sparse_files() {
+  char *vfs_name = "vfs_holes";
+  int gap = 10 * BLOCK_SIZE + 50, size = gap + 1000;
+  int prealloc = 64 * BLOCK_SIZE;
+  char *data = malloc(prealloc), *expected = calloc(prealloc, 1);
+  printf("* create_format_vdisk (Sparse Files) **\n");
+  is_res_pass(create_format_vdisk(vfs_name, 24));
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  for (int i = 0; i < prealloc; i++) {
+    data[i] = (char)(i * 13 + i / 509 + 1);
+  }
+  is_res_pass(sfs_create(volume, "sparse.bin"));
+  is_res_pass(sfs_create(volume, "prealloc.bin"));
+  is_res_pass(sfs_create(volume, "grown.bin"));
+  is_res_pass(sfs_sync(volume));
+  uint64_t free_blocks = free_block_count(volume);
+
+  // A write past the end leaves a hole that reads as zeros and has no
+  // blocks
+  int fd = sfs_open(volume, "sparse.bin", WRITE_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_write(volume, fd, data, 5000));
+  is_res_pass(sfs_seek(volume, fd, gap, SFS_SEEK_SET));
+  is_res_pass(sfs_write(volume, fd, data + gap, 1000));
+  sfs_close(volume, fd);
+  memcpy(expected, data, 5000);
+  memcpy(expected + gap, data + gap, 1000);
+  is_res_pass(sfs_sync(volume));
+  if (find_inode(volume, "sparse.bin").size != (uint64_t)size ||
+      free_blocks - free_block_count(volume) != 3) {
+    printf("ERROR: Sparse file took %llu blocks\n",
+           (unsigned long long)(free_blocks -
+                                free_block_count(volume)));
+    exit(-1);
+  }
+  check_file_contents(volume, "sparse.bin", expected, size);
+
+  // Rewriting the start keeps the size; a truncate cuts the file and a
+  // later one grows it back with zeros
+  fd = sfs_open(volume, "sparse.bin", WRITE_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_write(volume, fd, data + 7, 10));
+  memcpy(expected, data + 7, 10);
+  sfs_close(volume, fd);
+  check_file_contents(volume, "sparse.bin", expected, size);
+  fd = sfs_open(volume, "sparse.bin", WRITE_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_truncate(volume, fd, 3000));
+  is_res_pass(sfs_truncate(volume, fd, 3 * BLOCK_SIZE));
+  sfs_close(volume, fd);
+  memset(expected + 3000, 0, prealloc - 3000);
+  is_res_pass(sfs_sync(volume));
+  if (find_inode(volume, "sparse.bin").size != 3 * BLOCK_SIZE ||
+      free_blocks - free_block_count(volume) != 1) {
+    printf("ERROR: Truncated file is the wrong size or kept its blocks\n");
+    exit(-1);
+  }
+  check_file_contents(volume, "sparse.bin", expected, 3 * BLOCK_SIZE);
+
+  // Preallocated blocks form one run past the end, and later writes
+  // into them allocate nothing
+  fd = sfs_open(volume, "prealloc.bin", WRITE_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_fallocate(volume, fd, 0, prealloc, SFS_FALLOC_KEEP_SIZE));
+  is_res_pass(sfs_sync(volume));
+  uint64_t preallocated = free_block_count(volume);
+  if (find_inode(volume, "prealloc.bin").size != 0 ||
+      find_inode(volume, "prealloc.bin").extent_count != 1 ||
+      free_blocks - preallocated != 1 + 64) {
+    printf("ERROR: Preallocation is not one run of 64 blocks\n");
+    exit(-1);
+  }
+  for (int done = 0; done < prealloc; done += 5000) {
+    int piece = prealloc - done < 5000 ? prealloc - done : 5000;
+    is_res_pass(sfs_write(volume, fd, data + done, piece));
+  }
+  sfs_close(volume, fd);
+  is_res_pass(sfs_sync(volume));
+  if (free_block_count(volume) != preallocated ||
+      find_inode(volume, "prealloc.bin").extent_count != 1) {
+    printf("ERROR: Writes into preallocated blocks allocated more\n");
+    exit(-1);
+  }
+  check_file_contents(volume, "prealloc.bin", data, prealloc);
+
+  // Preallocating past the end of a small file grows it with zeros
+  is_res_pass(sfs_append(volume, "grown.bin", data, 100));
+  fd = sfs_open(volume, "grown.bin", WRITE_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_fallocate(volume, fd, 0, 8 * BLOCK_SIZE, 0));
+  is_res_pass(sfs_fallocate(volume, fd, 8 * BLOCK_SIZE, 8 * BLOCK_SIZE,
+                            SFS_FALLOC_KEEP_SIZE | SFS_FALLOC_NO_ZERO));
+  sfs_close(volume, fd);
+  char *grown = calloc(8 * BLOCK_SIZE, 1);
+  memcpy(grown, data, 100);
+  if (find_inode(volume, "grown.bin").size != 8 * BLOCK_SIZE) {
+    printf("ERROR: Preallocation did not grow the file\n");
+    exit(-1);
+  }
+  check_file_contents(volume, "grown.bin", grown, 8 * BLOCK_SIZE);
+
+  // A punched hole reads as zeros and gives back the blocks it covers
+  // whole, leaving the file its size
+  is_res_pass(sfs_sync(volume));
+  uint64_t before_punch = free_block_count(volume);
+  fd = sfs_open(volume, "prealloc.bin", WRITE_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_punch_hole(volume, fd, 4 * BLOCK_SIZE + 100,
+                             16 * BLOCK_SIZE));
+  sfs_close(volume, fd);
+  memset(data + 4 * BLOCK_SIZE + 100, 0, 16 * BLOCK_SIZE);
+  is_res_pass(sfs_sync(volume));
+  if (free_block_count(volume) - before_punch != 15 ||
+      find_inode(volume, "prealloc.bin").extent_count != 2 ||
+      find_inode(volume, "prealloc.bin").size != (uint64_t)prealloc) {
+    printf("ERROR: Punching a hole freed %llu blocks\n",
+           (unsigned long long)(free_block_count(volume) -
+                                before_punch));
+    exit(-1);
+  }
+  check_file_contents(volume, "prealloc.bin", data, prealloc);
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  check_file_contents(volume, "sparse.bin", expected, 3 * BLOCK_SIZE);
+  check_file_contents(volume, "prealloc.bin", data, prealloc);
+  check_file_contents(volume, "grown.bin", grown, 8 * BLOCK_SIZE);
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+  free(grown);
+  free(expected);
+  free(data);
+  printf("[test] success!\n");
+}
+
+void vdisk_block(char *vfs_name, uint64_t block, char *data, bool write) {
+  // Reads or overwrites a block of an unmounted vdisk behind its back
+  FILE *vdisk = fopen(vfs_name, "r+b");
+  if (vdisk == NULL || fseek(vdisk, (long)block * BLOCK_SIZE, SEEK_SET) < 0 ||
+      (write ? fwrite(data, BLOCK_SIZE, 1, vdisk)
+             : fread(data, BLOCK_SIZE, 1, vdisk)) != 1) {
+    printf("ERROR: Could not access block %llu of %s\n",
+           (unsigned long long)block, vfs_name);
+    exit(-1);
+  }
+  fclose(vdisk);
+}
+
+void test_block_checksums() {
+  char *vfs_name = "vfs_checksums";
+  int size = 8 * BLOCK_SIZE;
+  char *data = malloc(size), *actual = malloc(size);
+  char old_block[BLOCK_SIZE], block[BLOCK_SIZE];
+  printf("* create_format_vdisk (Block Checksums) **\n");
+
+  // Every kernel gives the standard check value and agrees with the
+  // others at any length and alignment
+  for (int kernel = 0; kernel < SFS_CRC32C_KERNELS; kernel++) {
+    if (sfs_crc32c_supported(kernel) &&
+        sfs_crc32c_kernel(kernel, 0, "123456789", 9) != 0xE3069283) {
+      printf("ERROR: CRC32C kernel %d gives the wrong check value\n",
+             kernel);
+      exit(-1);
+    }
+  }
+  for (int i = 0; i < size; i++) {
+    data[i] = (char)(i * 31 + i / 4093);
+  }
+  int lengths[] = {0, 1, 7, 8, 63, 127, 384, 1000, 4080, 4096, 5000, 16000};
+  for (int l = 0; l < (int)(sizeof(lengths) / sizeof(int)); l++) {
+    for (int offset = 0; offset < 8; offset++) {
+      uint32_t expected =
+          sfs_crc32c_kernel(SFS_CRC32C_BYTEWISE, 5, data + offset, lengths[l]);
+      for (int kernel = 0; kernel < SFS_CRC32C_KERNELS; kernel++) {
+        if (sfs_crc32c_supported(kernel) &&
+            sfs_crc32c_kernel(kernel, 5, data + offset, lengths[l]) !=
+                expected) {
+          printf("ERROR: CRC32C kernel %d disagrees at length %d\n", kernel,
+                 lengths[l]);
+          exit(-1);
+        }
+      }
+    }
+  }
+
+  is_res_pass(create_format_vdisk(vfs_name, 24));
+  struct Volume *volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  is_res_pass(sfs_create(volume, "data.bin"));
+  int fd = sfs_open(volume, "data.bin", WRITE_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_write(volume, fd, data, size));
+  sfs_close(volume, fd);
+  is_res_pass(sfs_sync(volume));
+  uint64_t block_number = find_inode(volume, "data.bin").extents[0].start + 2;
+  is_res_pass(sfs_umount(volume));
+  vdisk_block(vfs_name, block_number, old_block, false);
+
+  // A flipped byte fails the read that meets it, unless verifying is off
+  memcpy(block, old_block, BLOCK_SIZE);
+  block[100] ^= 0x10;
+  vdisk_block(vfs_name, block_number, block, true);
+  for (int flags = 0; flags <= SFS_MOUNT_MMAP; flags += SFS_MOUNT_MMAP) {
+    volume = sfs_mount_with_flags(vfs_name, flags);
+    is_mounted(volume);
+    fd = sfs_open(volume, "data.bin", READ_MODE);
+    is_res_pass(fd);
+    if (sfs_read(volume, fd, actual, size) == 0 ||
+        cache_stats(volume).checksum_errors == 0) {
+      printf("ERROR: A corrupt block was read without complaint\n");
+      exit(-1);
+    }
+    sfs_close(volume, fd);
+    is_res_pass(sfs_umount(volume));
+  }
+  volume = sfs_mount_with_flags(vfs_name, SFS_MOUNT_NO_VERIFY);
+  is_mounted(volume);
+  fd = sfs_open(volume, "data.bin", READ_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_read(volume, fd, actual, size));
+  sfs_close(volume, fd);
+  if (memcmp(actual + 2 * BLOCK_SIZE, block, BLOCK_SIZE) != 0) {
+    printf("ERROR: Unverified read did not return the disk contents\n");
+    exit(-1);
+  }
+
+  // Rewriting the block repairs it; if that write is then lost after it was
+  // synced, the old contents it had before fail the read
+  memset(data + 2 * BLOCK_SIZE, 'x', 300);
+  fd = sfs_open(volume, "data.bin", WRITE_MODE);
+  is_res_pass(fd);
+  is_res_pass(sfs_seek(volume, fd, 2 * BLOCK_SIZE, SFS_SEEK_SET));
+  is_res_pass(sfs_write(volume, fd, data + 2 * BLOCK_SIZE, BLOCK_SIZE));
+  sfs_close(volume, fd);
+  is_res_pass(sfs_umount(volume));
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  check_file_contents(volume, "data.bin", data, size);
+  is_res_pass(sfs_umount(volume));
+  vdisk_block(vfs_name, block_number, old_block, true);
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  fd = sfs_open(volume, "data.bin", READ_MODE);
+  is_res_pass(fd);
+  if (sfs_read(volume, fd, actual, size) == 0 ||
+      cache_stats(volume).checksum_errors == 0) {
+    printf("ERROR: A block restored to its old contents passed its checksum\n");
+    exit(-1);
+  }
+  sfs_close(volume, fd);
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+  free(actual);
+  free(data);
+  printf("[test] success!\n");
+}
+
+int make_log_text(char *data, int size) {
+  // Log lines like the ones compression is meant for
+  int length = 0, line = 0;
+  while (length < size) {
+    char text[160];
+    int n = snprintf(text, sizeof(text),
+                     "2026-10-18T12:%02d:%02d.%03dZ level=%s req=%06d "
+                     "path=/api/v1/items/%d status=%d bytes=%d\n",
+                     line / 3600 % 60, line / 60 % 60, line * 7 % 1000,
+                     line % 13 == 0 ? "warn" : "info", line * 37 % 1000000,
+                     line % 500, line % 17 == 0 ? 404 : 200,
+                     line * 131 % 65536);
+    memcpy(data + length, text, n < size - length ? n : size - length);
+    length += n;
+    line++;
+  }
+  return size;
+}
+
+uint64_t compressed_chunk_block(struct Volume *volume, char *filename) {
+  // First block of the file's first compressed chunk, or 0 if it has none
+  struct Inode inode = find_inode(volume, filename);
+  struct Extent extents[INLINE_EXTENTS + EXTENTS_PER_LEAF * 4];
+  uint32_t count = 0;
+  if (inode.extent_root == INVALID_BLOCK_POINTER) {
+    memcpy(extents, inode.extents,
+           inode.extent_count * sizeof(struct Extent));
+    count = inode.extent_count;
+  } else {
+    struct ExtentRoot root;
+    struct ExtentLeaf leaf;
+    read_block(volume, &root, inode.extent_root);
+    for (uint32_t l = 0; l < root.leaf_count && l < 4; l++) {
+      read_block(volume, &leaf, root.leaves[l]);
+      memcpy(&extents[count], leaf.extents,
+             leaf.count * sizeof(struct Extent));
+      count += leaf.count;
+    }
+  }
+  for (uint32_t e = 0; e < count; e++) {
+    if (extents[e].length & EXTENT_COMPRESSED) {
+      return extents[e].start;
+    }
+  }
+  return 0;
+}
+
+void test_compression() {
+  char *vfs_name = "vfs_compress";
+  int chunk = COMPRESS_CHUNK_BLOCKS * BLOCK_SIZE;
+  int size = 20 * chunk + 1234;
+  char *data = malloc(size), *actual = malloc(size);
+  char *packed = malloc(chunk + chunk / 255 + 16);
+  printf("* create_format_vdisk (Compression) **\n");
+
+  // The codec round-trips text, random bytes and inputs too short to hold
+  // a match, and rejects a damaged stream instead of overrunning
+  make_log_text(data, size);
+  int lengths[] = {0, 1, 5, 12, 13, 100, 4096, chunk};
+  for (int kind = 0; kind < 2; kind++) {
+    for (int l = 0; l < (int)(sizeof(lengths) / sizeof(int)); l++) {
+      int capacity = lengths[l] + lengths[l] / 255 + 16;
+      int length = sfs_lz4_compress(data, lengths[l], packed, capacity);
+      if ((length == 0 && lengths[l] > 0) ||
+          sfs_lz4_decompress(packed, length, actual, lengths[l]) !=
+              lengths[l] ||
+          memcmp(actual, data, lengths[l]) != 0) {
+        printf("ERROR: LZ4 round trip of %d bytes failed\n", lengths[l]);
+        exit(-1);
+      }
+    }
+    srand(25);
+    for (int i = 0; i < chunk; i++) {
+      data[i] = (char)rand();
+    }
+  }
+  make_log_text(data, size);
+  int length = sfs_lz4_compress(data, chunk, packed, chunk);
+  if (length == 0 || length > chunk / 2 ||
+      sfs_lz4_decompress(packed, length - 1, actual, chunk) != -1 ||
+      sfs_lz4_decompress(packed, length, actual, chunk / 2) != -1 ||
+      sfs_lz4_compress(data, chunk, packed, length - 1) != 0) {
+    printf("ERROR: LZ4 accepted a damaged stream or a short buffer\n");
+    exit(-1);
+  }
+
+  // Appended text goes to disk in compressed chunks, in fewer blocks
+  is_res_pass(create_format_vdisk(vfs_name, 24));
+  struct Volume *volume = sfs_mount_with_flags(vfs_name, SFS_MOUNT_COMPRESS);
+  is_mounted(volume);
+  is_res_pass(sfs_create(volume, "log.txt"));
+  is_res_pass(sfs_sync(volume));
+  uint64_t free_blocks = free_block_count(volume);
+  int fd = sfs_open(volume, "log.txt", WRITE_MODE);
+  is_res_pass(fd);
+  for (int done = 0; done < size; done += 100000) {
+    is_res_pass(sfs_write(volume, fd, data + done,
+                          size - done < 100000 ? size - done : 100000));
+  }
+  sfs_close(volume, fd);
+  is_res_pass(sfs_sync(volume));
+  uint64_t used = free_blocks - free_block_count(volume);
+  if (used * 2 > (uint64_t)size / BLOCK_SIZE) {
+    printf("ERROR: Compressed log took %llu blocks\n",
+           (unsigned long long)used);
+    exit(-1);
+  }
+  check_file_contents(volume, "log.txt", data, size);
+
+  // Small reads over a chunk decompress it once
+  fd = sfs_open(volume, "log.txt", READ_MODE);
+  is_res_pass(fd);
+  uint64_t misses = cache_stats(volume).chunk_misses;
+  for (int done = 0; done < chunk; done += 1000) {
+    is_res_pass(sfs_read(volume, fd, actual + done,
+                         chunk - done < 1000 ? chunk - done : 1000));
+  }
+  sfs_close(volume, fd);
+  if (memcmp(actual, data, chunk) != 0 ||
+      cache_stats(volume).chunk_misses - misses > 1 ||
+      cache_stats(volume).chunk_hits < (uint64_t)chunk / 1000) {
+    printf("ERROR: Small reads decompressed a chunk more than once\n");
+    exit(-1);
+  }
+  is_res_pass(sfs_umount(volume));
+
+  // A mount without the flag still reads the chunks, and expands the ones
+  // that writes, truncates and punches land in
+  volume = sfs_mount(vfs_name);
+  is_mounted(volume);
+  check_file_contents(volume, "log.txt", data, size);
+  fd = sfs_open(volume, "log.txt", WRITE_MODE);
+  is_res_pass(fd);
+  memset(data + 5 * chunk + 100, 'w', 5000);
+  is_res_pass(sfs_seek(volume, fd, 5 * chunk + 100, SFS_SEEK_SET));
+  is_res_pass(sfs_write(volume, fd, data + 5 * chunk + 100, 5000));
+  memset(data + 2 * chunk + 500, 0, 3 * BLOCK_SIZE);
+  is_res_pass(sfs_punch_hole(volume, fd, 2 * chunk + 500, 3 * BLOCK_SIZE));
+  memset(data + 8 * chunk - 10, 0, chunk + 20);
+  is_res_pass(sfs_punch_hole(volume, fd, 8 * chunk - 10, chunk + 20));
+  int cut = 15 * chunk + 3 * BLOCK_SIZE + 10;
+  is_res_pass(sfs_truncate(volume, fd, cut));
+  is_res_pass(sfs_truncate(volume, fd, size));
+  memset(data + cut, 0, size - cut);
+  sfs_close(volume, fd);
+  check_file_contents(volume, "log.txt", data, size);
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+
+  // A damaged chunk fails the read even without checksums, and deleting
+  // the file gives every block back
+  volume = sfs_mount_with_flags(vfs_name, SFS_MOUNT_NO_VERIFY);
+  is_mounted(volume);
+  uint64_t chunk_block = compressed_chunk_block(volume, "log.txt");
+  is_res_pass(sfs_umount(volume));
+  if (chunk_block == 0) {
+    printf("ERROR: No compressed chunk left to damage\n");
+    exit(-1);
+  }
+  char block[BLOCK_SIZE];
+  vdisk_block(vfs_name, chunk_block, block, false);
+  block[0] ^= 0x55;
+  vdisk_block(vfs_name, chunk_block, block, true);
+  volume = sfs_mount_with_flags(vfs_name, SFS_MOUNT_NO_VERIFY);
+  is_mounted(volume);
+  fd = sfs_open(volume, "log.txt", READ_MODE);
+  is_res_pass(fd);
+  if (sfs_read(volume, fd, actual, size) == 0) {
+    printf("ERROR: A damaged chunk was read without complaint\n");
+    exit(-1);
+  }
+  sfs_close(volume, fd);
+  is_res_pass(sfs_delete(volume, "log.txt"));
+  is_res_pass(sfs_sync(volume));
+  is_res_pass(sfs_sync(volume));
+  if (free_block_count(volume) < free_blocks) {
+    printf("ERROR: Deleting the file kept %llu blocks\n",
+           (unsigned long long)(free_blocks -
+                                free_block_count(volume)));
+    exit(-1);
+  }
+  check_volume_consistency(volume);
+  is_res_pass(sfs_umount(volume));
+  free(packed);
+  free(actual);
+  free(data);
+  printf("[test] success!\n");
+}
+
 int main(int argc, char **argv) {
   test_create_and_delete();
   test_multiple_file_operations();
+  test_block_cache();
+  test_name_index();
+  test_large_volume_allocation();
+  test_extent_mapping();
+  test_vectored_io();
+  test_mmap_mount();
+  test_concurrent_access();
+  test_multiple_volumes();
+  test_sparse_format();
+  test_crash_recovery();
+  test_batch_commit();
+  test_async_io();
+  test_read_ahead_write_behind();
+  test_cached_extent_map();
+  test_append_tail();
+  test_metadata_regions();
+  test_lazy_mount();
+  test_inode_table();
+  test_directories();
+  test_directory_listing();
+  test_small_files();
+  test_delayed_allocation();
+  test_sparse_files();
+  test_block_checksums();
+  test_compression();
   return 0;
 }